@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace torrent {
+
+    // Token bucket rate limiter.
+    //
+    // Tokens (bytes) are refilled lazily from the time elapsed since the last
+    // call, so a bucket costs nothing while idle and needs no timer of its own.
+    // The bucket holds at most one second worth of tokens, which bounds bursts
+    // after an idle period. A rate of 0 means unlimited.
+    class TokenBucket {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        explicit TokenBucket(std::uint64_t bytes_per_second = 0) { set_rate(bytes_per_second); }
+
+        void set_rate(std::uint64_t bytes_per_second);
+        std::uint64_t rate() const { return m_rate; }
+        bool unlimited() const { return m_rate == 0; }
+
+        // Bytes that may be transferred right now (UINT64_MAX if unlimited).
+        std::uint64_t available(Clock::time_point now);
+
+        void consume(std::uint64_t bytes);
+
+        // How long until at least `bytes` tokens are available.
+        Clock::duration time_until(std::uint64_t bytes, Clock::time_point now);
+
+    private:
+        void refill(Clock::time_point now);
+
+        std::uint64_t m_rate = 0;
+        double m_tokens = 0;
+        Clock::time_point m_last{};
+    };
+
+    // Upload and download limits for one level: the whole process, one
+    // torrent, or one peer.
+    struct BandwidthLimits {
+        TokenBucket upload;
+        TokenBucket download;
+    };
+
+    // The buckets a transfer is charged to, most specific first: peer,
+    // torrent, global. Null entries are skipped.
+    using BandwidthChain = std::array<TokenBucket*, 3>;
+
+    // Bytes every bucket in the chain allows right now, capped at `want`.
+    std::uint64_t bandwidth_quota(const BandwidthChain& chain, std::uint64_t want, TokenBucket::Clock::time_point now);
+
+    // Charge `bytes` to every bucket in the chain.
+    void bandwidth_consume(const BandwidthChain& chain, std::uint64_t bytes);
+
+    // How long until every bucket in the chain allows `bytes` (each bucket's
+    // own share is capped at its rate, since it never holds more than that).
+    TokenBucket::Clock::duration bandwidth_wait(
+        const BandwidthChain& chain,
+        std::uint64_t bytes,
+        TokenBucket::Clock::time_point now
+    );
+
+}
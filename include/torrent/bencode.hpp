@@ -14,7 +14,12 @@ namespace torrent {
 
 
     // --- Bencode decoding ---
+    // Throw std::runtime_error on malformed input, including lists and dicts
+    // nested more than 64 deep.
     json decode_bencoded_value(const std::string& encoded_value);
+    // Decode the value at the start of `encoded_value`; `consumed` is set to
+    // its length, so whatever follows (e.g. raw data after a dict) can be read.
+    json decode_bencoded_prefix(const std::string& encoded_value, std::size_t& consumed);
 
     json decode_string_bencoded_value(const std::string& encoded_value);
     json decode_integer_bencoded_value(const std::string& encoded_value);
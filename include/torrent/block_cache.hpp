@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "torrent/storage.hpp"
+#include "torrent/torrent_meta.hpp"
+
+namespace torrent {
+
+    struct CacheStats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::uint64_t read_ahead_blocks = 0; // blocks loaded without being asked for
+        std::uint64_t disk_reads = 0;        // whole-piece reads issued
+
+        double hit_rate() const {
+            std::uint64_t total = hits + misses;
+            return total == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(total);
+        }
+    };
+
+    // Bounded in-memory cache of 16 KiB blocks for serving uploads.
+    //
+    // Eviction follows ARC (Adaptive Replacement Cache): recently used blocks
+    // live in T1, blocks used more than once in T2, and two ghost lists (B1, B2)
+    // of recently evicted keys steer the T1/T2 split towards whichever side
+    // would have produced more hits.
+    //
+    // A miss reads the whole piece in one go and inserts its other blocks as
+    // read-ahead, since peers nearly always request a piece block by block.
+    // Read-ahead blocks don't count as "used" until a peer actually asks for them.
+    //
+    // Only pieces that are complete on disk may be read. Not thread-safe.
+    class BlockCache {
+    public:
+        static constexpr std::uint32_t kBlockSize = 16 * 1024;
+
+        using Block = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+        BlockCache(const TorrentMeta& meta, Storage& storage, std::size_t capacity_bytes);
+
+        // Block `block_index` of `piece` (blocks are kBlockSize-aligned; the last
+        // block of a piece may be shorter). A miss loads the whole piece.
+        Block get_block(std::uint32_t piece, std::uint32_t block_index);
+
+        // Copy [begin, begin + len) of `piece` into `out`, going through the cache.
+        void read(std::uint32_t piece, std::uint32_t begin, std::uint8_t* out, std::size_t len);
+
+        // Drop every cached block of `piece` (e.g. after its data changed).
+        void invalidate_piece(std::uint32_t piece);
+
+        const CacheStats& stats() const { return m_stats; }
+        std::size_t capacity_blocks() const { return m_capacity; }
+        std::size_t size_blocks() const { return m_t1.size() + m_t2.size(); }
+
+    private:
+        using Key = std::uint64_t;
+        enum class Where : std::uint8_t { T1, T2, B1, B2 };
+
+        struct Entry {
+            Where where;
+            std::list<Key>::iterator it;
+            Block data;             // null while in a ghost list
+            bool prefetched = false;
+        };
+
+        static Key make_key(std::uint32_t piece, std::uint32_t block) {
+            return (static_cast<Key>(piece) << 32) | block;
+        }
+
+        std::list<Key>& list_for(Where w);
+        void move_to(Key key, Entry& e, Where w);
+        void drop(Key key);
+        void replace(bool hit_in_b2);
+        // Make room for a key that is in no list at all (ARC case IV).
+        void make_room_for_new();
+
+        void load_piece(std::uint32_t piece, std::uint32_t wanted_block);
+        void insert_new(Key key, Block data, bool prefetched);
+
+        const TorrentMeta& m_meta;
+        Storage& m_storage;
+        std::size_t m_capacity; // in blocks
+        std::size_t m_p = 0;    // ARC target size of T1
+
+        std::list<Key> m_t1, m_t2, m_b1, m_b2; // front = MRU
+        std::unordered_map<Key, Entry> m_entries;
+
+        CacheStats m_stats;
+    };
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace torrent {
+
+    // Tit-for-tat choking decisions, independent of any sockets.
+    //
+    // Every round (run on a ~10s timer by Torrent) the interested peers are
+    // ranked by how fast they upload to us -- or, once we are seeding, by how
+    // fast we upload to them -- and the top `upload_slots - 1` are unchoked.
+    // One more slot is the optimistic unchoke: a random other interested peer,
+    // rotated every `optimistic_interval`, so new peers get a chance to prove
+    // themselves. Snubbed peers (stopped sending us data) never get a regular
+    // slot; they can be picked optimistically, and get the slots that would
+    // otherwise stay idle because too few other peers are interested.
+    class Choker {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        struct Config {
+            std::size_t upload_slots = 4;
+            std::chrono::seconds optimistic_interval{30};
+        };
+
+        struct Candidate {
+            int id = -1;                 // caller's handle for the peer
+            bool interested = false;     // peer is interested in our pieces
+            bool snubbed = false;
+            double download_rate = 0;    // bytes/s the peer sends us
+            double upload_rate = 0;      // bytes/s we send the peer
+        };
+
+        struct Decision {
+            std::vector<int> unchoke;    // everyone else is choked
+            int optimistic = -1;
+        };
+
+        Choker();
+        explicit Choker(Config config);
+
+        Decision run(const std::vector<Candidate>& peers, bool seeding, Clock::time_point now);
+
+        const Config& config() const { return m_config; }
+        void set_upload_slots(std::size_t n) { m_config.upload_slots = n; }
+
+    private:
+        Config m_config;
+        int m_optimistic = -1;
+        Clock::time_point m_last_rotation{};
+        std::mt19937 m_rng;
+    };
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "torrent/storage.hpp"
+#include "torrent/torrent_meta.hpp"
+
+namespace torrent {
+
+    // Piece and block picking that many threads (e.g. one network reactor
+    // per core, all serving one torrent) can share without a lock.
+    //
+    // All state is in atomics:
+    // - every piece has a bitmap of requested and of received blocks, in
+    //   64-bit words; a block is claimed by a CAS that sets its bit, so
+    //   two threads never get the same block, and released by clearing it
+    // - per piece, counters of requested and received blocks; the call that
+    //   receives the last block is the one told the piece is complete
+    // - availability counters are updated with relaxed increments: a pick
+    //   may see a count that is a moment old, which only makes it a little
+    //   less rare-first
+    // - have-bits and priorities are atomics too
+    //
+    // Picking is by priority, then rarest first, like PiecePicker. Ties are
+    // broken from a place that differs per caller, so threads spread over
+    // pieces instead of all fighting over the rarest one; a caller keeps
+    // taking blocks from its current piece until it has none left.
+    //
+    // Pieces go: wanted -> blocks claimed -> blocks received -> complete
+    // (hash it) -> mark_have() or piece_failed() (back to wanted).
+    class ConcurrentPicker {
+    public:
+        struct Block {
+            std::uint32_t piece = 0;
+            std::uint32_t block = 0;
+        };
+
+        // Blocks of kBlockSize (16 KiB); the last piece may have fewer.
+        explicit ConcurrentPicker(const TorrentMeta& meta);
+        ConcurrentPicker(std::uint32_t num_pieces, std::uint32_t blocks_per_piece, std::uint32_t blocks_in_last_piece);
+
+        ConcurrentPicker(const ConcurrentPicker&) = delete;
+        ConcurrentPicker& operator=(const ConcurrentPicker&) = delete;
+
+        static constexpr std::uint32_t kBlockSize = 16 * 1024;
+
+        void set_piece_priority(std::uint32_t piece, std::uint8_t prio);
+        std::uint8_t piece_priority(std::uint32_t piece) const;
+
+        // Availability: how many connected peers have each piece.
+        void add_peer_pieces(const std::vector<bool>& peer_has);
+        void remove_peer_pieces(const std::vector<bool>& peer_has);
+        void inc_availability(std::uint32_t piece);
+        std::uint32_t availability(std::uint32_t piece) const;
+
+        // Up to `max` free blocks, all of one piece, claimed for a peer that
+        // has `peer_has` (empty: every piece). `current` is the caller's
+        // piece: it is tried first and updated to the piece the blocks came
+        // from (-1 if none). Returns how many were written to `out`.
+        std::size_t claim_blocks(const std::vector<bool>& peer_has, std::int64_t& current,
+                                 std::size_t max, Block* out);
+        // A specific block; false if someone else has it.
+        bool claim_block(std::uint32_t piece, std::uint32_t block);
+        // Give a claimed block back (request cancelled, peer gone).
+        void release_block(std::uint32_t piece, std::uint32_t block);
+
+        // True for exactly one call per piece: the one receiving its last
+        // missing block. Receiving a block twice (end game) is harmless.
+        bool mark_received(std::uint32_t piece, std::uint32_t block);
+        // The piece passed its hash check.
+        void mark_have(std::uint32_t piece);
+        // It didn't: every block is wanted again.
+        void piece_failed(std::uint32_t piece);
+
+        bool have(std::uint32_t piece) const;
+        bool is_requested(std::uint32_t piece, std::uint32_t block) const;
+        bool is_received(std::uint32_t piece, std::uint32_t block) const;
+
+        std::uint32_t num_pieces() const { return m_num_pieces; }
+        std::uint32_t blocks_in_piece(std::uint32_t piece) const;
+        std::uint32_t num_have() const { return m_num_have.load(std::memory_order_relaxed); }
+
+        // CAS attempts that lost to another thread, since construction.
+        std::uint64_t cas_retries() const { return m_cas_retries.load(std::memory_order_relaxed); }
+
+    private:
+        // A cache line each, as are the bitmaps of a piece, so threads
+        // working on neighbouring pieces don't slow each other down.
+        struct alignas(64) Piece {
+            std::atomic<std::uint32_t> requested{0}; // bits set in its requested bitmap
+            std::atomic<std::uint32_t> received{0};
+            std::atomic<std::uint32_t> availability{0};
+            std::atomic<std::uint8_t> priority{static_cast<std::uint8_t>(FilePriority::Normal)};
+        };
+        struct alignas(64) Line {
+            std::atomic<std::uint64_t> words[8];
+        };
+
+        std::atomic<std::uint64_t>* requested_words(std::uint32_t piece) const;
+        std::atomic<std::uint64_t>* received_words(std::uint32_t piece) const;
+        bool pickable(std::uint32_t piece, const std::vector<bool>& peer_has) const;
+        std::size_t claim_from(std::uint32_t piece, std::size_t max, Block* out);
+
+        std::uint32_t m_num_pieces;
+        std::uint32_t m_blocks_per_piece;
+        std::uint32_t m_blocks_in_last_piece;
+        std::uint32_t m_lines_per_piece;
+
+        std::unique_ptr<Piece[]> m_pieces;
+        std::unique_ptr<Line[]> m_requested; // m_lines_per_piece per piece
+        std::unique_ptr<Line[]> m_received;
+        std::unique_ptr<std::atomic<std::uint64_t>[]> m_have; // one bit per piece
+        std::atomic<std::uint32_t> m_num_have{0};
+        std::atomic<std::uint64_t> m_cas_retries{0};
+    };
+
+}
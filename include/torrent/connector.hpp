@@ -0,0 +1,138 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "torrent/endpoint.hpp"
+#include "torrent/event_loop.hpp"
+
+namespace torrent {
+
+    // Opens outbound TCP connections to many peers at once.
+    //
+    // Peers are queued and connected with non-blocking connect(), at most
+    // `half_open_limit` at a time; each socket is handed over as soon as its
+    // connect completes, so the fastest peers come first regardless of the
+    // order they were added in. The queue alternates between IPv6 and IPv4
+    // peers so neither family waits behind the other, and within a family
+    // the best-ranked peer goes next (in order added if there's no ranking).
+    //
+    // A peer may have several addresses (e.g. a host name with A and AAAA
+    // records). These are raced happy-eyeballs style (RFC 8305): IPv6 and
+    // IPv4 addresses are interleaved, the next one starts after a short delay
+    // or as soon as the previous one fails, and the first to connect wins.
+    //
+    // With a uTP socket manager, IPv4 addresses are tried over uTP first; an
+    // address that doesn't answer over uTP is tried again over TCP after
+    // the candidate's other addresses.
+    //
+    // Must only be used from the loop thread.
+    class UtpSocketManager;
+
+    class Connector {
+    public:
+        // `fd` is connected and non-blocking; the callee takes ownership.
+        // `connect_time` is how long connect() took (about one round trip).
+        using ConnectedCallback = std::function<void(int fd, const Endpoint& remote,
+                                                     std::chrono::milliseconds connect_time)>;
+        using FailedCallback = std::function<void(const Endpoint& remote, const std::string& reason)>;
+
+        explicit Connector(EventLoop& loop);
+        ~Connector();
+
+        Connector(const Connector&) = delete;
+        Connector& operator=(const Connector&) = delete;
+
+        void set_on_connected(ConnectedCallback cb) { m_on_connected = std::move(cb); }
+        // Called for every address that could not be connected to.
+        void set_on_failed(FailedCallback cb) { m_on_failed = std::move(cb); }
+
+        // Higher goes first. Evaluated when a slot frees up, so it may change
+        // while peers are queued.
+        void set_rank(std::function<double(const Endpoint&)> fn) { m_rank = std::move(fn); }
+
+        // Asked before each new attempt; returning false keeps peers queued
+        // (e.g. while the torrent is at its connection limit).
+        void set_want_more(std::function<bool()> fn) { m_want_more = std::move(fn); }
+
+        // Not owned; must outlive the connector. nullptr: TCP only.
+        void set_utp(UtpSocketManager* utp) { m_utp = utp; }
+
+        void set_half_open_limit(std::size_t n);
+        void set_connect_timeout(std::chrono::milliseconds timeout) { m_connect_timeout = timeout; }
+
+        // Queue a peer. Addresses already queued or connecting are ignored.
+        void add(const Endpoint& peer) { add(std::vector<Endpoint>{peer}); }
+        // Queue one peer reachable at any of `addresses`.
+        void add(std::vector<Endpoint> addresses);
+
+        // Start queued peers if the limits allow it. Call after whatever
+        // the want-more check depends on has changed.
+        void start_queued();
+
+        std::size_t half_open() const { return m_attempts.size(); }
+        std::size_t queued() const { return m_queue_v6.size() + m_queue_v4.size(); }
+        // Rank of the best queued peer; -infinity if none are queued.
+        double best_queued_rank() const;
+
+    private:
+        // One connect() in progress.
+        struct Attempt {
+            Endpoint remote;
+            std::uint64_t candidate;
+            EventLoop::Clock::time_point started;
+            EventLoop::TimerId timeout = 0;
+            bool utp = false; // the fd is a uTP stream; the manager watches it
+        };
+
+        // One peer and the addresses we may reach it at.
+        struct Candidate {
+            std::vector<Endpoint> addresses;
+            std::size_t next = 0;           // next address to try
+            std::vector<Endpoint> tcp_retry; // addresses uTP failed on, to try over TCP
+            std::vector<int> attempts;      // fds still connecting
+            EventLoop::TimerId stagger = 0; // starts the next address
+        };
+
+        bool can_start() const;
+        double rank(std::uint64_t id) const;
+        std::uint64_t pop_best(std::deque<std::uint64_t>& queue);
+        static bool has_more(const Candidate& cand);
+        void start_next(std::uint64_t id);
+        void track(int fd, const Endpoint& remote, std::uint64_t id, bool utp);
+        void on_stagger(std::uint64_t id);
+        void on_event(int fd, std::uint32_t events);
+        void on_utp_result(int fd, const std::string& error);
+        void connected(int fd);
+        void fail_attempt(int fd, const std::string& reason);
+        void end_attempt(int fd);
+        void finish_candidate(std::uint64_t id);
+
+        EventLoop& m_loop;
+        UtpSocketManager* m_utp = nullptr;
+        ConnectedCallback m_on_connected;
+        FailedCallback m_on_failed;
+        std::function<bool()> m_want_more;
+        std::function<double(const Endpoint&)> m_rank;
+
+        std::size_t m_half_open_limit = 32;
+        std::chrono::milliseconds m_connect_timeout{10000};
+
+        std::uint64_t m_next_id = 1;
+        std::unordered_map<std::uint64_t, Candidate> m_candidates;
+        std::deque<std::uint64_t> m_queue_v6;
+        std::deque<std::uint64_t> m_queue_v4;
+        bool m_v6_turn = true;
+
+        std::unordered_map<int, Attempt> m_attempts; // by fd
+        std::unordered_set<Endpoint> m_known;        // queued or connecting
+    };
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "torrent/bencode.hpp"
+#include "torrent/event_loop.hpp"
+#include "torrent/session.hpp"
+
+namespace torrent {
+
+    // Control socket for a long-running Session: local clients connect to a
+    // Unix domain socket and add, remove, pause and resume torrents, change
+    // limits and watch progress, without paying for process startup and
+    // tracker/peer warm-up per job. Torrents stay in the session (seeding,
+    // with their connections and caches) until removed, and adding one
+    // that is already there just returns it.
+    //
+    // Messages are dictionaries, either one JSON object per line or
+    // back-to-back bencoded dicts; each reply uses the encoding of its
+    // request, and pushed events that of the client's last request. Every
+    // request has a "cmd"; an "id" is echoed in the reply. Replies carry
+    // "ok": 1, or "error" with a message. Info hashes are 40 hex digits.
+    //
+    //   add        torrent (.torrent path), save_path, [peers ("host:port" list)]
+    //              -> info_hash, existing (1 if it was already added)
+    //   remove, pause, resume   info_hash
+    //   status     [info_hash] -> torrents (list), connections, and pool
+    //              (threads, queued, executed, steals) if the session has one
+    //   limits     [upload], [download] (bytes/s, 0 = unlimited), [max_connections]
+    //   subscribe  [interval_ms] (default 1000, 100 to 3600000, 0 stops) -> "status" events
+    //              every interval and a "finished" event per completed torrent
+    //   shutdown   stop the daemon (trackers are told first)
+    //
+    // Must only be used from the loop thread.
+    class Daemon {
+    public:
+        // Listen on `socket_path` (an old socket file there is replaced).
+        // Throws std::runtime_error. `session` must outlive the daemon.
+        Daemon(EventLoop& loop, Session& session, const std::string& socket_path);
+        ~Daemon();
+
+        Daemon(const Daemon&) = delete;
+        Daemon& operator=(const Daemon&) = delete;
+
+        // Called on "shutdown", after its reply was queued.
+        void set_on_shutdown(std::function<void()> cb) { m_on_shutdown = std::move(cb); }
+
+        std::size_t num_clients() const { return m_clients.size(); }
+
+    private:
+        struct Client {
+            int fd = -1;
+            std::string in;
+            std::string out;
+            bool bencoded = false; // the last request was
+            bool eof = false;      // it won't send any more
+            std::uint32_t events = 0; // watched for
+            EventLoop::TimerId status_timer = 0;
+        };
+
+        void on_accept();
+        void on_client_event(int fd, std::uint32_t events);
+        void on_request(Client& c, const json& request);
+        json handle(Client& c, const json& request);
+        // Both may close the client; callers look it up again afterwards.
+        void send(Client& c, const json& msg);
+        void flush(Client& c);
+        void close_client(int fd);
+        json status_of(const Session::InfoHash* only) const;
+
+        EventLoop& m_loop;
+        Session& m_session;
+        std::string m_path;
+        int m_fd = -1;
+        std::unordered_map<int, std::unique_ptr<Client>> m_clients;
+        std::function<void()> m_on_shutdown;
+    };
+
+    // Length of the bencoded value at the start of `data`, 0 if it isn't
+    // all there yet. Throws std::runtime_error if it can't be bencode.
+    std::size_t bencoded_length(const std::string& data);
+
+}
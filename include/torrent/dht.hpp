@@ -0,0 +1,182 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "torrent/bencode.hpp"
+#include "torrent/endpoint.hpp"
+#include "torrent/event_loop.hpp"
+#include "torrent/routing_table.hpp"
+#include "torrent/utp.hpp"
+
+namespace torrent {
+
+    // A Mainline DHT node (BEP 5) on one UDP socket, IPv4 only.
+    //
+    // KRPC messages are bencoded dictionaries. We answer ping, find_node,
+    // get_peers and announce_peer, and run iterative lookups: the k closest
+    // nodes we know are asked for closer ones, at most alpha at a time, until
+    // the k closest that answered have all been asked. get_peers lookups
+    // report peers as they arrive and can finish with announce_peer to the
+    // closest nodes, using the write tokens they handed out.
+    //
+    // Our tokens are 8 bytes of SHA-1(secret + address). The secret changes
+    // every 5 minutes and the previous one is still accepted, so a token is
+    // good for 5 to 10 minutes. Announced peers expire after 30 minutes.
+    //
+    // Must only be used from the loop thread.
+    class Dht {
+    public:
+        using Clock = EventLoop::Clock;
+
+        struct Config {
+            std::size_t k = 8;     // bucket size, and how many nodes a lookup converges on
+            std::size_t alpha = 3; // queries in flight per lookup
+            std::chrono::milliseconds query_timeout{2000};
+            std::string bind_address = "0.0.0.0";
+        };
+
+        struct Stats {
+            std::uint64_t queries_sent = 0;
+            std::uint64_t responses_received = 0;
+            std::uint64_t timeouts = 0;
+            std::uint64_t queries_received = 0;
+        };
+
+        struct LookupResult {
+            std::vector<NodeEntry> nodes; // closest nodes that answered
+            std::size_t queries = 0;
+            std::size_t timeouts = 0;
+            std::chrono::microseconds elapsed{0};
+        };
+
+        using LookupId = std::uint64_t;
+        using PeersCallback = std::function<void(const std::vector<Endpoint>&)>;
+        using DoneCallback = std::function<void(const LookupResult&)>;
+
+        // Bind UDP `port` (0 = any free port). Throws std::runtime_error.
+        Dht(EventLoop& loop, std::uint16_t port);
+        Dht(EventLoop& loop, std::uint16_t port, Config config, std::optional<NodeId> id = std::nullopt);
+        // Share uTP's socket (and so its port): it hands us the datagrams
+        // that aren't uTP. `utp` must outlive the node.
+        Dht(EventLoop& loop, UtpSocketManager& utp);
+        Dht(EventLoop& loop, UtpSocketManager& utp, Config config, std::optional<NodeId> id = std::nullopt);
+        ~Dht();
+
+        Dht(const Dht&) = delete;
+        Dht& operator=(const Dht&) = delete;
+
+        // Join the network through these nodes: look up our own id via them.
+        // They are asked again whenever the routing table runs empty.
+        LookupId bootstrap(const std::vector<Endpoint>& nodes, DoneCallback done = nullptr);
+        // Ping a node we heard of (e.g. a peer's Port message); it is added
+        // to the routing table if it answers.
+        void add_node(const Endpoint& endpoint);
+
+        LookupId find_node(const NodeId& target, DoneCallback done);
+        // Iterative get_peers. With `announce_port`, finish by announcing
+        // ourselves on that port (0 = the port the DHT messages come from).
+        LookupId get_peers(const NodeId& info_hash, PeersCallback on_peers, DoneCallback done = nullptr,
+                           std::optional<std::uint16_t> announce_port = std::nullopt);
+        // Stop a lookup; none of its callbacks run afterwards.
+        void cancel(LookupId id);
+
+        const NodeId& id() const { return m_id; }
+        std::uint16_t port() const { return m_port; }
+        std::size_t num_nodes() const { return m_table.size(); }
+        const RoutingTable& table() const { return m_table; }
+        const Stats& stats() const { return m_stats; }
+
+    private:
+        struct Candidate {
+            NodeEntry node;
+            enum class State { Fresh, Queried, Answered, Failed } state = State::Fresh;
+            std::string token;
+        };
+
+        struct Lookup {
+            NodeId target{};
+            bool want_peers = false;
+            std::optional<std::uint16_t> announce_port;
+            std::vector<Candidate> candidates; // closest first
+            std::unordered_set<Endpoint> seen;
+            std::unordered_set<Endpoint> peers;
+            std::size_t in_flight = 0;
+            Clock::time_point started{};
+            LookupResult result;
+            PeersCallback on_peers;
+            DoneCallback done;
+        };
+
+        struct Pending {
+            Endpoint to;
+            LookupId lookup = 0; // 0: not part of a lookup
+            NodeId target_node{};
+            bool node_known = false; // target_node is set
+            EventLoop::TimerId timer = 0;
+        };
+
+        struct StoredPeer {
+            Endpoint endpoint;
+            Clock::time_point added;
+        };
+
+        void start();
+        void on_readable();
+        void on_datagram(const char* data, std::size_t len, const Endpoint& from);
+        void handle_query(const json& msg, const Endpoint& from);
+        void handle_response(const json& msg, const Endpoint& from, bool error);
+        void on_timeout(const std::string& tid);
+
+        void send_query(const Endpoint& to, const std::string& method, json args, LookupId lookup,
+                        const NodeId* node);
+        void send_message(const Endpoint& to, const json& msg);
+
+        // Seeded with the closest nodes in the table, plus `extra` (nodes
+        // whose id we don't know yet, e.g. bootstrap nodes). Call step() next.
+        LookupId start_lookup(const NodeId& target, bool want_peers, PeersCallback on_peers, DoneCallback done,
+                              std::optional<std::uint16_t> announce_port, const std::vector<Endpoint>& extra);
+        void add_candidate(Lookup& l, const NodeEntry& node);
+        void step(LookupId id);
+        void finish(LookupId id);
+
+        std::string make_token(const Endpoint& ep, const std::string& secret) const;
+        void maintain();
+
+        EventLoop& m_loop;
+        Config m_config;
+        NodeId m_id;
+        RoutingTable m_table;
+        int m_fd = -1;
+        UtpSocketManager* m_utp = nullptr; // sends and receives for us instead of m_fd
+        std::uint16_t m_port = 0;
+
+        std::uint16_t m_next_tid = 0;
+        std::unordered_map<std::string, Pending> m_pending;   // by transaction id
+        LookupId m_next_lookup = 1;
+        std::unordered_map<LookupId, Lookup> m_lookups;
+
+        std::string m_secret;
+        std::string m_prev_secret;
+        Clock::time_point m_secret_changed{};
+        std::map<NodeId, std::vector<StoredPeer>> m_peers;     // announced to us
+
+        std::vector<Endpoint> m_bootstrap;
+        Stats m_stats;
+        EventLoop::TimerId m_maintain_timer = 0;
+    };
+
+    // Compact node info: 20-byte id, 4-byte address, 2-byte port.
+    std::string encode_compact_nodes(const std::vector<NodeEntry>& nodes);
+    std::vector<NodeEntry> parse_compact_nodes(const std::string& data);
+
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace torrent {
+
+    // A peer's address and port in 18 bytes, without heap allocation.
+    //
+    // IPv4 addresses are stored IPv4-mapped (::ffff:a.b.c.d), so one layout
+    // covers both families. Convert to a sockaddr only at the socket call.
+    struct Endpoint {
+        std::array<std::uint8_t, 16> addr{};
+        std::uint16_t port = 0; // host byte order
+
+        static Endpoint v4(const std::uint8_t* bytes, std::uint16_t port);
+        static Endpoint v6(const std::uint8_t* bytes, std::uint16_t port);
+
+        // From an AF_INET / AF_INET6 socket address; nullopt for other families.
+        static std::optional<Endpoint> from_sockaddr(const sockaddr* sa);
+
+        // Numeric "1.2.3.4:80" or "[::1]:80"; nullopt if not numeric.
+        static std::optional<Endpoint> parse(const std::string& text);
+
+        // "host:port" where host may also be a name, resolved with
+        // getaddrinfo. Blocking; meant for user input, not peer lists.
+        // Throws std::runtime_error if it can't be resolved.
+        static Endpoint resolve(const std::string& text);
+        // Same, but every address the name resolves to (IPv6 and IPv4).
+        static std::vector<Endpoint> resolve_all(const std::string& text);
+
+        bool is_v4() const;
+
+        // Fills `ss` as AF_INET for IPv4 endpoints, AF_INET6 otherwise.
+        // Returns the length to pass to connect()/bind().
+        socklen_t to_sockaddr(sockaddr_storage& ss) const;
+
+        std::string address_string() const;
+        std::string to_string() const;  // "1.2.3.4:80" / "[::1]:80"
+        // Compact form of tracker replies and PEX: address then big-endian
+        // port, 6 bytes for IPv4 and 18 for IPv6.
+        std::string compact() const;
+
+        bool operator==(const Endpoint& o) const { return port == o.port && addr == o.addr; }
+        bool operator!=(const Endpoint& o) const { return !(*this == o); }
+        bool operator<(const Endpoint& o) const { return addr != o.addr ? addr < o.addr : port < o.port; }
+    };
+
+    static_assert(sizeof(Endpoint) == 18, "Endpoint must stay 18 bytes");
+
+}
+
+template <>
+struct std::hash<torrent::Endpoint> {
+    std::size_t operator()(const torrent::Endpoint& ep) const noexcept {
+        // FNV-1a over the 18 bytes
+        std::uint64_t h = 1469598103934665603ULL;
+        for (std::uint8_t b : ep.addr) h = (h ^ b) * 1099511628211ULL;
+        h = (h ^ (ep.port & 0xFF)) * 1099511628211ULL;
+        h = (h ^ (ep.port >> 8)) * 1099511628211ULL;
+        return static_cast<std::size_t>(h);
+    }
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+
+namespace torrent {
+
+    // Single-threaded epoll reactor with timers.
+    //
+    // All callbacks run on the thread that calls run(). post() and stop() are
+    // the only members that may be called from other threads.
+    class EventLoop {
+    public:
+        using Clock         = std::chrono::steady_clock;
+        using FdCallback    = std::function<void(std::uint32_t events)>; // EPOLLIN / EPOLLOUT / ...
+        using TimerCallback = std::function<void()>;
+        using TimerId       = std::uint64_t;
+
+        EventLoop();
+        ~EventLoop();
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        // Watch `fd` for `events` (EPOLLIN, EPOLLOUT, ...). The loop does not own the fd.
+        void add_fd(int fd, std::uint32_t events, FdCallback cb);
+        void modify_fd(int fd, std::uint32_t events);
+        void remove_fd(int fd);
+
+        // Run `cb` after `delay`, and then every `delay` if `repeat` is set.
+        TimerId add_timer(std::chrono::milliseconds delay, TimerCallback cb, bool repeat = true);
+        void cancel_timer(TimerId id);
+
+        // Queue `fn` to run on the loop thread. Thread-safe and lock-free,
+        // so pool workers and other loops can hand work over cheaply;
+        // functions posted from one thread run in the order posted.
+        void post(std::function<void()> fn);
+
+        // Dispatch events until stop() is called.
+        void run();
+        // Dispatch ready events once, waiting at most `timeout`.
+        void run_once(std::chrono::milliseconds timeout);
+        // Make run() return. Thread-safe.
+        void stop();
+
+        Clock::time_point now() const { return m_now; }
+
+    private:
+        struct Watcher {
+            int fd;
+            std::uint32_t events;
+            FdCallback cb;
+        };
+
+        struct Timer {
+            std::chrono::milliseconds interval;
+            bool repeat;
+            TimerCallback cb;
+        };
+
+        using TimerEntry = std::pair<Clock::time_point, TimerId>;
+
+        struct Posted {
+            std::function<void()> fn;
+            Posted* next = nullptr;
+        };
+
+        void run_timers();
+        void run_posted();
+        int next_timeout_ms(std::chrono::milliseconds cap) const;
+
+        int m_epoll_fd = -1;
+        int m_wake_fd  = -1;
+        bool m_running = false;
+        Clock::time_point m_now;
+
+        std::unordered_map<int, std::shared_ptr<Watcher>> m_watchers;
+
+        TimerId m_next_timer_id = 1;
+        std::unordered_map<TimerId, Timer> m_timers;
+        std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry>> m_timer_queue;
+
+        // Newest first; the loop takes the whole list at once, so there is
+        // no ABA problem and pushing onto an empty list is the only time
+        // the loop needs waking.
+        std::atomic<Posted*> m_posted{nullptr};
+        std::atomic<bool> m_stop_requested{false};
+    };
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "torrent/bencode.hpp"
+#include "torrent/endpoint.hpp"
+
+namespace torrent {
+
+    // The extension handshake (extended message id 0) a peer sent us.
+    struct ExtensionHandshake {
+        // "m": extension name -> the id the peer wants to receive it under.
+        // Id 0 means the peer disabled it; merge_extension_handshake()
+        // removes those.
+        std::unordered_map<std::string, std::uint8_t> messages;
+
+        std::optional<std::uint32_t> reqq;        // requests it queues without dropping
+        std::string client;                       // "v"
+        std::optional<std::uint16_t> listen_port; // "p"
+        std::optional<Endpoint> your_ip;          // "yourip": our address as it sees it (port 0)
+
+        json dict; // the whole dictionary, for keys of individual extensions
+    };
+
+    // Throws std::runtime_error if the payload isn't a bencoded dictionary.
+    ExtensionHandshake parse_extension_handshake(const std::uint8_t* data, std::size_t len);
+
+    // A peer's handshake may be sent again to update it: later "m" entries
+    // replace earlier ones (id 0 removes the extension), other keys are
+    // overwritten when present.
+    void merge_extension_handshake(ExtensionHandshake& into, ExtensionHandshake update);
+
+    // What an extension sees of one connection.
+    class ExtensionPeer {
+    public:
+        virtual ~ExtensionPeer() = default;
+
+        virtual const Endpoint& endpoint() const = 0;
+        // The peer's extension handshake (empty until it arrives).
+        virtual const ExtensionHandshake& extension_handshake() const = 0;
+
+        bool supports(const std::string& name) const {
+            return extension_handshake().messages.count(name) != 0;
+        }
+
+        // Queue a message of extension `name`; it is sent with the
+        // connection's next flush (after the current message or tick).
+        // Ignored if the peer doesn't support `name`.
+        virtual void send_extended(const std::string& name, const std::uint8_t* data, std::size_t len) = 0;
+    };
+
+    // One extension message type ("ut_metadata", "ut_pex", ...).
+    //
+    // Handlers run on the loop thread. Throwing from one of them closes the
+    // connection it was called for.
+    class Extension {
+    public:
+        virtual ~Extension() = default;
+
+        // Name in the "m" dictionary.
+        virtual std::string name() const = 0;
+
+        // Add keys of our own to the extension handshake we send
+        // (e.g. "metadata_size").
+        virtual void add_handshake_keys(json& /*dict*/) const {}
+
+        // The peer's extension handshake arrived, or an update of it.
+        virtual void on_handshake(ExtensionPeer& /*peer*/) {}
+
+        // A message for this extension. `data` points into the receive
+        // buffer and is only valid during the call.
+        virtual void on_message(ExtensionPeer& peer, const std::uint8_t* data, std::size_t len) = 0;
+
+        // The connection is about to close.
+        virtual void on_disconnect(ExtensionPeer& /*peer*/) {}
+
+        // Called every few seconds (the owner's tick).
+        virtual void on_tick() {}
+    };
+
+    // Extensions offered on a set of connections. Each gets a local message
+    // id (its position + 1) that peers use to address it; incoming extended
+    // messages are dispatched by that id.
+    class ExtensionRegistry {
+    public:
+        // Throws std::runtime_error on a duplicate name or when all 255 ids are used.
+        void add(std::unique_ptr<Extension> ext);
+
+        // nullptr for id 0 (the handshake) and unknown ids.
+        Extension* find(std::uint8_t local_id) const;
+        Extension* find(const std::string& name) const;
+
+        // Our handshake dictionary: "m" plus every extension's own keys.
+        json handshake() const;
+
+        bool empty() const { return m_extensions.empty(); }
+        const std::vector<std::unique_ptr<Extension>>& extensions() const { return m_extensions; }
+
+    private:
+        std::vector<std::unique_ptr<Extension>> m_extensions;
+    };
+
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 #include "torrent/torrent_meta.hpp"
+#include "torrent/storage.hpp"
 #include "torrent/tracker.hpp"
 #include "torrent/peer.hpp"
 
@@ -11,15 +15,30 @@ namespace torrent {
     //
     // Simple version:
     //  - use a single peer (first from tracker)
-    //  - download pieces sequentially: 0,1,2,...,N-1
-    //  - verify each piece hash (optional now, easy later)
-    //  - write in order to disk
+    //  - download wanted pieces in PiecePicker order (priority, then index:
+    //    with one peer every piece is equally rare)
+    //  - verify each piece hash
+    //  - write through Storage (multi-file torrents: `output_path` is a directory)
+    //
+    // `file_priorities` (one per file, empty = all Normal) selects which files
+    // to download; pieces only overlapping skipped files are never requested.
     //
     // Throws std::runtime_error on any fatal error.
     void download_file_single_peer(
         const TorrentMeta& meta,
         const std::string& peer_id,
-        const std::string& output_path
+        const std::string& output_path,
+        const std::vector<FilePriority>& file_priorities = {}
+    );
+
+    // Same as above, but writes through a caller-owned Storage (so that it can
+    // be shared with a seeding Torrent) and calls `on_piece_done` after each
+    // verified piece has been written.
+    void download_file_single_peer(
+        const TorrentMeta& meta,
+        const std::string& peer_id,
+        Storage& storage,
+        const std::function<void(std::uint32_t)>& on_piece_done = nullptr
     );
 
 }
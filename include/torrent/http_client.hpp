@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <curl/curl.h>
+
+#include "torrent/event_loop.hpp"
+
+namespace torrent {
+
+    // Asynchronous HTTP GETs on an EventLoop.
+    //
+    // All requests share one curl multi handle driven through its socket
+    // interface: curl tells us which sockets to watch and when its next
+    // timeout is, and the EventLoop does the waiting. Requests run
+    // concurrently, and connections to the same host are reused from the
+    // multi handle's connection cache.
+    //
+    // Must only be used from the loop thread.
+    class HttpClient {
+    public:
+        struct Response {
+            long status = 0;
+            std::string body;
+            std::string error;  // non-empty if the transfer itself failed
+        };
+        using Callback = std::function<void(const Response&)>;
+
+        explicit HttpClient(EventLoop& loop);
+        ~HttpClient();
+
+        HttpClient(const HttpClient&) = delete;
+        HttpClient& operator=(const HttpClient&) = delete;
+
+        // Start a GET; `cb` runs on the loop when it finishes or fails.
+        void get(const std::string& url, Callback cb, std::chrono::seconds timeout = std::chrono::seconds(30));
+
+        std::size_t pending() const { return m_requests.size(); }
+
+    private:
+        struct Request {
+            CURL* easy = nullptr;
+            std::string body;
+            Callback cb;
+        };
+
+        static int on_socket(CURL* easy, curl_socket_t fd, int what, void* userp, void* socketp);
+        static int on_timer(CURLM* multi, long timeout_ms, void* userp);
+        static size_t on_write(char* ptr, size_t size, size_t nmemb, void* userdata);
+
+        void socket_action(curl_socket_t fd, int flags);
+        void finish_transfers();
+
+        EventLoop& m_loop;
+        CURLM* m_multi = nullptr;
+        EventLoop::TimerId m_timer = 0;
+        std::unordered_map<CURL*, std::unique_ptr<Request>> m_requests;
+        std::unordered_set<curl_socket_t> m_watched;
+    };
+
+}
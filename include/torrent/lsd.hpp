@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_set>
+
+#include "torrent/endpoint.hpp"
+#include "torrent/event_loop.hpp"
+
+namespace torrent {
+
+    // Local Service Discovery (BEP 14): find peers on the local network
+    // through IPv4 multicast, without a tracker or the DHT.
+    //
+    // Every torrent is announced to 239.192.152.143:6771 when it is added and
+    // every 5 minutes after that, as an HTTP-like "BT-SEARCH" message with
+    // our listen port and its info hash. Announcements from others on the
+    // group are handed to the callback; our own come back too (multicast
+    // loopback, so instances on one host find each other) and are told
+    // apart by a random cookie.
+    //
+    // When a peer we haven't heard from announces a torrent we have, we
+    // announce it again right away (at most once a second), so newcomers
+    // find us without waiting for the next round.
+    //
+    // Must only be used from the loop thread.
+    class Lsd {
+    public:
+        using InfoHash = std::array<std::uint8_t, 20>;
+        using PeerCallback = std::function<void(const InfoHash& info_hash, const Endpoint& peer)>;
+
+        struct Config {
+            std::string group = "239.192.152.143";
+            std::uint16_t port = 6771;
+            // Address of the interface to send and join on; empty: the
+            // one the routing table picks for the group.
+            std::string interface;
+        };
+
+        // Throws std::runtime_error if the socket can't be set up.
+        Lsd(EventLoop& loop, PeerCallback on_peer);
+        Lsd(EventLoop& loop, PeerCallback on_peer, Config config);
+        ~Lsd();
+
+        Lsd(const Lsd&) = delete;
+        Lsd& operator=(const Lsd&) = delete;
+
+        // Announce `info_hash` (peers connect to `listen_port`) now and
+        // every 5 minutes until it is removed.
+        void add_torrent(const InfoHash& info_hash, std::uint16_t listen_port);
+        void remove_torrent(const InfoHash& info_hash);
+
+    private:
+        struct Announced {
+            std::uint16_t listen_port = 0;
+            EventLoop::Clock::time_point last{};
+            EventLoop::TimerId reply_timer = 0; // a delayed reply is due
+        };
+
+        void on_readable();
+        void announce(const InfoHash& info_hash);
+        void announce_all();
+        void reply(const InfoHash& info_hash);
+
+        EventLoop& m_loop;
+        PeerCallback m_on_peer;
+        Config m_config;
+        int m_fd = -1;
+        std::string m_cookie;
+        std::map<InfoHash, Announced> m_torrents;
+        std::unordered_set<Endpoint> m_heard; // peers that announced to us
+        EventLoop::TimerId m_timer = 0;
+    };
+
+    // One announcement, ready to send ("Host" is `group`:`port`).
+    std::string build_lsd_announce(const std::string& host, std::uint16_t listen_port,
+                                   const std::array<std::uint8_t, 20>& info_hash, const std::string& cookie);
+
+}
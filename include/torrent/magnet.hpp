@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "torrent/endpoint.hpp"
+#include "torrent/torrent_meta.hpp"
+
+namespace torrent {
+
+    // A parsed magnet link (BEP 9): the info hash, and optionally a display
+    // name, trackers and peers to start from.
+    struct MagnetLink {
+        std::array<std::uint8_t, 20> info_hash{};
+        std::string name;                  // "dn"
+        std::vector<std::string> trackers; // "tr", in order
+        std::vector<Endpoint> peers;       // "x.pe" (numeric host:port only)
+    };
+
+    bool is_magnet_link(const std::string& text);
+
+    // Parse "magnet:?xt=urn:btih:<hash>&..." with the hash in hex (40
+    // characters) or base32 (32). Throws std::runtime_error if there is no
+    // valid btih topic.
+    MagnetLink parse_magnet_link(const std::string& uri);
+
+    // What we know of the torrent before its metadata arrives: the info hash
+    // and the trackers (each in its own tier, as BEP 9 suggests). Enough
+    // for a TrackerManager.
+    TorrentMeta magnet_meta(const MagnetLink& magnet);
+
+}
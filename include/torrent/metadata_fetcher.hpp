@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "torrent/connector.hpp"
+#include "torrent/endpoint.hpp"
+#include "torrent/event_loop.hpp"
+#include "torrent/extension.hpp"
+#include "torrent/ut_metadata.hpp"
+
+namespace torrent {
+
+    // Gets the info dictionary of a magnet link from peers, before there is
+    // a Torrent to download into.
+    //
+    // Connects to the peers it is given (through a Connector, so many at
+    // once), does the BitTorrent and extension handshakes and lets a
+    // UtMetadata download the metadata from all peers that have it in
+    // parallel. Everything but extended messages is ignored. Peers without
+    // the extension protocol or ut_metadata are dropped.
+    //
+    // Must only be used from the loop thread.
+    class MetadataFetcher {
+    public:
+        // Runs once with the verified info dictionary. May stop the loop,
+        // but must not destroy the fetcher.
+        using DoneCallback = std::function<void(const std::string& info_bencoded)>;
+
+        MetadataFetcher(EventLoop& loop, const std::array<std::uint8_t, 20>& info_hash, const std::string& peer_id);
+        ~MetadataFetcher();
+
+        MetadataFetcher(const MetadataFetcher&) = delete;
+        MetadataFetcher& operator=(const MetadataFetcher&) = delete;
+
+        void set_on_done(DoneCallback cb) { m_on_done = std::move(cb); }
+
+        // Peers we are connected to already are skipped.
+        void add_peer(const Endpoint& peer) { add_peer(std::vector<Endpoint>{peer}); }
+        void add_peer(const std::vector<Endpoint>& addresses);
+
+        bool done() const { return m_metadata->complete(); }
+        std::size_t num_connections() const { return m_conns.size(); }
+
+    private:
+        struct Conn : ExtensionPeer {
+            MetadataFetcher* owner = nullptr;
+            int fd = -1;
+            Endpoint remote;
+            bool handshake_done = false;
+            ExtensionHandshake ext;
+
+            std::vector<std::uint8_t> in;
+            std::vector<std::uint8_t> out;
+            EventLoop::Clock::time_point last_recv;
+
+            const Endpoint& endpoint() const override { return remote; }
+            const ExtensionHandshake& extension_handshake() const override { return ext; }
+            void send_extended(const std::string& name, const std::uint8_t* data, std::size_t len) override;
+        };
+
+        void on_connected(int fd, const Endpoint& remote);
+        void on_readable(Conn& c);
+        bool handle_handshake(Conn& c);
+        void handle_extended(Conn& c, const std::uint8_t* data, std::size_t len);
+        bool flush(Conn& c);
+        void close_connection(int fd, const std::string& reason);
+        void on_tick();
+
+        EventLoop& m_loop;
+        std::array<std::uint8_t, 20> m_info_hash;
+        std::string m_peer_id;
+        DoneCallback m_on_done;
+
+        ExtensionRegistry m_extensions;
+        UtMetadata* m_metadata = nullptr; // owned by m_extensions
+        std::unordered_map<int, std::unique_ptr<Conn>> m_conns;
+        Connector m_connector;
+        EventLoop::TimerId m_tick_timer = 0;
+    };
+
+}
@@ -8,4 +8,10 @@ namespace torrent {
     void write_all(int fd, const void* buf, std::size_t len);
     void read_exact(int fd, void* buf, std::size_t len);
 
+    // A non-blocking TCP socket listening on `port` (IPv6 dual-stack,
+    // falling back to IPv4). With `reuse_port`, several sockets can listen
+    // on the same port and the kernel spreads new connections over them.
+    // Throws std::runtime_error.
+    int open_listen_socket(std::uint16_t port, bool reuse_port = false);
+
 }
@@ -4,8 +4,8 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include "torrent/endpoint.hpp"
 #include "torrent/torrent_meta.hpp"
-#include "torrent/tracker.hpp"
 
 namespace torrent {
     // Represents a TCP connection to a single BitTorrent peer.
@@ -14,33 +14,32 @@ namespace torrent {
         // Factory: create and connect to a peer, perform handshake.
         //
         // - meta: TorrentMeta, used for info_hash and name
-        // - peer: Peer (ip + port) from tracker
+        // - peer: address of the peer (e.g. from the tracker)
         // - peer_id: this client's 20-byte peer_id string
         //
         // Throws std::runtime_error on connect/handshake failure.
         static std::unique_ptr<PeerConnection> connect_and_handshake(
             const TorrentMeta& meta,
-            const Peer& peer,
+            const Endpoint& peer,
             const std::string& peer_id
         );
 
         ~PeerConnection();
 
-        std::string remote_ip() const { return m_peer.ip; }
-        std::uint16_t remote_port() const { return m_peer.port; }
+        const Endpoint& remote() const { return m_peer; }
 
         int socket_fd() const { return m_socket_fd; }
     private:
         PeerConnection(
             const TorrentMeta& meta,
-            const Peer& peer,
+            const Endpoint& peer,
             const std::string& peer_id
         );
 
         void perform_handshake(const TorrentMeta& meta, const std::string& peer_id);
 
         int m_socket_fd = -1;
-        Peer m_peer;
+        Endpoint m_peer;
     };
 
 }
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "torrent/endpoint.hpp"
+
+namespace torrent {
+
+    // What we have learned about one peer, kept across connections.
+    struct PeerRecord {
+        using Clock = std::chrono::steady_clock;
+
+        std::chrono::milliseconds rtt{0};  // TCP connect time; 0 = unknown
+        double download_rate = 0;          // bytes/s, recent best (decays)
+        double upload_rate = 0;
+        std::uint64_t downloaded = 0;      // payload bytes, all connections
+        std::uint64_t uploaded = 0;
+
+        int hash_failures = 0;             // failed pieces it sent data for
+        bool on_parole = false;            // may only download pieces alone
+        int failed_connects = 0;           // in a row; reset by a connect
+        int disconnects = 0;
+        std::string last_disconnect;       // reason of the last one
+
+        Clock::time_point last_seen{};     // announced, connected or talked to us
+        bool local = false;                // on our LAN (Local Service Discovery)
+        Clock::time_point last_disconnect_at{};
+        bool connected = false;
+    };
+
+    // Per-torrent peer database: connection quality of every peer we have
+    // heard of, a score for choosing whom to spend connection slots on, and
+    // the list of banned addresses.
+    //
+    // Bans are per IP address (any port), since a peer that sent corrupt
+    // data can simply reconnect from another port.
+    class PeerDb {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // Records kept; the least recently seen unconnected ones go first.
+        static constexpr std::size_t kMaxRecords = 4000;
+
+        // Record that `peer` exists (e.g. a tracker returned it).
+        void seen(const Endpoint& peer, Clock::time_point now);
+        // Same, for a peer announced on the local network: cheap to reach,
+        // so it is scored above remote ones.
+        void seen_local(const Endpoint& peer, Clock::time_point now);
+
+        void connected(const Endpoint& peer, std::chrono::milliseconds rtt, Clock::time_point now);
+        void connect_failed(const Endpoint& peer, Clock::time_point now);
+        void disconnected(const Endpoint& peer, const std::string& reason, Clock::time_point now);
+
+        // Live numbers of a connection, called periodically and on close.
+        void update_transfer(const Endpoint& peer, double download_rate, double upload_rate,
+                             std::uint64_t downloaded, std::uint64_t uploaded);
+
+        // A piece this peer sent data for failed its hash check. If it was
+        // the only source it is banned. Otherwise we can't tell who is to
+        // blame yet, so it goes on parole: it may only download pieces on its
+        // own until one of them passes, which makes its next failure (if any)
+        // its own. Returns true if the peer is (now) banned.
+        bool hash_failure(const Endpoint& peer, bool sole_source);
+        // A piece this peer downloaded on its own passed: parole is over.
+        void good_piece(const Endpoint& peer);
+        bool on_parole(const Endpoint& peer) const;
+
+        void ban(const Endpoint& peer);
+        bool is_banned(const Endpoint& peer) const;
+
+        // Higher is better; 0 for a peer we know nothing about, -infinity
+        // for banned ones. Throughput counts most (+10 per doubling above
+        // 16 KiB/s down, +5 up), local peers get +30 (as much as 8 times the
+        // download rate); latency, failed connects, hash failures and a
+        // recent disconnect count against it.
+        double score(const Endpoint& peer, Clock::time_point now) const;
+
+        const PeerRecord* find(const Endpoint& peer) const;
+        std::size_t size() const { return m_records.size(); }
+        std::size_t num_banned() const { return m_banned.size(); }
+
+    private:
+        PeerRecord& record(const Endpoint& peer);
+        void trim();
+
+        std::unordered_map<Endpoint, PeerRecord> m_records;
+        std::unordered_set<Endpoint> m_banned; // port 0: the whole address
+    };
+
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
+#include <string>
 #include <vector>
 #include <optional>
 
@@ -18,7 +20,17 @@ namespace torrent {
         Request       = 6,
         Piece         = 7,
         Cancel        = 8,
-        Port          = 9
+        Port          = 9,
+
+        // Fast extension (BEP 6)
+        Suggest       = 13,
+        HaveAll       = 14,
+        HaveNone      = 15,
+        Reject        = 16,
+        AllowedFast   = 17,
+
+        // Extension protocol (BEP 10)
+        Extended      = 20
     };
 
     struct BtMessage {
@@ -27,6 +39,48 @@ namespace torrent {
         std::vector<std::uint8_t> payload;
     };
 
+    // A message parsed in place: `payload` points into the parsed buffer.
+    struct BtMessageView {
+        std::uint32_t length = 0;
+        std::optional<MsgId> id;
+        const std::uint8_t* payload = nullptr;
+        std::size_t payload_len = 0;
+    };
+
+    // Largest message we accept from a peer: a 16 KiB block plus headers,
+    // with headroom for peers that serve larger blocks and for big bitfields.
+    constexpr std::uint32_t kMaxMessageLength = 1 << 20;
+
+    using Handshake = std::array<std::uint8_t, 68>;
+
+    // The 8 reserved handshake bytes (bytes 20..27) advertise extensions.
+    using Reserved = std::array<std::uint8_t, 8>;
+
+    // Fast extension (BEP 6): reserved[7] & 0x04
+    constexpr std::size_t kReservedFastByte = 7;
+    constexpr std::uint8_t kReservedFastBit = 0x04;
+    // DHT (BEP 5): reserved[7] & 0x01, then a Port message with the DHT port
+    constexpr std::size_t kReservedDhtByte = 7;
+    constexpr std::uint8_t kReservedDhtBit = 0x01;
+    // Extension protocol (BEP 10): reserved[5] & 0x10
+    constexpr std::size_t kReservedExtensionByte = 5;
+    constexpr std::uint8_t kReservedExtensionBit = 0x10;
+
+    Handshake build_handshake(
+        const std::array<std::uint8_t, 20>& info_hash,
+        const std::string& peer_id,
+        const Reserved& reserved = {}
+    );
+
+    // Reserved bytes of a received handshake (at least 28 bytes).
+    Reserved handshake_reserved(const std::uint8_t* handshake);
+    bool supports_fast(const Reserved& reserved);
+    bool supports_extensions(const Reserved& reserved);
+    bool supports_dht(const Reserved& reserved);
+
+    // Generic [len][id][payload] frame.
+    std::vector<std::uint8_t> build_message(MsgId id, const std::vector<std::uint8_t>& payload = {});
+
     std::vector<std::uint8_t> build_interested();
 
     std::vector<std::uint8_t> build_request(
@@ -35,6 +89,60 @@ namespace torrent {
         std::uint32_t length
     );
 
+    std::vector<std::uint8_t> build_have(std::uint32_t piece_index);
+    std::vector<std::uint8_t> build_bitfield(const std::vector<bool>& have);
+
+    // DHT: the UDP port our DHT node listens on
+    std::vector<std::uint8_t> build_port(std::uint16_t dht_port);
+
+    // Fast extension
+    std::vector<std::uint8_t> build_reject(
+        std::uint32_t piece_index,
+        std::uint32_t begin,
+        std::uint32_t length
+    );
+    std::vector<std::uint8_t> build_allowed_fast(std::uint32_t piece_index);
+    std::vector<std::uint8_t> build_suggest(std::uint32_t piece_index);
+
+    // Extension protocol: [len][20][extended id][payload]. Id 0 is the
+    // extension handshake; others are the ids the receiver assigned.
+    std::vector<std::uint8_t> build_extended(std::uint8_t ext_id, const std::uint8_t* payload, std::size_t len);
+
+    // BEP 6 "allowed fast" set: `k` pieces a peer at `address` may request
+    // while choked, derived from its address so every client agrees.
+    // `address` is 4 bytes (IPv4, per the BEP) or 16 (IPv6, our extension:
+    // the /64 prefix is used the way the BEP uses the IPv4 /24).
+    std::vector<std::uint32_t> allowed_fast_set(
+        const std::uint8_t* address,
+        std::size_t address_len,
+        const std::array<std::uint8_t, 20>& info_hash,
+        std::uint32_t num_pieces,
+        std::size_t k
+    );
+
+    // Only the 13-byte header of a Piece message; the block follows separately
+    // (e.g. via sendfile) and must be exactly `block_length` bytes.
+    std::array<std::uint8_t, 13> build_piece_header(
+        std::uint32_t piece_index,
+        std::uint32_t begin,
+        std::uint32_t block_length
+    );
+
+    // Blocking read of one message from a socket.
     BtMessage read_message(int sock_fd);
 
+    // Non-blocking framing: try to parse one message from `data`.
+    // Returns the number of bytes consumed (0 if the message is incomplete).
+    // Throws if the length prefix exceeds kMaxMessageLength.
+    std::size_t parse_message(const std::uint8_t* data, std::size_t len, BtMessage& out);
+    // Same without copying the payload.
+    std::size_t parse_message_view(const std::uint8_t* data, std::size_t len, BtMessageView& out);
+
+    // Payload helpers
+    std::uint32_t read_u32_be(const std::uint8_t* p);
+    void write_u32_be(std::uint8_t* p, std::uint32_t v);
+
+    // Decode a Bitfield payload into `num_pieces` flags.
+    std::vector<bool> parse_bitfield(const std::vector<std::uint8_t>& payload, std::uint32_t num_pieces);
+
 }
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "torrent/torrent_meta.hpp"
+#include "torrent/storage.hpp"
+
+namespace torrent {
+
+    // Decides which piece to download next.
+    //
+    // Every piece has a priority (0 = don't download). Pieces are picked
+    // highest priority first, then rarest first (fewest connected peers have
+    // it), then in index order. Pieces already being downloaded are skipped.
+    class PiecePicker {
+    public:
+        explicit PiecePicker(std::uint32_t num_pieces);
+
+        // Each piece gets the highest priority of the files it overlaps, so a
+        // piece straddling a skipped and a wanted file is still downloaded.
+        void apply_file_priorities(const TorrentMeta& meta, const std::vector<FilePriority>& file_priorities);
+
+        void set_piece_priority(std::uint32_t piece, std::uint8_t prio);
+        std::uint8_t piece_priority(std::uint32_t piece) const { return m_priority.at(piece); }
+
+        void mark_have(std::uint32_t piece);
+        bool have(std::uint32_t piece) const { return m_have.at(piece); }
+        const std::vector<bool>& have_bitfield() const { return m_have; }
+
+        // A piece with requests in flight is not picked again until cleared.
+        void mark_downloading(std::uint32_t piece) { m_downloading.at(piece) = true; }
+        void clear_downloading(std::uint32_t piece) { m_downloading.at(piece) = false; }
+        bool is_downloading(std::uint32_t piece) const { return m_downloading.at(piece); }
+
+        // Availability: how many connected peers have each piece.
+        void add_peer_pieces(const std::vector<bool>& peer_has);
+        void remove_peer_pieces(const std::vector<bool>& peer_has);
+        void inc_availability(std::uint32_t piece);
+        std::uint32_t availability(std::uint32_t piece) const { return m_availability.at(piece); }
+
+        // True if the piece is wanted and we don't have it yet.
+        bool wants(std::uint32_t piece) const { return m_priority.at(piece) != 0 && !m_have.at(piece); }
+
+        // Next wanted piece we don't have yet. If `peer_has` is non-empty, only
+        // pieces the peer has are considered.
+        std::optional<std::uint32_t> pick_piece(const std::vector<bool>& peer_has = {}) const;
+
+        std::uint32_t num_pieces() const { return static_cast<std::uint32_t>(m_have.size()); }
+        std::uint32_t num_have() const { return m_num_have; }
+        std::uint32_t num_wanted() const;
+
+        // True once every wanted piece has been downloaded.
+        bool is_finished() const;
+
+    private:
+        std::vector<std::uint8_t> m_priority;
+        std::vector<bool> m_have;
+        std::vector<bool> m_downloading;
+        std::vector<std::uint32_t> m_availability;
+        std::uint32_t m_num_have = 0;
+    };
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace torrent {
+
+    // Transfer rate over a sliding window of one-second buckets.
+    //
+    // Buckets are recycled lazily when they are touched, so there is no timer
+    // per meter: add() and rate() only need the current time.
+    class RateMeter {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr std::size_t kWindowSeconds = 20;
+
+        void add(std::uint64_t bytes, Clock::time_point now) {
+            std::int64_t sec = seconds(now);
+            Bucket& b = m_buckets[static_cast<std::size_t>(sec) % kWindowSeconds];
+            if (b.second != sec) {
+                b.second = sec;
+                b.bytes = 0;
+            }
+            b.bytes += bytes;
+            m_total += bytes;
+        }
+
+        // Average bytes/second over the window ending at `now`.
+        double rate(Clock::time_point now) const {
+            std::int64_t sec = seconds(now);
+            std::uint64_t sum = 0;
+            for (const Bucket& b : m_buckets) {
+                if (b.second > sec - static_cast<std::int64_t>(kWindowSeconds)) sum += b.bytes;
+            }
+            return static_cast<double>(sum) / kWindowSeconds;
+        }
+
+        std::uint64_t total() const { return m_total; }
+
+    private:
+        struct Bucket {
+            std::int64_t second = -1;
+            std::uint64_t bytes = 0;
+        };
+
+        static std::int64_t seconds(Clock::time_point t) {
+            return std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+        }
+
+        std::array<Bucket, kWindowSeconds> m_buckets{};
+        std::uint64_t m_total = 0;
+    };
+
+}
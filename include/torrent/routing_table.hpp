@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "torrent/endpoint.hpp"
+
+namespace torrent {
+
+    // 160-bit DHT node id; info hashes live in the same space.
+    using NodeId = std::array<std::uint8_t, 20>;
+
+    // Leading bits `a` and `b` have in common (160 if equal).
+    int common_prefix_bits(const NodeId& a, const NodeId& b);
+    // XOR metric: is `a` closer to `target` than `b`?
+    bool closer_to(const NodeId& target, const NodeId& a, const NodeId& b);
+    NodeId random_node_id();
+
+    struct NodeEntry {
+        NodeId id{};
+        Endpoint endpoint;
+        std::chrono::steady_clock::time_point last_seen{};
+        int failed = 0; // queries in a row it didn't answer
+    };
+
+    // Kademlia routing table (BEP 5) of up to `k` nodes per bucket.
+    //
+    // Bucket i holds the nodes whose id shares exactly i leading bits with
+    // ours. That is the table BEP 5 ends up with by splitting the bucket
+    // around our own id, without the splitting: a node's bucket is one XOR
+    // and a count of leading zeros. The nodes closest to a target can only
+    // be in a few buckets (see closest()), so a lookup reads O(k) entries
+    // however many nodes the table holds.
+    //
+    // Nodes that answer are kept over newcomers; a node that fails
+    // kMaxFailures queries in a row is dropped, and a full bucket makes room
+    // for a newcomer by evicting a node that has failed at least once.
+    class RoutingTable {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr int kMaxFailures = 2;
+
+        RoutingTable(const NodeId& self, std::size_t k);
+
+        // Add a node or mark it seen. Returns false if it didn't fit (its
+        // bucket is full of good nodes) or is ourselves.
+        bool add(const NodeId& id, const Endpoint& endpoint, Clock::time_point now);
+        // A query to `id` timed out.
+        void failed(const NodeId& id);
+        void remove(const NodeId& id);
+
+        // Up to `count` nodes, closest to `target` first.
+        std::vector<NodeEntry> closest(const NodeId& target, std::size_t count) const;
+
+        // A random id in each non-empty bucket that hasn't changed since
+        // `before`; looking those up refreshes the bucket.
+        std::vector<NodeId> stale_buckets(Clock::time_point before) const;
+
+        const NodeId& self() const { return m_self; }
+        std::size_t size() const { return m_size; }
+        std::size_t k() const { return m_k; }
+
+    private:
+        struct Bucket {
+            std::vector<NodeEntry> nodes;
+            Clock::time_point last_changed{};
+        };
+
+        std::size_t bucket_index(const NodeId& id) const;
+
+        NodeId m_self;
+        std::size_t m_k;
+        std::array<Bucket, 160> m_buckets;
+        std::size_t m_size = 0;
+    };
+
+}
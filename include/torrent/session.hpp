@@ -0,0 +1,254 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "torrent/bandwidth.hpp"
+#include "torrent/block_cache.hpp"
+#include "torrent/endpoint.hpp"
+#include "torrent/event_loop.hpp"
+#include "torrent/http_client.hpp"
+#include "torrent/rate_meter.hpp"
+#include "torrent/storage.hpp"
+#include "torrent/thread_pool.hpp"
+#include "torrent/torrent.hpp"
+#include "torrent/torrent_meta.hpp"
+#include "torrent/tracker_manager.hpp"
+#include "torrent/udp_tracker.hpp"
+#include "torrent/utp.hpp"
+
+namespace torrent {
+
+    // Many torrents on one EventLoop, sharing what a process has only one of.
+    //
+    // - One listen port (TCP, and uTP on the same UDP port if enabled).
+    //   Inbound connections are held until the first 48 bytes of their
+    //   handshake arrive and then handed to the torrent whose info hash they
+    //   name; unknown or paused torrents are refused.
+    // - One connection budget: every torrent counts its peers against
+    //   Config::max_connections. A torrent at the limit can still swap a
+    //   worse peer of its own for a better one, but never takes a slot from
+    //   another torrent; freed slots go to whoever has peers queued next.
+    // - One pair of bandwidth buckets for the whole session, on top of each
+    //   torrent's own.
+    // - One checking queue: existing data of added torrents is verified a
+    //   few MiB per loop turn (or a few pieces per pool thread at a time),
+    //   one torrent after another, so adding hundreds of torrents doesn't
+    //   stall the loop or thrash the disk.
+    // - One ThreadPool, if set, for checking and for every torrent's piece
+    //   hashing and writing.
+    // - One HttpClient and one UdpTrackerClient for every tracker announce,
+    //   so connections (and UDP connection ids) to a tracker are reused from
+    //   one torrent to the next.
+    //
+    // With Config::reactors > 1 the session runs that many reactor threads,
+    // each with its own EventLoop and a shard of the torrents, and so of
+    // the connections. Every shard listens on the port (SO_REUSEPORT); a
+    // handshake the kernel gave to the wrong shard is handed to the right
+    // one. The connection budget is split by torrents per shard, and the
+    // bandwidth limits are split too and moved every second towards the
+    // shards that use up their share. The members below still belong to
+    // the caller's loop and forward to the shards. uTP needs one reactor.
+    //
+    // Pausing a torrent closes its connections and sends "stopped" to its
+    // trackers but remembers its pieces (and keeps its read cache), so
+    // resuming starts right away without checking the data again.
+    //
+    // Must only be used from the loop thread.
+    class Session {
+    public:
+        using InfoHash = std::array<std::uint8_t, 20>;
+
+        struct Config {
+            std::uint16_t listen_port = 6881;
+            bool utp = false;                  // also accept and connect over uTP
+            std::size_t max_connections = 500; // peers across all torrents
+            std::uint64_t upload_limit = 0;    // bytes/s for the whole session; 0 = unlimited
+            std::uint64_t download_limit = 0;
+            std::size_t cache_bytes = 0;       // read cache per torrent for uploads; 0 = sendfile
+            std::size_t reactors = 1;          // event-loop threads the torrents are spread over
+            bool reuse_port = false;           // let other sockets listen on the port too
+        };
+
+        enum class State { Checking, Downloading, Seeding, Paused };
+
+        struct TorrentStatus {
+            InfoHash info_hash{};
+            std::string name;
+            State state = State::Checking;
+            std::uint32_t pieces = 0;        // verified, or checked so far while checking
+            std::uint32_t num_pieces = 0;
+            std::uint64_t uploaded = 0;      // payload bytes since added
+            std::uint64_t downloaded = 0;
+            double upload_rate = 0;          // bytes/s, 20-second average
+            double download_rate = 0;
+            std::size_t peers = 0;
+        };
+
+        using FinishedCallback = std::function<void(const InfoHash& info_hash)>;
+
+        // Listen on Config::listen_port, and start the reactor threads.
+        // Throws std::runtime_error if it can't be bound.
+        Session(EventLoop& loop, const std::string& peer_id);
+        Session(EventLoop& loop, const std::string& peer_id, Config config);
+        ~Session();
+
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+
+        // Add a torrent and queue its data for checking; it starts once
+        // checked. Throws std::runtime_error if it's already added or its
+        // files can't be created.
+        void add_torrent(const TorrentMeta& meta, const std::string& save_path,
+                         std::vector<FilePriority> file_priorities = {});
+        // Closes its connections and tells its trackers; the data stays.
+        void remove_torrent(const InfoHash& info_hash);
+        void pause(const InfoHash& info_hash);
+        void resume(const InfoHash& info_hash);
+
+        // A peer to connect to; kept until the torrent runs.
+        void add_peer(const InfoHash& info_hash, const Endpoint& peer);
+
+        // Check data, hash and write pieces on `pool`. Must outlive the
+        // session; set before adding torrents.
+        void set_thread_pool(ThreadPool* pool);
+        ThreadPool* thread_pool() const { return m_pool; }
+
+        // Session-wide caps in bytes/s; 0 means unlimited.
+        void set_limits(std::uint64_t upload, std::uint64_t download);
+        void set_max_connections(std::size_t n);
+
+        // Called once when a torrent finishes downloading.
+        void set_on_finished(FinishedCallback cb) { m_on_finished = std::move(cb); }
+
+        // Pause every torrent (saving its state) and send "stopped" to all
+        // trackers; `done` runs once every tracker answered or failed.
+        void stop(std::function<void()> done);
+
+        bool contains(const InfoHash& info_hash) const {
+            return m_shards.empty() ? m_entries.count(info_hash) != 0 : m_owners.count(info_hash) != 0;
+        }
+        std::size_t num_torrents() const { return m_shards.empty() ? m_entries.size() : m_owners.size(); }
+        // Across the reactors as of their last tick.
+        std::size_t num_connections() const;
+        std::uint16_t listen_port() const { return m_config.listen_port; }
+        // As constructed, with the limits changed since.
+        const Config& config() const { return m_config; }
+        std::vector<TorrentStatus> status() const;
+
+    private:
+        struct Shard; // a reactor thread and its session
+        using RouteTable = std::map<InfoHash, Shard*>;
+
+        struct Entry {
+            ~Entry() { *alive = false; }
+
+            std::shared_ptr<const TorrentMeta> meta; // shared with its retired trackers
+            std::unique_ptr<Storage> storage;
+            std::unique_ptr<BlockCache> cache;       // with Config::cache_bytes
+            std::unique_ptr<TaskGroup> jobs;         // checking on the pool; uses storage
+            std::shared_ptr<bool> alive = std::make_shared<bool>(true); // for their results
+            std::unique_ptr<Torrent> torrent;        // only while running
+            std::unique_ptr<TrackerManager> trackers;
+            std::vector<bool> have;       // while not running
+            std::vector<Endpoint> peers;  // added while not running
+            std::uint32_t next_check = 0; // next piece to verify
+            std::uint32_t checking = 0;   // of those, still on the pool
+            std::uint32_t checked = 0;    // verified
+            bool paused = false;
+            std::uint64_t uploaded = 0;   // by torrents before the current one
+            std::uint64_t downloaded = 0;
+            std::uint64_t sampled_up = 0; // totals at the last rate sample
+            std::uint64_t sampled_down = 0;
+            RateMeter upload_rate;
+            RateMeter download_rate;
+        };
+
+        // Trackers sending "stopped" for a torrent that was paused or removed.
+        struct Retired {
+            std::shared_ptr<const TorrentMeta> meta;
+            std::unique_ptr<TrackerManager> trackers;
+            bool done = false;
+        };
+
+        // An inbound connection whose handshake hasn't told us its torrent yet.
+        struct Pending {
+            Endpoint remote;
+            std::vector<std::uint8_t> received;
+            EventLoop::Clock::time_point since{};
+        };
+
+        void on_accept();
+        void add_pending(int fd, const Endpoint& remote);
+        void on_pending_readable(int fd);
+        void close_pending(int fd);
+
+        void check_some();
+        void start(Entry& e);
+        void stop_running(Entry& e); // save its state and retire its trackers
+        std::uint64_t uploaded(const Entry& e) const;
+        std::uint64_t downloaded(const Entry& e) const;
+        void on_tick();
+        void check_stopped();
+
+        // With reactors: the coordinating session's side
+        void start_shards();
+        Shard& owner(const InfoHash& info_hash) const;
+        void publish_routes();
+        void split_connections();
+        void rebalance();
+        // Called on a shard's thread for a handshake naming a torrent it
+        // doesn't have; false if no shard has it.
+        bool route(const InfoHash& info_hash, int fd, const Endpoint& remote, std::vector<std::uint8_t> received);
+        // On the shard's own thread, for a connection routed to it
+        void adopt(int fd, const Endpoint& remote, std::vector<std::uint8_t> received);
+
+        EventLoop& m_loop;
+        std::string m_peer_id;
+        Config m_config;
+        int m_listen_fd = -1;
+        std::unique_ptr<UtpSocketManager> m_utp;
+        ThreadPool* m_pool = nullptr;
+        HttpClient m_http; // for every TrackerManager; outlives them
+        UdpTrackerClient m_udp_trackers;
+
+        std::map<InfoHash, std::unique_ptr<Entry>> m_entries;
+        std::deque<InfoHash> m_check_queue;
+        EventLoop::TimerId m_check_timer = 0;
+        std::unordered_map<int, Pending> m_pending; // by fd
+        std::list<Retired> m_retired;
+
+        ConnectionBudget m_budget;
+        BandwidthLimits m_limits;
+        FinishedCallback m_on_finished;
+        EventLoop::TimerId m_tick_timer = 0;
+        bool m_stopping = false;
+        std::function<void()> m_on_stopped;
+
+        std::uint64_t m_total_up = 0;    // payload of all torrents, as of the last tick
+        std::uint64_t m_total_down = 0;
+
+        // With Config::reactors > 1
+        std::vector<std::unique_ptr<Shard>> m_shards;
+        std::map<InfoHash, Shard*> m_owners;
+        std::shared_ptr<const RouteTable> m_routes; // copy of m_owners for the shards, replaced whole
+        std::size_t m_shards_stopping = 0;
+        std::shared_ptr<bool> m_alive = std::make_shared<bool>(true); // for posts from the shards
+        Session* m_coordinator = nullptr; // in a shard: the session it belongs to
+        Shard* m_shard = nullptr;         // in a shard: its own
+    };
+
+    const char* session_state_name(Session::State state);
+
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "torrent/torrent_meta.hpp"
+
+namespace torrent {
+
+    // Per-file download priority. Skip means "do not download this file";
+    // the other values order pieces in the PiecePicker.
+    enum class FilePriority : std::uint8_t {
+        Skip   = 0,
+        Low    = 1,
+        Normal = 4,
+        High   = 7
+    };
+
+    // Parse "skip" / "low" / "normal" / "high". Throws on anything else.
+    FilePriority parse_file_priority(const std::string& s);
+    const char* file_priority_name(FilePriority prio);
+
+    // A contiguous run of bytes of one file that a piece range maps onto.
+    struct FileSlice {
+        std::size_t   file_index = 0;
+        std::uint64_t file_offset = 0;
+        std::uint64_t length = 0;
+    };
+
+    // Map [begin, begin + length) of `piece` onto the files it overlaps.
+    std::vector<FileSlice> map_block(
+        const TorrentMeta& meta,
+        std::uint32_t piece,
+        std::uint32_t begin,
+        std::uint64_t length
+    );
+
+    // Reads and writes piece data to the files of a torrent.
+    //
+    // - single-file torrents: `save_path` is the output file
+    // - multi-file torrents : `save_path` is the root directory
+    //
+    // Files with FilePriority::Skip are never created. Bytes of boundary pieces
+    // that fall into skipped files are kept in a partfile (`save_path + ".parts"`)
+    // so that only whole-piece-sized slots are allocated for them.
+    //
+    // All members are safe to call from several threads (e.g. a downloader
+    // writing while the seeding side reads).
+    //
+    // Throws std::runtime_error on I/O errors.
+    class Storage {
+    public:
+        // Where a slice of a piece actually lives on disk (real file or
+        // partfile slot). fd == -1 means the bytes were never written.
+        struct DiskRange {
+            int fd = -1;
+            std::uint64_t offset = 0;
+            std::uint64_t length = 0;
+        };
+
+        Storage(
+            const TorrentMeta& meta,
+            const std::string& save_path,
+            std::vector<FilePriority> file_priorities = {}
+        );
+        ~Storage();
+
+        Storage(const Storage&) = delete;
+        Storage& operator=(const Storage&) = delete;
+
+        void write_block(std::uint32_t piece, std::uint32_t begin, const std::uint8_t* data, std::size_t len);
+        void read_block(std::uint32_t piece, std::uint32_t begin, std::uint8_t* out, std::size_t len);
+
+        // Disk locations of a block, for zero-copy sends (sendfile). The fds
+        // stay owned by Storage and remain valid for its lifetime.
+        std::vector<DiskRange> map_to_disk(std::uint32_t piece, std::uint32_t begin, std::uint64_t len);
+
+        // Read the whole piece back and compare against its SHA1 from the metainfo.
+        bool verify_piece(std::uint32_t piece);
+
+        const std::vector<FilePriority>& file_priorities() const { return m_priorities; }
+
+        // Changing a skipped file to a wanted priority moves any of its bytes
+        // already held in the partfile into the real file.
+        void set_file_priority(std::size_t file_index, FilePriority prio);
+
+        std::string file_path(std::size_t file_index) const;
+        std::string part_file_path() const { return m_save_path + ".parts"; }
+
+        const TorrentMeta& meta() const { return m_meta; }
+
+    private:
+        std::vector<DiskRange> resolve(std::uint32_t piece, std::uint32_t begin, std::uint64_t len, bool for_write);
+
+        int open_file(std::size_t file_index, bool create);
+        int open_part_file(bool create);
+        // Returns the byte offset of `piece`'s slot in the partfile, or -1 if
+        // none exists and `allocate` is false.
+        long long part_slot_offset(std::uint32_t piece, bool allocate);
+
+        const TorrentMeta& m_meta;
+        std::string m_save_path;
+        std::vector<FilePriority> m_priorities;
+        std::vector<int> m_fds;
+
+        int m_part_fd = -1;
+        std::vector<std::uint32_t> m_part_slots; // slot + 1 per piece, 0 = no slot
+        std::uint32_t m_part_slots_used = 0;
+
+        std::mutex m_mutex; // guards fds and the partfile slot table
+    };
+
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace torrent {
+
+    // Worker threads for the CPU- and disk-bound work that must stay off
+    // the event loop: piece hashing, piece writes, checking existing data,
+    // hashing new torrents, parsing many .torrent files.
+    //
+    // Work stealing: every worker has its own deque. A task submitted from
+    // a worker goes to the back of that worker's deque, and workers take
+    // their own tasks from the back (newest first, its data still in
+    // cache). Tasks from other threads are dealt to the workers in turn.
+    // A worker with nothing left steals from the front of another's deque
+    // (oldest first) before it goes to sleep.
+    //
+    // Meant to be one per process, sized to the cores and shared by
+    // everything that needs threads, so subsystems running in parallel
+    // don't oversubscribe the CPU.
+    //
+    // A task that throws is logged and dropped (use async() or a TaskGroup
+    // to get its exception). Waiting on a future from inside a task can
+    // deadlock; TaskGroup::wait() doesn't, since it runs queued tasks while
+    // it waits.
+    class ThreadPool {
+    public:
+        using Task = std::function<void()>;
+
+        struct Config {
+            std::size_t threads = 0; // 0: one per core
+            bool pin = false;        // pin worker i to CPU i (modulo the cores we may run on)
+        };
+
+        struct Stats {
+            std::size_t threads = 0;
+            std::size_t queued = 0;        // waiting to run
+            std::uint64_t submitted = 0;
+            std::uint64_t executed = 0;    // including by threads helping while they wait
+            std::uint64_t steals = 0;      // taken from another worker's deque
+        };
+
+        ThreadPool();
+        explicit ThreadPool(Config config);
+        // Runs what is still queued, then joins the workers.
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        void submit(Task task);
+
+        // Run `fn` on the pool; the future has its result or exception.
+        template <typename F>
+        auto async(F fn) -> std::future<std::invoke_result_t<F>> {
+            using R = std::invoke_result_t<F>;
+            auto task = std::make_shared<std::packaged_task<R()>>(std::move(fn));
+            std::future<R> result = task->get_future();
+            submit([task] { (*task)(); });
+            return result;
+        }
+
+        // Run one queued task on the calling thread. False if none is queued.
+        bool run_one();
+
+        std::size_t size() const { return m_workers.size(); }
+        std::size_t queue_depth() const { return m_queued.load(std::memory_order_relaxed); }
+        std::vector<std::size_t> queue_depths() const; // per worker
+        Stats stats() const;
+
+    private:
+        struct Worker {
+            mutable std::mutex mutex;
+            std::deque<Task> tasks;
+            std::thread thread;
+        };
+
+        void run(std::size_t index);
+        bool take(std::size_t index, Task& out);  // own deque, back
+        bool steal(std::size_t thief, Task& out); // others' deques, front
+        void execute(Task& task);
+
+        std::vector<std::unique_ptr<Worker>> m_workers;
+        std::atomic<std::size_t> m_next{0};  // worker that gets the next outside task
+        std::atomic<std::size_t> m_queued{0};
+        std::atomic<std::uint64_t> m_submitted{0};
+        std::atomic<std::uint64_t> m_executed{0};
+        std::atomic<std::uint64_t> m_steals{0};
+
+        std::mutex m_sleep_mutex;
+        std::condition_variable m_wake;
+        bool m_stop = false;
+    };
+
+    // Tasks on a pool that are waited for together; the destructor waits
+    // too, so whatever the tasks use only has to outlive the group.
+    class TaskGroup {
+    public:
+        explicit TaskGroup(ThreadPool& pool) : m_pool(pool), m_state(std::make_shared<State>()) {}
+        ~TaskGroup();
+
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        void run(ThreadPool::Task task);
+
+        // Block until every task run so far has finished, running queued
+        // tasks (anyone's) meanwhile. Rethrows the first exception a task
+        // threw, once.
+        void wait();
+
+        std::size_t pending() const;
+
+    private:
+        struct State {
+            mutable std::mutex mutex;
+            std::condition_variable done;
+            std::size_t pending = 0;
+            std::exception_ptr error;
+        };
+
+        ThreadPool& m_pool;
+        std::shared_ptr<State> m_state;
+    };
+
+    // fn(i) for every i in [begin, end), in a few chunks per worker.
+    // Returns once all are done; rethrows the first exception.
+    template <typename F>
+    void parallel_for(ThreadPool& pool, std::size_t begin, std::size_t end, F fn) {
+        if (begin >= end) return;
+        const std::size_t n = end - begin;
+        const std::size_t chunks = std::min(n, pool.size() * 4);
+        const std::size_t per = (n + chunks - 1) / chunks;
+
+        TaskGroup group(pool);
+        for (std::size_t lo = begin; lo < end; lo += per) {
+            const std::size_t hi = std::min(end, lo + per);
+            group.run([lo, hi, &fn] {
+                for (std::size_t i = lo; i < hi; ++i) fn(i);
+            });
+        }
+        group.wait();
+    }
+
+}
@@ -0,0 +1,385 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "torrent/bandwidth.hpp"
+#include "torrent/block_cache.hpp"
+#include "torrent/choker.hpp"
+#include "torrent/connector.hpp"
+#include "torrent/event_loop.hpp"
+#include "torrent/extension.hpp"
+#include "torrent/peer_db.hpp"
+#include "torrent/peer_messages.hpp"
+#include "torrent/piece_picker.hpp"
+#include "torrent/rate_meter.hpp"
+#include "torrent/storage.hpp"
+#include "torrent/thread_pool.hpp"
+#include "torrent/torrent_meta.hpp"
+#include "torrent/tracker.hpp"
+#include "torrent/ut_pex.hpp"
+#include "torrent/utp.hpp"
+
+namespace torrent {
+
+    // Peer connections shared by several torrents (e.g. a Session's): each
+    // counts its open connections in `used`, and none opens or accepts one
+    // past `limit` except by closing one of its own.
+    struct ConnectionBudget {
+        std::size_t limit = 500;
+        std::size_t used = 0;
+    };
+
+    // The event-driven peer side of one torrent, running on an EventLoop.
+    //
+    // Download: connects to peers (many at once, through a Connector, so the
+    // fastest ones are talking first), requests blocks of the pieces chosen by the
+    // PiecePicker (several requests in flight per peer), verifies finished
+    // pieces and writes them to Storage.
+    //
+    // Upload: accepts inbound peer connections, sends our Bitfield and Have
+    // messages and serves Request messages straight from disk: the 13-byte
+    // Piece header is sent with MSG_MORE and the block follows via sendfile(),
+    // so block data never passes through user space. With a BlockCache set,
+    // blocks are served from memory instead so hot pieces don't hit the disk
+    // per request. Who gets served is decided by the Choker every 10 seconds.
+    //
+    // Peers: what we learn about each peer (connect time, throughput, hash
+    // failures, why it disconnected) goes into a PeerDb. Its score decides
+    // which queued peers are connected to first and, at the connection
+    // limit, which connection makes way for a better peer. Peers that send
+    // corrupt data are banned. Every block remembers who sent it; when a
+    // piece from several peers fails its hash check, each of them is put on
+    // parole (whole pieces on its own only, so its next failure is its own),
+    // and once the piece passes the blocks recorded from the failed attempt
+    // are compared with the good data to find out exactly who lied.
+    //
+    // Fast extension (BEP 6) with peers that support it: Have All / Have
+    // None instead of a bitfield, explicit Reject for requests we won't
+    // serve (and choke no longer silently drops them), an Allowed Fast set
+    // of pieces that may be requested while choked, and Suggest as a hint
+    // for which piece to start next.
+    //
+    // Extension protocol (BEP 10): registered Extensions are offered in the
+    // extension handshake and their messages are handed to them straight
+    // from the receive buffer. ut_metadata (BEP 9) is always registered, so
+    // peers that joined through a magnet link can get the metadata from us,
+    // and so is ut_pex (BEP 11): connected peers swap peer lists, and new
+    // ones from it are queued like tracker peers. The peer's "reqq" caps how many requests we
+    // keep in flight to it; within that cap the pipeline grows with its
+    // download rate, so fast peers never wait on our next request.
+    //
+    // Bandwidth: every byte on a socket is charged to token buckets for the
+    // peer, the torrent and (optionally) the whole process. A connection
+    // that runs out of tokens stops being polled for that direction and is
+    // retried from a single per-torrent timer once tokens are back.
+    //
+    // Must only be used from the loop thread (post() to it from elsewhere).
+    class Torrent {
+    public:
+        Torrent(
+            EventLoop& loop,
+            const TorrentMeta& meta,
+            Storage& storage,
+            const std::string& peer_id
+        );
+        ~Torrent();
+
+        Torrent(const Torrent&) = delete;
+        Torrent& operator=(const Torrent&) = delete;
+
+        // Listen for inbound peers on `port` (IPv6 dual-stack, falling back to IPv4).
+        // Throws std::runtime_error if the socket can't be bound.
+        void listen(std::uint16_t port);
+        // Peers reach us on `port` through a listen socket someone else
+        // owns (a Session's); only told to peers in the extension handshake.
+        void set_listen_port(std::uint16_t port) { m_listen_port = port; }
+
+        // Queue a peer to connect to. Connections are opened in parallel,
+        // at most `set_max_half_open()` at a time.
+        void add_peer(const Endpoint& peer);
+        // One peer with several addresses (e.g. IPv6 and IPv4); they are
+        // raced and the first to connect is used.
+        void add_peer(const std::vector<Endpoint>& addresses);
+        // A peer found on the local network (LSD): connected to before
+        // remote peers and kept over them when slots run out.
+        void add_local_peer(const Endpoint& peer);
+
+        // An inbound connection accepted elsewhere (a shared listen socket,
+        // uTP). `received` is what was already read from it, e.g. the start
+        // of the handshake that told which torrent it is for.
+        void add_incoming(int fd, const Endpoint& remote, std::vector<std::uint8_t> received = {});
+
+        // Also connect over uTP: IPv4 peers are tried over uTP first and over
+        // TCP if that fails. Incoming uTP connections go to add_incoming().
+        // Not owned; must outlive the torrent.
+        void set_utp(UtpSocketManager* utp) { m_connector.set_utp(utp); }
+
+        // Count our connections against `budget` too (nullptr: only our
+        // own limit). Must outlive the torrent; set before connecting.
+        void set_connection_budget(ConnectionBudget* budget) { m_budget = budget; }
+        void set_max_connections(std::size_t n) { m_max_connections = n; }
+        // Start queued connects the limits allow now, e.g. after another
+        // torrent sharing our budget closed connections.
+        void start_queued_peers() { m_connector.start_queued(); }
+
+        // Outbound connects in progress at the same time.
+        void set_max_half_open(std::size_t n) { m_connector.set_half_open_limit(n); }
+
+        // Offer an extension to peers. Must be called before connecting;
+        // throws std::runtime_error if one with the same name exists.
+        void add_extension(std::unique_ptr<Extension> ext) { m_extensions.add(std::move(ext)); }
+        const ExtensionRegistry& extensions() const { return m_extensions; }
+
+        // We run a DHT node on UDP `port`: say so in handshakes and send the
+        // port to peers that run one too. Their DHT endpoints (from Port
+        // messages) go to `on_node`.
+        void set_dht(std::uint16_t port, std::function<void(const Endpoint&)> on_node) {
+            m_dht_port = port;
+            m_on_dht_node = std::move(on_node);
+        }
+
+        // Pieces we have when we start (e.g. after verifying existing data).
+        void set_have(const std::vector<bool>& have);
+
+        // Record a newly completed piece and send Have to every connected peer.
+        void announce_piece(std::uint32_t piece);
+
+        // Called once when every wanted piece has been downloaded.
+        void set_on_finished(std::function<void()> cb) { m_on_finished = std::move(cb); }
+
+        // Hash finished pieces and write them to disk on `pool` instead of
+        // the loop thread. Must outlive the Torrent; set before connecting.
+        void set_thread_pool(ThreadPool* pool) {
+            m_pool = pool;
+            m_jobs = pool ? std::make_unique<TaskGroup>(*pool) : nullptr;
+        }
+
+        // Serve uploads from `cache` instead of sendfile() (nullptr to disable).
+        // The cache must outlive the Torrent.
+        void set_read_cache(BlockCache* cache) { m_cache = cache; }
+
+        // Number of peers we unchoke (upload to) at the same time, including
+        // the optimistic unchoke slot.
+        void set_max_uploads(std::size_t n) { m_choker.set_upload_slots(n); }
+
+        // Bandwidth caps in bytes/s; 0 means unlimited.
+        // The global limits are shared with other torrents and must outlive this one.
+        void set_global_limits(BandwidthLimits* limits) { m_global_limits = limits; }
+        void set_upload_limit(std::uint64_t bytes_per_second) { m_limits.upload.set_rate(bytes_per_second); }
+        void set_download_limit(std::uint64_t bytes_per_second) { m_limits.download.set_rate(bytes_per_second); }
+        // Applies to every connection, including ones already open.
+        void set_peer_upload_limit(std::uint64_t bytes_per_second);
+        void set_peer_download_limit(std::uint64_t bytes_per_second);
+
+        bool is_finished() const { return m_picker.is_finished(); }
+        const PiecePicker& picker() const { return m_picker; }
+
+        std::size_t num_connections() const { return m_conns.size(); }
+        const PeerDb& peer_db() const { return m_peer_db; }
+        std::uint64_t bytes_uploaded() const { return m_uploaded; }
+        std::uint64_t bytes_downloaded() const { return m_downloaded; }
+        // Bytes of wanted pieces we don't have yet (the tracker's "left").
+        std::uint64_t bytes_left() const;
+
+    private:
+        // One pending piece of output: either bytes in memory (possibly shared
+        // with the read cache) or a file range to be sent with sendfile().
+        struct OutChunk {
+            BlockCache::Block data;
+            std::size_t data_offset = 0;
+            int file_fd = -1;
+            std::uint64_t file_offset = 0;
+            std::uint64_t length = 0;
+            std::uint64_t sent = 0;
+            bool more = false; // more bytes of the same message follow
+        };
+
+        struct BlockRequest {
+            std::uint32_t piece;
+            std::uint32_t begin;
+            std::uint32_t length;
+        };
+
+        // A request we sent and haven't received the block for yet.
+        struct PendingBlock {
+            std::uint32_t piece;
+            std::uint32_t begin;
+            std::uint32_t length;
+            EventLoop::Clock::time_point requested_at;
+        };
+
+        struct PeerConn : ExtensionPeer {
+            Torrent* owner = nullptr;
+            int fd = -1;
+            Endpoint remote;
+            bool outbound = false;
+            bool utp = false;            // a uTP stream rather than TCP
+            bool handshake_done = false;
+            bool fast = false;           // both sides speak BEP 6
+            bool extended = false;       // both sides speak BEP 10
+            ExtensionHandshake ext;      // the peer's extension handshake
+
+            std::vector<std::uint8_t> in;
+            std::deque<OutChunk> out;
+
+            BandwidthLimits limits;
+            bool read_blocked = false;   // out of download tokens
+            bool write_blocked = false;  // out of upload tokens
+
+            std::vector<bool> peer_has;
+
+            // Upload side
+            bool am_choking = true;
+            bool peer_interested = false;
+            std::deque<BlockRequest> requests;
+            RateMeter upload_rate;
+            std::vector<std::uint32_t> allowed_fast_given; // may request these while choked
+
+            // Download side
+            bool peer_choking = true;
+            bool am_interested = false;
+            std::vector<PendingBlock> pending;
+            std::deque<PendingBlock> late;              // given back unanswered; still taken if they come
+            RateMeter download_rate;
+            std::vector<std::uint32_t> allowed_fast;    // we may request these while choked
+            std::vector<std::uint32_t> suggested;       // pieces the peer suggested
+            EventLoop::Clock::time_point last_block;
+
+            EventLoop::Clock::time_point connected_at;
+            EventLoop::Clock::time_point last_send;
+            EventLoop::Clock::time_point last_recv;
+
+            // ExtensionPeer
+            const Endpoint& endpoint() const override { return remote; }
+            const ExtensionHandshake& extension_handshake() const override { return ext; }
+            void send_extended(const std::string& name, const std::uint8_t* data, std::size_t len) override;
+        };
+
+        // A piece with blocks in flight. Blocks are assembled in memory and the
+        // piece is verified and written once all of them arrived.
+        struct PartialPiece {
+            enum class Block : std::uint8_t { Free, Requested, Received };
+
+            std::vector<std::uint8_t> data;
+            std::vector<Block> blocks;
+            std::vector<Endpoint> block_sources; // who sent each received block
+            std::uint32_t received = 0;
+            std::optional<Endpoint> exclusive_to; // claimed by a peer on parole
+            bool verifying = false;               // complete, being hashed on the pool
+        };
+
+        // A block of a piece that failed its hash check: who sent it and a
+        // digest of what they sent. Checked once the piece passes.
+        struct SuspectBlock {
+            std::uint32_t block;
+            Endpoint source;
+            std::string digest; // SHA-1 of the block data
+        };
+
+        void on_accept();
+        PeerConn& add_connection(int fd, const Endpoint& remote, bool outbound);
+        void close_connection(int fd, const std::string& reason);
+        void on_connected(int fd, const Endpoint& remote, std::chrono::milliseconds connect_time);
+
+        // Peer selection
+        double connection_score(const PeerConn& c) const;
+        bool make_room(double newcomer_score);
+        void close_banned();
+
+        void on_readable(PeerConn& c);
+        bool handle_handshake(PeerConn& c);
+        void handle_message(PeerConn& c, const BtMessage& msg);
+        void handle_piece(PeerConn& c, const std::vector<std::uint8_t>& payload);
+        void handle_reject(PeerConn& c, const std::vector<std::uint8_t>& payload);
+        void handle_extended(PeerConn& c, const std::uint8_t* data, std::size_t len);
+        void send_extension_handshake(PeerConn& c);
+        std::vector<UtPex::Peer> pex_peers() const;
+        void on_pex_peers(const std::vector<UtPex::Peer>& peers);
+        void send_allowed_fast(PeerConn& c);
+
+        void queue_bytes(PeerConn& c, std::vector<std::uint8_t> bytes, bool more = false);
+        void queue_block(PeerConn& c, const BlockRequest& req);
+        // Returns false if the connection had to be closed.
+        bool flush(PeerConn& c);
+        void update_interest(PeerConn& c);
+
+        // Bandwidth
+        BandwidthChain upload_chain(PeerConn& c);
+        BandwidthChain download_chain(PeerConn& c);
+        void wait_for_bandwidth(PeerConn& c, bool upload);
+        void on_bandwidth_timer();
+
+        // Download side
+        void update_am_interested(PeerConn& c);
+        void request_blocks(PeerConn& c);
+        std::size_t pipeline_depth(const PeerConn& c) const;
+        bool pick_block(PeerConn& c, BlockRequest& out);
+        void start_piece(PeerConn& c, std::uint32_t piece, BlockRequest& out);
+        void release_pending(PeerConn& c);
+        void piece_finished(std::uint32_t piece);
+        void piece_checked(std::uint32_t piece, bool ok, const std::string& error); // back from the pool
+        void piece_failed(std::uint32_t piece);
+        void piece_passed(std::uint32_t piece);
+        void record_suspects(std::uint32_t piece, const PartialPiece& pp);
+        bool smart_ban(std::uint32_t piece, const PartialPiece& pp);
+        bool is_snubbed(const PeerConn& c) const;
+
+        // Upload side
+        void choke(PeerConn& c);
+        void unchoke(PeerConn& c);
+        void fill_upload_slots();
+        void run_choker();
+
+        void on_tick();
+
+        std::uint32_t piece_length(std::uint32_t piece) const;
+
+        EventLoop& m_loop;
+        const TorrentMeta& m_meta;
+        Storage& m_storage;
+        BlockCache* m_cache = nullptr;
+        std::string m_peer_id;
+
+        int m_listen_fd = -1;
+        std::uint16_t m_listen_port = 0;
+        std::uint16_t m_dht_port = 0;
+        std::function<void(const Endpoint&)> m_on_dht_node;
+        ExtensionRegistry m_extensions;
+        PeerDb m_peer_db;
+        Connector m_connector;
+        EventLoop::TimerId m_tick_timer = 0;
+        EventLoop::TimerId m_choke_timer = 0;
+        EventLoop::TimerId m_bandwidth_timer = 0; // armed only while someone waits
+
+        BandwidthLimits m_limits;
+        BandwidthLimits* m_global_limits = nullptr;
+        std::uint64_t m_peer_upload_limit = 0;
+        std::uint64_t m_peer_download_limit = 0;
+        std::vector<int> m_bandwidth_waiting;
+
+        PiecePicker m_picker;
+        std::unordered_map<std::uint32_t, PartialPiece> m_partials;
+        std::unordered_map<std::uint32_t, std::vector<SuspectBlock>> m_suspects; // by piece
+        std::function<void()> m_on_finished;
+        bool m_finished_notified = false;
+
+        Choker m_choker;
+        std::unordered_map<int, std::unique_ptr<PeerConn>> m_conns;
+
+        std::size_t m_max_connections = 200;
+        ConnectionBudget* m_budget = nullptr;
+        ThreadPool* m_pool = nullptr;
+        std::unique_ptr<TaskGroup> m_jobs;                          // our jobs on m_pool
+        std::shared_ptr<bool> m_alive = std::make_shared<bool>(true); // for their results
+        std::uint64_t m_uploaded = 0;
+        std::uint64_t m_downloaded = 0;
+    };
+
+}
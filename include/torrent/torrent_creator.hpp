@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+#include "torrent/thread_pool.hpp"
+
+namespace torrent {
+
+    struct CreateOptions {
+        std::string announce;       // tracker URL; none if empty
+        long long piece_length = 0; // a power of two from 16 KiB; 0 picks one for ~1500 pieces
+        std::string comment;
+    };
+
+    // Bencoded .torrent for the file or directory at `path`; a directory
+    // becomes a multi-file torrent of every regular file under it, sorted
+    // by path. Pieces are read and hashed on `pool`, many at a time; the
+    // data is only read.
+    //
+    // Throws std::runtime_error if there is nothing to share or a file
+    // can't be read.
+    std::string create_torrent(ThreadPool& pool, const std::string& path, const CreateOptions& options);
+
+}
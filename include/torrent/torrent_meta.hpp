@@ -6,9 +6,21 @@
 #include <vector>
 
 namespace torrent {
+    class ThreadPool;
+
+    // One file inside the torrent's contiguous byte space.
+    struct FileEntry {
+        std::string path;       // relative path, '/'-separated
+        long long length = 0;
+        long long offset = 0;   // byte offset of this file within the torrent
+    };
+
     // Metadata parsed from a .torrent file.
     struct TorrentMeta {
         std::string announce;
+        // Tracker tiers (BEP 12), each shuffled. Falls back to one tier
+        // holding `announce` when the torrent has no announce-list.
+        std::vector<std::vector<std::string>> announce_list;
         std::string name;
         long long length = 0;
         long long piece_length = 0;
@@ -16,14 +28,27 @@ namespace torrent {
         std::string info_bencoded;
         std::array<std::uint8_t, 20> info_hash_raw{};
         std::string info_hash_urlencoded;
+
+        // Single-file torrents have exactly one entry (path == name).
+        std::vector<FileEntry> files;
+        bool multi_file = false;
     };
 
     // Parse a .torrent file at `path` into TorrentMeta.
     // This will:
     //  - read the file
     //  - decode bencode
-    //  - extract announce, name, length, piece length, pieces
+    //  - extract announce (and announce-list), name, length (or files), piece length, pieces
     //  - compute info_bencoded, info_hash_raw, info_hash_urlencoded
     TorrentMeta parse_torrent_file(const std::string& path);
 
+    // Build TorrentMeta from a bare bencoded info dictionary (e.g. fetched
+    // from peers for a magnet link). info_bencoded is kept byte for byte and
+    // the info hash is computed from it; there are no trackers.
+    TorrentMeta parse_info_dict(const std::string& info_bencoded);
+
+    // parse_torrent_file() for many files at once, on `pool`; results are
+    // in the order of `paths`. Throws the first error.
+    std::vector<TorrentMeta> parse_torrent_files(ThreadPool& pool, const std::vector<std::string>& paths);
+
 }
@@ -4,24 +4,55 @@
 #include <string>
 #include <vector>
 
+#include "torrent/endpoint.hpp"
 #include "torrent/torrent_meta.hpp"
 
 namespace torrent {
-    struct Peer {
-        std::string ip;
-        std::uint16_t port;
+    // Numbered as in the UDP tracker protocol.
+    enum class AnnounceEvent : std::uint32_t { None = 0, Completed = 1, Started = 2, Stopped = 3 };
+
+    // What we tell the tracker about ourselves.
+    struct AnnounceRequest {
+        std::uint64_t uploaded = 0;
+        std::uint64_t downloaded = 0;
+        std::uint64_t left = 0;
+        std::uint16_t port = 6881;
+        AnnounceEvent event = AnnounceEvent::Started;
+        int num_want = -1;  // -1: tracker default
     };
 
     struct TrackerResponse {
         int interval = 0;
-        std::vector<Peer> peers;
+        int min_interval = 0;   // 0 if the tracker didn't say
+        int seeders = -1;   // -1 if the tracker didn't say
+        int leechers = -1;
+        std::vector<Endpoint> peers;  // IPv4 and IPv6
     };
 
-    // Ask the tracker for peers for this torrent.
+    // Ask the tracker for peers for this torrent. Speaks HTTP(S) or, for
+    // udp:// announce URLs, the UDP tracker protocol (see udp_tracker.hpp).
     //
     // - meta: already-parsed torrent metadata (contains announce URL, info_hash_urlencoded, length)
     // - peer_id: 20-byte peer ID (you can pass your "122333..." string here)
     //
     // Throws std::runtime_error on HTTP failure or tracker failure.
     TrackerResponse request_peers(const TorrentMeta& meta, const std::string& peer_id);
+
+    // Full HTTP announce URL for `announce_url`.
+    std::string build_announce_url(
+        const std::string& announce_url,
+        const TorrentMeta& meta,
+        const std::string& peer_id,
+        const AnnounceRequest& req
+    );
+
+    // Decode a bencoded HTTP tracker reply.
+    // Throws std::runtime_error on malformed replies or a "failure reason".
+    TrackerResponse parse_tracker_response(const std::string& body);
+
+    // Compact peer lists: 6 bytes per IPv4 peer ("peers") or 18 bytes per
+    // IPv6 peer ("peers6", BEP 7), address then port, big-endian. A trailing
+    // partial entry is ignored.
+    std::vector<Endpoint> parse_compact_peers(const std::string& peers_bin);
+    std::vector<Endpoint> parse_compact_peers6(const std::string& peers_bin);
 }
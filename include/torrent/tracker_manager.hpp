@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "torrent/event_loop.hpp"
+#include "torrent/http_client.hpp"
+#include "torrent/torrent_meta.hpp"
+#include "torrent/tracker.hpp"
+#include "torrent/udp_tracker.hpp"
+
+namespace torrent {
+
+    // Transfer totals reported to trackers (payload bytes).
+    struct AnnounceStats {
+        std::uint64_t uploaded = 0;
+        std::uint64_t downloaded = 0;
+        std::uint64_t left = 0;
+    };
+
+    // Announces one torrent to all of its trackers (BEP 12 announce-list).
+    //
+    // Every tier is announced to at the same time, so a slow or dead tracker
+    // never holds up the others. Within a tier the trackers are tried in
+    // order until one answers, and that one moves to the front of its tier.
+    // HTTP trackers share one HttpClient (connection reuse) and UDP
+    // trackers one UdpTrackerClient, both on the loop: a dead tracker costs
+    // a timer while it is retried, not a thread.
+    //
+    // Peers are handed to the callback as soon as each response arrives,
+    // every time a tracker returns them: one that dropped may be back. The
+    // receiver skips those it is already connected or connecting to.
+    //
+    // After start(), each tier is re-announced on the interval its tracker
+    // asked for, early (but never before "min interval") when we run low on
+    // peers, and with exponential backoff after failures.
+    //
+    // Must only be used from the loop thread.
+    class TrackerManager {
+    public:
+        using PeersCallback = std::function<void(const std::vector<Endpoint>&)>;
+
+        TrackerManager(EventLoop& loop, const TorrentMeta& meta, const std::string& peer_id);
+        // Announce over `http` and `udp` (e.g. clients for many torrents, so
+        // their connections and connection ids are reused). Must outlive the
+        // manager.
+        TrackerManager(EventLoop& loop, const TorrentMeta& meta, const std::string& peer_id, HttpClient& http,
+                       UdpTrackerClient& udp);
+        ~TrackerManager();
+
+        TrackerManager(const TrackerManager&) = delete;
+        TrackerManager& operator=(const TrackerManager&) = delete;
+
+        // Called with the peers of each response, duplicates removed.
+        void set_on_peers(PeersCallback cb) { m_on_peers = std::move(cb); }
+
+        // Sources for the scheduled announces: current totals, the port we
+        // listen on and how many peers we are connected to.
+        void set_stats_provider(std::function<AnnounceStats()> fn) { m_stats = std::move(fn); }
+        void set_peer_count_provider(std::function<std::size_t()> fn) { m_peer_count = std::move(fn); }
+        void set_listen_port(std::uint16_t port) { m_port = port; }
+
+        // Announce to every tier once, with explicit parameters. Tiers that
+        // are still busy are skipped.
+        void announce(const AnnounceRequest& req);
+
+        // Send "started" and keep re-announcing until stop().
+        void start();
+        // Send "completed" (the download just finished).
+        void completed();
+        // Send "stopped" to every tier; `done` runs once all of them answered
+        // or failed. No announces are scheduled afterwards.
+        void stop(std::function<void()> done = nullptr);
+
+        // True while some tier is still waiting for a tracker.
+        bool busy() const;
+
+    private:
+        struct Tier {
+            std::vector<std::string> urls;
+            bool busy = false;
+
+            // Scheduling
+            AnnounceEvent pending_event = AnnounceEvent::Started; // sent with the next announce
+            EventLoop::Clock::time_point last_announce{};
+            EventLoop::Clock::time_point next_announce{};
+            std::chrono::seconds interval{0};
+            std::chrono::seconds min_interval{0};
+            int failures = 0;
+        };
+
+        // Shared with callbacks of clients that may outlive the manager.
+        struct Shared {
+            bool alive = true;
+        };
+
+        AnnounceRequest make_request(AnnounceEvent event) const;
+        void announce_scheduled(std::size_t tier);
+        void on_tick();
+
+        void announce_tier(std::size_t tier, std::size_t index, const AnnounceRequest& req);
+        void on_reply(std::size_t tier, std::size_t index, const AnnounceRequest& req,
+                      const TrackerResponse& resp, const std::string& error);
+        void deliver(const std::vector<Endpoint>& peers);
+        void check_stopped();
+
+        EventLoop& m_loop;
+        const TorrentMeta& m_meta;
+        std::string m_peer_id;
+
+        std::unique_ptr<HttpClient> m_own_http; // unless given one
+        HttpClient& m_http;
+        std::unique_ptr<UdpTrackerClient> m_own_udp;
+        UdpTrackerClient& m_udp;
+        std::vector<Tier> m_tiers;
+        PeersCallback m_on_peers;
+        std::shared_ptr<Shared> m_shared;
+
+        std::function<AnnounceStats()> m_stats;
+        std::function<std::size_t()> m_peer_count;
+        std::uint16_t m_port = 6881;
+
+        EventLoop::TimerId m_tick_timer = 0;
+        bool m_stopping = false;
+        std::function<void()> m_on_stopped;
+    };
+
+}
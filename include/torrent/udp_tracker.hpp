@@ -0,0 +1,189 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "torrent/event_loop.hpp"
+#include "torrent/tracker.hpp"
+
+namespace torrent {
+
+    // UDP tracker protocol (BEP 15).
+    //
+    // Every exchange is one datagram each way. A connect round trip first
+    // obtains a connection id, which is cached per tracker for a minute so
+    // later announces and scrapes skip it. Lost requests are retransmitted
+    // after 15 * 2^n seconds (n = attempt), as the spec asks.
+
+    struct UdpTrackerOptions {
+        std::chrono::milliseconds base_timeout{15000};
+        // The spec allows up to 8 retransmissions (over an hour in total);
+        // a dead tracker shouldn't stall us that long.
+        int max_retries = 3;
+    };
+
+    struct ScrapeResult {
+        std::uint32_t seeders = 0;
+        std::uint32_t completed = 0;
+        std::uint32_t leechers = 0;
+    };
+
+    // Announce to a udp://host:port[/path] tracker.
+    // Throws std::runtime_error on timeout or a tracker error message.
+    TrackerResponse udp_announce(
+        const std::string& url,
+        const std::array<std::uint8_t, 20>& info_hash,
+        const std::string& peer_id,
+        const AnnounceRequest& req,
+        const UdpTrackerOptions& options = {}
+    );
+
+    // Scrape swarm counts for up to 74 info hashes in one request.
+    std::vector<ScrapeResult> udp_scrape(
+        const std::string& url,
+        const std::vector<std::array<std::uint8_t, 20>>& info_hashes,
+        const UdpTrackerOptions& options = {}
+    );
+
+    // Announces on an EventLoop, for many torrents at once.
+    //
+    // udp_announce() blocks for as long as a dead tracker takes to time
+    // out; here every announce is a few datagrams on one socket per
+    // address family, matched to their replies by transaction id, and
+    // waiting costs a timer instead of a thread. Connection ids are cached
+    // per tracker and lost requests retransmitted as with udp_announce().
+    // Tracker names are resolved one at a time on a resolver thread (only
+    // started when a name isn't numeric) and kept for 30 minutes.
+    //
+    // Must only be used from the loop thread.
+    class UdpTrackerClient {
+    public:
+        // `error` is non-empty if the announce failed.
+        using AnnounceCallback = std::function<void(const TrackerResponse& resp, const std::string& error)>;
+
+        explicit UdpTrackerClient(EventLoop& loop);
+        UdpTrackerClient(EventLoop& loop, UdpTrackerOptions options);
+        ~UdpTrackerClient();
+
+        UdpTrackerClient(const UdpTrackerClient&) = delete;
+        UdpTrackerClient& operator=(const UdpTrackerClient&) = delete;
+
+        // Start an announce; `cb` runs on the loop when it finishes or
+        // fails, never from within this call. Dropped if the client goes
+        // away first.
+        void announce(
+            const std::string& url,
+            const std::array<std::uint8_t, 20>& info_hash,
+            const std::string& peer_id,
+            const AnnounceRequest& req,
+            AnnounceCallback cb
+        );
+
+        std::size_t pending() const { return m_requests.size(); }
+
+    private:
+        struct Tracker {
+            Endpoint address;
+            bool resolved = false;
+            bool resolving = false;
+            EventLoop::Clock::time_point resolved_at{};
+            std::vector<std::uint64_t> waiting; // requests, until resolved
+
+            bool has_connection_id = false;
+            std::uint64_t connection_id = 0;
+            EventLoop::Clock::time_point connected_at{};
+        };
+
+        struct Request {
+            std::string tracker;    // "host:port", key of m_trackers
+            std::string packet;     // the announce; ids are filled in per send
+            AnnounceCallback cb;
+            int attempt = 0;
+            bool connecting = false; // waiting for a connect reply
+            bool cached = false;     // announce sent with a cached connection id
+            std::uint32_t txid = 0;
+            EventLoop::TimerId timer = 0;
+        };
+
+        void resolve(const std::string& key);
+        void on_resolved(const std::string& key, const std::vector<Endpoint>& addresses, const std::string& error);
+        void resolver_main();
+
+        void start_attempt(std::uint64_t id);
+        void send_announce(std::uint64_t id);
+        void transmit(std::uint64_t id, std::string packet);
+        void on_timeout(std::uint64_t id);
+        void on_readable(int fd);
+        void finish(std::uint64_t id, const TrackerResponse& resp, const std::string& error);
+        int socket_for(const Endpoint& address);
+
+        EventLoop& m_loop;
+        UdpTrackerOptions m_options;
+        int m_fd4 = -1; // opened on first use
+        int m_fd6 = -1;
+        std::unordered_map<std::string, Tracker> m_trackers;
+        std::unordered_map<std::uint64_t, Request> m_requests;
+        std::unordered_map<std::uint32_t, std::uint64_t> m_transactions; // txid -> request
+        std::uint64_t m_next_id = 1;
+        std::shared_ptr<bool> m_alive = std::make_shared<bool>(true); // for posted callbacks
+
+        // Resolver thread: names in, results posted back to the loop
+        std::thread m_resolver;
+        std::mutex m_resolve_mutex;
+        std::condition_variable m_resolve_cv;
+        std::deque<std::string> m_resolve_queue;
+        bool m_resolver_stop = false;
+    };
+
+    // Minimal in-memory BEP 15 tracker for local testing. Peers that announce
+    // are remembered per info hash and handed to later announcers; fixed
+    // peers given to the constructor are returned for every torrent.
+    class UdpTrackerServer {
+    public:
+        UdpTrackerServer(EventLoop& loop, std::uint16_t port, std::vector<Endpoint> fixed_peers = {});
+        ~UdpTrackerServer();
+
+        UdpTrackerServer(const UdpTrackerServer&) = delete;
+        UdpTrackerServer& operator=(const UdpTrackerServer&) = delete;
+
+        // Silently drop the next `n` requests (to exercise retransmission).
+        void drop_requests(int n) { m_drop = n; }
+
+        std::uint64_t requests_seen() const { return m_requests; }
+
+    private:
+        struct SwarmPeer {
+            Endpoint peer;
+            bool seed = false;
+            EventLoop::Clock::time_point last_seen;
+        };
+
+        void on_readable();
+        std::string handle(const std::string& req, const Endpoint& from);
+
+        EventLoop& m_loop;
+        int m_fd = -1;
+        std::vector<Endpoint> m_fixed_peers;
+        std::map<std::string, std::vector<SwarmPeer>> m_swarms; // by raw info hash
+        std::unordered_map<std::uint64_t, EventLoop::Clock::time_point> m_connection_ids;
+        std::deque<std::pair<EventLoop::Clock::time_point, std::uint64_t>> m_issued_ids; // oldest first, to expire
+        std::map<std::string, std::uint32_t> m_completed;
+        std::mt19937_64 m_rng;
+        int m_drop = 0;
+        std::uint64_t m_requests = 0;
+    };
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "torrent/extension.hpp"
+
+namespace torrent {
+
+    // Metadata exchange (BEP 9, "ut_metadata"): the info dictionary is sent
+    // between peers in 16 KiB pieces, so a magnet link (just the info hash)
+    // is enough to join a swarm.
+    //
+    // With the metadata, requests are answered from it. Without, it is
+    // downloaded: each peer that announces "metadata_size" is asked for a
+    // few pieces nobody else is working on, so different pieces come from
+    // different peers at the same time. Rejected requests go to other
+    // peers. So do ones that time out, but a peer is asked for those again
+    // once it has nothing else left to fetch. Once every piece is in, the
+    // whole is checked against the info hash; from then on it is served
+    // like any other metadata.
+    class UtMetadata : public Extension {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using CompleteCallback = std::function<void(const std::string& info_bencoded)>;
+
+        static constexpr std::size_t kPieceSize = 16 * 1024;
+        // Larger announced sizes are refused (the info dict of a ~1 TB torrent
+        // with 1 MiB pieces is ~20 MB; anything near this is an attack).
+        static constexpr std::size_t kMaxMetadataSize = 32 * 1024 * 1024;
+
+        // Serve `info_bencoded`.
+        explicit UtMetadata(std::string info_bencoded);
+        // Download the metadata matching `info_hash`. `on_complete` runs once,
+        // after the hash check, from inside a message handler: it must not
+        // destroy this extension or close connections.
+        UtMetadata(const std::array<std::uint8_t, 20>& info_hash, CompleteCallback on_complete);
+
+        bool complete() const { return m_complete; }
+        // The info dictionary; empty until complete().
+        const std::string& metadata() const { return m_metadata; }
+
+        // Download progress; num_pieces() is 0 until a peer told us the size.
+        std::size_t num_pieces() const { return m_pieces.size(); }
+        std::size_t pieces_received() const { return m_received; }
+
+        std::string name() const override { return "ut_metadata"; }
+        void add_handshake_keys(json& dict) const override;
+        void on_handshake(ExtensionPeer& peer) override;
+        void on_message(ExtensionPeer& peer, const std::uint8_t* data, std::size_t len) override;
+        void on_disconnect(ExtensionPeer& peer) override;
+        void on_tick() override;
+
+    private:
+        enum class MsgType { Request = 0, Data = 1, Reject = 2 };
+
+        struct Piece {
+            bool received = false;
+            std::vector<ExtensionPeer*> requested_from;
+            ExtensionPeer* source = nullptr;
+        };
+
+        // A peer we download from.
+        struct PeerState {
+            std::size_t metadata_size = 0;            // what it announced
+            std::vector<std::uint32_t> rejected;      // pieces it won't send
+            std::vector<std::uint32_t> timed_out;     // asked again only when nothing else is left
+            std::unordered_map<std::uint32_t, Clock::time_point> requests; // in flight
+            bool ignored = false;                     // sent bad data
+        };
+
+        void serve(ExtensionPeer& peer, std::uint32_t piece);
+        void on_data(ExtensionPeer& peer, std::uint32_t piece, const std::uint8_t* data, std::size_t len);
+        void start_download();
+        void request_pieces(ExtensionPeer& peer);
+        void forget_request(ExtensionPeer& peer, std::uint32_t piece);
+        void verify();
+        void send(ExtensionPeer& peer, MsgType type, std::uint32_t piece,
+                  const std::uint8_t* data = nullptr, std::size_t len = 0, std::size_t total = 0);
+
+        std::array<std::uint8_t, 20> m_info_hash{};
+        CompleteCallback m_on_complete;
+
+        bool m_complete = false;
+        std::string m_metadata;
+
+        // Download
+        std::size_t m_size = 0;  // 0 until a peer announced it
+        std::string m_buffer;
+        std::vector<Piece> m_pieces;
+        std::size_t m_received = 0;
+        std::unordered_map<ExtensionPeer*, PeerState> m_peers;
+    };
+
+}
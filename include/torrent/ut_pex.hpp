@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "torrent/endpoint.hpp"
+#include "torrent/extension.hpp"
+
+namespace torrent {
+
+    // Peer exchange (BEP 11, "ut_pex"): connected peers tell each other whom
+    // else they are connected to, so the peer set grows without asking the
+    // tracker again.
+    //
+    // Once a minute every peer gets the peers we connected to since our last
+    // message ("added") and the ones we lost ("dropped"), at most 50 of each;
+    // the first message lists the current peers. Received lists are rate
+    // limited (one message per peer per 45 s, 50 peers each) and checked
+    // against every peer PEX has handed over before, so each new address
+    // is passed on once.
+    class UtPex : public Extension {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // "added.f" flags
+        static constexpr std::uint8_t kFlagEncryption = 0x01;
+        static constexpr std::uint8_t kFlagSeed = 0x02;
+        static constexpr std::uint8_t kFlagUtp = 0x04;
+        static constexpr std::uint8_t kFlagReachable = 0x10; // we connected to it
+
+        struct Peer {
+            Endpoint endpoint;
+            std::uint8_t flags = 0;
+        };
+
+        // The peers to advertise (reachable addresses only), and where
+        // newly learned peers go.
+        using PeersProvider = std::function<std::vector<Peer>()>;
+        using PeersCallback = std::function<void(const std::vector<Peer>&)>;
+
+        UtPex(PeersProvider connected, PeersCallback on_peers);
+
+        std::string name() const override { return "ut_pex"; }
+        void on_handshake(ExtensionPeer& peer) override;
+        void on_message(ExtensionPeer& peer, const std::uint8_t* data, std::size_t len) override;
+        void on_disconnect(ExtensionPeer& peer) override;
+        void on_tick() override;
+
+    private:
+        struct PeerState {
+            std::unordered_set<Endpoint> sent;  // what the peer knows from us
+            bool first_sent = false;
+            Clock::time_point last_sent{};
+            Clock::time_point last_received{};
+        };
+
+        void send_update(ExtensionPeer& peer, PeerState& st, const std::vector<Peer>& current);
+
+        PeersProvider m_connected;
+        PeersCallback m_on_peers;
+        std::unordered_map<ExtensionPeer*, PeerState> m_peers;
+        std::unordered_set<Endpoint> m_known; // handed to m_on_peers already
+    };
+
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "torrent/endpoint.hpp"
+#include "torrent/event_loop.hpp"
+
+namespace torrent {
+
+    // uTP (BEP 29): reliable, ordered byte streams over one UDP socket,
+    // IPv4 only, with LEDBAT congestion control. Every connection is
+    // multiplexed on the same socket by connection id.
+    //
+    // Each connection is handed to the application as one end of an
+    // AF_UNIX stream socketpair; we keep the other end and move bytes
+    // between it and the datagrams. To the caller a uTP connection is just
+    // a non-blocking stream socket: read, write, sendfile and close work as
+    // they do on TCP, so the peer wire code doesn't know the difference.
+    // Closing the socket sends whatever was written and then a FIN.
+    //
+    // LEDBAT: every packet carries its send time, and the receiver echoes
+    // how long it took to arrive. The lowest such delay over the last two
+    // minutes is the base delay (the path without queues); anything above
+    // it is queueing we caused. The window grows while that stays below
+    // 100 ms and shrinks when it goes over, so we back off before TCP
+    // flows sharing the bottleneck see losses. Loss halves the window and
+    // a timeout drops it to one packet. Selective ACKs report packets
+    // received past a gap, and a packet three others have overtaken is
+    // sent again without waiting for the timeout.
+    //
+    // Config::delay and Config::loss hold back or drop our outgoing
+    // datagrams, to try the transport on loopback without netem.
+    //
+    // Must only be used from the loop thread.
+    class UtpSocketManager {
+    public:
+        using Clock = EventLoop::Clock;
+
+        struct Config {
+            std::string bind_address = "0.0.0.0";
+            std::chrono::milliseconds delay{0}; // added to every datagram we send
+            double loss = 0;                    // fraction of datagrams we send that are dropped
+        };
+
+        struct Stats {
+            std::uint64_t packets_sent = 0;
+            std::uint64_t packets_received = 0;
+            std::uint64_t bytes_sent = 0;     // payload, first transmissions only
+            std::uint64_t bytes_received = 0; // payload delivered in order
+            std::uint64_t retransmits = 0;
+            std::uint64_t fast_retransmits = 0; // of retransmits, not waiting for a timeout
+            std::uint64_t timeouts = 0;
+            std::uint64_t dropped = 0;          // by Config::loss
+            std::uint64_t connections = 0;
+        };
+
+        // A connection's state, for benchmarks and diagnostics.
+        struct ConnectionInfo {
+            Endpoint remote;
+            std::size_t cwnd = 0;      // bytes
+            std::size_t in_flight = 0; // bytes
+            std::chrono::microseconds rtt{0};
+            std::chrono::microseconds queuing_delay{0}; // our packets, above the base delay
+        };
+
+        // `fd` is the caller's end of the connection, or -1 with `error`.
+        using ConnectCallback = std::function<void(int fd, const std::string& error)>;
+        using AcceptCallback = std::function<void(int fd, const Endpoint& remote)>;
+        // Datagrams on the socket that aren't uTP (e.g. DHT messages).
+        using DatagramCallback = std::function<void(const char* data, std::size_t len, const Endpoint& from)>;
+
+        // Bind UDP `port` (0 = any free port). Throws std::runtime_error.
+        UtpSocketManager(EventLoop& loop, std::uint16_t port);
+        UtpSocketManager(EventLoop& loop, std::uint16_t port, Config config);
+        ~UtpSocketManager();
+
+        UtpSocketManager(const UtpSocketManager&) = delete;
+        UtpSocketManager& operator=(const UtpSocketManager&) = delete;
+
+        // Start connecting to `remote`. Returns the caller's end of the
+        // connection right away (or -1 if no socketpair could be made);
+        // `done` runs later, never from inside connect(), once the remote
+        // answered or we gave up. The caller owns the fd either way.
+        int connect(const Endpoint& remote, ConnectCallback done);
+
+        // Incoming connections; without a handler they are refused.
+        void set_on_accept(AcceptCallback on_accept) { m_on_accept = std::move(on_accept); }
+        void set_on_datagram(DatagramCallback on_datagram) { m_on_datagram = std::move(on_datagram); }
+
+        // Send a datagram that isn't uTP from our socket.
+        void send_datagram(const Endpoint& to, const std::string& data);
+
+        int fd() const { return m_fd; }
+        std::uint16_t port() const { return m_port; }
+        std::size_t num_connections() const { return m_conns.size(); }
+        const Stats& stats() const { return m_stats; }
+        std::vector<ConnectionInfo> connections() const;
+
+    private:
+        struct Packet {
+            std::uint16_t seq = 0;
+            std::uint8_t type = 0;
+            std::vector<std::uint8_t> payload;
+            Clock::time_point sent{};
+            int transmissions = 0;
+            bool acked = false;      // selectively
+            bool need_resend = false;
+        };
+
+        struct Conn {
+            enum class State { SynSent, Connected } state = State::SynSent;
+            Endpoint remote;
+            std::uint16_t recv_id = 0; // ids on the packets they send us
+            std::uint16_t send_id = 0; // and on ours
+            int fd = -1;               // our end of the socketpair
+            int user_fd = -1;          // the application's; not ours to close
+            bool registered = false;   // fd is watched by the loop
+            std::uint32_t events = 0;
+            ConnectCallback on_connect;
+
+            // Sending
+            std::uint16_t seq_nr = 1;  // the next packet's
+            std::deque<Packet> outstanding; // not yet acked, oldest first
+            std::size_t in_flight = 0;      // payload bytes in outstanding, not selectively acked
+            double cwnd = 0;
+            double ssthresh = 0;
+            bool slow_start = true;
+            std::uint32_t peer_wnd = 0;
+            std::uint16_t last_ack = 0;
+            int dup_acks = 0;
+            Clock::time_point last_loss{};
+            bool app_eof = false;    // all it wrote is packetized, FIN included
+            bool app_closed = false; // it closed its end; nobody reads any more
+            Clock::time_point fin_time{};
+
+            // Timing
+            std::chrono::microseconds rtt{0};
+            std::chrono::microseconds rtt_var{0};
+            std::chrono::milliseconds rto{1000};
+            std::uint32_t reply_delay = 0;  // their last packet's one-way delay, echoed back
+            std::uint32_t base_delay[2] = {0, 0}; // lowest delay this minute and last minute
+            bool base_valid[2] = {false, false};
+            Clock::time_point base_rotated{};
+            std::uint32_t queuing_delay = 0; // of our last acked packet, µs
+
+            // Receiving
+            std::uint16_t ack_nr = 0;  // last packet received in order
+            std::map<std::uint16_t, std::vector<std::uint8_t>> reorder; // received past a gap, by seq
+            std::size_t reorder_bytes = 0;
+            std::vector<std::uint8_t> to_app; // in order, not yet written to fd
+            bool eof_received = false;
+            std::uint16_t eof_seq = 0;
+            bool app_shut = false;     // we passed the FIN on to the application
+            bool ack_due = false;
+            Clock::time_point last_recv{};
+            Clock::time_point last_send{};
+        };
+
+        struct Delayed {
+            Clock::time_point due;
+            Endpoint to;
+            std::vector<std::uint8_t> data;
+        };
+
+        using Key = std::pair<Endpoint, std::uint16_t>; // remote, recv_id
+
+        void on_readable();
+        void on_packet(const std::uint8_t* data, std::size_t len, const Endpoint& from);
+        void accept_syn(const Endpoint& from, std::uint16_t conn_id, std::uint16_t seq);
+        void process_acks(Conn& c, std::uint16_t ack_nr, const std::uint8_t* sack, std::size_t sack_len,
+                          std::uint32_t their_delay, bool pure_ack);
+        void receive_data(Conn& c, std::uint8_t type, std::uint16_t seq, const std::uint8_t* payload,
+                          std::size_t len);
+
+        void on_app_event(Conn& c, std::uint32_t events);
+        void pump(Conn& c);         // resend what's lost, packetize what the application wrote
+        void flush_to_app(Conn& c); // write what we received in order
+        void update_watch(Conn& c);
+        bool can_send(const Conn& c) const;
+        std::size_t window(const Conn& c) const;
+        std::uint32_t recv_window(const Conn& c) const;
+        void on_loss(Conn& c);
+
+        std::vector<std::uint8_t> build_packet(const Conn& c, std::uint8_t type, std::uint16_t seq,
+                                               const std::vector<std::uint8_t>& payload) const;
+        void send_packet(Conn& c, Packet& p);
+        void send_ack(Conn& c);
+        void send_reset(const Endpoint& to, std::uint16_t conn_id);
+        void send_raw(const Endpoint& to, std::vector<std::uint8_t> data);
+
+        void tick();
+        void flush_delayed();
+        void finish_if_done(Conn& c);
+        void fail(Conn& c, const std::string& error); // close the application's end
+        void destroy(Conn& c);
+
+        EventLoop& m_loop;
+        Config m_config;
+        int m_fd = -1;
+        std::uint16_t m_port = 0;
+        std::map<Key, std::unique_ptr<Conn>> m_conns;
+        std::vector<Key> m_acks; // owe an ack after this batch of datagrams
+        AcceptCallback m_on_accept;
+        DatagramCallback m_on_datagram;
+        std::mt19937 m_rng{std::random_device{}()};
+        std::deque<Delayed> m_delayed;
+        EventLoop::TimerId m_delay_timer = 0;
+        EventLoop::TimerId m_tick_timer = 0;
+        Stats m_stats;
+    };
+
+}
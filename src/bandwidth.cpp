@@ -0,0 +1,78 @@
+#include "torrent/bandwidth.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace torrent {
+
+    void TokenBucket::set_rate(std::uint64_t bytes_per_second) {
+        m_rate = bytes_per_second;
+        m_tokens = std::min(m_tokens, static_cast<double>(m_rate));
+    }
+
+    void TokenBucket::refill(Clock::time_point now) {
+        if (m_last == Clock::time_point{}) {
+            // First use: start with a full bucket
+            m_last = now;
+            m_tokens = static_cast<double>(m_rate);
+            return;
+        }
+        if (now <= m_last) return;
+
+        double elapsed = std::chrono::duration<double>(now - m_last).count();
+        m_tokens = std::min(m_tokens + elapsed * static_cast<double>(m_rate), static_cast<double>(m_rate));
+        m_last = now;
+    }
+
+    std::uint64_t TokenBucket::available(Clock::time_point now) {
+        if (unlimited()) return std::numeric_limits<std::uint64_t>::max();
+
+        refill(now);
+        return m_tokens > 0 ? static_cast<std::uint64_t>(m_tokens) : 0;
+    }
+
+    void TokenBucket::consume(std::uint64_t bytes) {
+        if (unlimited()) return;
+        m_tokens -= static_cast<double>(bytes);
+    }
+
+    TokenBucket::Clock::duration TokenBucket::time_until(std::uint64_t bytes, Clock::time_point now) {
+        if (unlimited()) return Clock::duration::zero();
+
+        refill(now);
+        double missing = static_cast<double>(bytes) - m_tokens;
+        if (missing <= 0) return Clock::duration::zero();
+
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(missing / static_cast<double>(m_rate))
+        );
+    }
+
+    std::uint64_t bandwidth_quota(const BandwidthChain& chain, std::uint64_t want, TokenBucket::Clock::time_point now) {
+        std::uint64_t quota = want;
+        for (TokenBucket* bucket : chain) {
+            if (bucket) quota = std::min(quota, bucket->available(now));
+        }
+        return quota;
+    }
+
+    void bandwidth_consume(const BandwidthChain& chain, std::uint64_t bytes) {
+        for (TokenBucket* bucket : chain) {
+            if (bucket) bucket->consume(bytes);
+        }
+    }
+
+    TokenBucket::Clock::duration bandwidth_wait(
+        const BandwidthChain& chain,
+        std::uint64_t bytes,
+        TokenBucket::Clock::time_point now
+    ) {
+        TokenBucket::Clock::duration wait = TokenBucket::Clock::duration::zero();
+        for (TokenBucket* bucket : chain) {
+            if (!bucket || bucket->unlimited()) continue;
+            wait = std::max(wait, bucket->time_until(std::min(bytes, bucket->rate()), now));
+        }
+        return wait;
+    }
+
+}
@@ -28,35 +28,122 @@ namespace torrent {
 
     // ---------------- Decoding bencoded values ----------------
 
+    // All decoders share one cursor-based parser so that nested values of any
+    // type (e.g. the list of file dicts in a multi-file torrent) are handled.
+    // It recurses once per list or dict, and peers choose what we decode, so
+    // nesting is capped well below what would overflow the stack.
+    static constexpr int kMaxDepth = 64;
+
+    static json decode_at(const std::string& encoded_value, size_t& idx, int depth);
+
+    static json decode_string_at(const std::string& encoded_value, size_t& idx) {
+        size_t colon_index = encoded_value.find(':', idx);
+        if (colon_index == std::string::npos || colon_index == idx) {
+            throw std::runtime_error("Invalid encoded value: " + encoded_value);
+        }
+        for (size_t i = idx; i < colon_index; i++) {
+            if (!std::isdigit(static_cast<unsigned char>(encoded_value[i]))) {
+                throw std::runtime_error("Invalid encoded value: " + encoded_value);
+            }
+        }
+
+        std::string number_string = encoded_value.substr(idx, colon_index - idx);
+        uint64_t number = std::strtoull(number_string.c_str(), nullptr, 10);
+        if (number > encoded_value.size() - colon_index - 1) {
+            throw std::runtime_error("Invalid encoded value: string length out of range");
+        }
+
+        idx = colon_index + 1 + number;
+        return json(encoded_value.substr(colon_index + 1, number));
+    }
+
+    static json decode_integer_at(const std::string& encoded_value, size_t& idx) {
+        size_t e_idx = encoded_value.find('e', idx);
+        if (e_idx == std::string::npos) {
+            throw std::runtime_error("Invalid encoded value: " + encoded_value);
+        }
+
+        json number = decode_integer_bencoded_value(encoded_value.substr(idx, e_idx - idx + 1));
+        idx = e_idx + 1;
+        return number;
+    }
+
+    static json decode_list_at(const std::string& encoded_value, size_t& idx, int depth) {
+        if (depth >= kMaxDepth) throw std::runtime_error("Invalid encoded value: nested too deeply");
+        json decoded_list = json::array();
+
+        idx++; // 'l'
+        while (idx < encoded_value.length() && encoded_value[idx] != 'e') {
+            decoded_list.push_back(decode_at(encoded_value, idx, depth + 1));
+        }
+        if (idx >= encoded_value.length()) {
+            throw std::runtime_error("Invalid encoded value: unterminated list");
+        }
+
+        idx++; // 'e'
+        return decoded_list;
+    }
+
+    static json decode_dict_at(const std::string& encoded_value, size_t& idx, int depth) {
+        if (depth >= kMaxDepth) throw std::runtime_error("Invalid encoded value: nested too deeply");
+        json decoded_dict = json::object();
+
+        idx++; // 'd'
+        while (idx < encoded_value.length() && encoded_value[idx] != 'e') {
+            if (!std::isdigit(static_cast<unsigned char>(encoded_value[idx]))) {
+                throw std::runtime_error("Invalid encoded value: dict key must be a string");
+            }
+            std::string current_key = decode_string_at(encoded_value, idx).get<std::string>();
+            if (idx >= encoded_value.length()) {
+                throw std::runtime_error("Invalid encoded value: missing dict value");
+            }
+            decoded_dict[current_key] = decode_at(encoded_value, idx, depth + 1);
+        }
+        if (idx >= encoded_value.length()) {
+            throw std::runtime_error("Invalid encoded value: unterminated dict");
+        }
+
+        idx++; // 'e'
+        return decoded_dict;
+    }
+
+    static json decode_at(const std::string& encoded_value, size_t& idx, int depth) {
+        char c = encoded_value[idx];
+        if (std::isdigit(static_cast<unsigned char>(c))) return decode_string_at(encoded_value, idx);
+        if (c == 'i') return decode_integer_at(encoded_value, idx);
+        if (c == 'l') return decode_list_at(encoded_value, idx, depth);
+        if (c == 'd') return decode_dict_at(encoded_value, idx, depth);
+        throw std::runtime_error("Unhandled encoded value: " + encoded_value);
+    }
+
     json decode_bencoded_value(const std::string& encoded_value) {
-        size_t encoded_value_length = encoded_value.length();
+        if (encoded_value.empty()) {
+            throw std::runtime_error("Unhandled encoded value: empty input");
+        }
+
+        size_t idx = 0;
+        return decode_at(encoded_value, idx, 0);
+    }
 
-        if (std::isdigit(encoded_value[0])) {
-            return decode_string_bencoded_value(encoded_value);
-        } else if (encoded_value_length > 2 && encoded_value[0] == 'i' && encoded_value[encoded_value_length - 1] == 'e') {
-            return decode_integer_bencoded_value(encoded_value);
-        } else if (encoded_value_length > 1 && encoded_value[0] == 'l' && encoded_value[encoded_value_length - 1] == 'e') {
-            return decode_list_bencoded_value(encoded_value);
-        } else if (encoded_value_length > 1 && encoded_value[0] == 'd' && encoded_value[encoded_value_length - 1] == 'e') {
-            return decode_dict_bencoded_value(encoded_value);
-        } else {
-            throw std::runtime_error("Unhandled encoded value: " + encoded_value);
+    json decode_bencoded_prefix(const std::string& encoded_value, std::size_t& consumed) {
+        if (encoded_value.empty()) {
+            throw std::runtime_error("Unhandled encoded value: empty input");
         }
+
+        consumed = 0;
+        return decode_at(encoded_value, consumed, 0);
     }
 
     json decode_string_bencoded_value(const std::string& encoded_value) {
-        size_t colon_index = encoded_value.find(':');
-        if (colon_index != std::string::npos) {
-            std::string number_string = encoded_value.substr(0, colon_index);
-            int64_t number = std::atoll(number_string.c_str());
-            std::string str = encoded_value.substr(colon_index + 1, number);
-            return json(str);
-        }
-        throw std::runtime_error("Invalid encoded value: " + encoded_value);
+        size_t idx = 0;
+        return decode_string_at(encoded_value, idx);
     }
 
     json decode_integer_bencoded_value(const std::string& encoded_value) {
         size_t encoded_value_length = encoded_value.length();
+        if (encoded_value_length < 3 || encoded_value[0] != 'i' || encoded_value[encoded_value_length - 1] != 'e') {
+            throw std::runtime_error("Invalid encoded value: " + encoded_value);
+        }
 
         size_t idx = 1;
         bool isNegative = false;
@@ -85,214 +172,21 @@ namespace torrent {
     }
 
     json decode_list_bencoded_value(const std::string& encoded_value) {
-        size_t encoded_value_length = encoded_value.length();
-        if (encoded_value_length == 2) return json::array();
-
-        json decoded_list = json::array();
-
-        size_t idx = 1;
-        while (idx < encoded_value_length - 1 && encoded_value[idx] != 'e') {
-            if (encoded_value[idx] == 'i') {
-                size_t e_idx = idx;
-                while (e_idx < encoded_value_length && encoded_value[e_idx] != 'e') e_idx++;
-
-                size_t encoded_int_len = e_idx - idx + 1;
-                std::string encoded_int = encoded_value.substr(idx, encoded_int_len);
-                decoded_list.push_back(decode_integer_bencoded_value(encoded_int));
-
-                idx = e_idx + 1;
-            }
-            else if (std::isdigit(encoded_value[idx])) {
-                size_t colon_index = encoded_value.find(':', idx);
-                if (colon_index != std::string::npos) {
-                    std::string number_string = encoded_value.substr(idx, colon_index - idx);
-                    int64_t number = std::atoll(number_string.c_str());
-                    std::string str = encoded_value.substr(colon_index + 1, number);
-                    decoded_list.push_back(str);
-
-                    idx = colon_index + 1 + number;
-                }
-                else {
-                    throw std::runtime_error("Invalid encoded value: " + encoded_value);
-                }
-            }
-            else if (encoded_value[idx] == 'l') {
-                std::string encoded_list = encoded_value.substr(idx);
-                decoded_list.push_back(decode_list_bencoded_value(encoded_list));
-                idx++;
-
-                size_t l_count = 1;
-                size_t e_count = 0;
-                while (idx < encoded_value_length && l_count != e_count) {
-                    if (encoded_value[idx] == 'i') {
-                        size_t e_idx = idx;
-                        while (e_idx < encoded_value_length && encoded_value[e_idx] != 'e') e_idx++;
-                        idx = e_idx + 1;
-                    }
-                    else if (std::isdigit(encoded_value[idx])) {
-                        size_t colon_index = encoded_value.find(':', idx);
-                        std::string number_string = encoded_value.substr(idx, colon_index - idx);
-                        int64_t number = std::atoll(number_string.c_str());
-                        idx = colon_index + 1 + number;
-                    }
-                    else if (encoded_value[idx] == 'l') {
-                        l_count++; idx++;
-                    }
-                    else if (encoded_value[idx] == 'e') {
-                        e_count++; idx++;
-                    }
-                }
-            }
-            else {
-                throw std::runtime_error("Invalid encoded value: " + encoded_value);
-            }
-
+        if (encoded_value.empty() || encoded_value[0] != 'l') {
+            throw std::runtime_error("Invalid encoded value: " + encoded_value);
         }
-        return decoded_list;
+
+        size_t idx = 0;
+        return decode_list_at(encoded_value, idx, 0);
     }
 
     json decode_dict_bencoded_value(const std::string& encoded_value) {
-        size_t encoded_value_length = encoded_value.length();
-        if (encoded_value_length == 2) return json::object();
-
-        json decoded_dict = json::object();
-        int64_t iteration = 0;
-        std::string current_key = "";
-
-        size_t idx = 1;
-        while (idx < encoded_value_length - 1 && encoded_value[idx] != 'e') {
-            iteration++;
-
-            if (iteration % 2 == 1) {
-                if (std::isdigit(encoded_value[idx])) {
-                    size_t colon_index = encoded_value.find(':', idx);
-                    if (colon_index != std::string::npos) {
-                        std::string number_string = encoded_value.substr(idx, colon_index - idx);
-                        int64_t number = std::atoll(number_string.c_str());
-                        current_key = encoded_value.substr(colon_index + 1, number);
-                        decoded_dict[current_key] = "";
-
-                        idx = colon_index + 1 + number;
-                    }
-                    else {
-                        throw std::runtime_error("Invalid encoded value: " + encoded_value);
-                    }
-                }
-                else {
-                    throw std::runtime_error("Invalid encoded value: " + encoded_value);
-                }
-            }
-            else {
-                if (std::isdigit(encoded_value[idx])) {
-                    size_t colon_index = encoded_value.find(':', idx);
-                    if (colon_index != std::string::npos) {
-                        std::string number_string = encoded_value.substr(idx, colon_index - idx);
-                        int64_t number = std::atoll(number_string.c_str());
-                        std::string str = encoded_value.substr(colon_index + 1, number);
-                        decoded_dict[current_key] = str;
-
-                        idx = colon_index + 1 + number;
-                    }
-                    else {
-                        throw std::runtime_error("Invalid encoded value: " + encoded_value);
-                    }
-                }
-                else if (encoded_value[idx] == 'i') {
-                    size_t e_idx = idx;
-                    while (e_idx < encoded_value_length && encoded_value[e_idx] != 'e') e_idx++;
-
-                    size_t encoded_int_len = e_idx - idx + 1;
-                    std::string encoded_int = encoded_value.substr(idx, encoded_int_len);
-                    decoded_dict[current_key] = decode_integer_bencoded_value(encoded_int);
-
-                    idx = e_idx + 1;
-                }
-                else if (encoded_value[idx] == 'l') {
-                    std::string encoded_list = encoded_value.substr(idx);
-                    decoded_dict[current_key] = decode_list_bencoded_value(encoded_list);
-
-                    idx++;
-
-                    size_t l_count = 1;
-                    size_t e_count = 0;
-                    while (idx < encoded_value_length && l_count != e_count) {
-                        if (encoded_value[idx] == 'i') {
-                            size_t e_idx = idx;
-                            while (e_idx < encoded_value_length && encoded_value[e_idx] != 'e') e_idx++;
-                            idx = e_idx + 1;
-                        }
-                        else if (std::isdigit(encoded_value[idx])) {
-                            size_t colon_index = encoded_value.find(':', idx);
-                            std::string number_string = encoded_value.substr(idx, colon_index - idx);
-                            int64_t number = std::atoll(number_string.c_str());
-                            idx = colon_index + 1 + number;
-                        }
-                        else if (encoded_value[idx] == 'l') {
-                            l_count++; idx++;
-                        }
-                        else if (encoded_value[idx] == 'e') {
-                            e_count++; idx++;
-                        }
-                    }
-                }
-                else if (encoded_value[idx] == 'd') {
-                    std::string encoded_dict = encoded_value.substr(idx);
-                    decoded_dict[current_key] = decode_dict_bencoded_value(encoded_dict);
-                    idx++;
-
-                    size_t d_count = 1;
-                    size_t e_count = 0;
-                    while (idx < encoded_value_length && d_count != e_count) {
-                        if (encoded_value[idx] == 'i') {
-                            size_t e_idx = idx;
-                            while (e_idx < encoded_value_length && encoded_value[e_idx] != 'e') e_idx++;
-                            idx = e_idx + 1;
-                        }
-                        else if (std::isdigit(encoded_value[idx])) {
-                            size_t colon_index = encoded_value.find(':', idx);
-                            std::string number_string = encoded_value.substr(idx, colon_index - idx);
-                            int64_t number = std::atoll(number_string.c_str());
-                            idx = colon_index + 1 + number;
-                        }
-                        else if (encoded_value[idx] == 'l') {
-                            idx++;
-
-                            size_t l_count = 1;
-                            size_t e_count_for_l = 0;
-                            while (idx < encoded_value_length && l_count != e_count_for_l) {
-                                if (encoded_value[idx] == 'i') {
-                                    size_t e_idx = idx;
-                                    while (e_idx < encoded_value_length && encoded_value[e_idx] != 'e') e_idx++;
-                                    idx = e_idx + 1;
-                                }
-                                else if (std::isdigit(encoded_value[idx])) {
-                                    size_t colon_index = encoded_value.find(':', idx);
-                                    std::string number_string = encoded_value.substr(idx, colon_index - idx);
-                                    int64_t number = std::atoll(number_string.c_str());
-                                    idx = colon_index + 1 + number;
-                                }
-                                else if (encoded_value[idx] == 'l') {
-                                    l_count++; idx++;
-                                }
-                                else if (encoded_value[idx] == 'e') {
-                                    e_count_for_l++; idx++;
-                                }
-                            }
-                        }
-                        else if (encoded_value[idx] == 'd') {
-                            d_count++; idx++;
-                        }
-                        else if (encoded_value[idx] == 'e') {
-                            e_count++; idx++;
-                        }
-                    }
-                }
-                else {
-                    throw std::runtime_error("Invalid encoded value: " + encoded_value);
-                }
-            }
+        if (encoded_value.empty() || encoded_value[0] != 'd') {
+            throw std::runtime_error("Invalid encoded value: " + encoded_value);
         }
-        return decoded_dict;
+
+        size_t idx = 0;
+        return decode_dict_at(encoded_value, idx, 0);
     }
 
 
@@ -304,7 +198,7 @@ namespace torrent {
             std::string str = value.get<std::string>();
             return std::to_string(str.size()) + ":" + str;
         }
-        else if (type == json::value_t::number_integer) {
+        else if (type == json::value_t::number_integer || type == json::value_t::number_unsigned) {
             return "i" + std::to_string(value.get<int64_t>()) + "e";
         }
         else if (type == json::value_t::array) {
@@ -0,0 +1,212 @@
+#include "torrent/block_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace torrent {
+
+    BlockCache::BlockCache(const TorrentMeta& meta, Storage& storage, std::size_t capacity_bytes)
+        : m_meta(meta), m_storage(storage),
+          m_capacity(std::max<std::size_t>(1, capacity_bytes / kBlockSize)) {}
+
+
+    // ----------------- ARC bookkeeping -----------------
+
+    std::list<BlockCache::Key>& BlockCache::list_for(Where w) {
+        switch (w) {
+            case Where::T1: return m_t1;
+            case Where::T2: return m_t2;
+            case Where::B1: return m_b1;
+            case Where::B2: return m_b2;
+        }
+        throw std::logic_error("BlockCache: bad list");
+    }
+
+    void BlockCache::move_to(Key key, Entry& e, Where w) {
+        list_for(e.where).erase(e.it);
+        std::list<Key>& dst = list_for(w);
+        dst.push_front(key);
+        e.where = w;
+        e.it = dst.begin();
+
+        // Ghost lists only remember the key
+        if (w == Where::B1 || w == Where::B2) {
+            e.data.reset();
+            e.prefetched = false;
+        }
+    }
+
+    void BlockCache::drop(Key key) {
+        auto it = m_entries.find(key);
+        if (it == m_entries.end()) return;
+        list_for(it->second.where).erase(it->second.it);
+        m_entries.erase(it);
+    }
+
+    // Evict one resident block into its ghost list (ARC "REPLACE").
+    void BlockCache::replace(bool hit_in_b2) {
+        if (m_t1.empty() && m_t2.empty()) return;
+
+        bool from_t1 = !m_t1.empty() &&
+            ((hit_in_b2 && m_t1.size() == m_p) || m_t1.size() > m_p);
+        if (!from_t1 && m_t2.empty()) from_t1 = true;
+
+        Key victim = from_t1 ? m_t1.back() : m_t2.back();
+        move_to(victim, m_entries.at(victim), from_t1 ? Where::B1 : Where::B2);
+        m_stats.evictions++;
+    }
+
+    void BlockCache::make_room_for_new() {
+        const std::size_t t1b1 = m_t1.size() + m_b1.size();
+        const std::size_t total = t1b1 + m_t2.size() + m_b2.size();
+
+        if (t1b1 >= m_capacity) {
+            if (m_t1.size() < m_capacity) {
+                drop(m_b1.back());
+                if (m_t1.size() + m_t2.size() >= m_capacity) replace(false);
+            }
+            else {
+                drop(m_t1.back());
+                m_stats.evictions++;
+            }
+        }
+        else if (total >= m_capacity) {
+            if (total >= 2 * m_capacity) drop(m_b2.back());
+            if (m_t1.size() + m_t2.size() >= m_capacity) replace(false);
+        }
+    }
+
+    void BlockCache::insert_new(Key key, Block data, bool prefetched) {
+        make_room_for_new();
+
+        m_t1.push_front(key);
+        Entry e;
+        e.where = Where::T1;
+        e.it = m_t1.begin();
+        e.data = std::move(data);
+        e.prefetched = prefetched;
+        m_entries[key] = std::move(e);
+    }
+
+
+    // ----------------- Disk -----------------
+
+    void BlockCache::load_piece(std::uint32_t piece, std::uint32_t wanted_block) {
+        if (piece >= m_meta.piece_hashes.size()) {
+            throw std::runtime_error("BlockCache: piece out of range");
+        }
+
+        const std::uint64_t full  = static_cast<std::uint64_t>(m_meta.piece_length);
+        const std::uint64_t start = full * piece;
+        const std::uint32_t piece_len = static_cast<std::uint32_t>(
+            std::min<std::uint64_t>(full, static_cast<std::uint64_t>(m_meta.length) - start)
+        );
+
+        const std::uint32_t num_blocks = (piece_len + kBlockSize - 1) / kBlockSize;
+        if (wanted_block >= num_blocks) {
+            throw std::runtime_error("BlockCache: block out of range");
+        }
+
+        std::vector<std::uint8_t> buf(piece_len);
+        m_storage.read_block(piece, 0, buf.data(), buf.size());
+        m_stats.disk_reads++;
+
+        // Insert read-ahead blocks first so the wanted one ends up most recent.
+        // Never let read-ahead push out more than the cache can hold.
+        std::size_t budget = m_capacity > 1 ? m_capacity - 1 : 0;
+        for (std::uint32_t b = 0; b < num_blocks && budget > 0; ++b) {
+            Key key = make_key(piece, b);
+            if (b == wanted_block || m_entries.count(key)) continue;
+
+            std::uint32_t off = b * kBlockSize;
+            std::uint32_t len = std::min(kBlockSize, piece_len - off);
+            insert_new(key, std::make_shared<std::vector<std::uint8_t>>(buf.begin() + off, buf.begin() + off + len), true);
+
+            budget--;
+            m_stats.read_ahead_blocks++;
+        }
+
+        std::uint32_t off = wanted_block * kBlockSize;
+        std::uint32_t len = std::min(kBlockSize, piece_len - off);
+        Block wanted = std::make_shared<std::vector<std::uint8_t>>(buf.begin() + off, buf.begin() + off + len);
+
+        Key key = make_key(piece, wanted_block);
+        auto it = m_entries.find(key);
+        if (it == m_entries.end()) {
+            insert_new(key, std::move(wanted), false);
+            return;
+        }
+
+        // Ghost hit: ARC cases II and III adapt the T1 target, then fetch into T2
+        Entry& e = it->second;
+        bool in_b2 = e.where == Where::B2;
+        if (in_b2) {
+            std::size_t delta = std::max<std::size_t>(1, m_b1.size() / std::max<std::size_t>(1, m_b2.size()));
+            m_p = m_p > delta ? m_p - delta : 0;
+        }
+        else {
+            std::size_t delta = std::max<std::size_t>(1, m_b2.size() / std::max<std::size_t>(1, m_b1.size()));
+            m_p = std::min(m_capacity, m_p + delta);
+        }
+
+        if (m_t1.size() + m_t2.size() >= m_capacity) replace(in_b2);
+        move_to(key, e, Where::T2);
+        e.data = std::move(wanted);
+    }
+
+
+    // ----------------- Public API -----------------
+
+    BlockCache::Block BlockCache::get_block(std::uint32_t piece, std::uint32_t block_index) {
+        Key key = make_key(piece, block_index);
+
+        auto it = m_entries.find(key);
+        if (it != m_entries.end() && it->second.data) {
+            Entry& e = it->second;
+            m_stats.hits++;
+
+            if (e.prefetched) {
+                // First real use of a read-ahead block: it is "recent", not "frequent"
+                e.prefetched = false;
+                move_to(key, e, Where::T1);
+            }
+            else {
+                move_to(key, e, Where::T2);
+            }
+            return e.data;
+        }
+
+        m_stats.misses++;
+        load_piece(piece, block_index);
+        return m_entries.at(key).data;
+    }
+
+    void BlockCache::read(std::uint32_t piece, std::uint32_t begin, std::uint8_t* out, std::size_t len) {
+        while (len > 0) {
+            std::uint32_t block = begin / kBlockSize;
+            std::uint32_t off   = begin % kBlockSize;
+
+            Block data = get_block(piece, block);
+            if (off >= data->size()) {
+                throw std::runtime_error("BlockCache: read past end of piece");
+            }
+
+            std::size_t n = std::min<std::size_t>(len, data->size() - off);
+            std::memcpy(out, data->data() + off, n);
+
+            out   += n;
+            begin += static_cast<std::uint32_t>(n);
+            len   -= n;
+        }
+    }
+
+    void BlockCache::invalidate_piece(std::uint32_t piece) {
+        const std::uint64_t blocks_per_piece =
+            (static_cast<std::uint64_t>(m_meta.piece_length) + kBlockSize - 1) / kBlockSize;
+        for (std::uint64_t b = 0; b < blocks_per_piece; ++b) {
+            drop(make_key(piece, static_cast<std::uint32_t>(b)));
+        }
+    }
+
+}
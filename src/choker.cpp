@@ -0,0 +1,77 @@
+#include "torrent/choker.hpp"
+
+#include <algorithm>
+
+namespace torrent {
+
+    Choker::Choker() : Choker(Config{}) {}
+
+    Choker::Choker(Config config) : m_config(config), m_rng(std::random_device{}()) {}
+
+    Choker::Decision Choker::run(const std::vector<Candidate>& peers, bool seeding, Clock::time_point now) {
+        Decision out;
+        if (m_config.upload_slots == 0) return out;
+
+        // 1) Regular slots: fastest interested, non-snubbed peers
+        std::vector<const Candidate*> ranked;
+        for (const Candidate& p : peers) {
+            if (p.interested && !p.snubbed) ranked.push_back(&p);
+        }
+        std::sort(ranked.begin(), ranked.end(), [seeding](const Candidate* a, const Candidate* b) {
+            return seeding ? a->upload_rate > b->upload_rate : a->download_rate > b->download_rate;
+        });
+
+        const std::size_t regular = m_config.upload_slots - 1;
+        for (std::size_t i = 0; i < ranked.size() && i < regular; ++i) {
+            out.unchoke.push_back(ranked[i]->id);
+        }
+
+        // 2) Optimistic slot: keep the current one until it is time to rotate,
+        //    unless it went away or already earned a regular slot
+        auto in_regular = [&out](int id) {
+            return std::find(out.unchoke.begin(), out.unchoke.end(), id) != out.unchoke.end();
+        };
+        auto still_eligible = [&](int id) {
+            for (const Candidate& p : peers) {
+                if (p.id == id) return p.interested && !in_regular(id);
+            }
+            return false;
+        };
+
+        bool rotate = m_optimistic < 0 ||
+                      now - m_last_rotation >= m_config.optimistic_interval ||
+                      !still_eligible(m_optimistic);
+
+        if (rotate) {
+            std::vector<int> pool;
+            for (const Candidate& p : peers) {
+                if (p.interested && !in_regular(p.id) && p.id != m_optimistic) pool.push_back(p.id);
+            }
+            if (pool.empty() && still_eligible(m_optimistic)) {
+                pool.push_back(m_optimistic); // nobody else to rotate to
+            }
+
+            m_optimistic = -1;
+            if (!pool.empty()) {
+                std::uniform_int_distribution<std::size_t> pick(0, pool.size() - 1);
+                m_optimistic = pool[pick(m_rng)];
+            }
+            m_last_rotation = now;
+        }
+
+        if (m_optimistic >= 0) {
+            out.unchoke.push_back(m_optimistic);
+            out.optimistic = m_optimistic;
+        }
+
+        // 3) Unused slots (few interested peers): hand them to snubbed peers
+        //    rather than leave upload capacity idle
+        for (const Candidate& p : peers) {
+            if (out.unchoke.size() >= m_config.upload_slots) break;
+            if (p.interested && !in_regular(p.id)) out.unchoke.push_back(p.id);
+        }
+
+        return out;
+    }
+
+}
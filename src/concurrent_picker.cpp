@@ -0,0 +1,252 @@
+#include "torrent/concurrent_picker.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+namespace torrent {
+
+    static constexpr std::uint32_t kBlocksPerLine = 8 * 64;
+
+    static std::uint32_t blocks_of(long long bytes) {
+        return static_cast<std::uint32_t>((bytes + ConcurrentPicker::kBlockSize - 1) / ConcurrentPicker::kBlockSize);
+    }
+
+    static std::uint32_t last_piece_blocks(const TorrentMeta& meta) {
+        const long long n = static_cast<long long>(meta.piece_hashes.size());
+        return n == 0 ? 0 : blocks_of(meta.length - (n - 1) * meta.piece_length);
+    }
+
+    ConcurrentPicker::ConcurrentPicker(const TorrentMeta& meta)
+        : ConcurrentPicker(static_cast<std::uint32_t>(meta.piece_hashes.size()), blocks_of(meta.piece_length),
+                           last_piece_blocks(meta)) {}
+
+    ConcurrentPicker::ConcurrentPicker(std::uint32_t num_pieces, std::uint32_t blocks_per_piece,
+                                       std::uint32_t blocks_in_last_piece)
+        : m_num_pieces(num_pieces),
+          m_blocks_per_piece(blocks_per_piece),
+          m_blocks_in_last_piece(blocks_in_last_piece),
+          m_lines_per_piece((blocks_per_piece + kBlocksPerLine - 1) / kBlocksPerLine) {
+        if (num_pieces == 0 || blocks_per_piece == 0 || blocks_in_last_piece == 0 ||
+            blocks_in_last_piece > blocks_per_piece) {
+            throw std::runtime_error("ConcurrentPicker: bad piece or block count");
+        }
+
+        // Value-initialized, so every bit starts cleared
+        const std::size_t lines = static_cast<std::size_t>(num_pieces) * m_lines_per_piece;
+        m_pieces.reset(new Piece[num_pieces]);
+        m_requested.reset(new Line[lines]());
+        m_received.reset(new Line[lines]());
+        m_have.reset(new std::atomic<std::uint64_t>[(num_pieces + 63) / 64]());
+    }
+
+    std::atomic<std::uint64_t>* ConcurrentPicker::requested_words(std::uint32_t piece) const {
+        return m_requested[static_cast<std::size_t>(piece) * m_lines_per_piece].words;
+    }
+
+    std::atomic<std::uint64_t>* ConcurrentPicker::received_words(std::uint32_t piece) const {
+        return m_received[static_cast<std::size_t>(piece) * m_lines_per_piece].words;
+    }
+
+    std::uint32_t ConcurrentPicker::blocks_in_piece(std::uint32_t piece) const {
+        return piece + 1 == m_num_pieces ? m_blocks_in_last_piece : m_blocks_per_piece;
+    }
+
+
+    // ----------------- Priorities and availability -----------------
+
+    void ConcurrentPicker::set_piece_priority(std::uint32_t piece, std::uint8_t prio) {
+        m_pieces[piece].priority.store(prio, std::memory_order_relaxed);
+    }
+
+    std::uint8_t ConcurrentPicker::piece_priority(std::uint32_t piece) const {
+        return m_pieces[piece].priority.load(std::memory_order_relaxed);
+    }
+
+    void ConcurrentPicker::add_peer_pieces(const std::vector<bool>& peer_has) {
+        for (std::uint32_t i = 0; i < m_num_pieces && i < peer_has.size(); ++i) {
+            if (peer_has[i]) m_pieces[i].availability.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void ConcurrentPicker::remove_peer_pieces(const std::vector<bool>& peer_has) {
+        for (std::uint32_t i = 0; i < m_num_pieces && i < peer_has.size(); ++i) {
+            if (!peer_has[i]) continue;
+            std::atomic<std::uint32_t>& avail = m_pieces[i].availability;
+            std::uint32_t old = avail.load(std::memory_order_relaxed);
+            while (old > 0 && !avail.compare_exchange_weak(old, old - 1, std::memory_order_relaxed)) {}
+        }
+    }
+
+    void ConcurrentPicker::inc_availability(std::uint32_t piece) {
+        m_pieces[piece].availability.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::uint32_t ConcurrentPicker::availability(std::uint32_t piece) const {
+        return m_pieces[piece].availability.load(std::memory_order_relaxed);
+    }
+
+
+    // ----------------- Claiming blocks -----------------
+
+    bool ConcurrentPicker::pickable(std::uint32_t piece, const std::vector<bool>& peer_has) const {
+        const Piece& p = m_pieces[piece];
+        if (p.priority.load(std::memory_order_relaxed) == 0) return false;
+        if (p.requested.load(std::memory_order_relaxed) >= blocks_in_piece(piece)) return false;
+        if (!peer_has.empty() && (piece >= peer_has.size() || !peer_has[piece])) return false;
+        return !have(piece);
+    }
+
+    // Sets the bits of up to `max` free blocks, a word at a time: one CAS
+    // takes every block it can from a word, and is retried only if another
+    // thread changed the word in between.
+    std::size_t ConcurrentPicker::claim_from(std::uint32_t piece, std::size_t max, Block* out) {
+        const std::uint32_t blocks = blocks_in_piece(piece);
+        std::atomic<std::uint64_t>* words = requested_words(piece);
+        std::size_t n = 0;
+        std::uint64_t retries = 0;
+
+        for (std::uint32_t w = 0; w * 64 < blocks && n < max; ++w) {
+            const std::uint32_t bits = std::min<std::uint32_t>(64, blocks - w * 64);
+            const std::uint64_t valid = bits == 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << bits) - 1;
+
+            std::uint64_t old = words[w].load(std::memory_order_relaxed);
+            while (true) {
+                std::uint64_t free = ~old & valid;
+                if (free == 0) break;
+
+                std::uint64_t take = 0;
+                std::size_t k = 0;
+                for (; free != 0 && n + k < max; ++k) {
+                    const std::uint64_t lowest = free & (~free + 1);
+                    take |= lowest;
+                    free ^= lowest;
+                }
+                if (words[w].compare_exchange_weak(old, old | take, std::memory_order_acq_rel,
+                                                   std::memory_order_relaxed)) {
+                    m_pieces[piece].requested.fetch_add(static_cast<std::uint32_t>(k), std::memory_order_relaxed);
+                    for (; take != 0; take &= take - 1) {
+                        out[n++] = Block{piece, w * 64 + static_cast<std::uint32_t>(__builtin_ctzll(take))};
+                    }
+                    break;
+                }
+                retries++;
+            }
+        }
+
+        if (retries) m_cas_retries.fetch_add(retries, std::memory_order_relaxed);
+        return n;
+    }
+
+    std::size_t ConcurrentPicker::claim_blocks(const std::vector<bool>& peer_has, std::int64_t& current,
+                                               std::size_t max, Block* out) {
+        if (max == 0) return 0;
+        if (current >= 0 && current < m_num_pieces) {
+            const std::uint32_t piece = static_cast<std::uint32_t>(current);
+            if (pickable(piece, peer_has)) {
+                const std::size_t n = claim_from(piece, max, out);
+                if (n > 0) return n;
+            }
+        }
+
+        // Each thread scans from its own random place, so equally good
+        // pieces are shared out instead of everyone taking the first one
+        thread_local std::minstd_rand rng(
+            static_cast<std::uint32_t>(std::hash<std::thread::id>{}(std::this_thread::get_id())));
+
+        // The piece picked can be emptied by others before we get to it
+        for (int attempt = 0; attempt < 4; ++attempt) {
+            const std::uint32_t start = static_cast<std::uint32_t>(rng() % m_num_pieces);
+            std::int64_t best = -1;
+            std::uint8_t best_prio = 0;
+            std::uint32_t best_avail = 0;
+            for (std::uint32_t k = 0; k < m_num_pieces; ++k) {
+                std::uint32_t piece = start + k;
+                if (piece >= m_num_pieces) piece -= m_num_pieces;
+                if (!pickable(piece, peer_has)) continue;
+
+                const std::uint8_t prio = piece_priority(piece);
+                const std::uint32_t avail = availability(piece);
+                if (best < 0 || prio > best_prio || (prio == best_prio && avail < best_avail)) {
+                    best = piece;
+                    best_prio = prio;
+                    best_avail = avail;
+                }
+            }
+            if (best < 0) break;
+
+            const std::size_t n = claim_from(static_cast<std::uint32_t>(best), max, out);
+            if (n > 0) {
+                current = best;
+                return n;
+            }
+        }
+
+        current = -1;
+        return 0;
+    }
+
+    bool ConcurrentPicker::claim_block(std::uint32_t piece, std::uint32_t block) {
+        const std::uint64_t bit = std::uint64_t{1} << (block % 64);
+        const std::uint64_t old = requested_words(piece)[block / 64].fetch_or(bit, std::memory_order_acq_rel);
+        if (old & bit) return false;
+        m_pieces[piece].requested.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void ConcurrentPicker::release_block(std::uint32_t piece, std::uint32_t block) {
+        // Received blocks stay claimed
+        if (is_received(piece, block)) return;
+
+        const std::uint64_t bit = std::uint64_t{1} << (block % 64);
+        const std::uint64_t old = requested_words(piece)[block / 64].fetch_and(~bit, std::memory_order_acq_rel);
+        if (old & bit) m_pieces[piece].requested.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+
+    // ----------------- Completion -----------------
+
+    bool ConcurrentPicker::mark_received(std::uint32_t piece, std::uint32_t block) {
+        const std::uint64_t bit = std::uint64_t{1} << (block % 64);
+        const std::uint64_t old = received_words(piece)[block / 64].fetch_or(bit, std::memory_order_acq_rel);
+        if (old & bit) return false;
+        return m_pieces[piece].received.fetch_add(1, std::memory_order_acq_rel) + 1 == blocks_in_piece(piece);
+    }
+
+    void ConcurrentPicker::mark_have(std::uint32_t piece) {
+        const std::uint64_t bit = std::uint64_t{1} << (piece % 64);
+        const std::uint64_t old = m_have[piece / 64].fetch_or(bit, std::memory_order_acq_rel);
+        if (!(old & bit)) m_num_have.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void ConcurrentPicker::piece_failed(std::uint32_t piece) {
+        // Received first: a block is only free again once it isn't received.
+        // The counters drop by the bits actually cleared, so they stay right
+        // if another thread claims a block in the meantime.
+        Piece& p = m_pieces[piece];
+        const std::uint32_t words = (blocks_in_piece(piece) + 63) / 64;
+        for (std::uint32_t w = 0; w < words; ++w) {
+            const std::uint64_t old = received_words(piece)[w].exchange(0, std::memory_order_acq_rel);
+            p.received.fetch_sub(static_cast<std::uint32_t>(__builtin_popcountll(old)), std::memory_order_acq_rel);
+        }
+        for (std::uint32_t w = 0; w < words; ++w) {
+            const std::uint64_t old = requested_words(piece)[w].exchange(0, std::memory_order_acq_rel);
+            p.requested.fetch_sub(static_cast<std::uint32_t>(__builtin_popcountll(old)), std::memory_order_relaxed);
+        }
+    }
+
+    bool ConcurrentPicker::have(std::uint32_t piece) const {
+        return m_have[piece / 64].load(std::memory_order_acquire) & (std::uint64_t{1} << (piece % 64));
+    }
+
+    bool ConcurrentPicker::is_requested(std::uint32_t piece, std::uint32_t block) const {
+        return requested_words(piece)[block / 64].load(std::memory_order_acquire) & (std::uint64_t{1} << (block % 64));
+    }
+
+    bool ConcurrentPicker::is_received(std::uint32_t piece, std::uint32_t block) const {
+        return received_words(piece)[block / 64].load(std::memory_order_acquire) & (std::uint64_t{1} << (block % 64));
+    }
+
+}
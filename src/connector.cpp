@@ -0,0 +1,310 @@
+#include "torrent/connector.hpp"
+#include "torrent/utp.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    // Head start each address of a peer gets before the next one is tried
+    // (RFC 8305 "Connection Attempt Delay").
+    static constexpr std::chrono::milliseconds kAttemptDelay{250};
+
+    Connector::Connector(EventLoop& loop): m_loop(loop) {}
+
+    Connector::~Connector() {
+        for (auto& kv : m_attempts) {
+            m_loop.cancel_timer(kv.second.timeout);
+            m_loop.remove_fd(kv.first);
+            ::close(kv.first);
+        }
+        for (auto& kv : m_candidates) {
+            if (kv.second.stagger) m_loop.cancel_timer(kv.second.stagger);
+        }
+    }
+
+    void Connector::set_half_open_limit(std::size_t n) {
+        m_half_open_limit = std::max<std::size_t>(n, 1);
+        start_queued();
+    }
+
+    void Connector::add(std::vector<Endpoint> addresses) {
+        // Interleave the families, IPv6 first: v6, v4, v6, v4, ...
+        std::vector<Endpoint> v6;
+        std::vector<Endpoint> v4;
+        for (const Endpoint& ep : addresses) {
+            if (!m_known.insert(ep).second) continue; // already queued or connecting
+            (ep.is_v4() ? v4 : v6).push_back(ep);
+        }
+        if (v6.empty() && v4.empty()) return;
+
+        Candidate cand;
+        for (std::size_t i = 0; i < std::max(v6.size(), v4.size()); ++i) {
+            if (i < v6.size()) cand.addresses.push_back(v6[i]);
+            if (i < v4.size()) cand.addresses.push_back(v4[i]);
+        }
+
+        const std::uint64_t id = m_next_id++;
+        (cand.addresses.front().is_v4() ? m_queue_v4 : m_queue_v6).push_back(id);
+        m_candidates.emplace(id, std::move(cand));
+
+        start_queued();
+    }
+
+    bool Connector::can_start() const {
+        if (m_attempts.size() >= m_half_open_limit) return false;
+        return !m_want_more || m_want_more();
+    }
+
+    void Connector::start_queued() {
+        while (!m_queue_v6.empty() || !m_queue_v4.empty()) {
+            if (!can_start()) return;
+
+            bool take_v6 = m_queue_v4.empty() || (m_v6_turn && !m_queue_v6.empty());
+            std::deque<std::uint64_t>& queue = take_v6 ? m_queue_v6 : m_queue_v4;
+            m_v6_turn = !take_v6;
+
+            start_next(pop_best(queue));
+        }
+    }
+
+    double Connector::rank(std::uint64_t id) const {
+        if (!m_rank) return 0;
+        return m_rank(m_candidates.at(id).addresses.front());
+    }
+
+    // Linear scan: queues are at most a few hundred peers and this runs
+    // once per connection slot.
+    std::uint64_t Connector::pop_best(std::deque<std::uint64_t>& queue) {
+        auto best = queue.begin();
+        if (m_rank) {
+            double best_rank = rank(*best);
+            for (auto it = std::next(queue.begin()); it != queue.end(); ++it) {
+                double r = rank(*it);
+                if (r > best_rank) {
+                    best = it;
+                    best_rank = r;
+                }
+            }
+        }
+
+        const std::uint64_t id = *best;
+        queue.erase(best);
+        return id;
+    }
+
+    double Connector::best_queued_rank() const {
+        double best = -std::numeric_limits<double>::infinity();
+        for (const auto* queue : {&m_queue_v6, &m_queue_v4}) {
+            for (std::uint64_t id : *queue) best = std::max(best, rank(id));
+        }
+        return best;
+    }
+
+
+    // ----------------- Attempts -----------------
+
+    bool Connector::has_more(const Candidate& cand) {
+        return cand.next < cand.addresses.size() || !cand.tcp_retry.empty();
+    }
+
+    // Start the candidate's next address that gets past connect(). Ends the
+    // candidate if it runs out of addresses with nothing in flight.
+    void Connector::start_next(std::uint64_t id) {
+        auto it = m_candidates.find(id);
+        if (it == m_candidates.end()) return;
+        Candidate& cand = it->second;
+
+        while (has_more(cand)) {
+            Endpoint remote;
+            bool over_utp = false;
+            if (cand.next < cand.addresses.size()) {
+                remote = cand.addresses[cand.next++];
+                over_utp = m_utp && remote.is_v4();
+            }
+            else {
+                remote = cand.tcp_retry.front();
+                cand.tcp_retry.erase(cand.tcp_retry.begin());
+            }
+
+            if (over_utp) {
+                int fd = m_utp->connect(remote, [this](int fd, const std::string& error) { on_utp_result(fd, error); });
+                if (fd >= 0) {
+                    track(fd, remote, id, true);
+                    return;
+                }
+                // No socketpair to be had: straight to TCP
+            }
+
+            sockaddr_storage ss{};
+            socklen_t len = remote.to_sockaddr(ss);
+
+            int fd = ::socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) continue;
+
+            if (::connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0 && errno != EINPROGRESS) {
+                const std::string reason = std::strerror(errno);
+                std::cerr << "[peer] " << remote.to_string() << " connect: " << reason << "\n";
+                ::close(fd);
+                if (m_on_failed) m_on_failed(remote, reason);
+                continue;
+            }
+
+            // Level-triggered EPOLLOUT fires once the connect has finished either way
+            m_loop.add_fd(fd, EPOLLOUT, [this, fd](std::uint32_t events) { on_event(fd, events); });
+            track(fd, remote, id, false);
+            return;
+        }
+
+        if (cand.attempts.empty()) finish_candidate(id);
+    }
+
+    // Register a connect in progress, and give the next address its start time.
+    void Connector::track(int fd, const Endpoint& remote, std::uint64_t id, bool utp) {
+        Attempt attempt;
+        attempt.remote    = remote;
+        attempt.candidate = id;
+        attempt.started   = m_loop.now();
+        attempt.utp       = utp;
+        attempt.timeout   = m_loop.add_timer(m_connect_timeout, [this, fd] {
+            auto at = m_attempts.find(fd);
+            if (at == m_attempts.end()) return;
+            at->second.timeout = 0; // one-shot timer is gone already
+            fail_attempt(fd, "timed out");
+        }, false);
+        m_attempts.emplace(fd, attempt);
+
+        Candidate& cand = m_candidates.at(id);
+        cand.attempts.push_back(fd);
+        if (has_more(cand)) {
+            cand.stagger = m_loop.add_timer(kAttemptDelay, [this, id] { on_stagger(id); }, false);
+        }
+    }
+
+    void Connector::on_stagger(std::uint64_t id) {
+        auto it = m_candidates.find(id);
+        if (it == m_candidates.end()) return;
+        it->second.stagger = 0;
+
+        // Racing still counts against the half-open limit; retry later if full
+        if (m_attempts.size() >= m_half_open_limit) {
+            it->second.stagger = m_loop.add_timer(kAttemptDelay, [this, id] { on_stagger(id); }, false);
+            return;
+        }
+        start_next(id);
+    }
+
+    void Connector::on_event(int fd, std::uint32_t events) {
+        auto it = m_attempts.find(fd);
+        if (it == m_attempts.end()) return;
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == 0 && (events & (EPOLLERR | EPOLLHUP))) err = ECONNREFUSED;
+        if (err != 0) {
+            fail_attempt(fd, std::strerror(err));
+            return;
+        }
+        connected(fd);
+    }
+
+    void Connector::on_utp_result(int fd, const std::string& error) {
+        if (!m_attempts.count(fd)) return;
+        if (error.empty()) connected(fd);
+        else fail_attempt(fd, "uTP " + error);
+    }
+
+    void Connector::connected(int fd) {
+        auto it = m_attempts.find(fd);
+        const Endpoint remote = it->second.remote;
+        const std::uint64_t id = it->second.candidate;
+        const auto connect_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+            EventLoop::Clock::now() - it->second.started
+        );
+        end_attempt(fd);
+
+        // First address to connect wins; abandon the others
+        const std::vector<int> losers = m_candidates.at(id).attempts;
+        for (int other : losers) {
+            end_attempt(other);
+            ::close(other);
+        }
+        finish_candidate(id);
+
+        if (m_on_connected) {
+            m_on_connected(fd, remote, connect_time);
+        }
+        else {
+            ::close(fd);
+        }
+        start_queued();
+    }
+
+    void Connector::fail_attempt(int fd, const std::string& reason) {
+        auto it = m_attempts.find(fd);
+        if (it == m_attempts.end()) return;
+
+        const Endpoint remote = it->second.remote;
+        const std::uint64_t id = it->second.candidate;
+        std::cerr << "[peer] " << remote.to_string() << " connect: " << reason << "\n";
+
+        const bool utp = it->second.utp;
+        end_attempt(fd);
+        ::close(fd);
+
+        // Don't wait out the stagger delay: try the next address right away
+        Candidate& cand = m_candidates.at(id);
+        if (utp) {
+            cand.tcp_retry.push_back(remote); // not a failure yet: TCP may do
+        }
+        else if (m_on_failed) {
+            m_on_failed(remote, reason);
+        }
+        if (cand.stagger) {
+            m_loop.cancel_timer(cand.stagger);
+            cand.stagger = 0;
+        }
+        if (has_more(cand)) {
+            start_next(id);
+        }
+        else if (cand.attempts.empty()) {
+            finish_candidate(id);
+        }
+        start_queued();
+    }
+
+    // Forget `fd` as an attempt: its timer, its watcher and its slot in the
+    // candidate. Closing the socket is left to the caller (for a uTP stream
+    // that also abandons the connect).
+    void Connector::end_attempt(int fd) {
+        auto it = m_attempts.find(fd);
+        if (it == m_attempts.end()) return;
+
+        if (it->second.timeout) m_loop.cancel_timer(it->second.timeout);
+
+        Candidate& cand = m_candidates.at(it->second.candidate);
+        cand.attempts.erase(std::remove(cand.attempts.begin(), cand.attempts.end(), fd), cand.attempts.end());
+
+        m_attempts.erase(it);
+        m_loop.remove_fd(fd);
+    }
+
+    void Connector::finish_candidate(std::uint64_t id) {
+        auto it = m_candidates.find(id);
+        if (it == m_candidates.end()) return;
+
+        if (it->second.stagger) m_loop.cancel_timer(it->second.stagger);
+        for (const Endpoint& ep : it->second.addresses) {
+            m_known.erase(ep);
+        }
+        m_candidates.erase(it);
+    }
+
+}
@@ -0,0 +1,417 @@
+#include "torrent/daemon.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "torrent/endpoint.hpp"
+#include "torrent/torrent_meta.hpp"
+
+namespace torrent {
+
+    // A request that hasn't ended within this many bytes is dropped with its client.
+    static constexpr std::size_t kMaxRequest = 1024 * 1024;
+    // Replies and events a client hasn't read yet; past this it is too slow.
+    static constexpr std::size_t kMaxQueued = 4 * 1024 * 1024;
+    // Status update intervals a client may subscribe to.
+    static constexpr std::uint64_t kMinIntervalMs = 100;
+    static constexpr std::uint64_t kMaxIntervalMs = 60 * 60 * 1000;
+
+    static const char kHexDigits[] = "0123456789abcdef";
+
+    static std::string to_hex(const Session::InfoHash& h) {
+        std::string out;
+        for (std::uint8_t b : h) {
+            out += kHexDigits[b >> 4];
+            out += kHexDigits[b & 0x0F];
+        }
+        return out;
+    }
+
+    static Session::InfoHash parse_info_hash(const json& request) {
+        if (!request.contains("info_hash") || !request["info_hash"].is_string()) {
+            throw std::runtime_error("missing info_hash");
+        }
+        const std::string text = request["info_hash"].get<std::string>();
+        Session::InfoHash h{};
+        if (text.size() != 40) throw std::runtime_error("info_hash must be 40 hex digits");
+        for (std::size_t i = 0; i < 20; ++i) {
+            const std::string byte = text.substr(2 * i, 2);
+            if (!std::isxdigit(static_cast<unsigned char>(byte[0])) ||
+                !std::isxdigit(static_cast<unsigned char>(byte[1]))) {
+                throw std::runtime_error("info_hash must be 40 hex digits");
+            }
+            h[i] = static_cast<std::uint8_t>(std::stoul(byte, nullptr, 16));
+        }
+        return h;
+    }
+
+    static std::string get_string(const json& request, const char* key) {
+        if (!request.contains(key) || !request[key].is_string()) {
+            throw std::runtime_error(std::string("missing ") + key);
+        }
+        return request[key].get<std::string>();
+    }
+
+    static std::uint64_t get_uint(const json& request, const char* key, std::uint64_t fallback) {
+        if (!request.contains(key)) return fallback;
+        const json& v = request[key];
+        if (!v.is_number_integer() || v.get<std::int64_t>() < 0) {
+            throw std::runtime_error(std::string(key) + " must be a non-negative integer");
+        }
+        return v.get<std::uint64_t>();
+    }
+
+    std::size_t bencoded_length(const std::string& data) {
+        std::size_t i = 0;
+        std::size_t depth = 0; // open lists and dicts
+        while (i < data.size()) {
+            const char c = data[i];
+            if (c == 'l' || c == 'd') {
+                depth++;
+                i++;
+                continue;
+            }
+            if (c == 'e') {
+                if (depth == 0) throw std::runtime_error("bencode: unexpected 'e'");
+                depth--;
+                i++;
+            }
+            else if (c == 'i') {
+                std::size_t end = data.find('e', i + 1);
+                if (end == std::string::npos) return 0;
+                i = end + 1;
+            }
+            else if (std::isdigit(static_cast<unsigned char>(c))) {
+                std::size_t colon = i;
+                while (colon < data.size() && std::isdigit(static_cast<unsigned char>(data[colon]))) colon++;
+                if (colon - i > 9) throw std::runtime_error("bencode: string too long");
+                if (colon == data.size()) return 0;
+                if (data[colon] != ':') throw std::runtime_error("bencode: expected ':'");
+                const std::size_t len = std::stoul(data.substr(i, colon - i));
+                if (data.size() - colon - 1 < len) return 0;
+                i = colon + 1 + len;
+            }
+            else {
+                throw std::runtime_error("bencode: unexpected character");
+            }
+            if (depth == 0) return i;
+        }
+        return 0;
+    }
+
+    Daemon::Daemon(EventLoop& loop, Session& session, const std::string& socket_path)
+        : m_loop(loop), m_session(session), m_path(socket_path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (m_path.empty() || m_path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Bad control socket path: " + m_path);
+        }
+        std::memcpy(addr.sun_path, m_path.c_str(), m_path.size() + 1);
+
+        m_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+
+        // Only a socket may be replaced, never some other file
+        struct stat st{};
+        if (::lstat(m_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) ::unlink(m_path.c_str());
+
+        // Our user only
+        const mode_t old_mask = ::umask(0077);
+        const int rc = ::bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        ::umask(old_mask);
+        if (rc != 0 || ::listen(m_fd, 16) != 0) {
+            std::string err = std::strerror(errno);
+            ::close(m_fd);
+            throw std::runtime_error("Failed to listen on " + m_path + ": " + err);
+        }
+
+        m_loop.add_fd(m_fd, EPOLLIN, [this](std::uint32_t) { on_accept(); });
+        m_session.set_on_finished([this](const Session::InfoHash& h) {
+            json event = {{"event", "finished"}, {"info_hash", to_hex(h)}};
+            std::vector<int> fds;
+            for (const auto& kv : m_clients) {
+                if (kv.second->status_timer) fds.push_back(kv.first);
+            }
+            for (int fd : fds) {
+                auto it = m_clients.find(fd);
+                if (it != m_clients.end()) send(*it->second, event);
+            }
+        });
+    }
+
+    Daemon::~Daemon() {
+        m_session.set_on_finished(nullptr);
+        std::vector<int> fds;
+        for (const auto& kv : m_clients) fds.push_back(kv.first);
+        for (int fd : fds) close_client(fd);
+        m_loop.remove_fd(m_fd);
+        ::close(m_fd);
+        ::unlink(m_path.c_str());
+    }
+
+
+    // ----------------- Clients -----------------
+
+    void Daemon::on_accept() {
+        while (true) {
+            int fd = ::accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            auto c = std::make_unique<Client>();
+            c->fd = fd;
+            c->events = EPOLLIN;
+            m_clients[fd] = std::move(c);
+            m_loop.add_fd(fd, EPOLLIN, [this, fd](std::uint32_t events) { on_client_event(fd, events); });
+        }
+    }
+
+    void Daemon::on_client_event(int fd, std::uint32_t events) {
+        auto it = m_clients.find(fd);
+        if (it == m_clients.end()) return;
+        Client& c = *it->second;
+
+        if (events & EPOLLOUT) {
+            flush(c);
+            if (m_clients.find(fd) == m_clients.end()) return;
+        }
+        if (c.eof) {
+            if (events & (EPOLLHUP | EPOLLERR)) close_client(fd);
+            return;
+        }
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+
+        char buf[16 * 1024];
+        while (true) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.append(buf, static_cast<std::size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n < 0) {
+                close_client(fd);
+                return;
+            }
+            // Done sending (e.g. `nc -U`): still answer what it sent
+            c.eof = true;
+            break;
+        }
+
+        // Every complete request in the buffer, in order
+        while (true) {
+            const std::size_t start = c.in.find_first_not_of(" \t\r\n");
+            if (start == std::string::npos) {
+                c.in.clear();
+                break;
+            }
+            if (start > 0) c.in.erase(0, start);
+
+            json request;
+            std::size_t used = 0;
+            c.bencoded = c.in[0] == 'd';
+            try {
+                if (c.bencoded) {
+                    used = bencoded_length(c.in);
+                    if (used == 0) break;
+                    request = decode_bencoded_value(c.in.substr(0, used));
+                }
+                else {
+                    const std::size_t eol = c.in.find('\n');
+                    if (eol == std::string::npos) break;
+                    used = eol + 1;
+                    request = json::parse(c.in.substr(0, eol));
+                }
+            }
+            catch (const std::exception& ex) {
+                // Can't tell where the next request starts; give up on this client
+                send(c, {{"error", std::string("bad request: ") + ex.what()}});
+                close_client(fd);
+                return;
+            }
+            c.in.erase(0, used);
+
+            on_request(c, request);
+            if (m_clients.find(fd) == m_clients.end()) return;
+        }
+
+        if (c.in.size() > kMaxRequest) {
+            send(c, {{"error", "request too large"}});
+            close_client(fd);
+            return;
+        }
+        if (c.eof) flush(c); // closes it once there is nothing more to send
+    }
+
+    void Daemon::on_request(Client& c, const json& request) {
+        json reply;
+        try {
+            if (!request.is_object()) throw std::runtime_error("request must be a dictionary");
+            reply = handle(c, request);
+            reply["ok"] = 1;
+        }
+        catch (const std::exception& ex) {
+            reply = {{"error", ex.what()}};
+        }
+        if (request.is_object() && request.contains("id")) reply["id"] = request["id"];
+
+        const bool shutdown = reply.contains("ok") && request.value("cmd", "") == "shutdown";
+        send(c, reply);
+        if (shutdown && m_on_shutdown) m_on_shutdown();
+    }
+
+    json Daemon::handle(Client& c, const json& request) {
+        const std::string cmd = get_string(request, "cmd");
+
+        if (cmd == "add") {
+            TorrentMeta meta = parse_torrent_file(get_string(request, "torrent"));
+            const Session::InfoHash& h = meta.info_hash_raw;
+            const bool existing = m_session.contains(h);
+            if (!existing) {
+                m_session.add_torrent(meta, get_string(request, "save_path"));
+                std::cerr << "[*] Added " << meta.name << "\n";
+            }
+            else {
+                m_session.resume(h);
+            }
+            if (request.contains("peers") && request["peers"].is_array()) {
+                for (const json& p : request["peers"]) {
+                    if (!p.is_string()) continue;
+                    for (const Endpoint& ep : Endpoint::resolve_all(p.get<std::string>())) m_session.add_peer(h, ep);
+                }
+            }
+            return {{"info_hash", to_hex(h)}, {"existing", existing ? 1 : 0}};
+        }
+        if (cmd == "remove" || cmd == "pause" || cmd == "resume") {
+            const Session::InfoHash h = parse_info_hash(request);
+            if (!m_session.contains(h)) throw std::runtime_error("no such torrent");
+            if (cmd == "remove") m_session.remove_torrent(h);
+            else if (cmd == "pause") m_session.pause(h);
+            else m_session.resume(h);
+            return json::object();
+        }
+        if (cmd == "status") {
+            if (!request.contains("info_hash")) return status_of(nullptr);
+            const Session::InfoHash h = parse_info_hash(request);
+            if (!m_session.contains(h)) throw std::runtime_error("no such torrent");
+            return status_of(&h);
+        }
+        if (cmd == "limits") {
+            const Session::Config& now = m_session.config();
+            m_session.set_limits(get_uint(request, "upload", now.upload_limit),
+                                 get_uint(request, "download", now.download_limit));
+            if (request.contains("max_connections")) {
+                m_session.set_max_connections(get_uint(request, "max_connections", 0));
+            }
+            return json::object();
+        }
+        if (cmd == "subscribe") {
+            const std::uint64_t interval = get_uint(request, "interval_ms", 1000);
+            if (interval > kMaxIntervalMs) throw std::runtime_error("interval_ms is above one hour");
+            if (c.status_timer) m_loop.cancel_timer(c.status_timer);
+            c.status_timer = 0;
+            if (interval > 0) {
+                const int fd = c.fd;
+                c.status_timer = m_loop.add_timer(std::chrono::milliseconds(std::max(interval, kMinIntervalMs)), [this, fd] {
+                    auto it = m_clients.find(fd);
+                    if (it == m_clients.end()) return;
+                    json event = status_of(nullptr);
+                    event["event"] = "status";
+                    send(*it->second, event);
+                });
+            }
+            return json::object();
+        }
+        if (cmd == "shutdown") return json::object();
+
+        throw std::runtime_error("unknown cmd: " + cmd);
+    }
+
+    json Daemon::status_of(const Session::InfoHash* only) const {
+        json torrents = json::array();
+        for (const Session::TorrentStatus& s : m_session.status()) {
+            if (only && s.info_hash != *only) continue;
+            torrents.push_back({
+                {"info_hash", to_hex(s.info_hash)},
+                {"name", s.name},
+                {"state", session_state_name(s.state)},
+                {"pieces", s.pieces},
+                {"num_pieces", s.num_pieces},
+                {"uploaded", s.uploaded},
+                {"downloaded", s.downloaded},
+                {"upload_rate", static_cast<std::uint64_t>(s.upload_rate)},
+                {"download_rate", static_cast<std::uint64_t>(s.download_rate)},
+                {"peers", s.peers},
+            });
+        }
+        json status = {{"torrents", torrents}, {"connections", m_session.num_connections()}};
+        if (const ThreadPool* pool = m_session.thread_pool()) {
+            const ThreadPool::Stats st = pool->stats();
+            status["pool"] = {{"threads", st.threads}, {"queued", st.queued},
+                              {"executed", st.executed}, {"steals", st.steals}};
+        }
+        return status;
+    }
+
+    void Daemon::send(Client& c, const json& msg) {
+        if (c.bencoded) c.out += encode_bencode_value(msg);
+        else c.out += msg.dump(-1, ' ', false, json::error_handler_t::replace) + "\n";
+        flush(c);
+    }
+
+    void Daemon::flush(Client& c) {
+        const int fd = c.fd;
+        std::size_t sent = 0;
+        while (sent < c.out.size()) {
+            ssize_t n = ::send(fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                sent += static_cast<std::size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            // Gone; the read side notices and closes
+            c.out.clear();
+            return;
+        }
+        c.out.erase(0, sent);
+
+        if (c.out.size() > kMaxQueued) {
+            std::cerr << "[!] Control client too slow, dropping it\n";
+            close_client(fd);
+            return;
+        }
+        if (c.eof && c.out.empty() && !c.status_timer) {
+            close_client(fd);
+            return;
+        }
+
+        const std::uint32_t events = (c.eof ? 0 : static_cast<std::uint32_t>(EPOLLIN)) |
+                                     (c.out.empty() ? 0 : static_cast<std::uint32_t>(EPOLLOUT));
+        if (events != c.events) {
+            c.events = events;
+            m_loop.modify_fd(fd, events);
+        }
+    }
+
+    void Daemon::close_client(int fd) {
+        auto it = m_clients.find(fd);
+        if (it == m_clients.end()) return;
+        if (it->second->status_timer) m_loop.cancel_timer(it->second->status_timer);
+        m_loop.remove_fd(fd);
+        ::close(fd);
+        m_clients.erase(it);
+    }
+
+}
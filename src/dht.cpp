@@ -0,0 +1,569 @@
+#include "torrent/dht.hpp"
+#include "torrent/tracker.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    static constexpr auto kMaintainInterval = std::chrono::seconds(60);
+    static constexpr auto kSecretLifetime = std::chrono::minutes(5);
+    static constexpr auto kPeerLifetime = std::chrono::minutes(30);
+    // Buckets nobody touched for this long are refreshed with a lookup.
+    static constexpr auto kBucketRefresh = std::chrono::minutes(15);
+
+    // Peers kept per info hash, info hashes kept, peers per get_peers reply
+    // (50 compact IPv4 peers keep the reply well under one datagram).
+    static constexpr std::size_t kMaxPeersPerHash = 100;
+    static constexpr std::size_t kMaxStoredHashes = 2000;
+    static constexpr std::size_t kMaxValues = 50;
+    // A lookup remembers this many candidates per k.
+    static constexpr std::size_t kCandidatesPerK = 4;
+
+    // KRPC error codes
+    static constexpr int kErrorProtocol = 203;
+    static constexpr int kErrorMethodUnknown = 204;
+
+    static std::string id_string(const NodeId& id) {
+        return std::string(reinterpret_cast<const char*>(id.data()), id.size());
+    }
+
+    // A 20-byte string member of `dict` as a NodeId.
+    static std::optional<NodeId> id_member(const json& dict, const char* key) {
+        auto it = dict.find(key);
+        if (it == dict.end() || !it->is_string()) return std::nullopt;
+
+        const std::string& s = it->get_ref<const std::string&>();
+        if (s.size() != 20) return std::nullopt;
+        NodeId id;
+        std::memcpy(id.data(), s.data(), 20);
+        return id;
+    }
+
+    static std::string string_member(const json& dict, const char* key) {
+        auto it = dict.find(key);
+        return it != dict.end() && it->is_string() ? it->get<std::string>() : std::string();
+    }
+
+    static std::int64_t int_member(const json& dict, const char* key, std::int64_t fallback) {
+        auto it = dict.find(key);
+        return it != dict.end() && it->is_number_integer() ? it->get<std::int64_t>() : fallback;
+    }
+
+    std::string encode_compact_nodes(const std::vector<NodeEntry>& nodes) {
+        std::string out;
+        for (const NodeEntry& n : nodes) {
+            if (!n.endpoint.is_v4()) continue;
+            out += id_string(n.id);
+            out += n.endpoint.compact();
+        }
+        return out;
+    }
+
+    std::vector<NodeEntry> parse_compact_nodes(const std::string& data) {
+        std::vector<NodeEntry> nodes;
+        const auto* p = reinterpret_cast<const std::uint8_t*>(data.data());
+        for (std::size_t off = 0; off + 26 <= data.size(); off += 26) {
+            NodeEntry n;
+            std::memcpy(n.id.data(), p + off, 20);
+            const auto port = static_cast<std::uint16_t>((p[off + 24] << 8) | p[off + 25]);
+            n.endpoint = Endpoint::v4(p + off + 20, port);
+            nodes.push_back(n);
+        }
+        return nodes;
+    }
+
+
+    // ----------------- Setup -----------------
+
+    Dht::Dht(EventLoop& loop, std::uint16_t port) : Dht(loop, port, Config{}) {}
+
+    Dht::Dht(EventLoop& loop, std::uint16_t port, Config config, std::optional<NodeId> id)
+        : m_loop(loop), m_config(std::move(config)), m_id(id ? *id : random_node_id()),
+          m_table(m_id, m_config.k) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(port);
+        if (::inet_pton(AF_INET, m_config.bind_address.c_str(), &addr.sin_addr) != 1) {
+            throw std::runtime_error("DHT: bad bind address " + m_config.bind_address);
+        }
+
+        m_fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) throw std::runtime_error(std::string("DHT socket failed: ") + std::strerror(errno));
+        if (::bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::string err = std::strerror(errno);
+            ::close(m_fd);
+            throw std::runtime_error("Failed to bind DHT port " + std::to_string(port) + ": " + err);
+        }
+
+        socklen_t len = sizeof(addr);
+        ::getsockname(m_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+        m_port = ntohs(addr.sin_port);
+
+        m_loop.add_fd(m_fd, EPOLLIN, [this](std::uint32_t) { on_readable(); });
+        start();
+    }
+
+    Dht::Dht(EventLoop& loop, UtpSocketManager& utp) : Dht(loop, utp, Config{}) {}
+
+    Dht::Dht(EventLoop& loop, UtpSocketManager& utp, Config config, std::optional<NodeId> id)
+        : m_loop(loop), m_config(std::move(config)), m_id(id ? *id : random_node_id()),
+          m_table(m_id, m_config.k), m_utp(&utp), m_port(utp.port()) {
+        m_utp->set_on_datagram([this](const char* data, std::size_t len, const Endpoint& from) {
+            on_datagram(data, len, from);
+        });
+        start();
+    }
+
+    void Dht::start() {
+        m_secret = id_string(random_node_id());
+        m_prev_secret = m_secret;
+        m_secret_changed = Clock::now();
+
+        m_maintain_timer = m_loop.add_timer(
+            std::chrono::duration_cast<std::chrono::milliseconds>(kMaintainInterval),
+            [this] { maintain(); }
+        );
+    }
+
+    Dht::~Dht() {
+        m_loop.cancel_timer(m_maintain_timer);
+        for (const auto& kv : m_pending) m_loop.cancel_timer(kv.second.timer);
+        if (m_utp) {
+            m_utp->set_on_datagram(nullptr);
+            return;
+        }
+        m_loop.remove_fd(m_fd);
+        ::close(m_fd);
+    }
+
+    Dht::LookupId Dht::bootstrap(const std::vector<Endpoint>& nodes, DoneCallback done) {
+        for (const Endpoint& ep : nodes) {
+            if (std::find(m_bootstrap.begin(), m_bootstrap.end(), ep) == m_bootstrap.end()) m_bootstrap.push_back(ep);
+        }
+        LookupId id = start_lookup(m_id, false, nullptr, std::move(done), std::nullopt, m_bootstrap);
+        step(id);
+        return id;
+    }
+
+    void Dht::add_node(const Endpoint& endpoint) {
+        if (!endpoint.is_v4() || endpoint.port == 0) return;
+        send_query(endpoint, "ping", json::object(), 0, nullptr);
+    }
+
+    Dht::LookupId Dht::find_node(const NodeId& target, DoneCallback done) {
+        LookupId id = start_lookup(target, false, nullptr, std::move(done), std::nullopt,
+                                   m_table.size() == 0 ? m_bootstrap : std::vector<Endpoint>{});
+        step(id);
+        return id;
+    }
+
+    Dht::LookupId Dht::get_peers(const NodeId& info_hash, PeersCallback on_peers, DoneCallback done,
+                                 std::optional<std::uint16_t> announce_port) {
+        LookupId id = start_lookup(info_hash, true, std::move(on_peers), std::move(done), announce_port,
+                                   m_table.size() == 0 ? m_bootstrap : std::vector<Endpoint>{});
+        step(id);
+        return id;
+    }
+
+    void Dht::cancel(LookupId id) {
+        // Its queries still in flight are matched against nothing when they return
+        m_lookups.erase(id);
+    }
+
+    void Dht::maintain() {
+        const auto now = Clock::now();
+
+        if (now - m_secret_changed >= kSecretLifetime) {
+            m_prev_secret = m_secret;
+            m_secret = id_string(random_node_id());
+            m_secret_changed = now;
+        }
+
+        for (auto it = m_peers.begin(); it != m_peers.end();) {
+            auto& list = it->second;
+            list.erase(std::remove_if(list.begin(), list.end(),
+                                      [now](const StoredPeer& p) { return now - p.added > kPeerLifetime; }),
+                       list.end());
+            it = list.empty() ? m_peers.erase(it) : std::next(it);
+        }
+
+        if (m_table.size() == 0) {
+            if (!m_bootstrap.empty()) bootstrap({});
+            return;
+        }
+        for (const NodeId& target : m_table.stale_buckets(now - kBucketRefresh)) find_node(target, nullptr);
+    }
+
+
+    // ----------------- Messages -----------------
+
+    void Dht::send_message(const Endpoint& to, const json& msg) {
+        sockaddr_storage ss{};
+        socklen_t len = to.to_sockaddr(ss);
+        const std::string data = encode_bencode_value(msg);
+        if (m_utp) {
+            m_utp->send_datagram(to, data);
+            return;
+        }
+        // Lost datagrams are the query timeout's business
+        (void)::sendto(m_fd, data.data(), data.size(), 0, reinterpret_cast<sockaddr*>(&ss), len);
+    }
+
+    void Dht::send_query(const Endpoint& to, const std::string& method, json args, LookupId lookup,
+                         const NodeId* node) {
+        std::string tid;
+        do {
+            const std::uint16_t n = m_next_tid++;
+            tid = std::string{static_cast<char>(n >> 8), static_cast<char>(n & 0xFF)};
+        } while (m_pending.count(tid));
+
+        args["id"] = id_string(m_id);
+        json msg = json::object();
+        msg["t"] = tid;
+        msg["y"] = "q";
+        msg["q"] = method;
+        msg["a"] = std::move(args);
+        send_message(to, msg);
+
+        Pending p;
+        p.to = to;
+        p.lookup = lookup;
+        if (node) {
+            p.target_node = *node;
+            p.node_known = true;
+        }
+        p.timer = m_loop.add_timer(m_config.query_timeout, [this, tid] { on_timeout(tid); }, false);
+        m_pending.emplace(tid, p);
+
+        m_stats.queries_sent++;
+        auto it = m_lookups.find(lookup);
+        if (it != m_lookups.end()) it->second.result.queries++;
+    }
+
+    void Dht::on_readable() {
+        while (true) {
+            char buf[2048];
+            sockaddr_storage from{};
+            socklen_t len = sizeof(from);
+            ssize_t n = ::recvfrom(m_fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+            if (n < 0) return; // EAGAIN
+
+            std::optional<Endpoint> sender = Endpoint::from_sockaddr(reinterpret_cast<sockaddr*>(&from));
+            if (sender) on_datagram(buf, static_cast<std::size_t>(n), *sender);
+        }
+    }
+
+    void Dht::on_datagram(const char* data, std::size_t len, const Endpoint& from) {
+        if (from.port == 0) return;
+
+        json msg;
+        try {
+            msg = decode_bencoded_value(std::string(data, len));
+        }
+        catch (const std::exception&) {
+            return; // not bencode; nothing to answer
+        }
+        if (!msg.is_object()) return;
+
+        const std::string y = string_member(msg, "y");
+        if (y == "q") handle_query(msg, from);
+        else if (y == "r") handle_response(msg, from, false);
+        else if (y == "e") handle_response(msg, from, true);
+    }
+
+    void Dht::handle_query(const json& msg, const Endpoint& from) {
+        m_stats.queries_received++;
+
+        auto t = msg.find("t");
+        if (t == msg.end() || !t->is_string()) return;
+
+        json reply = json::object();
+        reply["t"] = *t;
+
+        auto error = [&](int code, const std::string& text) {
+            reply["y"] = "e";
+            reply["e"] = json::array({code, text});
+            send_message(from, reply);
+        };
+
+        auto a = msg.find("a");
+        const std::string method = string_member(msg, "q");
+        if (a == msg.end() || !a->is_object()) return error(kErrorProtocol, "missing arguments");
+        const std::optional<NodeId> sender = id_member(*a, "id");
+        if (!sender) return error(kErrorProtocol, "missing id");
+
+        // Read-only nodes (BEP 43) don't answer queries; keep them out of the table
+        const auto now = Clock::now();
+        if (int_member(*a, "ro", 0) != 1) m_table.add(*sender, from, now);
+
+        json r = json::object();
+        r["id"] = id_string(m_id);
+
+        if (method == "ping") {
+            // Just the id
+        }
+        else if (method == "find_node") {
+            const std::optional<NodeId> target = id_member(*a, "target");
+            if (!target) return error(kErrorProtocol, "missing target");
+            r["nodes"] = encode_compact_nodes(m_table.closest(*target, m_config.k));
+        }
+        else if (method == "get_peers") {
+            const std::optional<NodeId> info_hash = id_member(*a, "info_hash");
+            if (!info_hash) return error(kErrorProtocol, "missing info_hash");
+
+            r["token"] = make_token(from, m_secret);
+            // Nodes always, so lookups keep converging past nodes that have peers
+            r["nodes"] = encode_compact_nodes(m_table.closest(*info_hash, m_config.k));
+
+            auto it = m_peers.find(*info_hash);
+            if (it != m_peers.end()) {
+                json values = json::array();
+                for (const StoredPeer& p : it->second) {
+                    if (values.size() == kMaxValues) break;
+                    if (p.endpoint.is_v4()) values.push_back(p.endpoint.compact());
+                }
+                r["values"] = std::move(values);
+            }
+        }
+        else if (method == "announce_peer") {
+            const std::optional<NodeId> info_hash = id_member(*a, "info_hash");
+            if (!info_hash) return error(kErrorProtocol, "missing info_hash");
+
+            const std::string token = string_member(*a, "token");
+            if (token != make_token(from, m_secret) && token != make_token(from, m_prev_secret)) {
+                return error(kErrorProtocol, "bad token");
+            }
+
+            std::int64_t port = int_member(*a, "implied_port", 0) == 1 ? from.port : int_member(*a, "port", 0);
+            if (port <= 0 || port > 65535) return error(kErrorProtocol, "bad port");
+
+            auto it = m_peers.find(*info_hash);
+            if (it == m_peers.end()) {
+                if (m_peers.size() >= kMaxStoredHashes) return error(kErrorProtocol, "storage full");
+                it = m_peers.emplace(*info_hash, std::vector<StoredPeer>{}).first;
+            }
+
+            Endpoint peer = from;
+            peer.port = static_cast<std::uint16_t>(port);
+            auto& list = it->second;
+            auto existing = std::find_if(list.begin(), list.end(),
+                                         [&peer](const StoredPeer& p) { return p.endpoint == peer; });
+            if (existing != list.end()) {
+                existing->added = now;
+            }
+            else {
+                if (list.size() >= kMaxPeersPerHash) list.erase(list.begin()); // the oldest
+                list.push_back(StoredPeer{peer, now});
+            }
+        }
+        else {
+            return error(kErrorMethodUnknown, "method unknown");
+        }
+
+        reply["y"] = "r";
+        reply["r"] = std::move(r);
+        send_message(from, reply);
+    }
+
+    void Dht::handle_response(const json& msg, const Endpoint& from, bool error) {
+        // Only answers from the node we asked count
+        auto pending = m_pending.find(string_member(msg, "t"));
+        if (pending == m_pending.end() || pending->second.to != from) return;
+
+        const Pending p = pending->second;
+        m_pending.erase(pending);
+        m_loop.cancel_timer(p.timer);
+        m_stats.responses_received++;
+
+        std::optional<NodeId> sender;
+        auto r = msg.find("r");
+        if (!error && r != msg.end() && r->is_object()) sender = id_member(*r, "id");
+        if (sender && *sender != m_id) m_table.add(*sender, from, Clock::now());
+
+        auto it = m_lookups.find(p.lookup);
+        if (it == m_lookups.end()) return;
+        Lookup& l = it->second;
+        l.in_flight--;
+
+        auto cand = std::find_if(l.candidates.begin(), l.candidates.end(),
+                                 [&from](const Candidate& c) { return c.node.endpoint == from; });
+        if (!sender) {
+            // An error or a malformed reply: no use to this lookup
+            if (cand != l.candidates.end()) cand->state = Candidate::State::Failed;
+            step(p.lookup);
+            return;
+        }
+
+        if (cand != l.candidates.end()) {
+            cand->state = Candidate::State::Answered;
+            cand->node.id = *sender;
+            cand->token = string_member(*r, "token");
+        }
+        else {
+            // A bootstrap node: now that we know its id it can be a candidate
+            Candidate c;
+            c.node.id = *sender;
+            c.node.endpoint = from;
+            c.state = Candidate::State::Answered;
+            c.token = string_member(*r, "token");
+            auto pos = std::lower_bound(l.candidates.begin(), l.candidates.end(), c,
+                                        [&l](const Candidate& x, const Candidate& y) {
+                                            return closer_to(l.target, x.node.id, y.node.id);
+                                        });
+            l.candidates.insert(pos, c);
+        }
+
+        for (const NodeEntry& n : parse_compact_nodes(string_member(*r, "nodes"))) add_candidate(l, n);
+
+        std::vector<Endpoint> fresh;
+        auto values = r->find("values");
+        if (l.want_peers && values != r->end() && values->is_array()) {
+            for (const json& v : *values) {
+                if (!v.is_string()) continue;
+                for (const Endpoint& peer : parse_compact_peers(v.get<std::string>())) {
+                    if (peer.port != 0 && l.peers.insert(peer).second) fresh.push_back(peer);
+                }
+            }
+        }
+
+        if (!fresh.empty() && l.on_peers) {
+            // May start or cancel lookups, so `l` is not used after this
+            PeersCallback cb = l.on_peers;
+            cb(fresh);
+        }
+        step(p.lookup);
+    }
+
+    void Dht::on_timeout(const std::string& tid) {
+        auto pending = m_pending.find(tid);
+        if (pending == m_pending.end()) return;
+
+        const Pending p = pending->second;
+        m_pending.erase(pending);
+        m_stats.timeouts++;
+        if (p.node_known) m_table.failed(p.target_node);
+
+        auto it = m_lookups.find(p.lookup);
+        if (it == m_lookups.end()) return;
+        Lookup& l = it->second;
+        l.in_flight--;
+        l.result.timeouts++;
+        for (Candidate& c : l.candidates) {
+            if (c.node.endpoint == p.to) c.state = Candidate::State::Failed;
+        }
+        step(p.lookup);
+    }
+
+    std::string Dht::make_token(const Endpoint& ep, const std::string& secret) const {
+        const std::string addr(reinterpret_cast<const char*>(ep.addr.data()), ep.addr.size());
+        return sha1_raw(secret + addr).substr(0, 8);
+    }
+
+
+    // ----------------- Lookups -----------------
+
+    Dht::LookupId Dht::start_lookup(const NodeId& target, bool want_peers, PeersCallback on_peers, DoneCallback done,
+                                    std::optional<std::uint16_t> announce_port, const std::vector<Endpoint>& extra) {
+        const LookupId id = m_next_lookup++;
+        Lookup& l = m_lookups[id];
+        l.target = target;
+        l.want_peers = want_peers;
+        l.announce_port = announce_port;
+        l.started = Clock::now();
+        l.on_peers = std::move(on_peers);
+        l.done = std::move(done);
+
+        for (const NodeEntry& n : m_table.closest(target, m_config.k)) add_candidate(l, n);
+
+        // Nodes we only know by address are asked right away, outside alpha
+        for (const Endpoint& ep : extra) {
+            if (!ep.is_v4() || !l.seen.insert(ep).second) continue;
+
+            json args = json::object();
+            args[want_peers ? "info_hash" : "target"] = id_string(target);
+            l.in_flight++;
+            send_query(ep, want_peers ? "get_peers" : "find_node", std::move(args), id, nullptr);
+        }
+        return id;
+    }
+
+    void Dht::add_candidate(Lookup& l, const NodeEntry& node) {
+        if (node.endpoint.port == 0 || node.id == m_id || !l.seen.insert(node.endpoint).second) return;
+
+        Candidate c;
+        c.node = node;
+        auto pos = std::lower_bound(l.candidates.begin(), l.candidates.end(), c,
+                                    [&l](const Candidate& x, const Candidate& y) {
+                                        return closer_to(l.target, x.node.id, y.node.id);
+                                    });
+        l.candidates.insert(pos, c);
+
+        // The far end will never be asked; answers from dropped ones are still counted
+        if (l.candidates.size() > m_config.k * kCandidatesPerK) l.candidates.pop_back();
+    }
+
+    void Dht::step(LookupId id) {
+        auto it = m_lookups.find(id);
+        if (it == m_lookups.end()) return;
+        Lookup& l = it->second;
+
+        // Work through the k closest candidates that haven't failed; done
+        // once all of them answered
+        bool waiting = l.in_flight > 0;
+        std::size_t considered = 0;
+        for (Candidate& c : l.candidates) {
+            if (c.state == Candidate::State::Failed) continue;
+            if (considered++ == m_config.k) break;
+
+            if (c.state == Candidate::State::Fresh) {
+                waiting = true;
+                if (l.in_flight >= m_config.alpha) continue;
+
+                json args = json::object();
+                args[l.want_peers ? "info_hash" : "target"] = id_string(l.target);
+                c.state = Candidate::State::Queried;
+                l.in_flight++;
+                send_query(c.node.endpoint, l.want_peers ? "get_peers" : "find_node", std::move(args), id, &c.node.id);
+            }
+            else if (c.state == Candidate::State::Queried) {
+                waiting = true;
+            }
+        }
+
+        if (!waiting) finish(id);
+    }
+
+    void Dht::finish(LookupId id) {
+        auto it = m_lookups.find(id);
+        if (it == m_lookups.end()) return;
+        Lookup l = std::move(it->second);
+        m_lookups.erase(it);
+
+        for (const Candidate& c : l.candidates) {
+            if (l.result.nodes.size() == m_config.k) break;
+            if (c.state != Candidate::State::Answered) continue;
+
+            l.result.nodes.push_back(c.node);
+            if (l.want_peers && l.announce_port && !c.token.empty()) {
+                json args = json::object();
+                args["info_hash"] = id_string(l.target);
+                args["port"] = static_cast<std::int64_t>(*l.announce_port);
+                args["implied_port"] = static_cast<std::int64_t>(*l.announce_port == 0 ? 1 : 0);
+                args["token"] = c.token;
+                send_query(c.node.endpoint, "announce_peer", std::move(args), 0, &c.node.id);
+            }
+        }
+
+        l.result.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - l.started);
+        if (l.done) l.done(l.result);
+    }
+
+}
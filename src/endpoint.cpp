@@ -0,0 +1,150 @@
+#include "torrent/endpoint.hpp"
+
+#include "torrent/string_utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+namespace torrent {
+
+    static constexpr std::uint8_t kV4MappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+    Endpoint Endpoint::v4(const std::uint8_t* bytes, std::uint16_t port) {
+        Endpoint ep;
+        std::memcpy(ep.addr.data(), kV4MappedPrefix, 12);
+        std::memcpy(ep.addr.data() + 12, bytes, 4);
+        ep.port = port;
+        return ep;
+    }
+
+    Endpoint Endpoint::v6(const std::uint8_t* bytes, std::uint16_t port) {
+        Endpoint ep;
+        std::memcpy(ep.addr.data(), bytes, 16);
+        ep.port = port;
+        return ep;
+    }
+
+    std::optional<Endpoint> Endpoint::from_sockaddr(const sockaddr* sa) {
+        if (sa->sa_family == AF_INET) {
+            auto* sin = reinterpret_cast<const sockaddr_in*>(sa);
+            return v4(reinterpret_cast<const std::uint8_t*>(&sin->sin_addr), ntohs(sin->sin_port));
+        }
+        if (sa->sa_family == AF_INET6) {
+            auto* sin6 = reinterpret_cast<const sockaddr_in6*>(sa);
+            return v6(sin6->sin6_addr.s6_addr, ntohs(sin6->sin6_port));
+        }
+        return std::nullopt;
+    }
+
+    std::optional<Endpoint> Endpoint::parse(const std::string& text) {
+        std::string host;
+        std::string port_str;
+
+        if (!text.empty() && text[0] == '[') {
+            auto close = text.find(']');
+            if (close == std::string::npos || close + 1 >= text.size() || text[close + 1] != ':') return std::nullopt;
+            host = text.substr(1, close - 1);
+            port_str = text.substr(close + 2);
+        }
+        else {
+            auto colon = text.rfind(':');
+            if (colon == std::string::npos) return std::nullopt;
+            host = text.substr(0, colon);
+            port_str = text.substr(colon + 1);
+        }
+
+        if (port_str.empty() || port_str.size() > 5 ||
+            port_str.find_first_not_of("0123456789") != std::string::npos) {
+            return std::nullopt;
+        }
+        unsigned long port = std::stoul(port_str);
+        if (port > 65535) return std::nullopt;
+
+        std::uint8_t buf[16];
+        if (::inet_pton(AF_INET, host.c_str(), buf) == 1) return v4(buf, static_cast<std::uint16_t>(port));
+        if (::inet_pton(AF_INET6, host.c_str(), buf) == 1) return v6(buf, static_cast<std::uint16_t>(port));
+        return std::nullopt;
+    }
+
+    Endpoint Endpoint::resolve(const std::string& text) {
+        return resolve_all(text).front();
+    }
+
+    std::vector<Endpoint> Endpoint::resolve_all(const std::string& text) {
+        if (auto ep = parse(text)) return {*ep};
+
+        std::string host, port_str;
+        split_host_port(text, host, port_str);
+
+        addrinfo hints{};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo* res = nullptr;
+        int gai = ::getaddrinfo(host.c_str(), port_str.c_str(), &hints, &res);
+        if (gai != 0 || !res) {
+            throw std::runtime_error("Cannot resolve " + text + ": " + ::gai_strerror(gai));
+        }
+
+        std::vector<Endpoint> out;
+        for (addrinfo* it = res; it; it = it->ai_next) {
+            std::optional<Endpoint> ep = from_sockaddr(it->ai_addr);
+            if (ep && std::find(out.begin(), out.end(), *ep) == out.end()) out.push_back(*ep);
+        }
+        ::freeaddrinfo(res);
+        if (out.empty()) throw std::runtime_error("Unsupported address family for " + text);
+        return out;
+    }
+
+    bool Endpoint::is_v4() const {
+        return std::memcmp(addr.data(), kV4MappedPrefix, 12) == 0;
+    }
+
+    socklen_t Endpoint::to_sockaddr(sockaddr_storage& ss) const {
+        std::memset(&ss, 0, sizeof(ss));
+
+        if (is_v4()) {
+            auto* sin = reinterpret_cast<sockaddr_in*>(&ss);
+            sin->sin_family = AF_INET;
+            sin->sin_port   = htons(port);
+            std::memcpy(&sin->sin_addr, addr.data() + 12, 4);
+            return sizeof(sockaddr_in);
+        }
+
+        auto* sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port   = htons(port);
+        std::memcpy(&sin6->sin6_addr, addr.data(), 16);
+        return sizeof(sockaddr_in6);
+    }
+
+    std::string Endpoint::address_string() const {
+        char buf[INET6_ADDRSTRLEN] = {0};
+        if (is_v4()) {
+            ::inet_ntop(AF_INET, addr.data() + 12, buf, sizeof(buf));
+        }
+        else {
+            ::inet_ntop(AF_INET6, addr.data(), buf, sizeof(buf));
+        }
+        return buf;
+    }
+
+    std::string Endpoint::to_string() const {
+        if (is_v4()) return address_string() + ":" + std::to_string(port);
+        return "[" + address_string() + "]:" + std::to_string(port);
+    }
+
+    std::string Endpoint::compact() const {
+        std::string out = is_v4() ? std::string(reinterpret_cast<const char*>(addr.data()) + 12, 4)
+                                  : std::string(reinterpret_cast<const char*>(addr.data()), 16);
+        out.push_back(static_cast<char>(port >> 8));
+        out.push_back(static_cast<char>(port & 0xFF));
+        return out;
+    }
+
+}
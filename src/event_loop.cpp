@@ -0,0 +1,208 @@
+#include "torrent/event_loop.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    EventLoop::EventLoop() : m_now(Clock::now()) {
+        m_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll_fd < 0) {
+            throw std::runtime_error(std::string("epoll_create1 failed: ") + std::strerror(errno));
+        }
+
+        m_wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_wake_fd < 0) {
+            ::close(m_epoll_fd);
+            throw std::runtime_error(std::string("eventfd failed: ") + std::strerror(errno));
+        }
+
+        add_fd(m_wake_fd, EPOLLIN, [this](std::uint32_t) {
+            std::uint64_t v;
+            while (::read(m_wake_fd, &v, sizeof(v)) > 0) {}
+        });
+    }
+
+    EventLoop::~EventLoop() {
+        // Never run, but their captures are released
+        Posted* p = m_posted.exchange(nullptr);
+        while (p) {
+            Posted* next = p->next;
+            delete p;
+            p = next;
+        }
+        if (m_wake_fd >= 0) ::close(m_wake_fd);
+        if (m_epoll_fd >= 0) ::close(m_epoll_fd);
+    }
+
+
+    // ----------------- File descriptors -----------------
+
+    void EventLoop::add_fd(int fd, std::uint32_t events, FdCallback cb) {
+        epoll_event ev{};
+        ev.events  = events;
+        ev.data.fd = fd;
+        if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            throw std::runtime_error(std::string("epoll_ctl ADD failed: ") + std::strerror(errno));
+        }
+        m_watchers[fd] = std::make_shared<Watcher>(Watcher{fd, events, std::move(cb)});
+    }
+
+    void EventLoop::modify_fd(int fd, std::uint32_t events) {
+        auto it = m_watchers.find(fd);
+        if (it == m_watchers.end() || it->second->events == events) return;
+
+        epoll_event ev{};
+        ev.events  = events;
+        ev.data.fd = fd;
+        if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+            throw std::runtime_error(std::string("epoll_ctl MOD failed: ") + std::strerror(errno));
+        }
+        it->second->events = events;
+    }
+
+    void EventLoop::remove_fd(int fd) {
+        auto it = m_watchers.find(fd);
+        if (it == m_watchers.end()) return;
+
+        ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        m_watchers.erase(it);
+    }
+
+
+    // ----------------- Timers -----------------
+
+    EventLoop::TimerId EventLoop::add_timer(std::chrono::milliseconds delay, TimerCallback cb, bool repeat) {
+        TimerId id = m_next_timer_id++;
+        m_timers[id] = Timer{delay, repeat, std::move(cb)};
+        m_timer_queue.push({Clock::now() + delay, id});
+        return id;
+    }
+
+    void EventLoop::cancel_timer(TimerId id) {
+        // The queue entry is dropped lazily when it comes due
+        m_timers.erase(id);
+    }
+
+    void EventLoop::run_timers() {
+        while (!m_timer_queue.empty() && m_timer_queue.top().first <= m_now) {
+            TimerEntry entry = m_timer_queue.top();
+            m_timer_queue.pop();
+
+            auto it = m_timers.find(entry.second);
+            if (it == m_timers.end()) continue; // cancelled
+
+            TimerCallback cb = it->second.cb;
+            if (it->second.repeat) {
+                m_timer_queue.push({m_now + it->second.interval, entry.second});
+            }
+            else {
+                m_timers.erase(it);
+            }
+
+            cb();
+        }
+    }
+
+    int EventLoop::next_timeout_ms(std::chrono::milliseconds cap) const {
+        if (m_timer_queue.empty()) return static_cast<int>(cap.count());
+
+        auto due = std::chrono::duration_cast<std::chrono::milliseconds>(
+            m_timer_queue.top().first - Clock::now()
+        );
+        if (due.count() < 0) return 0;
+        return static_cast<int>(std::min(due, cap).count());
+    }
+
+
+    // ----------------- Cross-thread -----------------
+
+    void EventLoop::post(std::function<void()> fn) {
+        // Once pushed, `p` is the loop's: it may already be run and freed
+        Posted* p = new Posted{std::move(fn), nullptr};
+        Posted* head = m_posted.load(std::memory_order_relaxed);
+        do {
+            p->next = head;
+        } while (!m_posted.compare_exchange_weak(head, p, std::memory_order_release, std::memory_order_relaxed));
+
+        // A non-empty list was pushed onto after the loop was woken for it
+        if (head) return;
+        std::uint64_t one = 1;
+        (void)::write(m_wake_fd, &one, sizeof(one));
+    }
+
+    void EventLoop::stop() {
+        m_stop_requested.store(true);
+        std::uint64_t one = 1;
+        (void)::write(m_wake_fd, &one, sizeof(one));
+    }
+
+    void EventLoop::run_posted() {
+        if (m_stop_requested.exchange(false)) m_running = false;
+
+        // Take everything posted so far and put it back in posting order
+        Posted* p = m_posted.exchange(nullptr, std::memory_order_acquire);
+        Posted* in_order = nullptr;
+        while (p) {
+            Posted* next = p->next;
+            p->next = in_order;
+            in_order = p;
+            p = next;
+        }
+
+        while (in_order) {
+            std::unique_ptr<Posted> current(in_order);
+            in_order = in_order->next;
+            try {
+                current->fn();
+            }
+            catch (...) {
+                // Dropped, as run() ends with the exception
+                while (in_order) {
+                    Posted* next = in_order->next;
+                    delete in_order;
+                    in_order = next;
+                }
+                throw;
+            }
+        }
+    }
+
+
+    // ----------------- Dispatch -----------------
+
+    void EventLoop::run_once(std::chrono::milliseconds timeout) {
+        epoll_event events[64];
+        int n = ::epoll_wait(m_epoll_fd, events, 64, next_timeout_ms(timeout));
+        if (n < 0 && errno != EINTR) {
+            throw std::runtime_error(std::string("epoll_wait failed: ") + std::strerror(errno));
+        }
+
+        m_now = Clock::now();
+
+        for (int i = 0; i < n; ++i) {
+            // Look the watcher up per event: an earlier callback may have removed it
+            auto it = m_watchers.find(events[i].data.fd);
+            if (it == m_watchers.end()) continue;
+
+            std::shared_ptr<Watcher> w = it->second;
+            w->cb(events[i].events);
+        }
+
+        run_posted();
+        run_timers();
+    }
+
+    void EventLoop::run() {
+        m_running = true;
+        while (m_running) {
+            run_once(std::chrono::milliseconds(1000));
+        }
+    }
+
+}
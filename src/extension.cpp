@@ -0,0 +1,103 @@
+#include "torrent/extension.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace torrent {
+
+    // ----------------- Handshake -----------------
+
+    ExtensionHandshake parse_extension_handshake(const std::uint8_t* data, std::size_t len) {
+        ExtensionHandshake hs;
+        hs.dict = decode_bencoded_value(std::string(reinterpret_cast<const char*>(data), len));
+        if (!hs.dict.is_object()) {
+            throw std::runtime_error("extension handshake is not a dictionary");
+        }
+
+        auto m = hs.dict.find("m");
+        if (m != hs.dict.end() && m->is_object()) {
+            for (auto it = m->begin(); it != m->end(); ++it) {
+                if (!it.value().is_number_integer()) continue;
+                std::int64_t id = it.value().get<std::int64_t>();
+                if (id >= 0 && id <= 255) hs.messages[it.key()] = static_cast<std::uint8_t>(id);
+            }
+        }
+
+        auto reqq = hs.dict.find("reqq");
+        if (reqq != hs.dict.end() && reqq->is_number_integer() && reqq->get<std::int64_t>() > 0) {
+            hs.reqq = static_cast<std::uint32_t>(std::min<std::int64_t>(reqq->get<std::int64_t>(), UINT32_MAX));
+        }
+
+        auto v = hs.dict.find("v");
+        if (v != hs.dict.end() && v->is_string()) hs.client = v->get<std::string>();
+
+        auto p = hs.dict.find("p");
+        if (p != hs.dict.end() && p->is_number_integer()) {
+            std::int64_t port = p->get<std::int64_t>();
+            if (port > 0 && port <= 65535) hs.listen_port = static_cast<std::uint16_t>(port);
+        }
+
+        auto yourip = hs.dict.find("yourip");
+        if (yourip != hs.dict.end() && yourip->is_string()) {
+            const std::string ip = yourip->get<std::string>();
+            const auto* bytes = reinterpret_cast<const std::uint8_t*>(ip.data());
+            if (ip.size() == 4) hs.your_ip = Endpoint::v4(bytes, 0);
+            else if (ip.size() == 16) hs.your_ip = Endpoint::v6(bytes, 0);
+        }
+
+        return hs;
+    }
+
+    void merge_extension_handshake(ExtensionHandshake& into, ExtensionHandshake update) {
+        for (const auto& kv : update.messages) {
+            if (kv.second == 0) into.messages.erase(kv.first);
+            else into.messages[kv.first] = kv.second;
+        }
+        if (update.reqq) into.reqq = update.reqq;
+        if (!update.client.empty()) into.client = std::move(update.client);
+        if (update.listen_port) into.listen_port = update.listen_port;
+        if (update.your_ip) into.your_ip = update.your_ip;
+
+        if (!into.dict.is_object()) into.dict = json::object();
+        for (auto it = update.dict.begin(); it != update.dict.end(); ++it) {
+            if (it.key() != "m") into.dict[it.key()] = it.value();
+        }
+    }
+
+
+    // ----------------- Registry -----------------
+
+    void ExtensionRegistry::add(std::unique_ptr<Extension> ext) {
+        if (m_extensions.size() >= 255) {
+            throw std::runtime_error("too many extensions");
+        }
+        if (find(ext->name())) {
+            throw std::runtime_error("extension registered twice: " + ext->name());
+        }
+        m_extensions.push_back(std::move(ext));
+    }
+
+    Extension* ExtensionRegistry::find(std::uint8_t local_id) const {
+        if (local_id == 0 || local_id > m_extensions.size()) return nullptr;
+        return m_extensions[local_id - 1].get();
+    }
+
+    Extension* ExtensionRegistry::find(const std::string& name) const {
+        for (const auto& ext : m_extensions) {
+            if (ext->name() == name) return ext.get();
+        }
+        return nullptr;
+    }
+
+    json ExtensionRegistry::handshake() const {
+        json dict = json::object();
+        json m = json::object();
+        for (std::size_t i = 0; i < m_extensions.size(); ++i) {
+            m[m_extensions[i]->name()] = static_cast<std::int64_t>(i + 1);
+            m_extensions[i]->add_handshake_keys(dict);
+        }
+        dict["m"] = std::move(m);
+        return dict;
+    }
+
+}
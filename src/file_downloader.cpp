@@ -1,21 +1,38 @@
 #include "torrent/file_downloader.hpp"
 
-#include <fstream>
 #include <iostream>
 #include <vector>
 #include <cstdint>
+#include <cstring>
+#include <optional>
 
+#include "torrent/bencode.hpp"
 #include "torrent/torrent_meta.hpp"
 #include "torrent/tracker.hpp"
 #include "torrent/peer.hpp"
 #include "torrent/piece_downloader.hpp"
+#include "torrent/piece_picker.hpp"
+#include "torrent/storage.hpp"
 
 namespace torrent {
 
     void download_file_single_peer(
         const TorrentMeta& meta,
         const std::string& peer_id,
-        const std::string& output_path
+        const std::string& output_path,
+        const std::vector<FilePriority>& file_priorities
+    ) {
+        Storage storage(meta, output_path, file_priorities);
+        download_file_single_peer(meta, peer_id, storage);
+
+        std::cerr << "[✓] Download complete, saved to " << output_path << "\n";
+    }
+
+    void download_file_single_peer(
+        const TorrentMeta& meta,
+        const std::string& peer_id,
+        Storage& storage,
+        const std::function<void(std::uint32_t)>& on_piece_done
     ) {
         std::cerr << "Starting full-file download (single peer)...\n";
 
@@ -25,33 +42,23 @@ namespace torrent {
             throw std::runtime_error("Tracker returned no peers");
         }
 
-        const Peer& peer = tr.peers.front();
-        std::cerr << "Using peer " << peer.ip << ":" << peer.port << "\n";
+        const Endpoint& peer = tr.peers.front();
+        std::cerr << "Using peer " << peer.to_string() << "\n";
 
-        // 2) Open output file
-        std::fstream out(output_path,
-                        std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
-        if (!out.is_open()) {
-            throw std::runtime_error("Failed to open output file: " + output_path);
-        }
+        // 2) Only pieces overlapping wanted files are picked
+        PiecePicker picker(static_cast<std::uint32_t>(meta.piece_hashes.size()));
+        picker.apply_file_priorities(meta, storage.file_priorities());
 
-        // Optionally pre-allocate file size (helps with some filesystems)
-        if (meta.length > 0) {
-            out.seekp(meta.length - 1, std::ios::beg);
-            out.write("", 1);
-            out.flush();
-            out.seekp(0, std::ios::beg);
-        }
-
-        const std::uint32_t num_pieces =
-            static_cast<std::uint32_t>(meta.piece_hashes.size());
+        const std::uint32_t num_pieces = picker.num_pieces();
 
         std::cerr << "File length  : " << meta.length << "\n";
         std::cerr << "Piece length : " << meta.piece_length << "\n";
         std::cerr << "Num pieces   : " << num_pieces << "\n";
+        std::cerr << "Wanted pieces: " << picker.num_wanted() << "\n";
 
-        // 3) Download pieces sequentially from the same connection
-        for (std::uint32_t piece_index = 0; piece_index < num_pieces; ++piece_index) {
+        // 3) Download wanted pieces in picker order
+        while (std::optional<std::uint32_t> next = picker.pick_piece()) {
+            std::uint32_t piece_index = *next;
             std::cerr << "[*] Downloading piece " << piece_index
                     << " / " << (num_pieces - 1) << "...\n";
 
@@ -61,38 +68,23 @@ namespace torrent {
             std::vector<std::uint8_t> buf =
                 download_piece_from_peer(conn->socket_fd(), meta, piece_index);
 
-            // Determine expected length for this piece
-            std::uint32_t expected_len = meta.piece_length;
-            if (piece_index == num_pieces - 1) {
-                // Last piece may be shorter
-                std::uint64_t full_before_last =
-                    static_cast<std::uint64_t>(meta.piece_length) * (num_pieces - 1);
-                expected_len = static_cast<std::uint32_t>(meta.length - full_before_last);
-            }
-
+            const std::uint32_t expected_len = piece_size(meta, piece_index);
             if (buf.size() < expected_len) {
                 throw std::runtime_error("Downloaded piece shorter than expected");
             }
 
-            // Write this piece at the correct offset
-            std::uint64_t offset =
-                static_cast<std::uint64_t>(meta.piece_length) * piece_index;
-
-            out.seekp(static_cast<std::streamoff>(offset), std::ios::beg);
-            if (!out) {
-                throw std::runtime_error("seekp failed");
+            std::string digest = sha1_raw(std::string(buf.begin(), buf.begin() + expected_len));
+            if (std::memcmp(digest.data(), meta.piece_hashes[piece_index].data(), 20) != 0) {
+                throw std::runtime_error("Piece " + std::to_string(piece_index) + " failed hash check");
             }
 
-            out.write(reinterpret_cast<const char*>(buf.data()),
-                    static_cast<std::streamsize>(expected_len));
-            if (!out) {
-                throw std::runtime_error("write failed");
-            }
+            // Write this piece through storage (handles file boundaries)
+            storage.write_block(piece_index, 0, buf.data(), expected_len);
+            picker.mark_have(piece_index);
+            if (on_piece_done) on_piece_done(piece_index);
 
             std::cerr << "[✓] Piece " << piece_index << " done\n";
         }
-
-        std::cerr << "[✓] Download complete, saved to " << output_path << "\n";
     }
 
 }
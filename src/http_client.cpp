@@ -0,0 +1,137 @@
+#include "torrent/http_client.hpp"
+
+#include <stdexcept>
+
+namespace torrent {
+
+    HttpClient::HttpClient(EventLoop& loop) : m_loop(loop) {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+
+        m_multi = curl_multi_init();
+        if (!m_multi) throw std::runtime_error("curl_multi_init failed");
+
+        curl_multi_setopt(m_multi, CURLMOPT_SOCKETFUNCTION, &HttpClient::on_socket);
+        curl_multi_setopt(m_multi, CURLMOPT_SOCKETDATA, this);
+        curl_multi_setopt(m_multi, CURLMOPT_TIMERFUNCTION, &HttpClient::on_timer);
+        curl_multi_setopt(m_multi, CURLMOPT_TIMERDATA, this);
+    }
+
+    HttpClient::~HttpClient() {
+        for (auto& kv : m_requests) {
+            curl_multi_remove_handle(m_multi, kv.first);
+            curl_easy_cleanup(kv.first);
+        }
+        m_requests.clear();
+
+        // Cleanup closes cached connections, reporting them through on_socket
+        curl_multi_cleanup(m_multi);
+        for (curl_socket_t fd : m_watched) m_loop.remove_fd(fd);
+        if (m_timer) m_loop.cancel_timer(m_timer);
+
+        curl_global_cleanup();
+    }
+
+    void HttpClient::get(const std::string& url, Callback cb, std::chrono::seconds timeout) {
+        CURL* easy = curl_easy_init();
+        if (!easy) throw std::runtime_error("curl_easy_init failed");
+
+        auto req = std::make_unique<Request>();
+        req->easy = easy;
+        req->cb   = std::move(cb);
+
+        curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT, static_cast<long>(timeout.count()));
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &HttpClient::on_write);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, &req->body);
+        curl_easy_setopt(easy, CURLOPT_PRIVATE, req.get());
+
+        m_requests[easy] = std::move(req);
+        curl_multi_add_handle(m_multi, easy); // arms the timer; the transfer starts from the loop
+    }
+
+    size_t HttpClient::on_write(char* ptr, size_t size, size_t nmemb, void* userdata) {
+        static_cast<std::string*>(userdata)->append(ptr, size * nmemb);
+        return size * nmemb;
+    }
+
+    int HttpClient::on_socket(CURL*, curl_socket_t fd, int what, void* userp, void*) {
+        auto* self = static_cast<HttpClient*>(userp);
+
+        if (what == CURL_POLL_REMOVE) {
+            if (self->m_watched.erase(fd)) self->m_loop.remove_fd(fd);
+            return 0;
+        }
+
+        std::uint32_t events = 0;
+        if (what == CURL_POLL_IN || what == CURL_POLL_INOUT) events |= EPOLLIN;
+        if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT) events |= EPOLLOUT;
+
+        if (self->m_watched.insert(fd).second) {
+            self->m_loop.add_fd(fd, events, [self, fd](std::uint32_t ev) {
+                int flags = 0;
+                if (ev & EPOLLIN) flags |= CURL_CSELECT_IN;
+                if (ev & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+                if (ev & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+                self->socket_action(fd, flags);
+            });
+        }
+        else {
+            self->m_loop.modify_fd(fd, events);
+        }
+        return 0;
+    }
+
+    int HttpClient::on_timer(CURLM*, long timeout_ms, void* userp) {
+        auto* self = static_cast<HttpClient*>(userp);
+
+        if (self->m_timer) {
+            self->m_loop.cancel_timer(self->m_timer);
+            self->m_timer = 0;
+        }
+        if (timeout_ms < 0) return 0; // no timeout wanted
+
+        self->m_timer = self->m_loop.add_timer(std::chrono::milliseconds(timeout_ms), [self] {
+            self->m_timer = 0;
+            self->socket_action(CURL_SOCKET_TIMEOUT, 0);
+        }, false);
+        return 0;
+    }
+
+    void HttpClient::socket_action(curl_socket_t fd, int flags) {
+        int running = 0;
+        curl_multi_socket_action(m_multi, fd, flags, &running);
+        finish_transfers();
+    }
+
+    void HttpClient::finish_transfers() {
+        int queued = 0;
+        while (CURLMsg* msg = curl_multi_info_read(m_multi, &queued)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+
+            CURL* easy = msg->easy_handle;
+            CURLcode rc = msg->data.result;
+
+            auto it = m_requests.find(easy);
+            if (it == m_requests.end()) continue;
+            std::unique_ptr<Request> req = std::move(it->second);
+            m_requests.erase(it);
+
+            Response resp;
+            if (rc == CURLE_OK) {
+                curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &resp.status);
+                resp.body = std::move(req->body);
+            }
+            else {
+                resp.error = curl_easy_strerror(rc);
+            }
+
+            curl_multi_remove_handle(m_multi, easy);
+            curl_easy_cleanup(easy);
+
+            if (req->cb) req->cb(resp);
+        }
+    }
+
+}
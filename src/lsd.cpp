@@ -0,0 +1,248 @@
+#include "torrent/lsd.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    static constexpr auto kAnnounceInterval = std::chrono::minutes(5);
+    // Announcements made in reply to newcomers are at least this far apart.
+    static constexpr auto kMinReplyInterval = std::chrono::seconds(1);
+    // Peers remembered as heard from; forgotten all at once.
+    static constexpr std::size_t kMaxHeard = 10000;
+
+    static const char kHexDigits[] = "0123456789abcdef";
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static std::string to_hex(const std::array<std::uint8_t, 20>& bytes) {
+        std::string out;
+        for (std::uint8_t b : bytes) {
+            out += kHexDigits[b >> 4];
+            out += kHexDigits[b & 0x0F];
+        }
+        return out;
+    }
+
+    static bool from_hex(const std::string& text, std::array<std::uint8_t, 20>& out) {
+        if (text.size() != 40) return false;
+        for (std::size_t i = 0; i < 20; ++i) {
+            int hi = hex_value(text[2 * i]);
+            int lo = hex_value(text[2 * i + 1]);
+            if (hi < 0 || lo < 0) return false;
+            out[i] = static_cast<std::uint8_t>(hi * 16 + lo);
+        }
+        return true;
+    }
+
+    static std::string trim(const std::string& s) {
+        std::size_t b = s.find_first_not_of(" \t\r");
+        std::size_t e = s.find_last_not_of(" \t\r");
+        return b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+    }
+
+    std::string build_lsd_announce(const std::string& host, std::uint16_t listen_port,
+                                   const std::array<std::uint8_t, 20>& info_hash, const std::string& cookie) {
+        return "BT-SEARCH * HTTP/1.1\r\n"
+               "Host: " + host + "\r\n"
+               "Port: " + std::to_string(listen_port) + "\r\n"
+               "Infohash: " + to_hex(info_hash) + "\r\n"
+               "cookie: " + cookie + "\r\n"
+               "\r\n\r\n";
+    }
+
+    Lsd::Lsd(EventLoop& loop, PeerCallback on_peer) : Lsd(loop, std::move(on_peer), Config{}) {}
+
+    Lsd::Lsd(EventLoop& loop, PeerCallback on_peer, Config config)
+        : m_loop(loop), m_on_peer(std::move(on_peer)), m_config(std::move(config)) {
+        in_addr group{};
+        in_addr iface{};
+        iface.s_addr = htonl(INADDR_ANY);
+        if (::inet_pton(AF_INET, m_config.group.c_str(), &group) != 1) {
+            throw std::runtime_error("LSD: bad multicast group " + m_config.group);
+        }
+        if (!m_config.interface.empty() && ::inet_pton(AF_INET, m_config.interface.c_str(), &iface) != 1) {
+            throw std::runtime_error("LSD: bad interface address " + m_config.interface);
+        }
+
+        m_fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) throw std::runtime_error(std::string("LSD socket failed: ") + std::strerror(errno));
+
+        auto fail = [this](const std::string& what) {
+            std::string err = std::strerror(errno);
+            ::close(m_fd);
+            throw std::runtime_error("LSD: " + what + ": " + err);
+        };
+
+        // Every client on this host binds the same group and port
+        int one = 1;
+        ::setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        ::setsockopt(m_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr   = group; // only datagrams sent to the group
+        addr.sin_port   = htons(m_config.port);
+        if (::bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            fail("bind " + m_config.group + ":" + std::to_string(m_config.port));
+        }
+
+        ip_mreq mreq{};
+        mreq.imr_multiaddr = group;
+        mreq.imr_interface = iface;
+        if (::setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) fail("join group");
+        if (!m_config.interface.empty() &&
+            ::setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) != 0) {
+            fail("select interface");
+        }
+
+        // The local network only; and hear ourselves, for other clients on this host
+        int ttl = 1;
+        ::setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        ::setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one));
+
+        std::random_device rd;
+        for (int i = 0; i < 8; ++i) m_cookie += kHexDigits[rd() % 16];
+
+        m_loop.add_fd(m_fd, EPOLLIN, [this](std::uint32_t) { on_readable(); });
+        m_timer = m_loop.add_timer(
+            std::chrono::duration_cast<std::chrono::milliseconds>(kAnnounceInterval),
+            [this] { announce_all(); }
+        );
+    }
+
+    Lsd::~Lsd() {
+        m_loop.cancel_timer(m_timer);
+        for (const auto& kv : m_torrents) {
+            if (kv.second.reply_timer) m_loop.cancel_timer(kv.second.reply_timer);
+        }
+        m_loop.remove_fd(m_fd);
+        ::close(m_fd);
+    }
+
+    void Lsd::add_torrent(const InfoHash& info_hash, std::uint16_t listen_port) {
+        m_torrents[info_hash].listen_port = listen_port;
+        announce(info_hash);
+    }
+
+    void Lsd::remove_torrent(const InfoHash& info_hash) {
+        auto it = m_torrents.find(info_hash);
+        if (it == m_torrents.end()) return;
+        if (it->second.reply_timer) m_loop.cancel_timer(it->second.reply_timer);
+        m_torrents.erase(it);
+    }
+
+    void Lsd::announce_all() {
+        for (const auto& kv : m_torrents) announce(kv.first);
+    }
+
+    void Lsd::announce(const InfoHash& info_hash) {
+        auto it = m_torrents.find(info_hash);
+        if (it == m_torrents.end()) return;
+        it->second.last = EventLoop::Clock::now();
+
+        const std::string host = m_config.group + ":" + std::to_string(m_config.port);
+        const std::string msg = build_lsd_announce(host, it->second.listen_port, info_hash, m_cookie);
+
+        sockaddr_in to{};
+        to.sin_family = AF_INET;
+        to.sin_port   = htons(m_config.port);
+        ::inet_pton(AF_INET, m_config.group.c_str(), &to.sin_addr);
+        if (::sendto(m_fd, msg.data(), msg.size(), 0, reinterpret_cast<sockaddr*>(&to), sizeof(to)) < 0) {
+            std::cerr << "[!] LSD announce failed: " << std::strerror(errno) << "\n";
+        }
+    }
+
+    void Lsd::on_readable() {
+        while (true) {
+            char buf[1500];
+            sockaddr_storage from{};
+            socklen_t len = sizeof(from);
+            ssize_t n = ::recvfrom(m_fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+            if (n < 0) return; // EAGAIN
+
+            std::optional<Endpoint> sender = Endpoint::from_sockaddr(reinterpret_cast<sockaddr*>(&from));
+            if (!sender) continue;
+
+            std::istringstream in(std::string(buf, static_cast<std::size_t>(n)));
+            std::string line;
+            if (!std::getline(in, line) || trim(line) != "BT-SEARCH * HTTP/1.1") continue;
+
+            // Headers are case-insensitive; Infohash may repeat
+            long port = 0;
+            std::string cookie;
+            std::vector<InfoHash> hashes;
+            while (std::getline(in, line)) {
+                auto colon = line.find(':');
+                if (colon == std::string::npos) continue;
+
+                std::string name = trim(line.substr(0, colon));
+                std::transform(name.begin(), name.end(), name.begin(),
+                               [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                const std::string value = trim(line.substr(colon + 1));
+
+                if (name == "port") {
+                    port = std::strtol(value.c_str(), nullptr, 10);
+                }
+                else if (name == "cookie") {
+                    cookie = value;
+                }
+                else if (name == "infohash") {
+                    InfoHash h;
+                    if (from_hex(value, h)) hashes.push_back(h);
+                }
+            }
+
+            if (cookie == m_cookie || port <= 0 || port > 65535) continue; // our own, or junk
+
+            Endpoint peer = *sender;
+            peer.port = static_cast<std::uint16_t>(port);
+            if (m_heard.size() > kMaxHeard) m_heard.clear();
+            const bool newcomer = m_heard.insert(peer).second;
+
+            for (const InfoHash& h : hashes) {
+                if (newcomer) reply(h);
+                m_on_peer(h, peer);
+            }
+        }
+    }
+
+    void Lsd::reply(const InfoHash& info_hash) {
+        auto it = m_torrents.find(info_hash);
+        if (it == m_torrents.end() || it->second.reply_timer) return;
+
+        const auto since = EventLoop::Clock::now() - it->second.last;
+        if (since >= kMinReplyInterval) {
+            announce(info_hash);
+            return;
+        }
+
+        // Too soon after the last one: go once the interval is up
+        const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(kMinReplyInterval - since);
+        it->second.reply_timer = m_loop.add_timer(wait, [this, info_hash] {
+            auto t = m_torrents.find(info_hash);
+            if (t == m_torrents.end()) return;
+            t->second.reply_timer = 0;
+            announce(info_hash);
+        }, false);
+    }
+
+}
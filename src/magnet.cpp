@@ -0,0 +1,132 @@
+#include "torrent/magnet.hpp"
+#include "torrent/bencode.hpp"
+
+#include <cctype>
+#include <stdexcept>
+
+namespace torrent {
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static std::string percent_decode(const std::string& s) {
+        std::string out;
+        out.reserve(s.size());
+        for (std::size_t i = 0; i < s.size(); ++i) {
+            if (s[i] == '%' && i + 2 < s.size() && hex_value(s[i + 1]) >= 0 && hex_value(s[i + 2]) >= 0) {
+                out.push_back(static_cast<char>(hex_value(s[i + 1]) * 16 + hex_value(s[i + 2])));
+                i += 2;
+            }
+            else if (s[i] == '+') {
+                out.push_back(' ');
+            }
+            else {
+                out.push_back(s[i]);
+            }
+        }
+        return out;
+    }
+
+    static bool decode_hex_hash(const std::string& text, std::array<std::uint8_t, 20>& out) {
+        if (text.size() != 40) return false;
+        for (std::size_t i = 0; i < 20; ++i) {
+            int hi = hex_value(text[2 * i]);
+            int lo = hex_value(text[2 * i + 1]);
+            if (hi < 0 || lo < 0) return false;
+            out[i] = static_cast<std::uint8_t>(hi * 16 + lo);
+        }
+        return true;
+    }
+
+    // RFC 4648 base32, as older magnet links use: 32 characters, 160 bits.
+    static bool decode_base32_hash(const std::string& text, std::array<std::uint8_t, 20>& out) {
+        if (text.size() != 32) return false;
+
+        std::uint64_t bits = 0;
+        int num_bits = 0;
+        std::size_t pos = 0;
+        for (char ch : text) {
+            char c = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+            int v;
+            if (c >= 'A' && c <= 'Z') v = c - 'A';
+            else if (c >= '2' && c <= '7') v = c - '2' + 26;
+            else return false;
+
+            bits = (bits << 5) | static_cast<std::uint64_t>(v);
+            num_bits += 5;
+            if (num_bits >= 8) {
+                num_bits -= 8;
+                out[pos++] = static_cast<std::uint8_t>(bits >> num_bits);
+            }
+        }
+        return pos == 20;
+    }
+
+    bool is_magnet_link(const std::string& text) {
+        return text.rfind("magnet:?", 0) == 0;
+    }
+
+    MagnetLink parse_magnet_link(const std::string& uri) {
+        if (!is_magnet_link(uri)) {
+            throw std::runtime_error("not a magnet link: " + uri);
+        }
+
+        MagnetLink magnet;
+        bool have_hash = false;
+
+        std::size_t pos = 8; // after "magnet:?"
+        while (pos < uri.size()) {
+            std::size_t amp = uri.find('&', pos);
+            if (amp == std::string::npos) amp = uri.size();
+            const std::string param = uri.substr(pos, amp - pos);
+            pos = amp + 1;
+
+            std::size_t eq = param.find('=');
+            if (eq == std::string::npos) continue;
+            const std::string key = param.substr(0, eq);
+            const std::string value = percent_decode(param.substr(eq + 1));
+
+            // Keys may carry an index ("tr.1"), which only orders them
+            std::string base = key.rfind("x.pe", 0) == 0 ? "x.pe" : key.substr(0, key.find('.'));
+
+            if (base == "xt" && value.rfind("urn:btih:", 0) == 0 && !have_hash) {
+                const std::string hash = value.substr(9);
+                have_hash = decode_hex_hash(hash, magnet.info_hash) || decode_base32_hash(hash, magnet.info_hash);
+            }
+            else if (base == "dn") {
+                magnet.name = value;
+            }
+            else if (base == "tr" && !value.empty()) {
+                magnet.trackers.push_back(value);
+            }
+            else if (base == "x.pe") {
+                if (auto ep = Endpoint::parse(value)) magnet.peers.push_back(*ep);
+            }
+        }
+
+        if (!have_hash) {
+            throw std::runtime_error("magnet link has no valid urn:btih info hash");
+        }
+        return magnet;
+    }
+
+    TorrentMeta magnet_meta(const MagnetLink& magnet) {
+        TorrentMeta meta;
+        meta.name = magnet.name;
+        for (const std::string& tr : magnet.trackers) {
+            meta.announce_list.push_back({tr});
+        }
+        if (!magnet.trackers.empty()) meta.announce = magnet.trackers.front();
+
+        meta.info_hash_raw = magnet.info_hash;
+        meta.info_hash_urlencoded = percent_encode_bytes(
+            std::string(reinterpret_cast<const char*>(magnet.info_hash.data()), magnet.info_hash.size())
+        );
+        return meta;
+    }
+
+}
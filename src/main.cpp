@@ -1,14 +1,49 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <unordered_set>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "torrent/bencode.hpp"
 #include "torrent/torrent_meta.hpp"
+#include "torrent/magnet.hpp"
+#include "torrent/metadata_fetcher.hpp"
 #include "torrent/tracker.hpp"
+#include "torrent/tracker_manager.hpp"
+#include "torrent/udp_tracker.hpp"
 #include "torrent/peer.hpp"
-#include "torrent/string_utils.hpp"
 #include "torrent/piece_downloader.hpp"
 #include "torrent/file_downloader.hpp"
+#include "torrent/storage.hpp"
+#include "torrent/event_loop.hpp"
+#include "torrent/bandwidth.hpp"
+#include "torrent/block_cache.hpp"
+#include "torrent/torrent.hpp"
+#include "torrent/dht.hpp"
+#include "torrent/lsd.hpp"
+#include "torrent/utp.hpp"
+#include "torrent/session.hpp"
+#include "torrent/daemon.hpp"
+#include "torrent/net_utils.hpp"
+#include "torrent/thread_pool.hpp"
+#include "torrent/torrent_creator.hpp"
+#include "torrent/concurrent_picker.hpp"
 
 
 using namespace torrent;
@@ -16,25 +51,539 @@ using namespace torrent;
 static void print_usage(const char* prog) {
     std::cerr
         << "Usage:\n"
-        << "  " << prog << " info <torrent_file>\n"
+        << "  " << prog << " info <torrent_file|magnet_link>\n"
         << "  " << prog << " peers <torrent_file>\n"
-        << "  " << prog << " handshake <torrent_file> <host:port>\n";
+        << "  " << prog << " scrape <torrent_file>\n"
+        << "  " << prog << " handshake <torrent_file> <host:port>\n"
+        << "  " << prog << " download -o <output_path> <torrent_file|magnet_link> [--priority <file_index>=<skip|low|normal|high>]... [--seed <port>]\n"
+        << "  " << prog << " seed <torrent_file> <data_path> [port] [--cache-mb <n>]\n"
+        << "  " << prog << " udp-tracker <port> [--drop <n>] [<ip:port>]...\n"
+        << "  " << prog << " dht-sim <nodes> [--lookups <n>] [--k <n>] [--alpha <n>]\n"
+        << "  " << prog << " utp-bench [--mb <n>] [--streams <n>] [--delay <ms>] [--loss <percent>]\n"
+        << "  " << prog << " picker-bench [--threads <max>] [--pieces <n>] [--blocks <n>] [--seconds <s>] [--mutex]\n"
+        << "  " << prog << " session <port> <torrent_file>=<save_path>... [--max-connections <n>] [--reactors <n>] [--utp]\n"
+        << "  " << prog << " daemon <socket_path> [port] [--max-connections <n>] [--reactors <n>] [--cache-mb <n>] [--utp]\n"
+        << "  " << prog << " ctl <socket_path> <json_request>...\n"
+        << "  " << prog << " create <file_or_dir> -o <torrent_file> [--tracker <url>] [--piece-kb <n>] [--comment <text>]\n"
+        << "\n"
+        << "Options for download --seed, seed, session, daemon and create:\n"
+        << "  --threads <n>                               hashing/disk threads (default: one per core)\n"
+        << "  --pin                                       pin each of them to a CPU\n"
+        << "\n"
+        << "Options for download --seed, seed, session and daemon:\n"
+        << "  --upload-limit <n>  --download-limit <n>   KiB/s, 0 = unlimited\n"
+        << "  --peer <host:port>                          also connect to this peer (repeatable)\n"
+        << "  --half-open <n>                             parallel connects (default 32)\n"
+        << "  --dht                                       find peers in the DHT too (UDP, same port)\n"
+        << "  --dht-node <host:port>                      bootstrap the DHT from this node (repeatable, implies --dht)\n"
+        << "  --lsd                                       find peers on the local network (multicast) and prefer them\n"
+        << "  --utp                                       also connect over uTP (UDP, same port), trying it before TCP\n";
+}
+
+// Azureus-style id ("-BT0001-" + 12 random digits) for the event-driven
+// engine, which drops connections to its own peer_id. Needed so that
+// several instances on one host can talk to each other.
+static std::string random_peer_id() {
+    std::random_device rd;
+    std::string id = "-BT0001-";
+    while (id.size() < 20) {
+        id += static_cast<char>('0' + rd() % 10);
+    }
+    return id;
+}
+
+// Well-known DHT routers, used when no --dht-node is given.
+static const char* const kDhtRouters[] = {
+    "router.bittorrent.com:6881",
+    "dht.transmissionbt.com:6881",
+    "router.utorrent.com:6881",
+};
+
+// Re-run the DHT lookup (and announce) this often.
+static constexpr auto kDhtAnnounceInterval = std::chrono::minutes(15);
+
+// A DHT node on UDP `port`, or on uTP's socket if there is one, joining
+// through `bootstrap` (or the public routers).
+static std::unique_ptr<Dht> start_dht(EventLoop& loop, std::uint16_t port, const std::vector<std::string>& bootstrap,
+                                      UtpSocketManager* utp = nullptr) {
+    std::vector<std::string> names = bootstrap;
+    if (names.empty()) names.assign(std::begin(kDhtRouters), std::end(kDhtRouters));
+
+    std::vector<Endpoint> nodes;
+    for (const std::string& name : names) {
+        try {
+            for (const Endpoint& ep : Endpoint::resolve_all(name)) {
+                if (ep.is_v4()) nodes.push_back(ep);
+            }
+        }
+        catch (const std::exception& ex) {
+            std::cerr << "[!] DHT bootstrap node " << name << ": " << ex.what() << "\n";
+        }
+    }
+
+    auto dht = utp ? std::make_unique<Dht>(loop, *utp) : std::make_unique<Dht>(loop, port);
+    Dht* d = dht.get();
+    d->bootstrap(nodes, [d](const Dht::LookupResult&) {
+        std::cerr << "[*] DHT bootstrapped, " << d->num_nodes() << " nodes in the routing table\n";
+    });
+    return dht;
+}
+
+// Get the info dictionary of `magnet` from peers (from its trackers, its
+// x.pe entries, `extra_peers` and the DHT if there is one) and build the
+// TorrentMeta, with the magnet's trackers as its announce-list.
+static TorrentMeta fetch_magnet_metadata(EventLoop& loop, const MagnetLink& magnet,
+                                         const std::vector<std::string>& extra_peers, Dht* dht = nullptr) {
+    const TorrentMeta partial = magnet_meta(magnet);
+    if (partial.announce_list.empty() && magnet.peers.empty() && extra_peers.empty() && !dht) {
+        throw std::runtime_error("magnet link has no trackers or peers (add some with --peer, or use --dht)");
+    }
+
+    const std::string engine_id = random_peer_id();
+    MetadataFetcher fetcher(loop, magnet.info_hash, engine_id);
+
+    std::string info;
+    fetcher.set_on_done([&](const std::string& info_bencoded) {
+        info = info_bencoded;
+        loop.stop();
+    });
+    for (const Endpoint& peer : magnet.peers) fetcher.add_peer(peer);
+    for (const std::string& p : extra_peers) fetcher.add_peer(Endpoint::resolve_all(p));
+
+    TrackerManager trackers(loop, partial, engine_id);
+    trackers.set_on_peers([&fetcher](const std::vector<Endpoint>& peers) {
+        for (const Endpoint& peer : peers) fetcher.add_peer(peer);
+    });
+    // The size is unknown yet; anything above 0 tells trackers we are a leecher
+    trackers.set_stats_provider([] {
+        AnnounceStats stats;
+        stats.left = UtMetadata::kPieceSize;
+        return stats;
+    });
+    trackers.set_peer_count_provider([&fetcher] { return fetcher.num_connections(); });
+    if (!partial.announce_list.empty()) trackers.start();
+
+    Dht::LookupId lookup = 0;
+    if (dht) {
+        lookup = dht->get_peers(magnet.info_hash, [&fetcher](const std::vector<Endpoint>& peers) {
+            std::cerr << "[*] DHT found " << peers.size() << " peers\n";
+            for (const Endpoint& peer : peers) fetcher.add_peer(peer);
+        });
+    }
+
+    std::cerr << "[*] Fetching metadata" << (magnet.name.empty() ? "" : " for " + magnet.name) << "\n";
+    loop.run();
+    if (dht) dht->cancel(lookup);
+
+    TorrentMeta meta = parse_info_dict(info);
+    meta.announce = partial.announce;
+    meta.announce_list = partial.announce_list;
+    return meta;
+}
+
+// A .torrent file or a magnet link (whose metadata is fetched from peers).
+static TorrentMeta load_meta(const std::string& source) {
+    if (!is_magnet_link(source)) return parse_torrent_file(source);
+
+    EventLoop loop;
+    return fetch_magnet_metadata(loop, parse_magnet_link(source), {});
+}
+
+// Look the torrent up in the DHT now and every 15 minutes, announcing
+// `port`; the peers found go to `torrent`.
+static void announce_on_dht(EventLoop& loop, Dht& dht, Torrent& torrent, const NodeId& info_hash,
+                            std::uint16_t port) {
+    auto lookup = [&dht, &torrent, info_hash, port] {
+        dht.get_peers(info_hash, [&torrent](const std::vector<Endpoint>& peers) {
+            std::cerr << "[*] DHT found " << peers.size() << " peers\n";
+            for (const Endpoint& peer : peers) torrent.add_peer(peer);
+        }, nullptr, port);
+    };
+    lookup();
+    loop.add_timer(std::chrono::duration_cast<std::chrono::milliseconds>(kDhtAnnounceInterval), lookup);
+    torrent.set_dht(dht.port(), [&dht](const Endpoint& node) { dht.add_node(node); });
+}
+
+// Announce the torrent on the local network (BEP 14) and connect to the
+// peers there ahead of remote ones.
+static std::unique_ptr<Lsd> start_lsd(EventLoop& loop, Torrent& torrent, const TorrentMeta& meta, std::uint16_t port) {
+    const Lsd::InfoHash info_hash = meta.info_hash_raw;
+    auto lsd = std::make_unique<Lsd>(loop, [&torrent, info_hash](const Lsd::InfoHash& h, const Endpoint& peer) {
+        if (h != info_hash) return;
+        std::cerr << "[*] Local peer " << peer.to_string() << " (LSD)\n";
+        torrent.add_local_peer(peer);
+    });
+    lsd->add_torrent(info_hash, port);
+    return lsd;
+}
+
+// Run `nodes` DHT nodes on loopback, let them find each other, then time
+// `lookups` get_peers lookups, each for a hash another random node has just
+// announced.
+static void run_dht_simulation(std::size_t num_nodes, std::size_t lookups, Dht::Config config) {
+    EventLoop loop;
+    std::mt19937 rng(std::random_device{}());
+    config.bind_address = "127.0.0.1";
+
+    std::vector<std::unique_ptr<Dht>> nodes;
+    for (std::size_t i = 0; i < num_nodes; ++i) nodes.push_back(std::make_unique<Dht>(loop, 0, config));
+    auto random_node = [&]() -> Dht& { return *nodes[rng() % nodes.size()]; };
+    auto total_queries = [&nodes] {
+        std::uint64_t n = 0;
+        for (const auto& d : nodes) n += d->stats().queries_sent;
+        return n;
+    };
+
+    // Nodes join one after another, each through a random earlier one, the
+    // way a network grows (all at once, most would bootstrap off nodes that
+    // know nobody yet). Then every node looks itself up again, as bucket
+    // refreshes would over time, so early nodes learn of later neighbours.
+    std::size_t pending = 0;
+    auto one_done = [&loop, &pending](const Dht::LookupResult&) {
+        if (--pending == 0) loop.stop();
+    };
+
+    const auto start = EventLoop::Clock::now();
+    for (std::size_t i = 1; i < nodes.size(); ++i) {
+        Endpoint via = *Endpoint::parse("127.0.0.1:" + std::to_string(nodes[rng() % i]->port()));
+        pending = 1;
+        nodes[i]->bootstrap({via}, one_done);
+        loop.run();
+    }
+    pending = nodes.size();
+    for (const auto& d : nodes) d->find_node(d->id(), one_done);
+    loop.run();
+
+    std::size_t min_table = SIZE_MAX, max_table = 0, sum_table = 0;
+    for (const auto& d : nodes) {
+        min_table = std::min(min_table, d->num_nodes());
+        max_table = std::max(max_table, d->num_nodes());
+        sum_table += d->num_nodes();
+    }
+    std::cout << "Nodes           : " << nodes.size() << " (k=" << config.k << ", alpha=" << config.alpha << ")\n";
+    std::cout << "Join            : "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(EventLoop::Clock::now() - start).count()
+              << " ms, " << total_queries() << " queries\n";
+    std::cout << "Routing tables  : " << sum_table / nodes.size() << " nodes on average ("
+              << min_table << ".." << max_table << ")\n";
+
+    // Lookups, one at a time
+    std::vector<double> latencies_ms;
+    std::size_t found = 0, queries = 0, timeouts = 0;
+    const std::uint64_t queries_before = total_queries();
+
+    std::function<void()> next = [&] {
+        if (latencies_ms.size() == lookups) {
+            loop.stop();
+            return;
+        }
+
+        const NodeId info_hash = random_node_id();
+        const auto peer_port = static_cast<std::uint16_t>(10000 + latencies_ms.size() % 50000);
+        Dht& announcer = random_node();
+        announcer.get_peers(info_hash, nullptr, [&, info_hash, peer_port](const Dht::LookupResult&) {
+            // Give the announce_peer datagrams a moment to land
+            loop.add_timer(std::chrono::milliseconds(20), [&, info_hash, peer_port] {
+                auto hit = std::make_shared<bool>(false);
+                random_node().get_peers(info_hash, [hit, peer_port](const std::vector<Endpoint>& peers) {
+                    for (const Endpoint& p : peers) {
+                        if (p.port == peer_port) *hit = true;
+                    }
+                }, [&, hit](const Dht::LookupResult& r) {
+                    latencies_ms.push_back(static_cast<double>(r.elapsed.count()) / 1000.0);
+                    queries += r.queries;
+                    timeouts += r.timeouts;
+                    if (*hit) found++;
+                    loop.post(next);
+                });
+            }, false);
+        }, peer_port);
+    };
+    if (lookups > 0) {
+        next();
+        loop.run();
+    }
+    if (latencies_ms.empty()) return;
+
+    std::vector<double> sorted = latencies_ms;
+    std::sort(sorted.begin(), sorted.end());
+    auto pct = [&sorted](double p) { return sorted[static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1))]; };
+
+    std::cout << "Lookups         : " << lookups << ", found the announced peer in " << found << "\n";
+    std::cout << "Latency (ms)    : p50 " << pct(0.5) << ", p90 " << pct(0.9) << ", p99 " << pct(0.99)
+              << ", max " << sorted.back() << "\n";
+    std::cout << "Queries/lookup  : " << static_cast<double>(queries) / static_cast<double>(lookups)
+              << " (timeouts " << timeouts << ")\n";
+    std::cout << "Total queries   : " << total_queries() - queries_before
+              << " for announces and lookups\n";
+}
+
+// Push `mib` MiB through each of `streams` uTP connections between two
+// sockets on loopback, with `config`'s delay and loss on both, and check
+// what arrives.
+static void run_utp_bench(std::size_t mib, std::size_t streams, UtpSocketManager::Config config) {
+    EventLoop loop;
+    config.bind_address = "127.0.0.1";
+    UtpSocketManager sender(loop, 0, config);
+    UtpSocketManager receiver(loop, 0, config);
+    const std::uint64_t total = static_cast<std::uint64_t>(mib) << 20;
+
+    // Byte i of every stream is i % 251, so a gap or a swap shows
+    struct Stream {
+        int fd = -1;
+        std::uint64_t offset = 0;
+    };
+    std::vector<std::unique_ptr<Stream>> readers;
+    std::size_t finished = 0;
+    bool corrupt = false;
+
+    receiver.set_on_accept([&](int fd, const Endpoint&) {
+        readers.push_back(std::make_unique<Stream>());
+        Stream* s = readers.back().get();
+        s->fd = fd;
+        loop.add_fd(fd, EPOLLIN, [&, s](std::uint32_t) {
+            char buf[65536];
+            while (true) {
+                ssize_t n = ::read(s->fd, buf, sizeof(buf));
+                if (n < 0) return; // EAGAIN
+                for (ssize_t i = 0; i < n; ++i) {
+                    if (static_cast<unsigned char>(buf[i]) != (s->offset + static_cast<std::uint64_t>(i)) % 251) corrupt = true;
+                }
+                s->offset += static_cast<std::uint64_t>(n);
+                if (n == 0) {
+                    loop.remove_fd(s->fd);
+                    ::close(s->fd);
+                    if (++finished == streams) loop.stop();
+                    return;
+                }
+            }
+        });
+    });
+
+    std::vector<char> pattern(65536 + 251);
+    for (std::size_t i = 0; i < pattern.size(); ++i) pattern[i] = static_cast<char>(i % 251);
+
+    std::vector<std::unique_ptr<Stream>> writers;
+    std::string error;
+    const Endpoint to = *Endpoint::parse("127.0.0.1:" + std::to_string(receiver.port()));
+    for (std::size_t i = 0; i < streams; ++i) {
+        writers.push_back(std::make_unique<Stream>());
+        Stream* s = writers.back().get();
+        s->fd = sender.connect(to, [&, s](int, const std::string& err) {
+            if (!err.empty()) {
+                error = err;
+                loop.stop();
+                return;
+            }
+            loop.add_fd(s->fd, EPOLLOUT, [&, s](std::uint32_t) {
+                while (s->offset < total) {
+                    const std::size_t at = static_cast<std::size_t>(s->offset % 251);
+                    const std::size_t len = static_cast<std::size_t>(std::min<std::uint64_t>(65536, total - s->offset));
+                    ssize_t n = ::write(s->fd, pattern.data() + at, len);
+                    if (n <= 0) return; // full; wait for room
+                    s->offset += static_cast<std::uint64_t>(n);
+                }
+                loop.remove_fd(s->fd);
+                ::close(s->fd); // uTP sends the rest, then a FIN
+            });
+        });
+        if (s->fd < 0) throw std::runtime_error("uTP connect failed");
+    }
+
+    // The window and delay over time, from the sending side
+    double cwnd_sum = 0, queuing_sum = 0;
+    std::size_t cwnd_max = 0, samples = 0;
+    std::chrono::microseconds rtt{0};
+    loop.add_timer(std::chrono::milliseconds(50), [&] {
+        for (const auto& c : sender.connections()) {
+            cwnd_sum += static_cast<double>(c.cwnd);
+            queuing_sum += static_cast<double>(c.queuing_delay.count());
+            cwnd_max = std::max(cwnd_max, c.cwnd);
+            rtt = c.rtt;
+            samples++;
+        }
+    });
+
+    const auto start = EventLoop::Clock::now();
+    loop.run();
+    const double seconds = std::chrono::duration<double>(EventLoop::Clock::now() - start).count();
+    if (!error.empty()) throw std::runtime_error("uTP connect failed: " + error);
+
+    std::uint64_t received = 0;
+    for (const auto& r : readers) received += r->offset;
+    const UtpSocketManager::Stats& st = sender.stats();
+    const UtpSocketManager::Stats& rs = receiver.stats();
+
+    std::cout << "Streams         : " << streams << " x " << mib << " MiB (delay " << config.delay.count()
+              << " ms each way, loss " << config.loss * 100 << "%)\n";
+    std::cout << "Received        : " << received << " of " << total * streams << " bytes"
+              << (corrupt ? ", CORRUPT" : ", intact") << "\n";
+    std::cout << "Time            : " << seconds << " s, "
+              << static_cast<double>(received) / seconds / (1 << 20) << " MiB/s\n";
+    std::cout << "Packets         : " << st.packets_sent << " sent, " << rs.packets_sent << " acks, "
+              << st.dropped + rs.dropped << " dropped\n";
+    std::cout << "Retransmits     : " << st.retransmits << " (" << st.fast_retransmits << " fast, "
+              << st.timeouts << " timeouts)\n";
+    if (samples > 0) {
+        std::cout << "Window          : " << cwnd_sum / static_cast<double>(samples) / 1024 << " KiB average, "
+                  << static_cast<double>(cwnd_max) / 1024 << " KiB max\n";
+        std::cout << "Delay           : rtt " << static_cast<double>(rtt.count()) / 1000 << " ms, queuing "
+                  << queuing_sum / static_cast<double>(samples) / 1000 << " ms average\n";
+    }
+}
+
+// Threads claiming blocks from one ConcurrentPicker as fast as they can,
+// like network threads serving one torrent: claim up to 16 blocks, then
+// receive them (or, one in 16, give them back), recycling every piece
+// that completes, and count a "have" from some peer now and then. Runs
+// `seconds` for each thread count 1, 2, 4, ... up to `max_threads`. With
+// `use_mutex`, every picker call takes one lock, as a baseline.
+static void run_picker_bench(std::size_t max_threads, std::uint32_t pieces, std::uint32_t blocks,
+                             double seconds, bool use_mutex) {
+    std::cout << "Pieces          : " << pieces << " x " << blocks << " blocks, "
+              << (use_mutex ? "one mutex" : "lock-free") << ", " << std::thread::hardware_concurrency()
+              << " CPUs\n";
+    std::cout << "Threads   Claims/s      Per thread    Speedup   CAS retries\n";
+
+    double single = 0;
+    for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+        ConcurrentPicker picker(pieces, blocks, blocks);
+        std::mutex mutex;
+        std::atomic<bool> go{false}, stop{false};
+        std::atomic<std::uint64_t> claimed{0};
+
+        auto locked = [&](auto fn) {
+            if (!use_mutex) return fn();
+            std::lock_guard<std::mutex> lock(mutex);
+            return fn();
+        };
+
+        std::vector<std::thread> workers;
+        for (std::size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                const std::vector<bool> all;
+                std::minstd_rand rng(static_cast<std::uint32_t>(t + 1));
+                std::int64_t current = -1;
+                ConcurrentPicker::Block batch[16];
+                std::uint64_t mine = 0;
+
+                while (!go.load()) std::this_thread::yield();
+                while (!stop.load(std::memory_order_relaxed)) {
+                    const std::size_t n = locked([&] { return picker.claim_blocks(all, current, 16, batch); });
+                    mine += n;
+                    const bool give_back = rng() % 16 == 0;
+                    for (std::size_t i = 0; i < n; ++i) {
+                        const ConcurrentPicker::Block b = batch[i];
+                        if (give_back) {
+                            locked([&] { picker.release_block(b.piece, b.block); });
+                        }
+                        else if (locked([&] { return picker.mark_received(b.piece, b.block); })) {
+                            locked([&] { picker.piece_failed(b.piece); });
+                        }
+                    }
+                    const std::uint32_t seen = static_cast<std::uint32_t>(rng() % pieces);
+                    locked([&] { picker.inc_availability(seen); });
+                }
+                claimed.fetch_add(mine);
+            });
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        go.store(true);
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stop.store(true);
+        for (auto& w : workers) w.join();
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const double rate = static_cast<double>(claimed.load()) / elapsed;
+        if (threads == 1) single = rate;
+        std::cout << std::left << std::fixed
+                  << std::setw(10) << threads
+                  << std::setprecision(0) << std::setw(14) << rate
+                  << std::setw(14) << rate / static_cast<double>(threads)
+                  << std::setprecision(2) << std::setw(10) << rate / single
+                  << picker.cas_retries() << "\n";
+    }
+}
+
+// Run the loop until SIGINT or SIGTERM. The first signal calls `stop`,
+// which should wind down (e.g. tell the trackers) and then call its
+// argument; the loop stops then, after 5 seconds at most, or on a second
+// signal.
+static void run_until_signal(EventLoop& loop, const std::function<void(std::function<void()>)>& stop) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    ::sigprocmask(SIG_BLOCK, &mask, nullptr);
+    int sig_fd = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    bool stopping = false;
+    if (sig_fd >= 0) {
+        loop.add_fd(sig_fd, EPOLLIN, [&](std::uint32_t) {
+            signalfd_siginfo info;
+            while (::read(sig_fd, &info, sizeof(info)) == sizeof(info)) {}
+
+            if (stopping) {
+                loop.stop();
+                return;
+            }
+            stopping = true;
+            stop([&loop] { loop.stop(); });
+            loop.add_timer(std::chrono::seconds(5), [&loop] { loop.stop(); }, false);
+        });
+    }
+
+    loop.run();
+
+    if (sig_fd >= 0) {
+        loop.remove_fd(sig_fd);
+        ::close(sig_fd);
+    }
+}
+
+// Run the loop with `trackers` announcing on schedule (with live stats from
+// `torrent`) and feeding it peers. SIGINT/SIGTERM send "stopped" to the
+// trackers, waiting at most 5 seconds, then end the loop; a second signal
+// ends it right away.
+static void run_with_trackers(EventLoop& loop, Torrent& torrent, TrackerManager& trackers, std::uint16_t port) {
+    trackers.set_listen_port(port);
+    trackers.set_on_peers([&torrent](const std::vector<Endpoint>& peers) {
+        for (const Endpoint& peer : peers) {
+            torrent.add_peer(peer);
+        }
+    });
+    trackers.set_stats_provider([&torrent] {
+        AnnounceStats stats;
+        stats.uploaded   = torrent.bytes_uploaded();
+        stats.downloaded = torrent.bytes_downloaded();
+        stats.left       = torrent.bytes_left();
+        return stats;
+    });
+    trackers.set_peer_count_provider([&torrent] { return torrent.num_connections(); });
+
+    trackers.start();
+    run_until_signal(loop, [&trackers](std::function<void()> done) {
+        std::cerr << "[*] Stopping, telling trackers...\n";
+        trackers.stop(std::move(done));
+    });
 }
 
 int main(int argc, char** argv) {
-    if (argc < 3) {
+    // The benchmarks are the only commands without a required argument
+    if (argc < 2 || (argc < 3 && std::string(argv[1]) != "utp-bench" && std::string(argv[1]) != "picker-bench")) {
         print_usage(argv[0]);
         return 1;
     }
 
     std::string command = argv[1];
-    std::string torrent_path = argv[2];
+    std::string torrent_path = argc > 2 ? argv[2] : "";
 
     const std::string peer_id = "12233344441223334444";
 
     try {
         if (command == "info") {
-            TorrentMeta meta = parse_torrent_file(torrent_path);
+            TorrentMeta meta = load_meta(torrent_path);
 
             std::cout << "Tracker URL: "   << meta.announce << "\n";
             std::cout << "Name       : "   << meta.name << "\n";
@@ -44,15 +593,138 @@ int main(int argc, char** argv) {
 
             std::string info_hash_hex = sha1(meta.info_bencoded);
             std::cout << "Info hash  : "   << info_hash_hex << "\n";
+
+            if (meta.multi_file) {
+                std::cout << "Files      : " << meta.files.size() << "\n";
+                for (std::size_t i = 0; i < meta.files.size(); ++i) {
+                    std::cout << "  [" << i << "] " << meta.files[i].path
+                              << " (" << meta.files[i].length << " bytes)\n";
+                }
+            }
         }
         else if (command == "peers") {
             TorrentMeta meta = parse_torrent_file(torrent_path);
-            TrackerResponse tr = request_peers(meta, peer_id);
 
-            std::cout << "Got " << tr.peers.size() << " peers from tracker\n";
-            for (const auto& p : tr.peers) {
-                std::cout << p.ip << ":" << p.port << "\n";
+            // Ask every tracker at once and print peers as the answers come in
+            EventLoop loop;
+            TrackerManager trackers(loop, meta, peer_id);
+            // Trackers of different tiers often know the same peers
+            std::unordered_set<Endpoint> seen;
+            trackers.set_on_peers([&seen](const std::vector<Endpoint>& peers) {
+                for (const auto& p : peers) {
+                    if (seen.insert(p).second) std::cout << p.to_string() << "\n";
+                }
+            });
+
+            AnnounceRequest req;
+            req.left = static_cast<std::uint64_t>(meta.length);
+            trackers.announce(req);
+
+            loop.add_timer(std::chrono::milliseconds(50), [&] {
+                if (!trackers.busy()) loop.stop();
+            });
+            loop.run();
+
+            std::cout << "Got " << seen.size() << " peers from trackers\n";
+        }
+        else if (command == "scrape") {
+            TorrentMeta meta = parse_torrent_file(torrent_path);
+            if (meta.announce.rfind("udp://", 0) != 0) {
+                throw std::runtime_error("scrape is only supported for udp:// trackers");
+            }
+
+            ScrapeResult sr = udp_scrape(meta.announce, {meta.info_hash_raw}).at(0);
+            std::cout << "Seeders  : " << sr.seeders << "\n";
+            std::cout << "Leechers : " << sr.leechers << "\n";
+            std::cout << "Completed: " << sr.completed << "\n";
+        }
+        else if (command == "udp-tracker") {
+            // Local BEP 15 tracker for testing: udp-tracker <port> [--drop <n>] [<ip:port>]...
+            std::uint16_t port = static_cast<std::uint16_t>(std::stoi(argv[2]));
+            int drop = 0;
+            std::vector<Endpoint> fixed;
+            for (int i = 3; i < argc; ++i) {
+                std::string arg = argv[i];
+                if (arg == "--drop" && i + 1 < argc) {
+                    drop = std::stoi(argv[++i]);
+                    continue;
+                }
+
+                fixed.push_back(Endpoint::resolve(arg));
+            }
+
+            EventLoop loop;
+            UdpTrackerServer server(loop, port, fixed);
+            server.drop_requests(drop);
+
+            std::cerr << "UDP tracker listening on 127.0.0.1:" << port << "\n";
+            loop.run();
+        }
+        else if (command == "dht-sim") {
+            // Local DHT network for measuring lookups: dht-sim <nodes> [--lookups <n>] [--k <n>] [--alpha <n>]
+            const std::size_t num_nodes = std::stoul(argv[2]);
+            std::size_t lookups = 100;
+            Dht::Config config;
+            for (int i = 3; i + 1 < argc; i += 2) {
+                std::string arg = argv[i];
+                if (arg == "--lookups") lookups = std::stoul(argv[i + 1]);
+                else if (arg == "--k") config.k = std::stoul(argv[i + 1]);
+                else if (arg == "--alpha") config.alpha = std::stoul(argv[i + 1]);
+                else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+            }
+            if (num_nodes < 2 || config.k == 0 || config.alpha == 0) {
+                throw std::runtime_error("dht-sim needs at least 2 nodes, and k and alpha above 0");
             }
+
+            run_dht_simulation(num_nodes, lookups, config);
+        }
+        else if (command == "utp-bench") {
+            // Loopback uTP transfer: utp-bench [--mb <n>] [--streams <n>] [--delay <ms>] [--loss <percent>]
+            std::size_t mib = 64, streams = 1;
+            UtpSocketManager::Config config;
+            for (int i = 2; i + 1 < argc; i += 2) {
+                std::string arg = argv[i];
+                if (arg == "--mb") mib = std::stoul(argv[i + 1]);
+                else if (arg == "--streams") streams = std::stoul(argv[i + 1]);
+                else if (arg == "--delay") config.delay = std::chrono::milliseconds(std::stol(argv[i + 1]));
+                else if (arg == "--loss") config.loss = std::stod(argv[i + 1]) / 100;
+                else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+            }
+            if (mib == 0 || streams == 0 || config.delay.count() < 0 || config.loss < 0 || config.loss >= 1) {
+                throw std::runtime_error("utp-bench needs --mb and --streams above 0, and a loss below 100%");
+            }
+
+            run_utp_bench(mib, streams, config);
+        }
+        else if (command == "picker-bench") {
+            // Concurrent block claiming: picker-bench [--threads <max>] [--pieces <n>] [--blocks <n>] [--seconds <s>] [--mutex]
+            std::size_t max_threads = 32;
+            std::uint32_t pieces = 4096, blocks = 64;
+            double seconds = 1;
+            bool use_mutex = false;
+            for (int i = 2; i < argc; ++i) {
+                std::string arg = argv[i];
+                if (arg == "--mutex") use_mutex = true;
+                else if (arg == "--threads" && i + 1 < argc) max_threads = std::stoul(argv[++i]);
+                else if (arg == "--pieces" && i + 1 < argc) pieces = static_cast<std::uint32_t>(std::stoul(argv[++i]));
+                else if (arg == "--blocks" && i + 1 < argc) blocks = static_cast<std::uint32_t>(std::stoul(argv[++i]));
+                else if (arg == "--seconds" && i + 1 < argc) seconds = std::stod(argv[++i]);
+                else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+            }
+            if (max_threads == 0 || pieces == 0 || blocks == 0 || seconds <= 0) {
+                throw std::runtime_error("picker-bench needs --threads, --pieces, --blocks and --seconds above 0");
+            }
+
+            run_picker_bench(max_threads, pieces, blocks, seconds, use_mutex);
         }
         else if (command == "handshake") {
             if (argc < 4) {
@@ -62,12 +734,8 @@ int main(int argc, char** argv) {
 
             TorrentMeta meta = parse_torrent_file(torrent_path);
 
-            // Parse <host:port> argument into a Peer
-            std::string host, port_str;
-            torrent::split_host_port(argv[3], host, port_str);
-            std::uint16_t port = static_cast<std::uint16_t>(std::stoi(port_str));
-
-            Peer peer{host, port};
+            // Parse <host:port> argument into an Endpoint
+            Endpoint peer = Endpoint::resolve(argv[3]);
 
             // This will:
             //  - open TCP
@@ -77,7 +745,7 @@ int main(int argc, char** argv) {
             auto conn = PeerConnection::connect_and_handshake(meta, peer, peer_id);
 
             std::cerr << "Handshake successful with "
-                      << conn->remote_ip() << ":" << conn->remote_port() << "\n";
+                      << conn->remote().to_string() << "\n";
         }
         else if (command == "download_piece") {
             if (argc < 5) {
@@ -89,11 +757,7 @@ int main(int argc, char** argv) {
 
             std::uint32_t piece_index = static_cast<std::uint32_t>(std::stoul(argv[3]));
 
-            std::string host, port_str;
-            split_host_port(argv[4], host, port_str);
-            std::uint16_t port = static_cast<std::uint16_t>(std::stoi(port_str));
-
-            Peer peer{host, port};
+            Endpoint peer = Endpoint::resolve(argv[4]);
 
             auto conn = PeerConnection::connect_and_handshake(meta, peer, peer_id);
 
@@ -103,18 +767,511 @@ int main(int argc, char** argv) {
         }
         else if (command == "download") {
             if (argc < 5 || std::string(argv[2]) != "-o") {
-                std::cerr << "Usage: " << argv[0] << " download -o <output_path> <torrent_file>\n";
+                std::cerr << "Usage: " << argv[0] << " download -o <output_path> <torrent_file>"
+                          << " [--priority <file_index>=<skip|low|normal|high>]... [--seed <port>]\n";
                 return 1;
             }
 
             std::string output_path = argv[3];
             std::string torrent_path = argv[4];
 
-            TorrentMeta meta = parse_torrent_file(torrent_path);
+            // Optional per-file priorities, e.g. --priority 0=skip --priority 3=high
+            std::vector<std::string> priority_specs;
+            int seed_port = -1;
+            BandwidthLimits limits;
+            std::vector<std::string> extra_peers;
+            int half_open = 0;
+            bool use_dht = false;
+            std::vector<std::string> dht_nodes;
+            bool use_lsd = false;
+            bool use_utp = false;
+            ThreadPool::Config pool_config;
+            for (int i = 5; i < argc; ++i) {
+                std::string arg = argv[i];
+                if (arg == "--dht") {
+                    use_dht = true;
+                    continue;
+                }
+                if (arg == "--pin") {
+                    pool_config.pin = true;
+                    continue;
+                }
+                if (arg == "--lsd") {
+                    use_lsd = true;
+                    continue;
+                }
+                if (arg == "--utp") {
+                    use_utp = true;
+                    continue;
+                }
+                if (i + 1 >= argc) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+
+                if (arg == "--seed") {
+                    seed_port = std::stoi(argv[++i]);
+                    continue;
+                }
+                if (arg == "--upload-limit") {
+                    limits.upload.set_rate(std::stoull(argv[++i]) * 1024);
+                    continue;
+                }
+                if (arg == "--download-limit") {
+                    limits.download.set_rate(std::stoull(argv[++i]) * 1024);
+                    continue;
+                }
+                if (arg == "--peer") {
+                    extra_peers.push_back(argv[++i]);
+                    continue;
+                }
+                if (arg == "--half-open") {
+                    half_open = std::stoi(argv[++i]);
+                    continue;
+                }
+                if (arg == "--threads") {
+                    pool_config.threads = std::stoul(argv[++i]);
+                    continue;
+                }
+                if (arg == "--dht-node") {
+                    use_dht = true;
+                    dht_nodes.push_back(argv[++i]);
+                    continue;
+                }
+                if (arg != "--priority") {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                priority_specs.push_back(argv[++i]);
+            }
+
+            if (use_dht && seed_port < 0) {
+                throw std::runtime_error("--dht needs --seed <port> (the DHT uses the same port number)");
+            }
+            if (use_lsd && seed_port < 0) {
+                throw std::runtime_error("--lsd needs --seed <port> (local peers connect to it)");
+            }
+            if (use_utp && seed_port < 0) {
+                throw std::runtime_error("--utp needs --seed <port> (uTP uses the same port number)");
+            }
+
+            // Shared by the metadata fetch (for magnet links) and the download
+            EventLoop loop;
+            std::unique_ptr<UtpSocketManager> utp;
+            if (use_utp) utp = std::make_unique<UtpSocketManager>(loop, static_cast<std::uint16_t>(seed_port));
+            std::unique_ptr<Dht> dht;
+            if (use_dht) dht = start_dht(loop, static_cast<std::uint16_t>(seed_port), dht_nodes, utp.get());
+
+            TorrentMeta meta = is_magnet_link(torrent_path)
+                ? fetch_magnet_metadata(loop, parse_magnet_link(torrent_path), extra_peers, dht.get())
+                : parse_torrent_file(torrent_path);
+
+            std::vector<FilePriority> priorities(meta.files.size(), FilePriority::Normal);
+            for (const std::string& spec : priority_specs) {
+                auto eq = spec.find('=');
+                if (eq == std::string::npos) {
+                    throw std::runtime_error("Expected <file_index>=<priority>, got: " + spec);
+                }
+
+                std::size_t file_index = std::stoul(spec.substr(0, eq));
+                if (file_index >= priorities.size()) {
+                    throw std::runtime_error("File index out of range: " + spec);
+                }
+                priorities[file_index] = parse_file_priority(spec.substr(eq + 1));
+            }
 
             const std::string peer_id = "12233344441223334444";
 
-            download_file_single_peer(meta, peer_id, output_path);
+            if (seed_port < 0) {
+                download_file_single_peer(meta, peer_id, output_path, priorities);
+                return 0;
+            }
+
+            // Download from every peer the tracker returns while serving finished
+            // pieces to others, then keep seeding; pieces are hashed and
+            // written on the pool
+            ThreadPool pool(pool_config);
+            Storage storage(meta, output_path, priorities);
+            const std::string engine_id = random_peer_id();
+            Torrent torrent(loop, meta, storage, engine_id);
+            torrent.set_thread_pool(&pool);
+            torrent.listen(static_cast<std::uint16_t>(seed_port));
+            torrent.set_utp(utp.get());
+            if (utp) utp->set_on_accept([&torrent](int fd, const Endpoint& remote) { torrent.add_incoming(fd, remote); });
+            torrent.set_global_limits(&limits);
+            if (half_open > 0) torrent.set_max_half_open(static_cast<std::size_t>(half_open));
+            for (const std::string& p : extra_peers) {
+                torrent.add_peer(Endpoint::resolve_all(p));
+            }
+            if (is_magnet_link(torrent_path)) {
+                for (const Endpoint& peer : parse_magnet_link(torrent_path).peers) torrent.add_peer(peer);
+            }
+
+            if (dht) announce_on_dht(loop, *dht, torrent, meta.info_hash_raw, static_cast<std::uint16_t>(seed_port));
+            std::unique_ptr<Lsd> lsd;
+            if (use_lsd) lsd = start_lsd(loop, torrent, meta, static_cast<std::uint16_t>(seed_port));
+
+            TrackerManager trackers(loop, meta, engine_id);
+            torrent.set_on_finished([seed_port, &trackers] {
+                std::cerr << "[✓] Download complete, seeding on port " << seed_port << "\n";
+                trackers.completed();
+            });
+
+            run_with_trackers(loop, torrent, trackers, static_cast<std::uint16_t>(seed_port));
+        }
+        else if (command == "seed") {
+            if (argc < 4) {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            std::string data_path = argv[3];
+            std::uint16_t port = 6881;
+            std::size_t cache_mb = 0;
+            BandwidthLimits limits;
+            std::vector<std::string> extra_peers;
+            int half_open = 0;
+            bool use_dht = false;
+            std::vector<std::string> dht_nodes;
+            bool use_lsd = false;
+            bool use_utp = false;
+            ThreadPool::Config pool_config;
+            for (int i = 4; i < argc; ++i) {
+                std::string arg = argv[i];
+                if (arg == "--cache-mb" && i + 1 < argc) {
+                    cache_mb = std::stoul(argv[++i]);
+                }
+                else if (arg == "--threads" && i + 1 < argc) {
+                    pool_config.threads = std::stoul(argv[++i]);
+                }
+                else if (arg == "--pin") {
+                    pool_config.pin = true;
+                }
+                else if (arg == "--upload-limit" && i + 1 < argc) {
+                    limits.upload.set_rate(std::stoull(argv[++i]) * 1024);
+                }
+                else if (arg == "--download-limit" && i + 1 < argc) {
+                    limits.download.set_rate(std::stoull(argv[++i]) * 1024);
+                }
+                else if (arg == "--peer" && i + 1 < argc) {
+                    extra_peers.push_back(argv[++i]);
+                }
+                else if (arg == "--half-open" && i + 1 < argc) {
+                    half_open = std::stoi(argv[++i]);
+                }
+                else if (arg == "--dht") {
+                    use_dht = true;
+                }
+                else if (arg == "--lsd") {
+                    use_lsd = true;
+                }
+                else if (arg == "--utp") {
+                    use_utp = true;
+                }
+                else if (arg == "--dht-node" && i + 1 < argc) {
+                    use_dht = true;
+                    dht_nodes.push_back(argv[++i]);
+                }
+                else {
+                    port = static_cast<std::uint16_t>(std::stoi(arg));
+                }
+            }
+
+            TorrentMeta meta = parse_torrent_file(torrent_path);
+            ThreadPool pool(pool_config);
+            Storage storage(meta, data_path);
+
+            // Only advertise pieces that are actually on disk and intact
+            // (vector<bool> packs bits, so each piece gets a byte while checking)
+            std::vector<std::uint8_t> verified(meta.piece_hashes.size(), 0);
+            parallel_for(pool, 0, verified.size(), [&](std::size_t i) {
+                verified[i] = storage.verify_piece(static_cast<std::uint32_t>(i));
+            });
+            std::vector<bool> have(verified.begin(), verified.end());
+            const auto num_have = std::count(have.begin(), have.end(), true);
+            std::cerr << "Verified " << num_have << " / " << have.size() << " pieces\n";
+
+            EventLoop loop;
+            std::unique_ptr<UtpSocketManager> utp;
+            if (use_utp) utp = std::make_unique<UtpSocketManager>(loop, port);
+            const std::string engine_id = random_peer_id();
+            Torrent torrent(loop, meta, storage, engine_id);
+            torrent.set_thread_pool(&pool);
+            torrent.set_have(have);
+            torrent.set_global_limits(&limits);
+            torrent.listen(port);
+            torrent.set_utp(utp.get());
+            if (utp) utp->set_on_accept([&torrent](int fd, const Endpoint& remote) { torrent.add_incoming(fd, remote); });
+            if (half_open > 0) torrent.set_max_half_open(static_cast<std::size_t>(half_open));
+            for (const std::string& p : extra_peers) {
+                torrent.add_peer(Endpoint::resolve_all(p));
+            }
+
+            // Optional read cache; report how well it does once a minute
+            std::unique_ptr<BlockCache> cache;
+            if (cache_mb > 0) {
+                cache = std::make_unique<BlockCache>(meta, storage, cache_mb * 1024 * 1024);
+                torrent.set_read_cache(cache.get());
+
+                loop.add_timer(std::chrono::seconds(60), [&cache] {
+                    const CacheStats& st = cache->stats();
+                    std::cerr << "[cache] hits " << st.hits << ", misses " << st.misses
+                              << ", hit rate " << static_cast<int>(st.hit_rate() * 100) << "%"
+                              << ", disk reads " << st.disk_reads
+                              << ", evictions " << st.evictions << "\n";
+                });
+            }
+
+            std::unique_ptr<Dht> dht;
+            if (use_dht) {
+                dht = start_dht(loop, port, dht_nodes, utp.get());
+                announce_on_dht(loop, *dht, torrent, meta.info_hash_raw, port);
+            }
+            std::unique_ptr<Lsd> lsd;
+            if (use_lsd) lsd = start_lsd(loop, torrent, meta, port);
+
+            std::cerr << "Seeding " << meta.name << " on port " << port << "\n";
+
+            TrackerManager trackers(loop, meta, engine_id);
+            run_with_trackers(loop, torrent, trackers, port);
+        }
+        else if (command == "session") {
+            // Several torrents on one loop and port, each <torrent_file>=<save_path>
+            Session::Config config;
+            config.listen_port = static_cast<std::uint16_t>(std::stoi(argv[2]));
+            std::vector<std::pair<std::string, std::string>> torrents;
+            std::vector<std::string> extra_peers;
+            ThreadPool::Config pool_config;
+            for (int i = 3; i < argc; ++i) {
+                std::string arg = argv[i];
+                if (arg == "--max-connections" && i + 1 < argc) {
+                    config.max_connections = std::stoul(argv[++i]);
+                }
+                else if (arg == "--reactors" && i + 1 < argc) {
+                    config.reactors = std::stoul(argv[++i]);
+                }
+                else if (arg == "--threads" && i + 1 < argc) {
+                    pool_config.threads = std::stoul(argv[++i]);
+                }
+                else if (arg == "--pin") {
+                    pool_config.pin = true;
+                }
+                else if (arg == "--upload-limit" && i + 1 < argc) {
+                    config.upload_limit = std::stoull(argv[++i]) * 1024;
+                }
+                else if (arg == "--download-limit" && i + 1 < argc) {
+                    config.download_limit = std::stoull(argv[++i]) * 1024;
+                }
+                else if (arg == "--peer" && i + 1 < argc) {
+                    extra_peers.push_back(argv[++i]);
+                }
+                else if (arg == "--utp") {
+                    config.utp = true;
+                }
+                else {
+                    auto eq = arg.find('=');
+                    if (eq == std::string::npos) throw std::runtime_error("Expected <torrent_file>=<save_path>: " + arg);
+                    torrents.emplace_back(arg.substr(0, eq), arg.substr(eq + 1));
+                }
+            }
+            if (torrents.empty()) {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            ThreadPool pool(pool_config);
+            std::vector<std::string> paths;
+            for (const auto& t : torrents) paths.push_back(t.first);
+            const std::vector<TorrentMeta> metas = parse_torrent_files(pool, paths);
+
+            EventLoop loop;
+            Session session(loop, random_peer_id(), config);
+            session.set_thread_pool(&pool);
+            for (std::size_t i = 0; i < torrents.size(); ++i) {
+                session.add_torrent(metas[i], torrents[i].second);
+                for (const std::string& p : extra_peers) {
+                    for (const Endpoint& ep : Endpoint::resolve_all(p)) session.add_peer(metas[i].info_hash_raw, ep);
+                }
+            }
+            std::cerr << "[*] Session with " << session.num_torrents() << " torrents on port "
+                      << config.listen_port << "\n";
+
+            EventLoop::TimerId status_timer = loop.add_timer(std::chrono::seconds(10), [&session] {
+                for (const Session::TorrentStatus& st : session.status()) {
+                    std::cerr << "[*] " << st.name << ": " << session_state_name(st.state) << " "
+                              << st.pieces << "/" << st.num_pieces << " pieces, down "
+                              << static_cast<std::uint64_t>(st.download_rate / 1024) << " KiB/s, up "
+                              << static_cast<std::uint64_t>(st.upload_rate / 1024) << " KiB/s, "
+                              << st.peers << " peers\n";
+                }
+            });
+
+            run_until_signal(loop, [&session](std::function<void()> done) {
+                std::cerr << "[*] Stopping, telling trackers...\n";
+                session.stop(std::move(done));
+            });
+            loop.cancel_timer(status_timer);
+        }
+        else if (command == "daemon") {
+            // Torrents come and go through the control socket
+            const std::string socket_path = argv[2];
+            Session::Config config;
+            std::size_t cache_mb = 0;
+            ThreadPool::Config pool_config;
+            for (int i = 3; i < argc; ++i) {
+                std::string arg = argv[i];
+                if (arg == "--max-connections" && i + 1 < argc) {
+                    config.max_connections = std::stoul(argv[++i]);
+                }
+                else if (arg == "--reactors" && i + 1 < argc) {
+                    config.reactors = std::stoul(argv[++i]);
+                }
+                else if (arg == "--threads" && i + 1 < argc) {
+                    pool_config.threads = std::stoul(argv[++i]);
+                }
+                else if (arg == "--pin") {
+                    pool_config.pin = true;
+                }
+                else if (arg == "--cache-mb" && i + 1 < argc) {
+                    cache_mb = std::stoul(argv[++i]);
+                }
+                else if (arg == "--upload-limit" && i + 1 < argc) {
+                    config.upload_limit = std::stoull(argv[++i]) * 1024;
+                }
+                else if (arg == "--download-limit" && i + 1 < argc) {
+                    config.download_limit = std::stoull(argv[++i]) * 1024;
+                }
+                else if (arg == "--utp") {
+                    config.utp = true;
+                }
+                else {
+                    config.listen_port = static_cast<std::uint16_t>(std::stoi(arg));
+                }
+            }
+            config.cache_bytes = cache_mb * 1024 * 1024;
+
+            ThreadPool pool(pool_config);
+            EventLoop loop;
+            Session session(loop, random_peer_id(), config);
+            session.set_thread_pool(&pool);
+            Daemon control(loop, session, socket_path);
+            std::cerr << "[*] Daemon on " << socket_path << ", peers on port " << config.listen_port << "\n";
+
+            bool stopping = false;
+            auto stop = [&](std::function<void()> done) {
+                if (stopping) return;
+                stopping = true;
+                std::cerr << "[*] Stopping, telling trackers...\n";
+                session.stop(std::move(done));
+            };
+            control.set_on_shutdown([&] {
+                stop([&loop] { loop.stop(); });
+                loop.add_timer(std::chrono::seconds(5), [&loop] { loop.stop(); }, false);
+            });
+            run_until_signal(loop, stop);
+        }
+        else if (command == "ctl") {
+            // Send each request as a JSON line and print the replies (and,
+            // after a subscribe, the events) as they come
+            if (argc < 4) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            const std::string socket_path = argv[2];
+            if (socket_path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path too long");
+            std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+            int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                throw std::runtime_error("Failed to connect to " + socket_path + ": " + std::strerror(errno));
+            }
+
+            std::size_t expected = 0;
+            bool subscribed = false;
+            for (int i = 3; i < argc; ++i) {
+                json request = json::parse(argv[i]);
+                if (request.value("cmd", "") == "subscribe" && request.value("interval_ms", 1000) != 0) {
+                    subscribed = true;
+                }
+                const std::string line = request.dump() + "\n";
+                write_all(fd, line.data(), line.size());
+                expected++;
+            }
+
+            std::string buffer;
+            char chunk[4096];
+            while (subscribed || expected > 0) {
+                ssize_t n = ::read(fd, chunk, sizeof(chunk));
+                if (n <= 0) break;
+                buffer.append(chunk, static_cast<std::size_t>(n));
+
+                std::size_t eol;
+                while ((eol = buffer.find('\n')) != std::string::npos) {
+                    const std::string line = buffer.substr(0, eol);
+                    buffer.erase(0, eol + 1);
+                    std::cout << line << std::endl;
+                    if (!json::parse(line).contains("event") && expected > 0) expected--;
+                }
+            }
+            ::close(fd);
+        }
+        else if (command == "create") {
+            // Hash a file or directory into a new .torrent
+            const std::string source = argv[2];
+            std::string output_path;
+            CreateOptions options;
+            ThreadPool::Config pool_config;
+            for (int i = 3; i < argc; ++i) {
+                std::string arg = argv[i];
+                if (arg == "-o" && i + 1 < argc) {
+                    output_path = argv[++i];
+                }
+                else if (arg == "--tracker" && i + 1 < argc) {
+                    options.announce = argv[++i];
+                }
+                else if (arg == "--piece-kb" && i + 1 < argc) {
+                    options.piece_length = std::stoll(argv[++i]) * 1024;
+                }
+                else if (arg == "--comment" && i + 1 < argc) {
+                    options.comment = argv[++i];
+                }
+                else if (arg == "--threads" && i + 1 < argc) {
+                    pool_config.threads = std::stoul(argv[++i]);
+                }
+                else if (arg == "--pin") {
+                    pool_config.pin = true;
+                }
+                else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+            }
+            if (output_path.empty()) {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            ThreadPool pool(pool_config);
+            const auto start = std::chrono::steady_clock::now();
+            const std::string encoded = create_torrent(pool, source, options);
+            const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start);
+
+            std::ofstream out(output_path, std::ios::binary | std::ios::trunc);
+            out.write(encoded.data(), static_cast<std::streamsize>(encoded.size()));
+            if (!out) throw std::runtime_error("Failed to write " + output_path);
+            out.close();
+
+            const TorrentMeta meta = parse_torrent_file(output_path);
+            const ThreadPool::Stats st = pool.stats();
+            std::cout << "Created " << output_path << "\n"
+                      << "Info Hash: " << sha1(meta.info_bencoded) << "\n"
+                      << "Pieces: " << meta.piece_hashes.size() << " x " << meta.piece_length / 1024 << " KiB, "
+                      << meta.files.size() << " file(s), " << meta.length << " bytes\n";
+            std::cerr << "[*] Hashed in " << elapsed.count() << " ms on " << st.threads << " threads ("
+                      << st.executed << " tasks, " << st.steals << " stolen)\n";
         }
         else {
             print_usage(argv[0]);
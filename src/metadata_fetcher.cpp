@@ -0,0 +1,250 @@
+#include "torrent/metadata_fetcher.hpp"
+#include "torrent/peer_messages.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    static constexpr std::size_t kMaxConnections = 30;
+    static constexpr auto kTickInterval = std::chrono::seconds(1);
+    // Peers that send nothing for this long (including the handshake) are dropped.
+    static constexpr auto kIdleTimeout = std::chrono::seconds(30);
+
+    MetadataFetcher::MetadataFetcher(EventLoop& loop, const std::array<std::uint8_t, 20>& info_hash,
+                                     const std::string& peer_id)
+        : m_loop(loop), m_info_hash(info_hash), m_peer_id(peer_id), m_connector(loop) {
+        if (m_peer_id.size() != 20) {
+            throw std::runtime_error("peer_id must be exactly 20 bytes");
+        }
+
+        auto metadata = std::make_unique<UtMetadata>(info_hash, [this](const std::string& info) {
+            if (m_on_done) m_on_done(info);
+        });
+        m_metadata = metadata.get();
+        m_extensions.add(std::move(metadata));
+
+        m_connector.set_on_connected([this](int fd, const Endpoint& remote, std::chrono::milliseconds) {
+            on_connected(fd, remote);
+        });
+        m_connector.set_want_more([this] { return !done() && m_conns.size() < kMaxConnections; });
+
+        m_tick_timer = m_loop.add_timer(kTickInterval, [this] { on_tick(); });
+    }
+
+    MetadataFetcher::~MetadataFetcher() {
+        m_loop.cancel_timer(m_tick_timer);
+        for (auto& kv : m_conns) {
+            m_loop.remove_fd(kv.first);
+            ::close(kv.first);
+        }
+    }
+
+    void MetadataFetcher::add_peer(const std::vector<Endpoint>& addresses) {
+        std::vector<Endpoint> fresh;
+        for (const Endpoint& ep : addresses) {
+            const bool connected = std::any_of(m_conns.begin(), m_conns.end(), [&ep](const auto& kv) {
+                return kv.second->remote == ep;
+            });
+            if (!connected) fresh.push_back(ep);
+        }
+        if (!fresh.empty()) m_connector.add(fresh);
+    }
+
+    void MetadataFetcher::on_connected(int fd, const Endpoint& remote) {
+        if (done()) {
+            ::close(fd);
+            return;
+        }
+
+        auto conn = std::make_unique<Conn>();
+        conn->owner     = this;
+        conn->fd        = fd;
+        conn->remote    = remote;
+        conn->last_recv = m_loop.now();
+
+        Reserved reserved{};
+        reserved[kReservedExtensionByte] |= kReservedExtensionBit;
+        Handshake hs = build_handshake(m_info_hash, m_peer_id, reserved);
+        conn->out.assign(hs.begin(), hs.end());
+
+        Conn* c = conn.get();
+        m_conns[fd] = std::move(conn);
+
+        m_loop.add_fd(fd, EPOLLIN, [this, c](std::uint32_t events) {
+            if (events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(c->fd, "socket error");
+                return;
+            }
+            if ((events & EPOLLOUT) && !flush(*c)) return;
+            if (events & EPOLLIN) on_readable(*c);
+        });
+        flush(*c);
+    }
+
+    void MetadataFetcher::close_connection(int fd, const std::string& reason) {
+        auto it = m_conns.find(fd);
+        if (it == m_conns.end()) return;
+
+        Conn& c = *it->second;
+        std::cerr << "[peer] " << c.remote.to_string() << " disconnected: " << reason << "\n";
+        if (c.handshake_done) {
+            for (const auto& ext : m_extensions.extensions()) ext->on_disconnect(c);
+        }
+
+        m_loop.remove_fd(fd);
+        ::close(fd);
+        m_conns.erase(it);
+        m_connector.start_queued();
+    }
+
+
+    // ----------------- Receiving -----------------
+
+    void MetadataFetcher::on_readable(Conn& c) {
+        const int fd = c.fd;
+
+        std::uint8_t buf[16 * 1024];
+        while (true) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.insert(c.in.end(), buf, buf + n);
+                c.last_recv = m_loop.now();
+                continue;
+            }
+            if (n == 0) {
+                close_connection(fd, "closed by peer");
+                return;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+            close_connection(fd, std::string("recv: ") + std::strerror(errno));
+            return;
+        }
+
+        if (!c.handshake_done && !handle_handshake(c)) return;
+
+        std::size_t pos = 0;
+        try {
+            while (c.handshake_done) {
+                BtMessageView msg;
+                std::size_t used = parse_message_view(c.in.data() + pos, c.in.size() - pos, msg);
+                if (used == 0) break;
+                pos += used;
+
+                if (msg.id == MsgId::Extended) {
+                    handle_extended(c, msg.payload, msg.payload_len);
+                    if (m_conns.find(fd) == m_conns.end()) return;
+                }
+            }
+        }
+        catch (const std::exception& ex) {
+            close_connection(fd, ex.what());
+            return;
+        }
+        c.in.erase(c.in.begin(), c.in.begin() + static_cast<std::ptrdiff_t>(pos));
+
+        flush(c);
+    }
+
+    bool MetadataFetcher::handle_handshake(Conn& c) {
+        if (c.in.size() < 68) return true;
+
+        if (c.in[0] != 19 || std::memcmp(&c.in[1], "BitTorrent protocol", 19) != 0) {
+            close_connection(c.fd, "invalid protocol string");
+            return false;
+        }
+        if (std::memcmp(&c.in[28], m_info_hash.data(), 20) != 0) {
+            close_connection(c.fd, "info_hash mismatch");
+            return false;
+        }
+        if (!supports_extensions(handshake_reserved(c.in.data()))) {
+            close_connection(c.fd, "no extension protocol");
+            return false;
+        }
+
+        c.in.erase(c.in.begin(), c.in.begin() + 68);
+        c.handshake_done = true;
+        std::cerr << "[peer] " << c.remote.to_string() << " connected\n";
+
+        const std::string payload = encode_bencode_value(m_extensions.handshake());
+        const auto bytes = build_extended(0, reinterpret_cast<const std::uint8_t*>(payload.data()), payload.size());
+        c.out.insert(c.out.end(), bytes.begin(), bytes.end());
+        return true;
+    }
+
+    void MetadataFetcher::handle_extended(Conn& c, const std::uint8_t* data, std::size_t len) {
+        if (len < 1) throw std::runtime_error("empty extended message");
+
+        if (data[0] == 0) {
+            merge_extension_handshake(c.ext, parse_extension_handshake(data + 1, len - 1));
+            if (!c.supports(m_metadata->name())) {
+                close_connection(c.fd, "no ut_metadata");
+                return;
+            }
+            m_metadata->on_handshake(c);
+            return;
+        }
+
+        if (Extension* ext = m_extensions.find(data[0])) {
+            ext->on_message(c, data + 1, len - 1);
+        }
+    }
+
+
+    // ----------------- Sending -----------------
+
+    void MetadataFetcher::Conn::send_extended(const std::string& name, const std::uint8_t* data, std::size_t len) {
+        auto it = ext.messages.find(name);
+        if (it == ext.messages.end()) return;
+
+        const auto bytes = build_extended(it->second, data, len);
+        out.insert(out.end(), bytes.begin(), bytes.end());
+    }
+
+    // Returns false if the connection had to be closed.
+    bool MetadataFetcher::flush(Conn& c) {
+        std::size_t sent = 0;
+        while (sent < c.out.size()) {
+            ssize_t n = ::send(c.fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                close_connection(c.fd, std::string("send: ") + std::strerror(errno));
+                return false;
+            }
+            sent += static_cast<std::size_t>(n);
+        }
+        c.out.erase(c.out.begin(), c.out.begin() + static_cast<std::ptrdiff_t>(sent));
+
+        m_loop.modify_fd(c.fd, c.out.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT));
+        return true;
+    }
+
+    void MetadataFetcher::on_tick() {
+        const auto now = m_loop.now();
+
+        std::vector<int> idle;
+        for (const auto& kv : m_conns) {
+            if (now - kv.second->last_recv > kIdleTimeout) idle.push_back(kv.first);
+        }
+        for (int fd : idle) close_connection(fd, "timed out");
+
+        for (const auto& ext : m_extensions.extensions()) ext->on_tick();
+
+        std::vector<int> fds;
+        for (const auto& kv : m_conns) fds.push_back(kv.first);
+        for (int fd : fds) {
+            auto it = m_conns.find(fd);
+            if (it != m_conns.end()) flush(*it->second);
+        }
+    }
+
+}
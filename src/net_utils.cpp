@@ -1,6 +1,11 @@
 #include "torrent/net_utils.hpp"
 
+#include <cerrno>
+#include <cstring>
 #include <stdexcept>
+#include <string>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -27,4 +32,49 @@ namespace torrent {
         }
     }
 
+    int open_listen_socket(std::uint16_t port, bool reuse_port) {
+        int fd = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        bool v6 = fd >= 0;
+        if (!v6) {
+            fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        }
+        if (fd < 0) {
+            throw std::runtime_error(std::string("listen socket failed: ") + std::strerror(errno));
+        }
+
+        int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (reuse_port && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+            const std::string error = std::strerror(errno);
+            ::close(fd);
+            throw std::runtime_error("SO_REUSEPORT failed: " + error);
+        }
+
+        int rc;
+        if (v6) {
+            int zero = 0;
+            ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+            sockaddr_in6 addr{};
+            addr.sin6_family = AF_INET6;
+            addr.sin6_addr   = in6addr_any;
+            addr.sin6_port   = htons(port);
+            rc = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+        else {
+            sockaddr_in addr{};
+            addr.sin_family      = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port        = htons(port);
+            rc = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+
+        if (rc != 0 || ::listen(fd, 128) != 0) {
+            std::string err = std::strerror(errno);
+            ::close(fd);
+            throw std::runtime_error("Failed to listen on port " + std::to_string(port) + ": " + err);
+        }
+        return fd;
+    }
+
 }
@@ -1,6 +1,7 @@
 #include "torrent/peer.hpp"
 #include "torrent/bencode.hpp"
 #include "torrent/net_utils.hpp"
+#include "torrent/peer_messages.hpp"
 #include "torrent/string_utils.hpp"
 
 #include <stdexcept>
@@ -10,28 +11,15 @@
 #include <cstring>
 #include <sstream>
 
+#include <cerrno>
+
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netdb.h>
 #include <unistd.h>
-#include <arpa/inet.h>
 
 namespace torrent {
 
     using Bytes20   = std::array<std::uint8_t, 20>;
-    using Handshake = std::array<std::uint8_t, 68>;
-
-    // Convert a std::string (length 20) to Bytes20
-    static Bytes20 to_bytes20(const std::string& s) {
-        if (s.size() != 20) {
-            throw std::runtime_error("to_bytes20: string must be exactly 20 bytes");
-        }
-        Bytes20 out{};
-        for (std::size_t i = 0; i < 20; ++i) {
-            out[i] = static_cast<std::uint8_t>(static_cast<unsigned char>(s[i]));
-        }
-        return out;
-    }
 
     static bool printable20(const std::uint8_t* data) {
         for (int i = 0; i < 20; ++i) {
@@ -41,66 +29,32 @@ namespace torrent {
         return true;
     }
 
-    static Handshake build_handshake(const Bytes20& info_hash, const Bytes20& peer_id) {
-        Handshake hs{};
-
-        const std::string pstr = "BitTorrent protocol";
-        const std::uint8_t pstrlen = static_cast<std::uint8_t>(pstr.size());
-
-        hs[0] = pstrlen;
-        std::memcpy(&hs[1], pstr.data(), pstr.size());
-        std::memcpy(&hs[28], info_hash.data(), 20);
-        std::memcpy(&hs[48], peer_id.data(), 20);
-
-        return hs;
-    }
-
 
     // ----------------- PeerConnection implementation -----------------
 
     PeerConnection::PeerConnection(
         const TorrentMeta& meta,
-        const Peer& peer,
+        const Endpoint& peer,
         const std::string& peer_id_ascii
     ): m_peer(peer) {
-        // 1) Resolve and connect
-        addrinfo hints{};
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_family   = AF_UNSPEC;
-
-        addrinfo* res = nullptr;
-        int gai = ::getaddrinfo(
-            peer.ip.c_str(),
-            std::to_string(peer.port).c_str(),
-            &hints,
-            &res
-        );
-        if (gai != 0) {
-            throw std::runtime_error(std::string("getaddrinfo: ") + gai_strerror(gai));
-        }
+        // 1) Connect
+        sockaddr_storage ss{};
+        socklen_t len = peer.to_sockaddr(ss);
 
-        int fd = -1;
-        for (addrinfo* it = res; it; it = it->ai_next) {
-            int s = ::socket(it->ai_family, it->ai_socktype, it->ai_protocol);
-            if (s < 0) continue;
-
-            // 5s timeouts like in your code
-            timeval tv{};
-            tv.tv_sec  = 5;
-            tv.tv_usec = 0;
-            ::setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-            ::setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-            if (::connect(s, it->ai_addr, it->ai_addrlen) == 0) {
-                fd = s;
-                break;
-            }
-            ::close(s);
+        int fd = ::socket(ss.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
         }
 
-        ::freeaddrinfo(res);
+        // 5s timeouts like in your code
+        timeval tv{};
+        tv.tv_sec  = 5;
+        tv.tv_usec = 0;
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-        if (fd < 0) {
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0) {
+            ::close(fd);
             throw std::runtime_error("connect failed");
         }
 
@@ -119,7 +73,7 @@ namespace torrent {
 
     std::unique_ptr<PeerConnection> PeerConnection::connect_and_handshake(
         const TorrentMeta& meta,
-        const Peer& peer,
+        const Endpoint& peer,
         const std::string& peer_id_ascii
     ) {
         return std::unique_ptr<PeerConnection>(
@@ -140,8 +94,7 @@ namespace torrent {
             info_hash[i] = meta.info_hash_raw[i];
         }
 
-        Bytes20 peer_id = to_bytes20(peer_id_ascii);
-        Handshake out_hs = build_handshake(info_hash, peer_id);
+        Handshake out_hs = build_handshake(info_hash, peer_id_ascii);
 
         // Send our handshake
         write_all(m_socket_fd, out_hs.data(), out_hs.size());
@@ -178,6 +131,6 @@ namespace torrent {
             std::cout << "Peer ID: " << hex(pid, 20) << "\n";
         }
 
-        std::cerr << "Handshake OK with " << m_peer.ip << ":" << m_peer.port << "\n";
+        std::cerr << "Handshake OK with " << m_peer.to_string() << "\n";
     }
 }
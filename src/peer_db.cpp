@@ -0,0 +1,149 @@
+#include "torrent/peer_db.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+namespace torrent {
+
+    // A peer that just dropped us isn't worth retrying for a while.
+    static constexpr auto kRecentDisconnect = std::chrono::seconds(60);
+    // Old peak rates fade by this factor per update (about every 10 s).
+    static constexpr double kRateDecay = 0.9;
+    static constexpr double kRateUnit = 16 * 1024;
+    // Score bonus of peers on our LAN, which cost far less to talk to.
+    static constexpr double kLocalBonus = 30;
+
+    static Endpoint address_of(const Endpoint& peer) {
+        Endpoint ep = peer;
+        ep.port = 0;
+        return ep;
+    }
+
+    PeerRecord& PeerDb::record(const Endpoint& peer) {
+        auto it = m_records.find(peer);
+        if (it != m_records.end()) return it->second;
+
+        if (m_records.size() >= kMaxRecords) trim();
+        return m_records[peer];
+    }
+
+    // Drop the least recently seen quarter of the unconnected records.
+    void PeerDb::trim() {
+        std::vector<std::pair<Clock::time_point, Endpoint>> idle;
+        for (const auto& kv : m_records) {
+            if (!kv.second.connected) idle.emplace_back(kv.second.last_seen, kv.first);
+        }
+
+        std::size_t drop = std::min(idle.size(), kMaxRecords / 4);
+        std::nth_element(idle.begin(), idle.begin() + static_cast<std::ptrdiff_t>(drop), idle.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (std::size_t i = 0; i < drop; ++i) m_records.erase(idle[i].second);
+    }
+
+    const PeerRecord* PeerDb::find(const Endpoint& peer) const {
+        auto it = m_records.find(peer);
+        return it == m_records.end() ? nullptr : &it->second;
+    }
+
+    void PeerDb::seen(const Endpoint& peer, Clock::time_point now) {
+        record(peer).last_seen = now;
+    }
+
+    void PeerDb::seen_local(const Endpoint& peer, Clock::time_point now) {
+        PeerRecord& r = record(peer);
+        r.last_seen = now;
+        r.local = true;
+    }
+
+    void PeerDb::connected(const Endpoint& peer, std::chrono::milliseconds rtt, Clock::time_point now) {
+        PeerRecord& r = record(peer);
+        if (rtt.count() > 0) {
+            // Smooth like TCP's SRTT so one slow handshake doesn't stick
+            r.rtt = r.rtt.count() == 0 ? rtt : (r.rtt * 7 + rtt) / 8;
+        }
+        r.failed_connects = 0;
+        r.connected = true;
+        r.last_seen = now;
+    }
+
+    void PeerDb::connect_failed(const Endpoint& peer, Clock::time_point now) {
+        PeerRecord& r = record(peer);
+        r.failed_connects++;
+        r.last_disconnect_at = now;
+    }
+
+    void PeerDb::disconnected(const Endpoint& peer, const std::string& reason, Clock::time_point now) {
+        PeerRecord& r = record(peer);
+        r.connected = false;
+        r.disconnects++;
+        r.last_disconnect = reason;
+        r.last_disconnect_at = now;
+        r.last_seen = now;
+    }
+
+    void PeerDb::update_transfer(const Endpoint& peer, double download_rate, double upload_rate,
+                                 std::uint64_t downloaded, std::uint64_t uploaded) {
+        PeerRecord& r = record(peer);
+        r.download_rate = std::max(r.download_rate * kRateDecay, download_rate);
+        r.upload_rate   = std::max(r.upload_rate * kRateDecay, upload_rate);
+        r.downloaded = downloaded;
+        r.uploaded   = uploaded;
+    }
+
+    bool PeerDb::hash_failure(const Endpoint& peer, bool sole_source) {
+        PeerRecord& r = record(peer);
+        r.hash_failures++;
+        if (sole_source) {
+            ban(peer);
+            return true;
+        }
+        r.on_parole = true;
+        return is_banned(peer);
+    }
+
+    void PeerDb::good_piece(const Endpoint& peer) {
+        auto it = m_records.find(peer);
+        if (it != m_records.end()) it->second.on_parole = false;
+    }
+
+    bool PeerDb::on_parole(const Endpoint& peer) const {
+        const PeerRecord* r = find(peer);
+        return r && r->on_parole;
+    }
+
+    void PeerDb::ban(const Endpoint& peer) {
+        if (m_banned.insert(address_of(peer)).second) {
+            std::cerr << "[peer] banned " << peer.address_string() << "\n";
+        }
+    }
+
+    bool PeerDb::is_banned(const Endpoint& peer) const {
+        return m_banned.count(address_of(peer)) != 0;
+    }
+
+    double PeerDb::score(const Endpoint& peer, Clock::time_point now) const {
+        if (is_banned(peer)) return -std::numeric_limits<double>::infinity();
+
+        const PeerRecord* r = find(peer);
+        if (!r) return 0;
+
+        double s = 0;
+        s += 10 * std::log2(1 + r->download_rate / kRateUnit);
+        s += 5 * std::log2(1 + r->upload_rate / kRateUnit);
+        if (r->local) s += kLocalBonus;
+
+        // -1 per 20 ms of connect time, capped so distance alone can't sink a peer
+        if (r->rtt.count() > 0) s -= std::min(static_cast<double>(r->rtt.count()) / 20.0, 25.0);
+
+        s -= 15.0 * r->failed_connects;
+        s -= 25.0 * r->hash_failures;
+        if (r->last_disconnect_at != Clock::time_point{} && now - r->last_disconnect_at < kRecentDisconnect) {
+            s -= 20;
+        }
+        return s;
+    }
+
+}
@@ -1,6 +1,8 @@
 #include "torrent/peer_messages.hpp"
 #include "torrent/net_utils.hpp"
+#include "torrent/bencode.hpp"
 
+#include <algorithm>
 #include <stdexcept>
 #include <cstring>
 #include <sys/types.h>
@@ -9,6 +11,73 @@
 
 namespace torrent {
 
+    // ----------------- Payload helpers -----------------
+
+    std::uint32_t read_u32_be(const std::uint8_t* p) {
+        std::uint32_t v;
+        std::memcpy(&v, p, 4);
+        return ntohl(v);
+    }
+
+    void write_u32_be(std::uint8_t* p, std::uint32_t v) {
+        std::uint32_t be = htonl(v);
+        std::memcpy(p, &be, 4);
+    }
+
+
+    // ----------------- Builders -----------------
+
+    Handshake build_handshake(
+        const std::array<std::uint8_t, 20>& info_hash,
+        const std::string& peer_id,
+        const Reserved& reserved
+    ) {
+        if (peer_id.size() != 20) {
+            throw std::runtime_error("peer_id must be exactly 20 bytes");
+        }
+
+        Handshake hs{};
+
+        const std::string pstr = "BitTorrent protocol";
+        const std::uint8_t pstrlen = static_cast<std::uint8_t>(pstr.size());
+
+        hs[0] = pstrlen;
+        std::memcpy(&hs[1], pstr.data(), pstr.size());
+        std::memcpy(&hs[20], reserved.data(), 8);
+        std::memcpy(&hs[28], info_hash.data(), 20);
+        std::memcpy(&hs[48], peer_id.data(), 20);
+
+        return hs;
+    }
+
+    Reserved handshake_reserved(const std::uint8_t* handshake) {
+        Reserved r{};
+        std::memcpy(r.data(), handshake + 20, 8);
+        return r;
+    }
+
+    bool supports_fast(const Reserved& reserved) {
+        return (reserved[kReservedFastByte] & kReservedFastBit) != 0;
+    }
+
+    bool supports_extensions(const Reserved& reserved) {
+        return (reserved[kReservedExtensionByte] & kReservedExtensionBit) != 0;
+    }
+
+    bool supports_dht(const Reserved& reserved) {
+        return (reserved[kReservedDhtByte] & kReservedDhtBit) != 0;
+    }
+
+    std::vector<std::uint8_t> build_message(MsgId id, const std::vector<std::uint8_t>& payload) {
+        std::vector<std::uint8_t> msg(4 + 1 + payload.size());
+        write_u32_be(msg.data(), static_cast<std::uint32_t>(1 + payload.size()));
+        msg[4] = static_cast<std::uint8_t>(id);
+        if (!payload.empty()) {
+            std::memcpy(msg.data() + 5, payload.data(), payload.size());
+        }
+        return msg;
+    }
+
     std::vector<std::uint8_t> build_interested() {
         // length = 1 (just the message ID), id = 2
         std::vector<std::uint8_t> msg;
@@ -46,6 +115,108 @@ namespace torrent {
         return msg;
     }
 
+    std::vector<std::uint8_t> build_have(std::uint32_t piece_index) {
+        std::vector<std::uint8_t> payload(4);
+        write_u32_be(payload.data(), piece_index);
+        return build_message(MsgId::Have, payload);
+    }
+
+    std::vector<std::uint8_t> build_bitfield(const std::vector<bool>& have) {
+        // High bit of the first byte is piece 0
+        std::vector<std::uint8_t> payload((have.size() + 7) / 8, 0);
+        for (std::size_t i = 0; i < have.size(); ++i) {
+            if (have[i]) payload[i / 8] |= static_cast<std::uint8_t>(0x80 >> (i % 8));
+        }
+        return build_message(MsgId::Bitfield, payload);
+    }
+
+    std::vector<std::uint8_t> build_reject(
+        std::uint32_t piece_index,
+        std::uint32_t begin,
+        std::uint32_t length
+    ) {
+        std::vector<std::uint8_t> payload(12);
+        write_u32_be(payload.data(), piece_index);
+        write_u32_be(payload.data() + 4, begin);
+        write_u32_be(payload.data() + 8, length);
+        return build_message(MsgId::Reject, payload);
+    }
+
+    std::vector<std::uint8_t> build_extended(std::uint8_t ext_id, const std::uint8_t* payload, std::size_t len) {
+        std::vector<std::uint8_t> msg(4 + 2 + len);
+        write_u32_be(msg.data(), static_cast<std::uint32_t>(2 + len));
+        msg[4] = static_cast<std::uint8_t>(MsgId::Extended);
+        msg[5] = ext_id;
+        if (len > 0) std::memcpy(msg.data() + 6, payload, len);
+        return msg;
+    }
+
+    std::vector<std::uint8_t> build_allowed_fast(std::uint32_t piece_index) {
+        std::vector<std::uint8_t> payload(4);
+        write_u32_be(payload.data(), piece_index);
+        return build_message(MsgId::AllowedFast, payload);
+    }
+
+    std::vector<std::uint8_t> build_port(std::uint16_t dht_port) {
+        std::vector<std::uint8_t> payload{static_cast<std::uint8_t>(dht_port >> 8),
+                                          static_cast<std::uint8_t>(dht_port & 0xFF)};
+        return build_message(MsgId::Port, payload);
+    }
+
+    std::vector<std::uint8_t> build_suggest(std::uint32_t piece_index) {
+        std::vector<std::uint8_t> payload(4);
+        write_u32_be(payload.data(), piece_index);
+        return build_message(MsgId::Suggest, payload);
+    }
+
+    std::vector<std::uint32_t> allowed_fast_set(
+        const std::uint8_t* address,
+        std::size_t address_len,
+        const std::array<std::uint8_t, 20>& info_hash,
+        std::uint32_t num_pieces,
+        std::size_t k
+    ) {
+        std::vector<std::uint32_t> set;
+        if (num_pieces == 0) return set;
+        k = std::min<std::size_t>(k, num_pieces);
+
+        // x = masked address + info hash; keep hashing x and taking 4-byte words
+        std::string x(reinterpret_cast<const char*>(address), address_len);
+        if (address_len == 4) {
+            x[3] = 0;
+        }
+        else {
+            for (std::size_t i = 8; i < x.size(); ++i) x[i] = 0;
+        }
+        x.append(reinterpret_cast<const char*>(info_hash.data()), info_hash.size());
+
+        while (set.size() < k) {
+            x = sha1_raw(x);
+            for (std::size_t i = 0; i < 5 && set.size() < k; ++i) {
+                std::uint32_t y = read_u32_be(reinterpret_cast<const std::uint8_t*>(x.data()) + i * 4);
+                std::uint32_t index = y % num_pieces;
+                if (std::find(set.begin(), set.end(), index) == set.end()) set.push_back(index);
+            }
+        }
+        return set;
+    }
+
+    std::array<std::uint8_t, 13> build_piece_header(
+        std::uint32_t piece_index,
+        std::uint32_t begin,
+        std::uint32_t block_length
+    ) {
+        std::array<std::uint8_t, 13> hdr{};
+        write_u32_be(hdr.data(), 9 + block_length);
+        hdr[4] = static_cast<std::uint8_t>(MsgId::Piece);
+        write_u32_be(hdr.data() + 5, piece_index);
+        write_u32_be(hdr.data() + 9, begin);
+        return hdr;
+    }
+
+
+    // ----------------- Parsing -----------------
+
     BtMessage read_message(int sock_fd) {
         BtMessage out;
 
@@ -73,4 +244,51 @@ namespace torrent {
         return out;
     }
 
+    std::size_t parse_message_view(const std::uint8_t* data, std::size_t len, BtMessageView& out) {
+        if (len < 4) return 0;
+
+        std::uint32_t msg_len = read_u32_be(data);
+        if (msg_len > kMaxMessageLength) {
+            throw std::runtime_error("message too long: " + std::to_string(msg_len));
+        }
+        if (len < 4 + static_cast<std::size_t>(msg_len)) return 0;
+
+        out.length = msg_len;
+        if (msg_len == 0) {
+            out.id.reset(); // keep-alive
+            out.payload = nullptr;
+            out.payload_len = 0;
+        }
+        else {
+            out.id = static_cast<MsgId>(data[4]);
+            out.payload = data + 5;
+            out.payload_len = msg_len - 1;
+        }
+
+        return 4 + static_cast<std::size_t>(msg_len);
+    }
+
+    std::size_t parse_message(const std::uint8_t* data, std::size_t len, BtMessage& out) {
+        BtMessageView view;
+        std::size_t used = parse_message_view(data, len, view);
+        if (used == 0) return 0;
+
+        out.length = view.length;
+        out.id = view.id;
+        out.payload.assign(view.payload, view.payload + view.payload_len);
+        return used;
+    }
+
+    std::vector<bool> parse_bitfield(const std::vector<std::uint8_t>& payload, std::uint32_t num_pieces) {
+        if (payload.size() != (num_pieces + 7) / 8) {
+            throw std::runtime_error("bitfield has wrong length");
+        }
+
+        std::vector<bool> have(num_pieces, false);
+        for (std::uint32_t i = 0; i < num_pieces; ++i) {
+            have[i] = (payload[i / 8] & (0x80 >> (i % 8))) != 0;
+        }
+        return have;
+    }
+
 }
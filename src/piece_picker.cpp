@@ -0,0 +1,101 @@
+#include "torrent/piece_picker.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace torrent {
+
+    PiecePicker::PiecePicker(std::uint32_t num_pieces)
+        : m_priority(num_pieces, static_cast<std::uint8_t>(FilePriority::Normal)),
+          m_have(num_pieces, false),
+          m_downloading(num_pieces, false),
+          m_availability(num_pieces, 0) {}
+
+    void PiecePicker::apply_file_priorities(
+        const TorrentMeta& meta,
+        const std::vector<FilePriority>& file_priorities
+    ) {
+        if (file_priorities.size() != meta.files.size()) {
+            throw std::runtime_error("apply_file_priorities: file priority count does not match file count");
+        }
+
+        std::fill(m_priority.begin(), m_priority.end(), 0);
+
+        const std::uint64_t full = static_cast<std::uint64_t>(meta.piece_length);
+        for (std::size_t i = 0; i < meta.files.size(); ++i) {
+            const FileEntry& f = meta.files[i];
+            if (f.length == 0) continue;
+
+            std::uint8_t prio = static_cast<std::uint8_t>(file_priorities[i]);
+            std::uint64_t first = static_cast<std::uint64_t>(f.offset) / full;
+            std::uint64_t last  = static_cast<std::uint64_t>(f.offset + f.length - 1) / full;
+
+            for (std::uint64_t p = first; p <= last && p < m_priority.size(); ++p) {
+                m_priority[p] = std::max(m_priority[p], prio);
+            }
+        }
+    }
+
+    void PiecePicker::set_piece_priority(std::uint32_t piece, std::uint8_t prio) {
+        m_priority.at(piece) = prio;
+    }
+
+    void PiecePicker::mark_have(std::uint32_t piece) {
+        if (!m_have.at(piece)) {
+            m_have[piece] = true;
+            m_num_have++;
+        }
+    }
+
+    void PiecePicker::add_peer_pieces(const std::vector<bool>& peer_has) {
+        for (std::uint32_t i = 0; i < m_availability.size() && i < peer_has.size(); ++i) {
+            if (peer_has[i]) m_availability[i]++;
+        }
+    }
+
+    void PiecePicker::remove_peer_pieces(const std::vector<bool>& peer_has) {
+        for (std::uint32_t i = 0; i < m_availability.size() && i < peer_has.size(); ++i) {
+            if (peer_has[i] && m_availability[i] > 0) m_availability[i]--;
+        }
+    }
+
+    void PiecePicker::inc_availability(std::uint32_t piece) {
+        m_availability.at(piece)++;
+    }
+
+    std::optional<std::uint32_t> PiecePicker::pick_piece(const std::vector<bool>& peer_has) const {
+        std::optional<std::uint32_t> best;
+        std::uint8_t best_prio = 0;
+        std::uint32_t best_avail = 0;
+
+        for (std::uint32_t i = 0; i < m_have.size(); ++i) {
+            if (m_have[i] || m_downloading[i] || m_priority[i] == 0) continue;
+            if (!peer_has.empty() && (i >= peer_has.size() || !peer_has[i])) continue;
+
+            bool better = !best ||
+                m_priority[i] > best_prio ||
+                (m_priority[i] == best_prio && m_availability[i] < best_avail);
+            if (better) {
+                best = i;
+                best_prio = m_priority[i];
+                best_avail = m_availability[i];
+            }
+        }
+
+        return best;
+    }
+
+    std::uint32_t PiecePicker::num_wanted() const {
+        return static_cast<std::uint32_t>(
+            std::count_if(m_priority.begin(), m_priority.end(), [](std::uint8_t p) { return p != 0; })
+        );
+    }
+
+    bool PiecePicker::is_finished() const {
+        for (std::uint32_t i = 0; i < m_have.size(); ++i) {
+            if (m_priority[i] != 0 && !m_have[i]) return false;
+        }
+        return true;
+    }
+
+}
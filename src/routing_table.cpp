@@ -0,0 +1,146 @@
+#include "torrent/routing_table.hpp"
+
+#include <algorithm>
+#include <random>
+
+namespace torrent {
+
+    int common_prefix_bits(const NodeId& a, const NodeId& b) {
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            const unsigned x = static_cast<unsigned>(a[i] ^ b[i]);
+            if (x != 0) return static_cast<int>(i * 8) + __builtin_clz(x) - 24;
+        }
+        return 160;
+    }
+
+    bool closer_to(const NodeId& target, const NodeId& a, const NodeId& b) {
+        for (std::size_t i = 0; i < target.size(); ++i) {
+            const std::uint8_t da = a[i] ^ target[i];
+            const std::uint8_t db = b[i] ^ target[i];
+            if (da != db) return da < db;
+        }
+        return false;
+    }
+
+    NodeId random_node_id() {
+        static thread_local std::mt19937 rng(std::random_device{}());
+        NodeId id;
+        for (auto& b : id) b = static_cast<std::uint8_t>(rng());
+        return id;
+    }
+
+    RoutingTable::RoutingTable(const NodeId& self, std::size_t k) : m_self(self), m_k(k) {}
+
+    std::size_t RoutingTable::bucket_index(const NodeId& id) const {
+        return static_cast<std::size_t>(common_prefix_bits(m_self, id));
+    }
+
+    bool RoutingTable::add(const NodeId& id, const Endpoint& endpoint, Clock::time_point now) {
+        const std::size_t index = bucket_index(id);
+        if (index >= m_buckets.size()) return false; // our own id
+
+        Bucket& bucket = m_buckets[index];
+        auto it = std::find_if(bucket.nodes.begin(), bucket.nodes.end(),
+                               [&id](const NodeEntry& n) { return n.id == id; });
+        if (it != bucket.nodes.end()) {
+            it->endpoint = endpoint;
+            it->last_seen = now;
+            it->failed = 0;
+            bucket.last_changed = now;
+            return true;
+        }
+
+        if (bucket.nodes.size() >= m_k) {
+            // Good nodes stay; only one that has let us down makes room
+            auto worst = std::max_element(bucket.nodes.begin(), bucket.nodes.end(),
+                                          [](const NodeEntry& a, const NodeEntry& b) { return a.failed < b.failed; });
+            if (worst->failed == 0) return false;
+            bucket.nodes.erase(worst);
+            m_size--;
+        }
+
+        bucket.nodes.push_back(NodeEntry{id, endpoint, now, 0});
+        bucket.last_changed = now;
+        m_size++;
+        return true;
+    }
+
+    void RoutingTable::failed(const NodeId& id) {
+        const std::size_t index = bucket_index(id);
+        if (index >= m_buckets.size()) return;
+
+        auto& nodes = m_buckets[index].nodes;
+        auto it = std::find_if(nodes.begin(), nodes.end(), [&id](const NodeEntry& n) { return n.id == id; });
+        if (it == nodes.end()) return;
+
+        if (++it->failed >= kMaxFailures) {
+            nodes.erase(it);
+            m_size--;
+        }
+    }
+
+    void RoutingTable::remove(const NodeId& id) {
+        const std::size_t index = bucket_index(id);
+        if (index >= m_buckets.size()) return;
+
+        auto& nodes = m_buckets[index].nodes;
+        auto it = std::find_if(nodes.begin(), nodes.end(), [&id](const NodeEntry& n) { return n.id == id; });
+        if (it == nodes.end()) return;
+        nodes.erase(it);
+        m_size--;
+    }
+
+    // Let b = common_prefix_bits(self, target). Nodes in bucket b share b+1
+    // bits with the target, nodes in buckets above b share exactly b, and
+    // a node in bucket i < b shares only i. So the buckets, nearest first,
+    // are: b, then all of b+1..159 together, then b-1, b-2, ..., 0. Whole
+    // groups are taken in that order until there are enough candidates,
+    // and only those are sorted.
+    std::vector<NodeEntry> RoutingTable::closest(const NodeId& target, std::size_t count) const {
+        std::vector<NodeEntry> out;
+        if (count == 0) return out;
+
+        const int b = common_prefix_bits(m_self, target);
+        auto take = [&out, this](int index) {
+            const auto& nodes = m_buckets[static_cast<std::size_t>(index)].nodes;
+            out.insert(out.end(), nodes.begin(), nodes.end());
+        };
+
+        int next_lower = b - 1;
+        if (b < 160) {
+            take(b);
+            if (out.size() < count) {
+                for (int i = b + 1; i < 160; ++i) take(i);
+            }
+        }
+        else {
+            next_lower = 159; // the target is our own id
+        }
+        for (int i = next_lower; i >= 0 && out.size() < count; --i) take(i);
+
+        const std::size_t n = std::min(count, out.size());
+        std::partial_sort(out.begin(), out.begin() + static_cast<std::ptrdiff_t>(n), out.end(),
+                          [&target](const NodeEntry& x, const NodeEntry& y) { return closer_to(target, x.id, y.id); });
+        out.resize(n);
+        return out;
+    }
+
+    std::vector<NodeId> RoutingTable::stale_buckets(Clock::time_point before) const {
+        std::vector<NodeId> ids;
+        for (std::size_t i = 0; i < m_buckets.size(); ++i) {
+            if (m_buckets[i].nodes.empty() || m_buckets[i].last_changed >= before) continue;
+
+            // Our first i bits, the opposite of bit i, then anything
+            NodeId id = random_node_id();
+            for (std::size_t bit = 0; bit <= i; ++bit) {
+                const std::uint8_t mask = static_cast<std::uint8_t>(0x80 >> (bit % 8));
+                const bool set = bit < i ? (m_self[bit / 8] & mask) != 0 : (m_self[bit / 8] & mask) == 0;
+                if (set) id[bit / 8] |= mask;
+                else id[bit / 8] &= static_cast<std::uint8_t>(~mask);
+            }
+            ids.push_back(id);
+        }
+        return ids;
+    }
+
+}
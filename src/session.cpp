@@ -0,0 +1,772 @@
+#include "torrent/session.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "torrent/net_utils.hpp"
+
+namespace torrent {
+
+    // Bytes of existing data verified per loop turn while checking.
+    static constexpr std::uint64_t kCheckBytesPerTurn = 4 * 1024 * 1024;
+    // Enough of a handshake to know its torrent: protocol string, reserved
+    // bytes and info hash.
+    static constexpr std::size_t kHandshakePrefix = 48;
+    static constexpr std::size_t kMaxPending = 256;
+    static constexpr auto kPendingTimeout = std::chrono::seconds(10);
+
+    // A reactor thread with the session holding its shard of the torrents.
+    struct Session::Shard {
+        EventLoop loop;
+        std::unique_ptr<Session> session; // used on `thread` only
+        std::thread thread;
+
+        // Published by the shard every tick for the coordinating session
+        std::atomic<std::uint64_t> uploaded{0};
+        std::atomic<std::uint64_t> downloaded{0};
+        std::atomic<std::size_t> connections{0};
+
+        // The coordinating session's bookkeeping, on its own thread
+        std::size_t torrents = 0;
+        std::uint64_t sampled_up = 0;
+        std::uint64_t sampled_down = 0;
+        std::uint64_t upload_share = 0;
+        std::uint64_t download_share = 0;
+    };
+
+    // Run `fn` on `loop`'s thread and wait for its result (or exception).
+    template <typename F>
+    static auto call_on(EventLoop& loop, F fn) -> decltype(fn()) {
+        auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+        auto result = task->get_future();
+        loop.post([task] { (*task)(); });
+        return result.get();
+    }
+
+    // `total` split over `n` parts as evenly as whole numbers allow.
+    static std::uint64_t share_of(std::uint64_t total, std::size_t n, std::size_t i) {
+        return total / n + (i < total % n ? 1 : 0);
+    }
+
+    // Split a rate limit over the shards. A shard that didn't use (nearly)
+    // all of its share last second gets a bit more than it used; the rest
+    // is divided among those that did, so the limit follows the traffic.
+    static std::vector<std::uint64_t> split_rate(std::uint64_t limit, const std::vector<std::uint64_t>& used,
+                                                 const std::vector<std::uint64_t>& shares) {
+        const std::size_t n = used.size();
+        std::vector<std::uint64_t> out(n, 0);
+        if (limit == 0) return out;
+
+        const std::uint64_t floor = std::max<std::uint64_t>(limit / (n * 8), 1);
+        std::uint64_t given = 0;
+        std::vector<std::size_t> hungry;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (shares[i] == 0 || used[i] >= shares[i] - shares[i] / 10) {
+                hungry.push_back(i);
+            }
+            else {
+                out[i] = std::max(floor, used[i] + used[i] / 4);
+                given += out[i];
+            }
+        }
+        if (given >= limit) {
+            for (std::size_t i = 0; i < n; ++i) out[i] = share_of(limit, n, i);
+            return out;
+        }
+
+        const std::uint64_t rest = limit - given;
+        if (hungry.empty()) {
+            for (std::size_t i = 0; i < n; ++i) out[i] += share_of(rest, n, i);
+        }
+        else {
+            for (std::size_t k = 0; k < hungry.size(); ++k) out[hungry[k]] = share_of(rest, hungry.size(), k);
+        }
+        return out;
+    }
+
+    const char* session_state_name(Session::State state) {
+        switch (state) {
+            case Session::State::Checking:    return "checking";
+            case Session::State::Downloading: return "downloading";
+            case Session::State::Seeding:     return "seeding";
+            case Session::State::Paused:      return "paused";
+        }
+        return "?";
+    }
+
+    Session::Session(EventLoop& loop, const std::string& peer_id) : Session(loop, peer_id, Config{}) {}
+
+    Session::Session(EventLoop& loop, const std::string& peer_id, Config config)
+        : m_loop(loop), m_peer_id(peer_id), m_config(std::move(config)), m_http(loop), m_udp_trackers(loop) {
+        m_budget.limit = m_config.max_connections;
+        if (m_config.reactors > 1) {
+            start_shards();
+            m_tick_timer = m_loop.add_timer(std::chrono::seconds(1), [this] { on_tick(); });
+            return;
+        }
+        set_limits(m_config.upload_limit, m_config.download_limit);
+
+        m_listen_fd = open_listen_socket(m_config.listen_port, m_config.reuse_port);
+        if (m_config.utp) {
+            try {
+                m_utp = std::make_unique<UtpSocketManager>(m_loop, m_config.listen_port);
+            }
+            catch (...) {
+                ::close(m_listen_fd);
+                throw;
+            }
+            m_utp->set_on_accept([this](int fd, const Endpoint& remote) { add_pending(fd, remote); });
+        }
+
+        m_loop.add_fd(m_listen_fd, EPOLLIN, [this](std::uint32_t) { on_accept(); });
+        m_tick_timer = m_loop.add_timer(std::chrono::seconds(1), [this] { on_tick(); });
+    }
+
+    Session::~Session() {
+        *m_alive = false;
+        m_loop.cancel_timer(m_tick_timer);
+        if (!m_shards.empty()) {
+            // Each session goes on its own thread, then the threads
+            for (auto& s : m_shards) {
+                Shard* sp = s.get();
+                sp->loop.post([sp] {
+                    sp->session.reset();
+                    sp->loop.stop();
+                });
+            }
+            for (auto& s : m_shards) s->thread.join();
+            return;
+        }
+        if (m_check_timer) m_loop.cancel_timer(m_check_timer);
+        for (const auto& kv : m_pending) {
+            m_loop.remove_fd(kv.first);
+            ::close(kv.first);
+        }
+        m_loop.remove_fd(m_listen_fd);
+        ::close(m_listen_fd);
+
+        // Torrents first: their connections may be uTP streams
+        m_entries.clear();
+        m_retired.clear();
+        if (m_utp) m_utp->set_on_accept(nullptr);
+    }
+
+
+    // ----------------- Torrents -----------------
+
+    void Session::add_torrent(const TorrentMeta& meta, const std::string& save_path,
+                              std::vector<FilePriority> file_priorities) {
+        const InfoHash& h = meta.info_hash_raw;
+        if (contains(h)) throw std::runtime_error("Torrent already added: " + meta.name);
+
+        if (!m_shards.empty()) {
+            // To the shard with the fewest torrents
+            Shard* s = m_shards.front().get();
+            for (auto& other : m_shards) {
+                if (other->torrents < s->torrents) s = other.get();
+            }
+            Session* target = s->session.get();
+            call_on(s->loop, [target, &meta, &save_path, &file_priorities] {
+                target->add_torrent(meta, save_path, std::move(file_priorities));
+            });
+            s->torrents++;
+            m_owners[h] = s;
+            publish_routes();
+            split_connections();
+            return;
+        }
+
+        auto e = std::make_unique<Entry>();
+        e->meta = std::make_shared<const TorrentMeta>(meta);
+        e->storage = std::make_unique<Storage>(*e->meta, save_path, std::move(file_priorities));
+        e->have.assign(meta.piece_hashes.size(), false);
+        if (m_config.cache_bytes > 0) {
+            e->cache = std::make_unique<BlockCache>(*e->meta, *e->storage, m_config.cache_bytes);
+        }
+        if (m_pool) e->jobs = std::make_unique<TaskGroup>(*m_pool);
+        m_entries.emplace(h, std::move(e));
+
+        m_check_queue.push_back(h);
+        if (!m_check_timer) {
+            m_check_timer = m_loop.add_timer(std::chrono::milliseconds(1), [this] { check_some(); });
+        }
+    }
+
+    void Session::remove_torrent(const InfoHash& info_hash) {
+        if (!m_shards.empty()) {
+            auto owner_it = m_owners.find(info_hash);
+            if (owner_it == m_owners.end()) return;
+            Shard* s = owner_it->second;
+            Session* target = s->session.get();
+            s->loop.post([target, info_hash] { target->remove_torrent(info_hash); });
+            s->torrents--;
+            m_owners.erase(owner_it);
+            publish_routes();
+            split_connections();
+            return;
+        }
+
+        auto it = m_entries.find(info_hash);
+        if (it == m_entries.end()) return;
+
+        stop_running(*it->second);
+        m_check_queue.erase(std::remove(m_check_queue.begin(), m_check_queue.end(), info_hash),
+                            m_check_queue.end());
+        std::cerr << "[*] " << it->second->meta->name << ": removed\n";
+        m_entries.erase(it);
+    }
+
+    void Session::pause(const InfoHash& info_hash) {
+        if (!m_shards.empty()) {
+            if (!contains(info_hash)) return;
+            Session* target = owner(info_hash).session.get();
+            owner(info_hash).loop.post([target, info_hash] { target->pause(info_hash); });
+            return;
+        }
+
+        auto it = m_entries.find(info_hash);
+        if (it == m_entries.end() || it->second->paused) return;
+
+        Entry& e = *it->second;
+        e.paused = true;
+        stop_running(e);
+        std::cerr << "[*] " << e.meta->name << ": paused\n";
+    }
+
+    void Session::resume(const InfoHash& info_hash) {
+        if (!m_shards.empty()) {
+            if (!contains(info_hash) || m_stopping) return;
+            Session* target = owner(info_hash).session.get();
+            owner(info_hash).loop.post([target, info_hash] { target->resume(info_hash); });
+            return;
+        }
+
+        auto it = m_entries.find(info_hash);
+        if (it == m_entries.end() || !it->second->paused || m_stopping) return;
+
+        Entry& e = *it->second;
+        e.paused = false;
+        std::cerr << "[*] " << e.meta->name << ": resumed\n";
+        if (e.checked == e.have.size()) start(e);
+        // else it is still in the checking queue and starts once checked
+    }
+
+    void Session::add_peer(const InfoHash& info_hash, const Endpoint& peer) {
+        if (!m_shards.empty()) {
+            if (!contains(info_hash)) return;
+            Session* target = owner(info_hash).session.get();
+            owner(info_hash).loop.post([target, info_hash, peer] { target->add_peer(info_hash, peer); });
+            return;
+        }
+
+        auto it = m_entries.find(info_hash);
+        if (it == m_entries.end()) return;
+        if (it->second->torrent) it->second->torrent->add_peer(peer);
+        else it->second->peers.push_back(peer);
+    }
+
+    void Session::set_limits(std::uint64_t upload, std::uint64_t download) {
+        m_config.upload_limit = upload;
+        m_config.download_limit = download;
+        m_limits.upload.set_rate(upload);
+        m_limits.download.set_rate(download);
+
+        // An even split to start from; rebalance() moves it
+        for (std::size_t i = 0; i < m_shards.size(); ++i) {
+            Shard& s = *m_shards[i];
+            s.upload_share = share_of(upload, m_shards.size(), i);
+            s.download_share = share_of(download, m_shards.size(), i);
+            Session* target = s.session.get();
+            s.loop.post([target, up = s.upload_share, down = s.download_share] { target->set_limits(up, down); });
+        }
+    }
+
+    void Session::set_max_connections(std::size_t n) {
+        m_budget.limit = m_config.max_connections = n;
+        split_connections();
+    }
+
+    void Session::set_thread_pool(ThreadPool* pool) {
+        m_pool = pool;
+        for (auto& s : m_shards) {
+            Session* target = s->session.get();
+            s->loop.post([target, pool] { target->m_pool = pool; });
+        }
+    }
+
+    std::size_t Session::num_connections() const {
+        if (m_shards.empty()) return m_budget.used;
+        std::size_t n = 0;
+        for (const auto& s : m_shards) n += s->connections.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    std::vector<Session::TorrentStatus> Session::status() const {
+        if (!m_shards.empty()) {
+            std::vector<TorrentStatus> out;
+            for (const auto& s : m_shards) {
+                const Session* target = s->session.get();
+                std::vector<TorrentStatus> part = call_on(s->loop, [target] { return target->status(); });
+                std::move(part.begin(), part.end(), std::back_inserter(out));
+            }
+            std::sort(out.begin(), out.end(), [](const TorrentStatus& a, const TorrentStatus& b) {
+                return a.info_hash < b.info_hash;
+            });
+            return out;
+        }
+
+        const auto now = m_loop.now();
+        std::vector<TorrentStatus> out;
+        out.reserve(m_entries.size());
+        for (const auto& kv : m_entries) {
+            const Entry& e = *kv.second;
+            TorrentStatus s;
+            s.info_hash = kv.first;
+            s.name = e.meta->name;
+            s.num_pieces = static_cast<std::uint32_t>(e.have.size());
+            s.uploaded = uploaded(e);
+            s.downloaded = downloaded(e);
+            s.upload_rate = e.upload_rate.rate(now);
+            s.download_rate = e.download_rate.rate(now);
+
+            if (e.torrent) {
+                s.pieces = e.torrent->picker().num_have();
+                s.peers = e.torrent->num_connections();
+                s.state = e.torrent->is_finished() ? State::Seeding : State::Downloading;
+            }
+            else {
+                s.pieces = e.checked < e.have.size()
+                    ? e.checked
+                    : static_cast<std::uint32_t>(std::count(e.have.begin(), e.have.end(), true));
+                s.state = e.paused ? State::Paused : State::Checking;
+            }
+            out.push_back(std::move(s));
+        }
+        return out;
+    }
+
+    void Session::stop(std::function<void()> done) {
+        m_stopping = true;
+        if (!m_shards.empty()) {
+            m_on_stopped = std::move(done);
+            m_shards_stopping = m_shards.size();
+            for (auto& s : m_shards) {
+                Session* target = s->session.get();
+                s->loop.post([this, target, alive = m_alive] {
+                    target->stop([this, alive] {
+                        m_loop.post([this, alive] {
+                            if (!*alive || --m_shards_stopping > 0 || !m_on_stopped) return;
+                            auto cb = std::move(m_on_stopped);
+                            m_on_stopped = nullptr;
+                            cb();
+                        });
+                    });
+                });
+            }
+            return;
+        }
+
+        for (auto& kv : m_entries) stop_running(*kv.second);
+        m_check_queue.clear();
+        m_on_stopped = std::move(done);
+        check_stopped();
+    }
+
+    std::uint64_t Session::uploaded(const Entry& e) const {
+        return e.uploaded + (e.torrent ? e.torrent->bytes_uploaded() : 0);
+    }
+
+    std::uint64_t Session::downloaded(const Entry& e) const {
+        return e.downloaded + (e.torrent ? e.torrent->bytes_downloaded() : 0);
+    }
+
+    // Verify existing data of the torrent at the front of the queue, a few
+    // pieces per turn, or keep the pool busy with it; start it once every
+    // piece was looked at.
+    void Session::check_some() {
+        std::uint64_t budget = kCheckBytesPerTurn;
+        while (!m_check_queue.empty() && budget > 0) {
+            auto it = m_entries.find(m_check_queue.front());
+            if (it == m_entries.end()) {
+                m_check_queue.pop_front();
+                continue;
+            }
+
+            Entry& e = *it->second;
+            const std::uint32_t num_pieces = static_cast<std::uint32_t>(e.have.size());
+            if (m_pool) {
+                // A couple of pieces per thread: enough to keep the disk busy,
+                // few enough that pieces don't pile up in memory
+                const std::size_t max_jobs = m_pool->size() * 2;
+                while (e.next_check < num_pieces && e.checking < max_jobs) {
+                    const std::uint32_t piece = e.next_check++;
+                    e.checking++;
+                    Entry* ep = &e;
+                    e.jobs->run([this, ep, piece, storage = e.storage.get(), alive = e.alive] {
+                        const bool ok = storage->verify_piece(piece);
+                        m_loop.post([ep, piece, ok, alive] {
+                            if (!*alive) return;
+                            ep->have[piece] = ok;
+                            ep->checking--;
+                            ep->checked++;
+                        });
+                    });
+                }
+            }
+            else {
+                const std::uint64_t piece_len = static_cast<std::uint64_t>(e.meta->piece_length);
+                while (e.next_check < num_pieces && budget > 0) {
+                    e.have[e.next_check] = e.storage->verify_piece(e.next_check);
+                    e.next_check++;
+                    e.checked++;
+                    budget -= std::min(budget, piece_len);
+                }
+            }
+            if (e.checked < num_pieces) break;
+
+            m_check_queue.pop_front();
+            const auto num_have = std::count(e.have.begin(), e.have.end(), true);
+            std::cerr << "[✓] " << e.meta->name << ": verified " << num_have << " / " << e.have.size()
+                      << " pieces\n";
+            if (!e.paused) start(e);
+        }
+
+        if (m_check_queue.empty()) {
+            m_loop.cancel_timer(m_check_timer);
+            m_check_timer = 0;
+        }
+    }
+
+    void Session::start(Entry& e) {
+        Entry* ep = &e;
+        const InfoHash h = e.meta->info_hash_raw;
+
+        e.torrent = std::make_unique<Torrent>(m_loop, *e.meta, *e.storage, m_peer_id);
+        e.torrent->set_have(e.have);
+        e.torrent->set_listen_port(m_config.listen_port);
+        e.torrent->set_global_limits(&m_limits);
+        e.torrent->set_connection_budget(&m_budget);
+        if (m_pool) e.torrent->set_thread_pool(m_pool);
+        e.torrent->set_utp(m_utp.get());
+        e.torrent->set_read_cache(e.cache.get());
+        e.torrent->set_on_finished([this, ep, h] {
+            std::cerr << "[✓] " << ep->meta->name << ": download complete, seeding\n";
+            ep->trackers->completed();
+            if (m_on_finished) m_on_finished(h);
+        });
+
+        e.trackers = std::make_unique<TrackerManager>(m_loop, *e.meta, m_peer_id, m_http, m_udp_trackers);
+        e.trackers->set_listen_port(m_config.listen_port);
+        e.trackers->set_on_peers([ep](const std::vector<Endpoint>& peers) {
+            for (const Endpoint& peer : peers) ep->torrent->add_peer(peer);
+        });
+        e.trackers->set_stats_provider([this, ep] {
+            AnnounceStats stats;
+            stats.uploaded   = uploaded(*ep);
+            stats.downloaded = downloaded(*ep);
+            stats.left       = ep->torrent->bytes_left();
+            return stats;
+        });
+        e.trackers->set_peer_count_provider([ep] { return ep->torrent->num_connections(); });
+        e.trackers->start();
+
+        for (const Endpoint& peer : e.peers) e.torrent->add_peer(peer);
+        e.peers.clear();
+    }
+
+    void Session::stop_running(Entry& e) {
+        if (!e.torrent) return;
+
+        // Announces still to come (a busy tier's "stopped") see the totals
+        // as of now; the entry may be gone by then
+        AnnounceStats last;
+        last.uploaded   = uploaded(e);
+        last.downloaded = downloaded(e);
+        last.left       = e.torrent->bytes_left();
+
+        e.have = e.torrent->picker().have_bitfield();
+        e.uploaded = last.uploaded;
+        e.downloaded = last.downloaded;
+        e.torrent.reset();
+
+        e.trackers->set_on_peers(nullptr);
+        e.trackers->set_stats_provider([last] { return last; });
+        e.trackers->set_peer_count_provider([] { return std::size_t{0}; });
+        m_retired.push_back(Retired{e.meta, std::move(e.trackers), false});
+        auto it = std::prev(m_retired.end());
+        it->trackers->stop([this, it] {
+            it->done = true;
+            check_stopped();
+        });
+    }
+
+    void Session::check_stopped() {
+        if (!m_stopping || !m_on_stopped) return;
+        for (const Retired& r : m_retired) {
+            if (!r.done) return;
+        }
+        auto done = std::move(m_on_stopped);
+        m_on_stopped = nullptr;
+        done();
+    }
+
+    void Session::on_tick() {
+        if (!m_shards.empty()) {
+            rebalance();
+            return;
+        }
+        const auto now = m_loop.now();
+
+        for (auto& kv : m_entries) {
+            Entry& e = *kv.second;
+            const std::uint64_t up = uploaded(e);
+            const std::uint64_t down = downloaded(e);
+            e.upload_rate.add(up - e.sampled_up, now);
+            e.download_rate.add(down - e.sampled_down, now);
+            m_total_up += up - e.sampled_up;
+            m_total_down += down - e.sampled_down;
+            e.sampled_up = up;
+            e.sampled_down = down;
+        }
+        if (m_shard) {
+            m_shard->uploaded.store(m_total_up, std::memory_order_relaxed);
+            m_shard->downloaded.store(m_total_down, std::memory_order_relaxed);
+            m_shard->connections.store(m_budget.used, std::memory_order_relaxed);
+        }
+
+        // Slots other torrents freed go to whoever has peers waiting
+        for (auto& kv : m_entries) {
+            if (m_budget.used >= m_budget.limit) break;
+            if (kv.second->torrent) kv.second->torrent->start_queued_peers();
+        }
+
+        std::vector<int> expired;
+        for (const auto& kv : m_pending) {
+            if (now - kv.second.since > kPendingTimeout) expired.push_back(kv.first);
+        }
+        for (int fd : expired) close_pending(fd);
+
+        // Not from inside their own stop callback
+        m_retired.remove_if([](const Retired& r) { return r.done; });
+    }
+
+
+    // ----------------- Inbound connections -----------------
+
+    void Session::on_accept() {
+        while (true) {
+            sockaddr_storage ss{};
+            socklen_t len = sizeof(ss);
+            int fd = ::accept4(m_listen_fd, reinterpret_cast<sockaddr*>(&ss), &len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return; // EAGAIN or a transient error; wait for the next event
+            }
+
+            std::optional<Endpoint> remote = Endpoint::from_sockaddr(reinterpret_cast<sockaddr*>(&ss));
+            if (!remote) {
+                ::close(fd);
+                continue;
+            }
+            add_pending(fd, *remote);
+        }
+    }
+
+    void Session::add_pending(int fd, const Endpoint& remote) {
+        if (m_pending.size() >= kMaxPending || m_stopping) {
+            ::close(fd);
+            return;
+        }
+        Pending& p = m_pending[fd];
+        p.remote = remote;
+        p.since = m_loop.now();
+        m_loop.add_fd(fd, EPOLLIN, [this, fd](std::uint32_t) { on_pending_readable(fd); });
+    }
+
+    void Session::on_pending_readable(int fd) {
+        auto it = m_pending.find(fd);
+        if (it == m_pending.end()) return;
+        Pending& p = it->second;
+
+        // Only up to the info hash: the rest is the torrent's to read
+        std::uint8_t buf[kHandshakePrefix];
+        const std::size_t want = kHandshakePrefix - p.received.size();
+        ssize_t n = ::recv(fd, buf, want, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+        if (n <= 0) {
+            close_pending(fd);
+            return;
+        }
+        p.received.insert(p.received.end(), buf, buf + n);
+        if (p.received[0] != 19) {
+            close_pending(fd);
+            return;
+        }
+        if (p.received.size() < kHandshakePrefix) return;
+
+        InfoHash h;
+        std::copy(p.received.begin() + 28, p.received.begin() + 48, h.begin());
+        auto entry = m_entries.find(h);
+        const bool ours = entry != m_entries.end();
+        if (ours ? !entry->second->torrent : !m_coordinator) {
+            close_pending(fd);
+            return;
+        }
+
+        const Endpoint remote = p.remote;
+        std::vector<std::uint8_t> received = std::move(p.received);
+        m_loop.remove_fd(fd);
+        m_pending.erase(it);
+        if (ours) entry->second->torrent->add_incoming(fd, remote, std::move(received));
+        else if (!m_coordinator->route(h, fd, remote, std::move(received))) ::close(fd);
+    }
+
+    void Session::close_pending(int fd) {
+        m_loop.remove_fd(fd);
+        ::close(fd);
+        m_pending.erase(fd);
+    }
+
+
+    // ----------------- Reactors -----------------
+
+    void Session::start_shards() {
+        if (m_config.utp) throw std::runtime_error("uTP needs a single reactor");
+
+        m_routes = std::make_shared<const RouteTable>();
+        const std::size_t n = m_config.reactors;
+        for (std::size_t i = 0; i < n; ++i) {
+            Config config = m_config;
+            config.reactors = 1;
+            config.reuse_port = true;
+            config.max_connections = share_of(m_config.max_connections, n, i);
+            config.upload_limit = share_of(m_config.upload_limit, n, i);
+            config.download_limit = share_of(m_config.download_limit, n, i);
+
+            auto s = std::make_unique<Shard>();
+            s->upload_share = config.upload_limit;
+            s->download_share = config.download_limit;
+            s->session = std::make_unique<Session>(s->loop, m_peer_id, config);
+            s->session->m_coordinator = this;
+            s->session->m_shard = s.get();
+            s->session->m_on_finished = [this, alive = m_alive](const InfoHash& h) {
+                m_loop.post([this, alive, h] {
+                    if (*alive && m_on_finished) m_on_finished(h);
+                });
+            };
+            m_shards.push_back(std::move(s));
+        }
+        for (auto& s : m_shards) {
+            Shard* sp = s.get();
+            sp->thread = std::thread([sp] {
+                // Signals are for the caller's thread (signalfd)
+                sigset_t all;
+                sigfillset(&all);
+                ::pthread_sigmask(SIG_BLOCK, &all, nullptr);
+                sp->loop.run();
+            });
+        }
+        std::cerr << "[*] Session on " << n << " reactor threads\n";
+    }
+
+    Session::Shard& Session::owner(const InfoHash& info_hash) const {
+        return *m_owners.at(info_hash);
+    }
+
+    // The shards read the table without locking: it is never changed, only
+    // replaced, and they keep the copy they loaded alive while they use it.
+    void Session::publish_routes() {
+        std::atomic_store(&m_routes, std::shared_ptr<const RouteTable>(std::make_shared<RouteTable>(m_owners)));
+    }
+
+    // The connection budget, by torrents per shard.
+    void Session::split_connections() {
+        const std::size_t n = m_shards.size();
+        std::size_t torrents = 0;
+        for (const auto& s : m_shards) torrents += s->torrents;
+
+        std::size_t given = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            Shard& s = *m_shards[i];
+            std::size_t limit = torrents == 0
+                ? share_of(m_config.max_connections, n, i)
+                : m_config.max_connections * s.torrents / torrents;
+            if (i + 1 == n && torrents > 0) limit = m_config.max_connections - given; // the rounding
+            given += limit;
+
+            Session* target = s.session.get();
+            s.loop.post([target, limit] { target->set_max_connections(limit); });
+        }
+    }
+
+    void Session::rebalance() {
+        const std::size_t n = m_shards.size();
+        std::vector<std::uint64_t> used_up(n), used_down(n), up_shares(n), down_shares(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            Shard& s = *m_shards[i];
+            const std::uint64_t up = s.uploaded.load(std::memory_order_relaxed);
+            const std::uint64_t down = s.downloaded.load(std::memory_order_relaxed);
+            used_up[i] = up - s.sampled_up;
+            used_down[i] = down - s.sampled_down;
+            s.sampled_up = up;
+            s.sampled_down = down;
+            up_shares[i] = s.upload_share;
+            down_shares[i] = s.download_share;
+        }
+
+        up_shares = split_rate(m_config.upload_limit, used_up, up_shares);
+        down_shares = split_rate(m_config.download_limit, used_down, down_shares);
+        for (std::size_t i = 0; i < n; ++i) {
+            Shard& s = *m_shards[i];
+            if (s.upload_share == up_shares[i] && s.download_share == down_shares[i]) continue;
+            s.upload_share = up_shares[i];
+            s.download_share = down_shares[i];
+            Session* target = s.session.get();
+            s.loop.post([target, up = up_shares[i], down = down_shares[i]] { target->set_limits(up, down); });
+        }
+    }
+
+    bool Session::route(const InfoHash& info_hash, int fd, const Endpoint& remote,
+                        std::vector<std::uint8_t> received) {
+        const std::shared_ptr<const RouteTable> routes = std::atomic_load(&m_routes);
+        auto it = routes->find(info_hash);
+        if (it == routes->end()) return false;
+
+        // Closed with the target's loop if it never runs this
+        Shard* target = it->second;
+        std::shared_ptr<int> owned(new int(fd), [](int* p) {
+            if (*p >= 0) ::close(*p);
+            delete p;
+        });
+        target->loop.post([target, owned, remote, received = std::move(received)]() mutable {
+            if (!target->session) return; // shutting down
+            target->session->adopt(std::exchange(*owned, -1), remote, std::move(received));
+        });
+        return true;
+    }
+
+    void Session::adopt(int fd, const Endpoint& remote, std::vector<std::uint8_t> received) {
+        InfoHash h;
+        std::copy(received.begin() + 28, received.begin() + 48, h.begin());
+        auto entry = m_entries.find(h);
+        if (entry == m_entries.end() || !entry->second->torrent || m_stopping) {
+            ::close(fd);
+            return;
+        }
+        entry->second->torrent->add_incoming(fd, remote, std::move(received));
+    }
+
+}
@@ -0,0 +1,336 @@
+#include "torrent/storage.hpp"
+#include "torrent/bencode.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    // ----------------- Priorities -----------------
+
+    FilePriority parse_file_priority(const std::string& s) {
+        if (s == "skip")   return FilePriority::Skip;
+        if (s == "low")    return FilePriority::Low;
+        if (s == "normal") return FilePriority::Normal;
+        if (s == "high")   return FilePriority::High;
+        throw std::runtime_error("Unknown file priority: " + s);
+    }
+
+    const char* file_priority_name(FilePriority prio) {
+        switch (prio) {
+            case FilePriority::Skip:   return "skip";
+            case FilePriority::Low:    return "low";
+            case FilePriority::Normal: return "normal";
+            case FilePriority::High:   return "high";
+        }
+        return "?";
+    }
+
+
+    // ----------------- Piece -> file mapping -----------------
+
+    std::vector<FileSlice> map_block(
+        const TorrentMeta& meta,
+        std::uint32_t piece,
+        std::uint32_t begin,
+        std::uint64_t length
+    ) {
+        std::vector<FileSlice> out;
+
+        std::uint64_t start = static_cast<std::uint64_t>(meta.piece_length) * piece + begin;
+        std::uint64_t end   = start + length;
+        if (end > static_cast<std::uint64_t>(meta.length)) {
+            throw std::runtime_error("map_block: range past end of torrent");
+        }
+
+        // First file whose end is past `start` (files are sorted by offset)
+        auto it = std::upper_bound(
+            meta.files.begin(), meta.files.end(), start,
+            [](std::uint64_t pos, const FileEntry& f) {
+                return pos < static_cast<std::uint64_t>(f.offset + f.length);
+            }
+        );
+
+        for (; it != meta.files.end() && start < end; ++it) {
+            std::uint64_t file_begin = static_cast<std::uint64_t>(it->offset);
+            std::uint64_t file_end   = file_begin + static_cast<std::uint64_t>(it->length);
+            if (file_end <= start) continue; // zero-length file
+
+            std::uint64_t n = std::min(end, file_end) - start;
+
+            FileSlice slice;
+            slice.file_index  = static_cast<std::size_t>(it - meta.files.begin());
+            slice.file_offset = start - file_begin;
+            slice.length      = n;
+            out.push_back(slice);
+
+            start += n;
+        }
+
+        return out;
+    }
+
+
+    // ----------------- Low-level helpers -----------------
+
+    static void pwrite_all(int fd, const std::uint8_t* data, std::size_t len, std::uint64_t offset) {
+        std::size_t total = 0;
+        while (total < len) {
+            ssize_t n = ::pwrite(fd, data + total, len - total, static_cast<off_t>(offset + total));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw std::runtime_error(std::string("pwrite failed: ") + std::strerror(errno));
+            total += static_cast<std::size_t>(n);
+        }
+    }
+
+    // Reads up to `len` bytes; anything past EOF is returned as zeros.
+    static void pread_all(int fd, std::uint8_t* out, std::size_t len, std::uint64_t offset) {
+        std::size_t total = 0;
+        while (total < len) {
+            ssize_t n = ::pread(fd, out + total, len - total, static_cast<off_t>(offset + total));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw std::runtime_error(std::string("pread failed: ") + std::strerror(errno));
+            if (n == 0) {
+                std::memset(out + total, 0, len - total);
+                return;
+            }
+            total += static_cast<std::size_t>(n);
+        }
+    }
+
+
+    // ----------------- Storage -----------------
+
+    Storage::Storage(
+        const TorrentMeta& meta,
+        const std::string& save_path,
+        std::vector<FilePriority> file_priorities
+    ): m_meta(meta), m_save_path(save_path), m_priorities(std::move(file_priorities)) {
+        if (m_priorities.empty()) {
+            m_priorities.assign(meta.files.size(), FilePriority::Normal);
+        }
+        if (m_priorities.size() != meta.files.size()) {
+            throw std::runtime_error("Storage: file priority count does not match file count");
+        }
+
+        m_fds.assign(meta.files.size(), -1);
+
+        // Pick up files that are already on disk (resume / seeding) and create
+        // wanted ones up front so that empty files exist as well.
+        for (std::size_t i = 0; i < meta.files.size(); ++i) {
+            bool wanted = m_priorities[i] != FilePriority::Skip;
+            open_file(i, wanted);
+        }
+
+        // Load partfile slot table if a previous run left one behind
+        if (open_part_file(false) >= 0) {
+            m_part_slots.assign(meta.piece_hashes.size(), 0);
+
+            std::vector<std::uint8_t> header(m_part_slots.size() * 4);
+            pread_all(m_part_fd, header.data(), header.size(), 0);
+            for (std::size_t i = 0; i < m_part_slots.size(); ++i) {
+                std::uint32_t v;
+                std::memcpy(&v, header.data() + i * 4, 4);
+                m_part_slots[i] = ntohl(v);
+                m_part_slots_used = std::max(m_part_slots_used, m_part_slots[i]);
+            }
+        }
+    }
+
+    Storage::~Storage() {
+        for (int fd : m_fds) {
+            if (fd >= 0) ::close(fd);
+        }
+        if (m_part_fd >= 0) ::close(m_part_fd);
+    }
+
+    std::string Storage::file_path(std::size_t file_index) const {
+        if (!m_meta.multi_file) return m_save_path;
+        return m_save_path + "/" + m_meta.files.at(file_index).path;
+    }
+
+    int Storage::open_file(std::size_t file_index, bool create) {
+        if (m_fds[file_index] >= 0) return m_fds[file_index];
+
+        std::string path = file_path(file_index);
+
+        int flags = O_RDWR;
+        if (create) {
+            flags |= O_CREAT;
+            std::filesystem::path parent = std::filesystem::path(path).parent_path();
+            if (!parent.empty()) std::filesystem::create_directories(parent);
+        }
+
+        int fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0) {
+            if (!create && errno == ENOENT) return -1;
+            throw std::runtime_error("Failed to open " + path + ": " + std::strerror(errno));
+        }
+
+        // Size the file up front (sparse) so reads past written data return zeros
+        struct stat st{};
+        if (::fstat(fd, &st) == 0 && st.st_size < m_meta.files[file_index].length) {
+            if (::ftruncate(fd, static_cast<off_t>(m_meta.files[file_index].length)) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Failed to size " + path + ": " + std::strerror(errno));
+            }
+        }
+
+        m_fds[file_index] = fd;
+        return fd;
+    }
+
+    int Storage::open_part_file(bool create) {
+        if (m_part_fd >= 0) return m_part_fd;
+
+        std::string path = part_file_path();
+        int fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+        if (fd < 0) {
+            if (!create && errno == ENOENT) return -1;
+            throw std::runtime_error("Failed to open partfile " + path + ": " + std::strerror(errno));
+        }
+
+        m_part_fd = fd;
+        return fd;
+    }
+
+    // Partfile layout: [num_pieces x u32 big-endian slot+1][slot 0][slot 1]...
+    // Each slot is piece_length bytes and holds a piece's bytes at their
+    // in-piece offsets; only the bytes of skipped files are ever written.
+    long long Storage::part_slot_offset(std::uint32_t piece, bool allocate) {
+        if (m_part_slots.empty()) {
+            if (!allocate) return -1;
+            open_part_file(true);
+            m_part_slots.assign(m_meta.piece_hashes.size(), 0);
+        }
+
+        if (m_part_slots[piece] == 0) {
+            if (!allocate) return -1;
+
+            m_part_slots[piece] = ++m_part_slots_used;
+            std::uint32_t be = htonl(m_part_slots[piece]);
+            pwrite_all(m_part_fd, reinterpret_cast<const std::uint8_t*>(&be), 4,
+                       static_cast<std::uint64_t>(piece) * 4);
+        }
+
+        std::uint64_t header = static_cast<std::uint64_t>(m_part_slots.size()) * 4;
+        std::uint64_t slot   = m_part_slots[piece] - 1;
+        return static_cast<long long>(header + slot * static_cast<std::uint64_t>(m_meta.piece_length));
+    }
+
+    std::vector<Storage::DiskRange> Storage::resolve(
+        std::uint32_t piece,
+        std::uint32_t begin,
+        std::uint64_t len,
+        bool for_write
+    ) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<DiskRange> out;
+
+        std::uint32_t in_piece = begin;
+        for (const FileSlice& s : map_block(m_meta, piece, begin, len)) {
+            DiskRange r;
+            r.length = s.length;
+
+            // Real file if it is wanted or already on disk, otherwise the partfile
+            bool wanted = m_priorities[s.file_index] != FilePriority::Skip;
+            int fd = open_file(s.file_index, wanted);
+            if (fd >= 0) {
+                r.fd     = fd;
+                r.offset = s.file_offset;
+            }
+            else {
+                long long slot = part_slot_offset(piece, for_write);
+                if (slot >= 0) {
+                    r.fd     = m_part_fd;
+                    r.offset = static_cast<std::uint64_t>(slot) + in_piece;
+                }
+            }
+
+            out.push_back(r);
+            in_piece += static_cast<std::uint32_t>(s.length);
+        }
+
+        return out;
+    }
+
+    std::vector<Storage::DiskRange> Storage::map_to_disk(std::uint32_t piece, std::uint32_t begin, std::uint64_t len) {
+        return resolve(piece, begin, len, false);
+    }
+
+    void Storage::write_block(std::uint32_t piece, std::uint32_t begin, const std::uint8_t* data, std::size_t len) {
+        for (const DiskRange& r : resolve(piece, begin, len, true)) {
+            pwrite_all(r.fd, data, static_cast<std::size_t>(r.length), r.offset);
+            data += r.length;
+        }
+    }
+
+    void Storage::read_block(std::uint32_t piece, std::uint32_t begin, std::uint8_t* out, std::size_t len) {
+        for (const DiskRange& r : resolve(piece, begin, len, false)) {
+            if (r.fd >= 0) {
+                pread_all(r.fd, out, static_cast<std::size_t>(r.length), r.offset);
+            }
+            else {
+                std::memset(out, 0, static_cast<std::size_t>(r.length));
+            }
+            out += r.length;
+        }
+    }
+
+    bool Storage::verify_piece(std::uint32_t piece) {
+        std::uint64_t full  = static_cast<std::uint64_t>(m_meta.piece_length);
+        std::uint64_t start = full * piece;
+        std::uint64_t len   = std::min<std::uint64_t>(full, static_cast<std::uint64_t>(m_meta.length) - start);
+
+        std::string buf(static_cast<std::size_t>(len), '\0');
+        read_block(piece, 0, reinterpret_cast<std::uint8_t*>(&buf[0]), buf.size());
+
+        std::string digest = sha1_raw(buf);
+        return std::memcmp(digest.data(), m_meta.piece_hashes.at(piece).data(), 20) == 0;
+    }
+
+    void Storage::set_file_priority(std::size_t file_index, FilePriority prio) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        FilePriority old = m_priorities.at(file_index);
+        m_priorities[file_index] = prio;
+
+        if (old != FilePriority::Skip || prio == FilePriority::Skip) return;
+        if (m_fds[file_index] >= 0) return;
+
+        // Un-skipped: create the file and pull its bytes out of the partfile
+        int fd = open_file(file_index, true);
+        if (m_part_slots.empty()) return;
+
+        const FileEntry& f = m_meta.files[file_index];
+        if (f.length == 0) return;
+
+        std::uint64_t full = static_cast<std::uint64_t>(m_meta.piece_length);
+        std::uint32_t first = static_cast<std::uint32_t>(static_cast<std::uint64_t>(f.offset) / full);
+        std::uint32_t last  = static_cast<std::uint32_t>(static_cast<std::uint64_t>(f.offset + f.length - 1) / full);
+
+        std::vector<std::uint8_t> buf;
+        for (std::uint32_t piece = first; piece <= last; ++piece) {
+            long long slot = part_slot_offset(piece, false);
+            if (slot < 0) continue;
+
+            std::uint64_t piece_begin = full * piece;
+            std::uint64_t lo = std::max<std::uint64_t>(piece_begin, static_cast<std::uint64_t>(f.offset));
+            std::uint64_t hi = std::min<std::uint64_t>(piece_begin + full, static_cast<std::uint64_t>(f.offset + f.length));
+
+            buf.resize(static_cast<std::size_t>(hi - lo));
+            pread_all(m_part_fd, buf.data(), buf.size(), static_cast<std::uint64_t>(slot) + (lo - piece_begin));
+            pwrite_all(fd, buf.data(), buf.size(), lo - static_cast<std::uint64_t>(f.offset));
+        }
+    }
+
+}
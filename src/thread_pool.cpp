@@ -0,0 +1,224 @@
+#include "torrent/thread_pool.hpp"
+
+#include <iostream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+namespace torrent {
+
+    // The pool and worker the current thread belongs to, if any.
+    static thread_local ThreadPool* t_pool = nullptr;
+    static thread_local std::size_t t_index = 0;
+
+    ThreadPool::ThreadPool() : ThreadPool(Config{}) {}
+
+    ThreadPool::ThreadPool(Config config) {
+        std::size_t n = config.threads;
+        if (n == 0) n = std::max(1u, std::thread::hardware_concurrency());
+
+        // CPUs we may run on, for pinning
+        std::vector<int> cpus;
+        if (config.pin) {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (::sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                    if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+                }
+            }
+        }
+
+        for (std::size_t i = 0; i < n; ++i) m_workers.push_back(std::make_unique<Worker>());
+        for (std::size_t i = 0; i < n; ++i) {
+            m_workers[i]->thread = std::thread([this, i] { run(i); });
+            if (!cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[i % cpus.size()], &set);
+                ::pthread_setaffinity_np(m_workers[i]->thread.native_handle(), sizeof(set), &set);
+            }
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& w : m_workers) w->thread.join();
+    }
+
+    void ThreadPool::submit(Task task) {
+        const std::size_t index = t_pool == this
+            ? t_index
+            : m_next.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+        {
+            // Counted before the lock lets anyone take it, so m_queued never
+            // goes below 0
+            std::lock_guard<std::mutex> lock(m_workers[index]->mutex);
+            m_workers[index]->tasks.push_back(std::move(task));
+            m_queued.fetch_add(1);
+        }
+        m_submitted.fetch_add(1, std::memory_order_relaxed);
+
+        // Taking the lock orders this against a worker checking m_queued
+        // before it sleeps, so the wakeup can't be missed
+        { std::lock_guard<std::mutex> lock(m_sleep_mutex); }
+        m_wake.notify_one();
+    }
+
+    bool ThreadPool::run_one() {
+        Task task;
+        const bool ours = t_pool == this;
+        if ((ours && take(t_index, task)) || steal(ours ? t_index : m_workers.size(), task)) {
+            execute(task);
+            return true;
+        }
+        return false;
+    }
+
+    void ThreadPool::run(std::size_t index) {
+        t_pool = this;
+        t_index = index;
+
+        // Signals are for the thread that waits for them (signalfd)
+        sigset_t all;
+        sigfillset(&all);
+        ::pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        while (true) {
+            Task task;
+            if (take(index, task) || steal(index, task)) {
+                execute(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_wake.wait(lock, [this] { return m_stop || m_queued.load() > 0; });
+            if (m_stop && m_queued.load() == 0) return;
+        }
+    }
+
+    bool ThreadPool::take(std::size_t index, Task& out) {
+        Worker& w = *m_workers[index];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.tasks.empty()) return false;
+        out = std::move(w.tasks.back());
+        w.tasks.pop_back();
+        m_queued.fetch_sub(1);
+        return true;
+    }
+
+    // Victims are tried starting after the thief, so thieves spread out.
+    // `thief` may be size() for a thread that isn't a worker.
+    bool ThreadPool::steal(std::size_t thief, Task& out) {
+        const std::size_t n = m_workers.size();
+        for (std::size_t k = 1; k <= n; ++k) {
+            const std::size_t victim = (thief + k) % n;
+            if (victim == thief) continue;
+
+            Worker& w = *m_workers[victim];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            if (w.tasks.empty()) continue;
+            out = std::move(w.tasks.front());
+            w.tasks.pop_front();
+            m_queued.fetch_sub(1);
+            m_steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void ThreadPool::execute(Task& task) {
+        try {
+            task();
+        }
+        catch (const std::exception& ex) {
+            std::cerr << "[!] Thread pool task failed: " << ex.what() << "\n";
+        }
+        catch (...) {
+            std::cerr << "[!] Thread pool task failed: unknown exception\n";
+        }
+        m_executed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<std::size_t> ThreadPool::queue_depths() const {
+        std::vector<std::size_t> out;
+        for (const auto& w : m_workers) {
+            std::lock_guard<std::mutex> lock(w->mutex);
+            out.push_back(w->tasks.size());
+        }
+        return out;
+    }
+
+    ThreadPool::Stats ThreadPool::stats() const {
+        Stats s;
+        s.threads   = m_workers.size();
+        s.queued    = m_queued.load(std::memory_order_relaxed);
+        s.submitted = m_submitted.load(std::memory_order_relaxed);
+        s.executed  = m_executed.load(std::memory_order_relaxed);
+        s.steals    = m_steals.load(std::memory_order_relaxed);
+        return s;
+    }
+
+
+    // ----------------- TaskGroup -----------------
+
+    TaskGroup::~TaskGroup() {
+        try {
+            wait();
+        }
+        catch (...) {
+            // Nobody asked for it
+        }
+    }
+
+    void TaskGroup::run(ThreadPool::Task task) {
+        {
+            std::lock_guard<std::mutex> lock(m_state->mutex);
+            m_state->pending++;
+        }
+        std::shared_ptr<State> state = m_state;
+        m_pool.submit([state, task = std::move(task)] {
+            std::exception_ptr error;
+            try {
+                task();
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (error && !state->error) state->error = error;
+            if (--state->pending == 0) state->done.notify_all();
+        });
+    }
+
+    void TaskGroup::wait() {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        while (m_state->pending > 0) {
+            lock.unlock();
+            const bool ran = m_pool.run_one();
+            lock.lock();
+            // Nothing queued: ours are running elsewhere. Look again now
+            // and then, since tasks can still be dealt to this thread's
+            // deque while it waits.
+            if (!ran) m_state->done.wait_for(lock, std::chrono::milliseconds(1),
+                                             [this] { return m_state->pending == 0; });
+        }
+        if (m_state->error) {
+            std::exception_ptr error = m_state->error;
+            m_state->error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    std::size_t TaskGroup::pending() const {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return m_state->pending;
+    }
+
+}
@@ -0,0 +1,1441 @@
+#include "torrent/torrent.hpp"
+#include "torrent/bencode.hpp"
+#include "torrent/net_utils.hpp"
+#include "torrent/ut_metadata.hpp"
+#include "torrent/ut_pex.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    static constexpr std::uint32_t kBlockSize = 16 * 1024;
+
+    // Blocks larger than this are refused (the de-facto limit is 16 KiB).
+    static constexpr std::uint32_t kMaxRequestLength = 128 * 1024;
+    // Requests queued per peer before we start ignoring new ones.
+    static constexpr std::size_t kMaxQueuedRequests = 500;
+    // Stop pulling requests into the send queue once this much is pending.
+    static constexpr std::uint64_t kSendQueueTarget = 64 * 1024;
+    // Requests we keep in flight to each unchoked peer, at least...
+    static constexpr std::size_t kPipelineDepth = 16;
+    // ...and up to this many for fast peers that queue that many ("reqq").
+    static constexpr std::size_t kMaxPipelineDepth = 250;
+    // Requests given back (timed out, choked) whose blocks we still accept.
+    static constexpr std::size_t kMaxLateBlocks = kMaxPipelineDepth;
+    // Fast peers get enough requests in flight for this long at their rate.
+    static constexpr double kRequestQueueSeconds = 3.0;
+    // Largest single read or write while a bandwidth limit applies, so one
+    // connection can't take all tokens of a shared bucket in one go.
+    static constexpr std::uint64_t kBandwidthQuantum = 16 * 1024;
+
+    static constexpr auto kTickInterval = std::chrono::seconds(10);
+    static constexpr auto kChokeInterval = std::chrono::seconds(10);
+    static constexpr auto kKeepAliveAfter = std::chrono::seconds(90);
+    static constexpr auto kIdleTimeout = std::chrono::seconds(180);
+    // A request outstanding this long is handed to other peers.
+    static constexpr auto kRequestTimeout = std::chrono::seconds(60);
+    // A peer that hasn't sent a block this long while we wait on it is snubbed.
+    static constexpr auto kSnubTimeout = std::chrono::seconds(60);
+    // New connections can't be replaced by better peers for this long.
+    static constexpr auto kMinConnectedTime = std::chrono::seconds(60);
+    // Size of the allowed fast set we offer (BEP 6 suggests 10).
+    static constexpr std::size_t kAllowedFastCount = 10;
+    // Caps on what we remember of a peer's Allowed Fast and Suggest messages.
+    static constexpr std::size_t kMaxAllowedFast = 64;
+    static constexpr std::size_t kMaxSuggested = 32;
+
+    // Sent as "v" in the extension handshake.
+    static constexpr const char* kClientVersion = "BT 0.0.1";
+
+    static Reserved local_reserved(bool dht) {
+        Reserved r{};
+        r[kReservedFastByte] |= kReservedFastBit;
+        r[kReservedExtensionByte] |= kReservedExtensionBit;
+        if (dht) r[kReservedDhtByte] |= kReservedDhtBit;
+        return r;
+    }
+
+    static void set_nonblocking(int fd) {
+        int flags = ::fcntl(fd, F_GETFL, 0);
+        ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    // ----------------- Setup -----------------
+
+    Torrent::Torrent(
+        EventLoop& loop,
+        const TorrentMeta& meta,
+        Storage& storage,
+        const std::string& peer_id
+    ): m_loop(loop), m_meta(meta), m_storage(storage), m_peer_id(peer_id), m_connector(loop),
+       m_picker(static_cast<std::uint32_t>(meta.piece_hashes.size())) {
+        if (m_peer_id.size() != 20) {
+            throw std::runtime_error("peer_id must be exactly 20 bytes");
+        }
+
+        m_picker.apply_file_priorities(meta, storage.file_priorities());
+
+        // Let magnet link users get the metadata from us
+        m_extensions.add(std::make_unique<UtMetadata>(meta.info_bencoded));
+        m_extensions.add(std::make_unique<UtPex>(
+            [this] { return pex_peers(); },
+            [this](const std::vector<UtPex::Peer>& peers) { on_pex_peers(peers); }
+        ));
+
+        m_connector.set_on_connected([this](int fd, const Endpoint& remote, std::chrono::milliseconds connect_time) {
+            on_connected(fd, remote, connect_time);
+        });
+        m_connector.set_on_failed([this](const Endpoint& remote, const std::string&) {
+            m_peer_db.connect_failed(remote, m_loop.now());
+        });
+        m_connector.set_rank([this](const Endpoint& remote) { return m_peer_db.score(remote, m_loop.now()); });
+        m_connector.set_want_more([this] {
+            if (m_budget && m_budget->used + m_connector.half_open() >= m_budget->limit) return false;
+            return m_conns.size() + m_connector.half_open() < m_max_connections;
+        });
+
+        m_tick_timer = m_loop.add_timer(
+            std::chrono::duration_cast<std::chrono::milliseconds>(kTickInterval),
+            [this] { on_tick(); }
+        );
+        m_choke_timer = m_loop.add_timer(
+            std::chrono::duration_cast<std::chrono::milliseconds>(kChokeInterval),
+            [this] { run_choker(); }
+        );
+    }
+
+    Torrent::~Torrent() {
+        // Jobs on the pool use our pieces and storage
+        m_jobs.reset();
+        *m_alive = false;
+
+        m_loop.cancel_timer(m_tick_timer);
+        m_loop.cancel_timer(m_choke_timer);
+        if (m_bandwidth_timer) m_loop.cancel_timer(m_bandwidth_timer);
+        if (m_budget) m_budget->used -= m_conns.size();
+
+        for (auto& kv : m_conns) {
+            m_loop.remove_fd(kv.first);
+            ::close(kv.first);
+        }
+        if (m_listen_fd >= 0) {
+            m_loop.remove_fd(m_listen_fd);
+            ::close(m_listen_fd);
+        }
+    }
+
+    void Torrent::listen(std::uint16_t port) {
+        int fd = open_listen_socket(port);
+        m_listen_fd = fd;
+        m_listen_port = port;
+        m_loop.add_fd(fd, EPOLLIN, [this](std::uint32_t) { on_accept(); });
+    }
+
+    void Torrent::set_have(const std::vector<bool>& have) {
+        if (have.size() != m_picker.num_pieces()) {
+            throw std::runtime_error("set_have: wrong number of pieces");
+        }
+        for (std::uint32_t i = 0; i < have.size(); ++i) {
+            if (have[i]) m_picker.mark_have(i);
+        }
+    }
+
+    void Torrent::announce_piece(std::uint32_t piece) {
+        if (piece >= m_picker.num_pieces() || m_picker.have(piece)) return;
+        m_picker.mark_have(piece);
+
+        std::vector<int> fds;
+        for (auto& kv : m_conns) {
+            if (!kv.second->handshake_done) continue;
+            queue_bytes(*kv.second, build_have(piece));
+            fds.push_back(kv.first);
+        }
+        for (int fd : fds) {
+            auto it = m_conns.find(fd);
+            if (it == m_conns.end()) continue;
+            update_am_interested(*it->second);
+            flush(*it->second);
+        }
+    }
+
+    std::uint64_t Torrent::bytes_left() const {
+        std::uint64_t left = 0;
+        for (std::uint32_t i = 0; i < m_picker.num_pieces(); ++i) {
+            if (m_picker.wants(i)) left += piece_length(i);
+        }
+        return left;
+    }
+
+    std::uint32_t Torrent::piece_length(std::uint32_t piece) const {
+        std::uint64_t full  = static_cast<std::uint64_t>(m_meta.piece_length);
+        std::uint64_t start = full * piece;
+        return static_cast<std::uint32_t>(std::min<std::uint64_t>(full, static_cast<std::uint64_t>(m_meta.length) - start));
+    }
+
+
+    // ----------------- Connections -----------------
+
+    void Torrent::on_accept() {
+        while (true) {
+            sockaddr_storage ss{};
+            socklen_t len = sizeof(ss);
+            int fd = ::accept4(m_listen_fd, reinterpret_cast<sockaddr*>(&ss), &len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return; // EAGAIN or a transient error; wait for the next event
+            }
+
+            std::optional<Endpoint> remote = Endpoint::from_sockaddr(reinterpret_cast<sockaddr*>(&ss));
+            if (!remote) {
+                ::close(fd);
+                continue;
+            }
+            add_incoming(fd, *remote);
+        }
+    }
+
+    void Torrent::add_incoming(int fd, const Endpoint& remote, std::vector<std::uint8_t> received) {
+        if (m_peer_db.is_banned(remote) || !make_room(m_peer_db.score(remote, m_loop.now()))) {
+            ::close(fd);
+            return;
+        }
+        m_peer_db.seen(remote, m_loop.now());
+        PeerConn& c = add_connection(fd, remote, false);
+        c.in = std::move(received);
+        // A complete handshake may be in already, with nothing more to read
+        if (!c.in.empty()) on_readable(c);
+    }
+
+    void Torrent::add_peer(const Endpoint& peer) {
+        add_peer(std::vector<Endpoint>{peer});
+    }
+
+    void Torrent::add_local_peer(const Endpoint& peer) {
+        if (m_peer_db.is_banned(peer)) return;
+        m_peer_db.seen_local(peer, m_loop.now());
+        const PeerRecord* r = m_peer_db.find(peer);
+        if (r && r->connected) return;
+        m_connector.add(peer);
+    }
+
+    void Torrent::add_peer(const std::vector<Endpoint>& addresses) {
+        // Trackers and the DHT return the same peers again and again; the
+        // connector skips those it is connecting to, we skip connected ones
+        std::vector<Endpoint> allowed;
+        for (const Endpoint& ep : addresses) {
+            if (m_peer_db.is_banned(ep)) continue;
+            m_peer_db.seen(ep, m_loop.now());
+            const PeerRecord* r = m_peer_db.find(ep);
+            if (r && r->connected) continue;
+            allowed.push_back(ep);
+        }
+        if (!allowed.empty()) m_connector.add(allowed);
+    }
+
+    Torrent::PeerConn& Torrent::add_connection(int fd, const Endpoint& remote, bool outbound) {
+        set_nonblocking(fd);
+
+        auto conn = std::make_unique<PeerConn>();
+        conn->owner      = this;
+        conn->fd         = fd;
+        conn->remote     = remote;
+        conn->outbound   = outbound;
+        // uTP streams are the only AF_UNIX sockets we're handed (socketpair ends)
+        int domain = 0;
+        socklen_t domain_len = sizeof(domain);
+        conn->utp = ::getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) == 0 && domain == AF_UNIX;
+        conn->peer_has.assign(m_picker.num_pieces(), false);
+        conn->limits.upload.set_rate(m_peer_upload_limit);
+        conn->limits.download.set_rate(m_peer_download_limit);
+        conn->connected_at = m_loop.now();
+        conn->last_send  = m_loop.now();
+        conn->last_recv  = m_loop.now();
+        conn->last_block = m_loop.now();
+
+        PeerConn* c = conn.get();
+        m_conns[fd] = std::move(conn);
+        if (m_budget) m_budget->used++;
+
+        m_loop.add_fd(fd, EPOLLIN, [this, c](std::uint32_t events) {
+            int fd = c->fd;
+            if (events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(fd, "socket error");
+                return;
+            }
+            if (events & EPOLLOUT) {
+                if (!flush(*c)) return;
+            }
+            if (events & EPOLLIN) {
+                on_readable(*c);
+            }
+        });
+
+        return *c;
+    }
+
+    // Outbound connect finished: we speak first.
+    void Torrent::on_connected(int fd, const Endpoint& remote, std::chrono::milliseconds connect_time) {
+        m_peer_db.connected(remote, connect_time, m_loop.now());
+        if (!make_room(m_peer_db.score(remote, m_loop.now()))) {
+            m_peer_db.disconnected(remote, "connection limit", m_loop.now());
+            ::close(fd);
+            return;
+        }
+
+        PeerConn& c = add_connection(fd, remote, true);
+        Handshake hs = build_handshake(m_meta.info_hash_raw, m_peer_id, local_reserved(m_dht_port != 0));
+        queue_bytes(c, std::vector<std::uint8_t>(hs.begin(), hs.end()));
+        flush(c);
+    }
+
+    void Torrent::close_connection(int fd, const std::string& reason) {
+        auto it = m_conns.find(fd);
+        if (it == m_conns.end()) return;
+
+        PeerConn& c = *it->second;
+        bool was_unchoked = !c.am_choking;
+        if (c.handshake_done || c.outbound) {
+            std::cerr << "[peer] " << c.remote.to_string() << " disconnected: " << reason << "\n";
+        }
+
+        m_peer_db.update_transfer(c.remote, c.download_rate.rate(m_loop.now()), c.upload_rate.rate(m_loop.now()),
+                                  c.download_rate.total(), c.upload_rate.total());
+        m_peer_db.disconnected(c.remote, reason, m_loop.now());
+
+        if (c.extended) {
+            for (const auto& ext : m_extensions.extensions()) ext->on_disconnect(c);
+        }
+        release_pending(c);
+        if (c.handshake_done) m_picker.remove_peer_pieces(c.peer_has);
+
+        m_loop.remove_fd(fd);
+        ::close(fd);
+        m_conns.erase(it);
+        if (m_budget) m_budget->used--;
+
+        if (was_unchoked) fill_upload_slots();
+        m_connector.start_queued();
+    }
+
+
+    // ----------------- Receiving -----------------
+
+    void Torrent::on_readable(PeerConn& c) {
+        const int fd = c.fd;
+
+        const BandwidthChain chain = download_chain(c);
+
+        std::uint8_t buf[16 * 1024];
+        while (true) {
+            std::uint64_t quota = bandwidth_quota(chain, sizeof(buf), m_loop.now());
+            if (quota == 0) {
+                wait_for_bandwidth(c, false);
+                break;
+            }
+
+            ssize_t n = ::recv(fd, buf, static_cast<std::size_t>(quota), 0);
+            if (n > 0) {
+                bandwidth_consume(chain, static_cast<std::uint64_t>(n));
+                c.in.insert(c.in.end(), buf, buf + n);
+                c.last_recv = m_loop.now();
+                continue;
+            }
+            if (n == 0) {
+                close_connection(fd, "closed by peer");
+                return;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+            close_connection(fd, std::string("recv: ") + std::strerror(errno));
+            return;
+        }
+
+        if (!c.handshake_done) {
+            if (!handle_handshake(c)) return;
+        }
+
+        std::size_t pos = 0;
+        try {
+            while (c.handshake_done) {
+                BtMessageView view;
+                std::size_t used = parse_message_view(c.in.data() + pos, c.in.size() - pos, view);
+                if (used == 0) break;
+                pos += used;
+
+                if (view.id == MsgId::Extended) {
+                    // Handed over straight from the receive buffer
+                    handle_extended(c, view.payload, view.payload_len);
+                }
+                else {
+                    BtMessage msg;
+                    msg.length = view.length;
+                    msg.id = view.id;
+                    msg.payload.assign(view.payload, view.payload + view.payload_len);
+                    handle_message(c, msg);
+                }
+                if (m_conns.find(fd) == m_conns.end()) return; // closed by handler
+            }
+        }
+        catch (const std::exception& ex) {
+            close_connection(fd, ex.what());
+            return;
+        }
+        c.in.erase(c.in.begin(), c.in.begin() + static_cast<std::ptrdiff_t>(pos));
+
+        request_blocks(c);
+        flush(c);
+    }
+
+    bool Torrent::handle_handshake(PeerConn& c) {
+        if (c.in.size() < 68) return true;
+
+        if (c.in[0] != 19 || std::memcmp(&c.in[1], "BitTorrent protocol", 19) != 0) {
+            close_connection(c.fd, "invalid protocol string");
+            return false;
+        }
+        if (std::memcmp(&c.in[28], m_meta.info_hash_raw.data(), 20) != 0) {
+            close_connection(c.fd, "info_hash mismatch");
+            return false;
+        }
+        if (std::memcmp(&c.in[48], m_peer_id.data(), 20) == 0) {
+            close_connection(c.fd, "connected to ourselves");
+            return false;
+        }
+
+        const Reserved reserved = handshake_reserved(c.in.data());
+        c.fast = supports_fast(reserved);
+        c.extended = supports_extensions(reserved);
+        c.in.erase(c.in.begin(), c.in.begin() + 68);
+        c.handshake_done = true;
+        std::cerr << "[peer] " << c.remote.to_string() << " connected" << (c.utp ? " over uTP" : "") << "\n";
+
+        // Inbound peers spoke first; answer with our handshake
+        if (!c.outbound) {
+            Handshake hs = build_handshake(m_meta.info_hash_raw, m_peer_id, local_reserved(m_dht_port != 0));
+            queue_bytes(c, std::vector<std::uint8_t>(hs.begin(), hs.end()));
+        }
+
+        const std::uint32_t num_have = m_picker.num_have();
+        if (c.fast && num_have == m_picker.num_pieces()) {
+            queue_bytes(c, build_message(MsgId::HaveAll));
+        }
+        else if (c.fast && num_have == 0) {
+            queue_bytes(c, build_message(MsgId::HaveNone));
+        }
+        else if (num_have > 0) {
+            queue_bytes(c, build_bitfield(m_picker.have_bitfield()));
+        }
+        if (c.fast) send_allowed_fast(c);
+        if (c.extended) send_extension_handshake(c);
+        if (m_dht_port != 0 && supports_dht(reserved)) queue_bytes(c, build_port(m_dht_port));
+        return true;
+    }
+
+    void Torrent::handle_message(PeerConn& c, const BtMessage& msg) {
+        if (!msg.id) return; // keep-alive
+
+        const auto& p = msg.payload;
+        if (*msg.id >= MsgId::Suggest && *msg.id <= MsgId::AllowedFast && !c.fast) {
+            throw std::runtime_error("fast extension message without negotiating it");
+        }
+
+        switch (*msg.id) {
+            case MsgId::Choke:
+                c.peer_choking = true;
+                // Without the fast extension a choke discards everything we
+                // asked for; with it, each request is answered or rejected
+                if (!c.fast) release_pending(c);
+                break;
+
+            case MsgId::Unchoke:
+                c.peer_choking = false;
+                c.last_block = m_loop.now();
+                break;
+
+            case MsgId::Interested:
+                c.peer_interested = true;
+                fill_upload_slots();
+                break;
+
+            case MsgId::NotInterested:
+                c.peer_interested = false;
+                if (!c.am_choking) {
+                    choke(c);
+                    fill_upload_slots();
+                }
+                break;
+
+            case MsgId::Have: {
+                if (p.size() != 4) throw std::runtime_error("bad Have length");
+                std::uint32_t piece = read_u32_be(p.data());
+                if (piece < c.peer_has.size() && !c.peer_has[piece]) {
+                    c.peer_has[piece] = true;
+                    m_picker.inc_availability(piece);
+                    if (!c.am_interested && m_picker.wants(piece)) update_am_interested(c);
+                }
+                break;
+            }
+
+            case MsgId::Bitfield:
+            case MsgId::HaveAll:
+            case MsgId::HaveNone:
+                m_picker.remove_peer_pieces(c.peer_has);
+                if (*msg.id == MsgId::Bitfield) {
+                    c.peer_has = parse_bitfield(p, m_picker.num_pieces());
+                }
+                else {
+                    c.peer_has.assign(m_picker.num_pieces(), *msg.id == MsgId::HaveAll);
+                }
+                m_picker.add_peer_pieces(c.peer_has);
+                update_am_interested(c);
+                break;
+
+            case MsgId::Reject:
+                handle_reject(c, p);
+                break;
+
+            case MsgId::AllowedFast:
+            case MsgId::Suggest: {
+                if (p.size() != 4) throw std::runtime_error("bad Allowed Fast / Suggest length");
+                std::uint32_t piece = read_u32_be(p.data());
+                if (piece >= m_picker.num_pieces()) break;
+
+                auto& list = *msg.id == MsgId::AllowedFast ? c.allowed_fast : c.suggested;
+                const std::size_t cap = *msg.id == MsgId::AllowedFast ? kMaxAllowedFast : kMaxSuggested;
+                if (list.size() < cap && std::find(list.begin(), list.end(), piece) == list.end()) {
+                    list.push_back(piece);
+                }
+                break;
+            }
+
+            case MsgId::Request: {
+                if (p.size() != 12) throw std::runtime_error("bad Request length");
+                BlockRequest req{read_u32_be(p.data()), read_u32_be(p.data() + 4), read_u32_be(p.data() + 8)};
+
+                // Requests while choked are dropped (the peer knows it is choked),
+                // unless the piece is in its allowed fast set. Fast peers are told.
+                bool allowed = !c.am_choking ||
+                               std::find(c.allowed_fast_given.begin(), c.allowed_fast_given.end(), req.piece)
+                               != c.allowed_fast_given.end();
+                if (!allowed || c.requests.size() >= kMaxQueuedRequests) {
+                    if (c.fast) queue_bytes(c, build_reject(req.piece, req.begin, req.length));
+                    break;
+                }
+
+                if (req.piece >= m_picker.num_pieces() || !m_picker.have(req.piece)) {
+                    if (c.fast) {
+                        queue_bytes(c, build_reject(req.piece, req.begin, req.length));
+                        break;
+                    }
+                    throw std::runtime_error("requested a piece we don't have");
+                }
+                if (req.length == 0 || req.length > kMaxRequestLength ||
+                    static_cast<std::uint64_t>(req.begin) + req.length > piece_length(req.piece)) {
+                    throw std::runtime_error("invalid block request");
+                }
+
+                c.requests.push_back(req);
+                break;
+            }
+
+            case MsgId::Piece:
+                handle_piece(c, p);
+                break;
+
+            case MsgId::Cancel: {
+                if (p.size() != 12) throw std::runtime_error("bad Cancel length");
+                std::uint32_t piece  = read_u32_be(p.data());
+                std::uint32_t begin  = read_u32_be(p.data() + 4);
+                std::uint32_t length = read_u32_be(p.data() + 8);
+                auto it = std::find_if(c.requests.begin(), c.requests.end(), [&](const BlockRequest& r) {
+                    return r.piece == piece && r.begin == begin && r.length == length;
+                });
+                if (it != c.requests.end()) {
+                    c.requests.erase(it);
+                    // BEP 6: a cancelled request is still answered, with a Reject
+                    if (c.fast) queue_bytes(c, build_reject(piece, begin, length));
+                }
+                break;
+            }
+
+            case MsgId::Port: {
+                if (p.size() != 2) throw std::runtime_error("bad Port length");
+                Endpoint node = c.remote;
+                node.port = static_cast<std::uint16_t>((p[0] << 8) | p[1]);
+                if (node.port != 0 && m_on_dht_node) m_on_dht_node(node);
+                break;
+            }
+
+            default:
+                // Unknown ids are ignored
+                break;
+        }
+    }
+
+
+    // ----------------- Extensions -----------------
+
+    void Torrent::send_extension_handshake(PeerConn& c) {
+        json dict = m_extensions.handshake();
+        dict["v"] = kClientVersion;
+        dict["reqq"] = static_cast<std::int64_t>(kMaxQueuedRequests);
+        if (m_listen_port != 0) dict["p"] = static_cast<std::int64_t>(m_listen_port);
+
+        const std::uint8_t* addr = c.remote.is_v4() ? c.remote.addr.data() + 12 : c.remote.addr.data();
+        dict["yourip"] = std::string(reinterpret_cast<const char*>(addr), c.remote.is_v4() ? 4 : 16);
+
+        const std::string payload = encode_bencode_value(dict);
+        queue_bytes(c, build_extended(0, reinterpret_cast<const std::uint8_t*>(payload.data()), payload.size()));
+    }
+
+    void Torrent::handle_extended(PeerConn& c, const std::uint8_t* data, std::size_t len) {
+        if (!c.extended) throw std::runtime_error("extended message without negotiating it");
+        if (len < 1) throw std::runtime_error("empty extended message");
+
+        if (data[0] == 0) {
+            merge_extension_handshake(c.ext, parse_extension_handshake(data + 1, len - 1));
+            for (const auto& ext : m_extensions.extensions()) ext->on_handshake(c);
+            return;
+        }
+
+        // Ids are ours (from our handshake); ones we never handed out are ignored
+        if (Extension* ext = m_extensions.find(data[0])) {
+            ext->on_message(c, data + 1, len - 1);
+        }
+    }
+
+    void Torrent::PeerConn::send_extended(const std::string& name, const std::uint8_t* data, std::size_t len) {
+        auto it = ext.messages.find(name);
+        if (it == ext.messages.end()) return;
+        owner->queue_bytes(*this, build_extended(it->second, data, len));
+    }
+
+
+    // Peers we can vouch for: outbound ones at the address we connected to,
+    // inbound ones at the listen port they told us ("p").
+    std::vector<UtPex::Peer> Torrent::pex_peers() const {
+        std::vector<UtPex::Peer> peers;
+        for (const auto& kv : m_conns) {
+            const PeerConn& c = *kv.second;
+            if (!c.handshake_done) continue;
+
+            UtPex::Peer p;
+            p.endpoint = c.remote;
+            if (c.outbound) {
+                p.flags |= UtPex::kFlagReachable;
+            }
+            else if (c.ext.listen_port) {
+                p.endpoint.port = *c.ext.listen_port;
+            }
+            else {
+                continue;
+            }
+            if (std::all_of(c.peer_has.begin(), c.peer_has.end(), [](bool b) { return b; })) {
+                p.flags |= UtPex::kFlagSeed;
+            }
+            peers.push_back(p);
+        }
+        return peers;
+    }
+
+    void Torrent::on_pex_peers(const std::vector<UtPex::Peer>& peers) {
+        const std::vector<UtPex::Peer> connected = pex_peers();
+        for (const UtPex::Peer& p : peers) {
+            // Seeds have nothing for us once we are one too
+            if (is_finished() && (p.flags & UtPex::kFlagSeed)) continue;
+
+            bool known = std::any_of(connected.begin(), connected.end(), [&](const UtPex::Peer& c) {
+                return c.endpoint == p.endpoint;
+            });
+            if (!known) add_peer(p.endpoint);
+        }
+    }
+
+
+    // ----------------- Downloading -----------------
+
+    void Torrent::update_am_interested(PeerConn& c) {
+        if (!c.handshake_done) return;
+
+        bool interested = false;
+        for (std::uint32_t i = 0; i < c.peer_has.size(); ++i) {
+            if (c.peer_has[i] && m_picker.wants(i)) {
+                interested = true;
+                break;
+            }
+        }
+
+        if (interested == c.am_interested) return;
+        c.am_interested = interested;
+        queue_bytes(c, build_message(interested ? MsgId::Interested : MsgId::NotInterested));
+    }
+
+    // Next block to ask this peer for: first free blocks of pieces already in
+    // progress (finish what we started), then a new piece from the picker.
+    // Enough requests to cover kRequestQueueSeconds at the peer's current
+    // rate (at least kPipelineDepth), but never more than the peer said it
+    // queues. Peers that didn't say (no extension handshake) get kPipelineDepth.
+    std::size_t Torrent::pipeline_depth(const PeerConn& c) const {
+        const std::size_t limit = c.ext.reqq ? std::min<std::size_t>(*c.ext.reqq, kMaxPipelineDepth) : kPipelineDepth;
+        const double rate = c.download_rate.rate(m_loop.now());
+        const auto by_rate = static_cast<std::size_t>(rate * kRequestQueueSeconds / kBlockSize);
+        return std::min(std::max(kPipelineDepth, by_rate), limit);
+    }
+
+    bool Torrent::pick_block(PeerConn& c, BlockRequest& out) {
+        const bool parole = m_peer_db.on_parole(c.remote);
+
+        // While choked only the peer's allowed fast pieces may be requested
+        const std::vector<bool>* has = &c.peer_has;
+        std::vector<bool> fast_only;
+        if (c.peer_choking) {
+            fast_only.assign(c.peer_has.size(), false);
+            for (std::uint32_t piece : c.allowed_fast) {
+                if (c.peer_has[piece]) fast_only[piece] = true;
+            }
+            has = &fast_only;
+        }
+
+        for (auto& kv : m_partials) {
+            std::uint32_t piece = kv.first;
+            if (!(*has)[piece]) continue;
+
+            PartialPiece& pp = kv.second;
+            if (pp.exclusive_to) {
+                if (*pp.exclusive_to != c.remote) continue;
+            }
+            else if (parole) {
+                // Only pieces nobody else has started, and then nobody else may join
+                bool untouched = std::all_of(pp.blocks.begin(), pp.blocks.end(), [](PartialPiece::Block b) {
+                    return b == PartialPiece::Block::Free;
+                });
+                if (!untouched) continue;
+                pp.exclusive_to = c.remote;
+            }
+
+            for (std::uint32_t b = 0; b < pp.blocks.size(); ++b) {
+                if (pp.blocks[b] != PartialPiece::Block::Free) continue;
+
+                pp.blocks[b] = PartialPiece::Block::Requested;
+                out.piece  = piece;
+                out.begin  = b * kBlockSize;
+                out.length = std::min(kBlockSize, static_cast<std::uint32_t>(pp.data.size()) - out.begin);
+                return true;
+            }
+        }
+
+        // A piece the peer suggested (e.g. one it has cached) before our own pick
+        while (!c.suggested.empty()) {
+            std::uint32_t piece = c.suggested.front();
+            c.suggested.erase(c.suggested.begin());
+            if ((*has)[piece] && m_picker.wants(piece) && !m_picker.is_downloading(piece)) {
+                start_piece(c, piece, out);
+                return true;
+            }
+        }
+
+        std::optional<std::uint32_t> next = m_picker.pick_piece(*has);
+        if (!next) return false;
+
+        start_piece(c, *next, out);
+        return true;
+    }
+
+    // Start downloading `piece` from `c`; `out` is its first block.
+    void Torrent::start_piece(PeerConn& c, std::uint32_t piece, BlockRequest& out) {
+        m_picker.mark_downloading(piece);
+
+        PartialPiece& pp = m_partials[piece];
+        pp.data.assign(piece_length(piece), 0);
+        pp.blocks.assign((pp.data.size() + kBlockSize - 1) / kBlockSize, PartialPiece::Block::Free);
+        pp.block_sources.assign(pp.blocks.size(), Endpoint{});
+        if (m_peer_db.on_parole(c.remote)) pp.exclusive_to = c.remote;
+        pp.blocks[0] = PartialPiece::Block::Requested;
+
+        out.piece  = piece;
+        out.begin  = 0;
+        out.length = std::min(kBlockSize, static_cast<std::uint32_t>(pp.data.size()));
+    }
+
+    // The peer won't send a block we asked for: let someone else have it.
+    void Torrent::handle_reject(PeerConn& c, const std::vector<std::uint8_t>& payload) {
+        if (payload.size() != 12) throw std::runtime_error("bad Reject length");
+
+        std::uint32_t piece = read_u32_be(payload.data());
+        std::uint32_t begin = read_u32_be(payload.data() + 4);
+        std::uint32_t len   = read_u32_be(payload.data() + 8);
+
+        auto pit = std::find_if(c.pending.begin(), c.pending.end(), [&](const PendingBlock& pb) {
+            return pb.piece == piece && pb.begin == begin && pb.length == len;
+        });
+        if (pit == c.pending.end()) return;
+        c.pending.erase(pit);
+
+        auto it = m_partials.find(piece);
+        if (it != m_partials.end() && begin % kBlockSize == 0 && begin / kBlockSize < it->second.blocks.size()) {
+            auto& state = it->second.blocks[begin / kBlockSize];
+            if (state == PartialPiece::Block::Requested) state = PartialPiece::Block::Free;
+        }
+
+        // Rejected while choked: it isn't allowed fast after all, don't ask again
+        if (c.peer_choking) {
+            c.allowed_fast.erase(std::remove(c.allowed_fast.begin(), c.allowed_fast.end(), piece),
+                                 c.allowed_fast.end());
+        }
+    }
+
+    // Offer the peer the pieces of its allowed fast set that we have.
+    void Torrent::send_allowed_fast(PeerConn& c) {
+        const std::uint8_t* addr = c.remote.is_v4() ? c.remote.addr.data() + 12 : c.remote.addr.data();
+        const std::size_t addr_len = c.remote.is_v4() ? 4 : 16;
+
+        for (std::uint32_t piece : allowed_fast_set(addr, addr_len, m_meta.info_hash_raw,
+                                                    m_picker.num_pieces(), kAllowedFastCount)) {
+            if (!m_picker.have(piece)) continue;
+            c.allowed_fast_given.push_back(piece);
+            queue_bytes(c, build_allowed_fast(piece));
+        }
+    }
+
+    void Torrent::request_blocks(PeerConn& c) {
+        if (!c.handshake_done || !c.am_interested) return;
+        if (c.peer_choking && c.allowed_fast.empty()) return;
+
+        const std::size_t depth = pipeline_depth(c);
+        while (c.pending.size() < depth) {
+            BlockRequest req;
+            if (!pick_block(c, req)) break;
+
+            queue_bytes(c, build_request(req.piece, req.begin, req.length));
+            c.pending.push_back(PendingBlock{req.piece, req.begin, req.length, m_loop.now()});
+        }
+    }
+
+    // Give this peer's outstanding requests back so other peers can take them.
+    // The blocks may still be on their way, so they are remembered as late.
+    void Torrent::release_pending(PeerConn& c) {
+        for (const PendingBlock& pb : c.pending) {
+            c.late.push_back(pb);
+            auto it = m_partials.find(pb.piece);
+            if (it == m_partials.end()) continue;
+
+            auto& state = it->second.blocks[pb.begin / kBlockSize];
+            if (state == PartialPiece::Block::Requested) state = PartialPiece::Block::Free;
+        }
+        c.pending.clear();
+        while (c.late.size() > kMaxLateBlocks) c.late.pop_front();
+
+        // Pieces claimed on parole are opened up again rather than left stuck
+        for (auto& kv : m_partials) {
+            if (kv.second.exclusive_to == c.remote) kv.second.exclusive_to.reset();
+        }
+    }
+
+    void Torrent::handle_piece(PeerConn& c, const std::vector<std::uint8_t>& payload) {
+        if (payload.size() < 8) throw std::runtime_error("piece message too short");
+
+        std::uint32_t piece = read_u32_be(payload.data());
+        std::uint32_t begin = read_u32_be(payload.data() + 4);
+        std::uint32_t len   = static_cast<std::uint32_t>(payload.size() - 8);
+
+        // Only blocks we asked this peer for, now or before giving the
+        // request back; anything else could slip into a piece that another
+        // peer is blamed for if it fails
+        auto matches = [&](const PendingBlock& pb) {
+            return pb.piece == piece && pb.begin == begin && pb.length == len;
+        };
+        auto pit = std::find_if(c.pending.begin(), c.pending.end(), matches);
+        if (pit != c.pending.end()) {
+            c.pending.erase(pit);
+        }
+        else {
+            auto lit = std::find_if(c.late.begin(), c.late.end(), matches);
+            if (lit == c.late.end()) return;
+            c.late.erase(lit);
+        }
+
+        c.download_rate.add(len, m_loop.now());
+        c.last_block = m_loop.now();
+        m_downloaded += len;
+
+        // Late blocks (timed out and re-requested elsewhere) are still used if needed
+        auto it = m_partials.find(piece);
+        if (it == m_partials.end() || begin % kBlockSize != 0) return;
+
+        PartialPiece& pp = it->second;
+        // Reserved for a peer on parole, so that a failure is its own
+        if (pp.exclusive_to && *pp.exclusive_to != c.remote) return;
+        std::uint32_t b = begin / kBlockSize;
+        if (b >= pp.blocks.size() || pp.blocks[b] == PartialPiece::Block::Received) return;
+        if (begin + len != std::min<std::uint64_t>(pp.data.size(), static_cast<std::uint64_t>(begin) + kBlockSize)) {
+            throw std::runtime_error("piece block has wrong length");
+        }
+
+        std::memcpy(pp.data.data() + begin, payload.data() + 8, len);
+        pp.blocks[b] = PartialPiece::Block::Received;
+        pp.block_sources[b] = c.remote;
+        pp.received++;
+
+        if (pp.received == pp.blocks.size()) piece_finished(piece);
+    }
+
+    void Torrent::piece_finished(std::uint32_t piece) {
+        PartialPiece& pp = m_partials.at(piece);
+
+        if (m_pool) {
+            // Hash and write on the pool; the piece isn't touched meanwhile
+            // (all its blocks are in, and close_banned() leaves it alone)
+            pp.verifying = true;
+            const std::vector<std::uint8_t>* data = &pp.data;
+            m_jobs->run([this, piece, data, alive = m_alive] {
+                std::string digest = sha1_raw(std::string(data->begin(), data->end()));
+                const bool ok = std::memcmp(digest.data(), m_meta.piece_hashes[piece].data(), 20) == 0;
+                std::string error;
+                if (ok) {
+                    try {
+                        m_storage.write_block(piece, 0, data->data(), data->size());
+                    }
+                    catch (const std::exception& ex) {
+                        error = ex.what();
+                    }
+                }
+                m_loop.post([this, piece, ok, error, alive] {
+                    if (*alive) piece_checked(piece, ok, error);
+                });
+            });
+            return;
+        }
+
+        std::string digest = sha1_raw(std::string(pp.data.begin(), pp.data.end()));
+        if (std::memcmp(digest.data(), m_meta.piece_hashes[piece].data(), 20) != 0) {
+            piece_failed(piece);
+            return;
+        }
+        m_storage.write_block(piece, 0, pp.data.data(), pp.data.size());
+        piece_passed(piece);
+    }
+
+    void Torrent::piece_checked(std::uint32_t piece, bool ok, const std::string& error) {
+        PartialPiece& pp = m_partials.at(piece);
+        pp.verifying = false;
+
+        if (!error.empty()) {
+            // Nobody's fault; get it again
+            std::cerr << "[!] Piece " << piece << " could not be written: " << error << "\n";
+            std::fill(pp.blocks.begin(), pp.blocks.end(), PartialPiece::Block::Free);
+            pp.received = 0;
+            return;
+        }
+        if (ok) piece_passed(piece);
+        else piece_failed(piece);
+    }
+
+    void Torrent::piece_failed(std::uint32_t piece) {
+        PartialPiece& pp = m_partials.at(piece);
+        std::cerr << "[!] Piece " << piece << " failed hash check, downloading again\n";
+
+        std::vector<Endpoint> sources;
+        for (const Endpoint& src : pp.block_sources) {
+            if (std::find(sources.begin(), sources.end(), src) == sources.end()) sources.push_back(src);
+        }
+
+        // A lone source is surely guilty; several go on parole until we know
+        bool banned = false;
+        for (const Endpoint& src : sources) {
+            banned |= m_peer_db.hash_failure(src, sources.size() == 1);
+        }
+        if (sources.size() > 1) record_suspects(piece, pp);
+
+        std::fill(pp.blocks.begin(), pp.blocks.end(), PartialPiece::Block::Free);
+        pp.received = 0;
+        pp.exclusive_to.reset();
+        if (banned) close_banned();
+    }
+
+    // Verified and on disk.
+    void Torrent::piece_passed(std::uint32_t piece) {
+        PartialPiece& pp = m_partials.at(piece);
+
+        const bool sole_source = std::all_of(pp.block_sources.begin(), pp.block_sources.end(),
+                                             [&](const Endpoint& src) { return src == pp.block_sources[0]; });
+        if (sole_source) m_peer_db.good_piece(pp.block_sources[0]);
+
+        if (smart_ban(piece, pp)) close_banned();
+
+        m_partials.erase(piece);
+        m_picker.clear_downloading(piece);
+
+        announce_piece(piece);
+        std::cerr << "[✓] Piece " << piece << " done (" << m_picker.num_have()
+                  << " / " << m_picker.num_pieces() << ")\n";
+
+        if (!m_finished_notified && m_picker.is_finished()) {
+            m_finished_notified = true;
+            if (m_on_finished) m_on_finished();
+        }
+    }
+
+    // Remember what each peer sent for a piece that failed, so the culprit
+    // can be found once the piece has been downloaded correctly.
+    void Torrent::record_suspects(std::uint32_t piece, const PartialPiece& pp) {
+        std::vector<SuspectBlock>& suspects = m_suspects[piece];
+        for (std::uint32_t b = 0; b < pp.blocks.size(); ++b) {
+            const std::uint32_t begin = b * kBlockSize;
+            const std::uint32_t len = std::min(kBlockSize, static_cast<std::uint32_t>(pp.data.size()) - begin);
+
+            SuspectBlock sb;
+            sb.block  = b;
+            sb.source = pp.block_sources[b];
+            sb.digest = sha1_raw(std::string(pp.data.begin() + begin, pp.data.begin() + begin + len));
+
+            // The same peer sending the same bytes again tells us nothing new
+            bool known = std::any_of(suspects.begin(), suspects.end(), [&](const SuspectBlock& s) {
+                return s.block == b && s.source == sb.source && s.digest == sb.digest;
+            });
+            if (!known) suspects.push_back(std::move(sb));
+        }
+    }
+
+    // `pp` passed its hash check: any recorded block that differs from the
+    // good data pins the peer that sent it. Returns true if someone was banned.
+    bool Torrent::smart_ban(std::uint32_t piece, const PartialPiece& pp) {
+        auto it = m_suspects.find(piece);
+        if (it == m_suspects.end()) return false;
+
+        bool banned = false;
+        for (const SuspectBlock& sb : it->second) {
+            const std::uint32_t begin = sb.block * kBlockSize;
+            const std::uint32_t len = std::min(kBlockSize, static_cast<std::uint32_t>(pp.data.size()) - begin);
+            const std::string good = sha1_raw(std::string(pp.data.begin() + begin, pp.data.begin() + begin + len));
+            if (sb.digest == good || m_peer_db.is_banned(sb.source)) continue;
+
+            std::cerr << "[!] " << sb.source.to_string() << " sent a corrupt block of piece " << piece << "\n";
+            m_peer_db.ban(sb.source);
+            banned = true;
+        }
+
+        m_suspects.erase(it);
+        return banned;
+    }
+
+    bool Torrent::is_snubbed(const PeerConn& c) const {
+        return c.am_interested && !c.peer_choking && !c.pending.empty() &&
+               m_loop.now() - c.last_block > kSnubTimeout;
+    }
+
+
+    // ----------------- Sending -----------------
+
+    void Torrent::queue_bytes(PeerConn& c, std::vector<std::uint8_t> bytes, bool more) {
+        OutChunk chunk;
+        chunk.length = bytes.size();
+        chunk.data   = std::make_shared<const std::vector<std::uint8_t>>(std::move(bytes));
+        chunk.more   = more;
+        c.out.push_back(std::move(chunk));
+    }
+
+    void Torrent::queue_block(PeerConn& c, const BlockRequest& req) {
+        auto hdr = build_piece_header(req.piece, req.begin, req.length);
+        queue_bytes(c, std::vector<std::uint8_t>(hdr.begin(), hdr.end()), true);
+
+        c.upload_rate.add(req.length, m_loop.now());
+        m_uploaded += req.length;
+
+        if (m_cache) {
+            OutChunk chunk;
+            chunk.length = req.length;
+
+            std::uint32_t off = req.begin % BlockCache::kBlockSize;
+            BlockCache::Block block = m_cache->get_block(req.piece, req.begin / BlockCache::kBlockSize);
+            if (off + req.length <= block->size()) {
+                // Request lies inside one cached block: send straight from the cache
+                chunk.data        = std::move(block);
+                chunk.data_offset = off;
+            }
+            else {
+                std::vector<std::uint8_t> buf(req.length);
+                m_cache->read(req.piece, req.begin, buf.data(), buf.size());
+                chunk.data = std::make_shared<const std::vector<std::uint8_t>>(std::move(buf));
+            }
+
+            c.out.push_back(std::move(chunk));
+            return;
+        }
+
+        auto ranges = m_storage.map_to_disk(req.piece, req.begin, req.length);
+        for (std::size_t i = 0; i < ranges.size(); ++i) {
+            const Storage::DiskRange& r = ranges[i];
+
+            OutChunk chunk;
+            chunk.length = r.length;
+            chunk.more   = i + 1 < ranges.size();
+            if (r.fd >= 0) {
+                chunk.file_fd     = r.fd;
+                chunk.file_offset = r.offset;
+            }
+            else {
+                chunk.data = std::make_shared<const std::vector<std::uint8_t>>(static_cast<std::size_t>(r.length), 0);
+            }
+            c.out.push_back(std::move(chunk));
+        }
+    }
+
+    bool Torrent::flush(PeerConn& c) {
+        const int fd = c.fd;
+        if (c.write_blocked) return true;
+
+        const BandwidthChain chain = upload_chain(c);
+        const bool limited = !chain[0]->unlimited() || !chain[1]->unlimited() ||
+                             (chain[2] && !chain[2]->unlimited());
+
+        while (true) {
+            // Pull queued requests into the send queue while it is short
+            std::uint64_t pending = 0;
+            for (const auto& chunk : c.out) pending += chunk.length - chunk.sent;
+            while (pending < kSendQueueTarget && !c.requests.empty()) {
+                BlockRequest req = c.requests.front();
+                c.requests.pop_front();
+                queue_block(c, req);
+                pending += 13 + req.length;
+            }
+
+            if (c.out.empty()) break;
+
+            OutChunk& chunk = c.out.front();
+            std::uint64_t left = chunk.length - chunk.sent;
+            if (limited) {
+                left = bandwidth_quota(chain, std::min(left, kBandwidthQuantum), m_loop.now());
+                if (left == 0) {
+                    wait_for_bandwidth(c, true);
+                    return true;
+                }
+            }
+
+            ssize_t n;
+            if (chunk.file_fd >= 0) {
+                off_t off = static_cast<off_t>(chunk.file_offset + chunk.sent);
+                n = ::sendfile(fd, chunk.file_fd, &off, static_cast<std::size_t>(left));
+            }
+            else {
+                // A partial chunk (bandwidth limited) is always followed by more bytes
+                bool more = chunk.more || chunk.sent + left < chunk.length;
+                int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+                n = ::send(fd, chunk.data->data() + chunk.data_offset + chunk.sent,
+                           static_cast<std::size_t>(left), flags);
+            }
+
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                close_connection(fd, std::string("send: ") + std::strerror(errno));
+                return false;
+            }
+            if (n == 0) {
+                // sendfile() hit EOF: the file is shorter than the metainfo says
+                close_connection(fd, "short read from disk");
+                return false;
+            }
+
+            bandwidth_consume(chain, static_cast<std::uint64_t>(n));
+            chunk.sent += static_cast<std::uint64_t>(n);
+            c.last_send = m_loop.now();
+            if (chunk.sent == chunk.length) c.out.pop_front();
+        }
+
+        update_interest(c);
+        return true;
+    }
+
+    // Poll only for what the connection can act on: no EPOLLIN while out of
+    // download tokens, no EPOLLOUT while out of upload tokens or idle.
+    void Torrent::update_interest(PeerConn& c) {
+        std::uint32_t events = c.read_blocked ? 0 : static_cast<std::uint32_t>(EPOLLIN);
+        if (!c.out.empty() && !c.write_blocked) events |= static_cast<std::uint32_t>(EPOLLOUT);
+        m_loop.modify_fd(c.fd, events);
+    }
+
+
+    // ----------------- Bandwidth -----------------
+
+    void Torrent::set_peer_upload_limit(std::uint64_t bytes_per_second) {
+        m_peer_upload_limit = bytes_per_second;
+        for (auto& kv : m_conns) kv.second->limits.upload.set_rate(bytes_per_second);
+    }
+
+    void Torrent::set_peer_download_limit(std::uint64_t bytes_per_second) {
+        m_peer_download_limit = bytes_per_second;
+        for (auto& kv : m_conns) kv.second->limits.download.set_rate(bytes_per_second);
+    }
+
+    BandwidthChain Torrent::upload_chain(PeerConn& c) {
+        return {&c.limits.upload, &m_limits.upload, m_global_limits ? &m_global_limits->upload : nullptr};
+    }
+
+    BandwidthChain Torrent::download_chain(PeerConn& c) {
+        return {&c.limits.download, &m_limits.download, m_global_limits ? &m_global_limits->download : nullptr};
+    }
+
+    // Park a connection until its buckets refill. One timer per torrent serves
+    // all waiting connections, armed for when the first of them can move again.
+    void Torrent::wait_for_bandwidth(PeerConn& c, bool upload) {
+        bool& blocked = upload ? c.write_blocked : c.read_blocked;
+        if (blocked) return;
+
+        blocked = true;
+        update_interest(c);
+        if (std::find(m_bandwidth_waiting.begin(), m_bandwidth_waiting.end(), c.fd) == m_bandwidth_waiting.end()) {
+            m_bandwidth_waiting.push_back(c.fd);
+        }
+
+        if (m_bandwidth_timer) return;
+
+        auto wait = bandwidth_wait(upload ? upload_chain(c) : download_chain(c), kBandwidthQuantum, m_loop.now());
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(wait);
+        ms = std::clamp(ms, std::chrono::milliseconds(5), std::chrono::milliseconds(1000));
+
+        m_bandwidth_timer = m_loop.add_timer(ms, [this] {
+            m_bandwidth_timer = 0;
+            on_bandwidth_timer();
+        }, false);
+    }
+
+    // Resume waiting connections in the order they blocked; whoever runs out
+    // of tokens again goes back to the end of the queue.
+    void Torrent::on_bandwidth_timer() {
+        std::vector<int> waiting;
+        waiting.swap(m_bandwidth_waiting);
+
+        for (int fd : waiting) {
+            auto it = m_conns.find(fd);
+            if (it == m_conns.end()) continue;
+            PeerConn& c = *it->second;
+
+            bool resume_read  = c.read_blocked;
+            bool resume_write = c.write_blocked;
+            c.read_blocked  = false;
+            c.write_blocked = false;
+            update_interest(c);
+
+            if (resume_write && !flush(c)) continue;
+            if (resume_read) on_readable(c);
+        }
+    }
+
+
+    // ----------------- Choking -----------------
+
+    void Torrent::choke(PeerConn& c) {
+        c.am_choking = true;
+        queue_bytes(c, build_message(MsgId::Choke));
+
+        if (!c.fast) {
+            c.requests.clear(); // per spec, pending requests are discarded on choke
+            return;
+        }
+
+        // Fast peers get an explicit Reject for each, except allowed fast pieces
+        std::deque<BlockRequest> keep;
+        for (const BlockRequest& req : c.requests) {
+            bool allowed = std::find(c.allowed_fast_given.begin(), c.allowed_fast_given.end(), req.piece)
+                           != c.allowed_fast_given.end();
+            if (allowed) keep.push_back(req);
+            else queue_bytes(c, build_reject(req.piece, req.begin, req.length));
+        }
+        c.requests.swap(keep);
+    }
+
+    void Torrent::unchoke(PeerConn& c) {
+        c.am_choking = false;
+        queue_bytes(c, build_message(MsgId::Unchoke));
+    }
+
+    // Between choker rounds, hand free upload slots to interested peers
+    // right away instead of leaving them idle for up to 10 seconds.
+    void Torrent::fill_upload_slots() {
+        std::size_t unchoked = 0;
+        for (auto& kv : m_conns) {
+            if (!kv.second->am_choking) unchoked++;
+        }
+
+        std::vector<int> changed;
+        for (auto& kv : m_conns) {
+            if (unchoked >= m_choker.config().upload_slots) break;
+
+            PeerConn& c = *kv.second;
+            if (c.handshake_done && c.peer_interested && c.am_choking) {
+                unchoke(c);
+                changed.push_back(kv.first);
+                unchoked++;
+            }
+        }
+
+        for (int fd : changed) {
+            auto it = m_conns.find(fd);
+            if (it != m_conns.end()) flush(*it->second);
+        }
+    }
+
+    void Torrent::run_choker() {
+        const auto now = m_loop.now();
+
+        std::vector<Choker::Candidate> candidates;
+        for (auto& kv : m_conns) {
+            const PeerConn& c = *kv.second;
+            if (!c.handshake_done) continue;
+
+            Choker::Candidate cand;
+            cand.id            = kv.first;
+            cand.interested    = c.peer_interested;
+            cand.snubbed       = is_snubbed(c);
+            cand.download_rate = c.download_rate.rate(now);
+            cand.upload_rate   = c.upload_rate.rate(now);
+            candidates.push_back(cand);
+        }
+
+        Choker::Decision decision = m_choker.run(candidates, m_picker.is_finished(), now);
+
+        std::vector<int> changed;
+        for (auto& kv : m_conns) {
+            PeerConn& c = *kv.second;
+            if (!c.handshake_done) continue;
+
+            bool unchoke_it = std::find(decision.unchoke.begin(), decision.unchoke.end(), kv.first)
+                              != decision.unchoke.end();
+            if (unchoke_it && c.am_choking) {
+                unchoke(c);
+                changed.push_back(kv.first);
+            }
+            else if (!unchoke_it && !c.am_choking) {
+                choke(c);
+                changed.push_back(kv.first);
+            }
+        }
+
+        for (int fd : changed) {
+            auto it = m_conns.find(fd);
+            if (it != m_conns.end()) flush(*it->second);
+        }
+    }
+
+
+    // ----------------- Peer selection -----------------
+
+    double Torrent::connection_score(const PeerConn& c) const {
+        return m_peer_db.score(c.remote, m_loop.now());
+    }
+
+    // At the connection limit, drop the lowest-scoring established peer if
+    // `newcomer_score` beats it. Returns true if there is room now. A full
+    // shared budget counts as our limit: we only ever replace our own peers.
+    bool Torrent::make_room(double newcomer_score) {
+        const bool budget_full = m_budget && m_budget->used >= m_budget->limit;
+        if (m_conns.size() < m_max_connections && !budget_full) return true;
+
+        const auto now = m_loop.now();
+        int worst = -1;
+        double worst_score = newcomer_score;
+        for (const auto& kv : m_conns) {
+            const PeerConn& c = *kv.second;
+            if (!c.handshake_done || now - c.connected_at < kMinConnectedTime) continue;
+
+            double s = connection_score(c);
+            if (s < worst_score) {
+                worst = kv.first;
+                worst_score = s;
+            }
+        }
+        if (worst < 0) return false;
+
+        close_connection(worst, "replaced by a better peer");
+        return true;
+    }
+
+    void Torrent::close_banned() {
+        std::vector<int> banned;
+        for (const auto& kv : m_conns) {
+            if (m_peer_db.is_banned(kv.second->remote)) banned.push_back(kv.first);
+        }
+        for (int fd : banned) close_connection(fd, "banned");
+
+        // Blocks they already sent for unfinished pieces can't be trusted either
+        for (auto& kv : m_partials) {
+            PartialPiece& pp = kv.second;
+            if (pp.verifying) continue; // the hash check will tell
+            for (std::uint32_t b = 0; b < pp.blocks.size(); ++b) {
+                if (pp.blocks[b] == PartialPiece::Block::Received && m_peer_db.is_banned(pp.block_sources[b])) {
+                    pp.blocks[b] = PartialPiece::Block::Free;
+                    pp.received--;
+                }
+            }
+        }
+    }
+
+
+    // ----------------- Housekeeping -----------------
+
+    void Torrent::on_tick() {
+        const auto now = m_loop.now();
+
+        std::vector<int> dead;
+        std::vector<int> active;
+        for (auto& kv : m_conns) {
+            PeerConn& c = *kv.second;
+            if (now - c.last_recv > kIdleTimeout) dead.push_back(kv.first);
+            else if (c.handshake_done) active.push_back(kv.first);
+        }
+
+        for (int fd : dead) close_connection(fd, "timed out");
+
+        for (auto& kv : m_conns) {
+            PeerConn& c = *kv.second;
+            m_peer_db.update_transfer(c.remote, c.download_rate.rate(now), c.upload_rate.rate(now),
+                                      c.download_rate.total(), c.upload_rate.total());
+        }
+
+        // Full, but a better peer is waiting: swap one slot per tick
+        const bool budget_full = m_budget && m_budget->used >= m_budget->limit;
+        if ((m_conns.size() >= m_max_connections || budget_full) && m_connector.queued() > 0 &&
+            make_room(m_connector.best_queued_rank())) {
+            m_connector.start_queued();
+        }
+
+        for (int fd : active) {
+            auto it = m_conns.find(fd);
+            if (it == m_conns.end()) continue;
+            PeerConn& c = *it->second;
+
+            // Hand requests that have been outstanding too long to other peers
+            bool expired = std::any_of(c.pending.begin(), c.pending.end(), [&](const PendingBlock& pb) {
+                return now - pb.requested_at > kRequestTimeout;
+            });
+            if (expired) release_pending(c);
+
+            if (now - c.last_send > kKeepAliveAfter) {
+                queue_bytes(c, std::vector<std::uint8_t>(4, 0));
+            }
+        }
+
+        for (const auto& ext : m_extensions.extensions()) ext->on_tick();
+
+        for (int fd : active) {
+            auto it = m_conns.find(fd);
+            if (it == m_conns.end()) continue;
+            request_blocks(*it->second);
+            flush(*it->second);
+        }
+    }
+
+}
@@ -0,0 +1,165 @@
+#include "torrent/torrent_creator.hpp"
+#include "torrent/bencode.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    namespace fs = std::filesystem;
+
+    namespace {
+
+        struct SourceFile {
+            std::string path;                    // on disk
+            std::vector<std::string> components; // in the torrent
+            long long length = 0;
+            long long offset = 0;
+            int fd = -1;
+        };
+
+        // Every regular file under `root`, sorted by path.
+        std::vector<SourceFile> list_files(const fs::path& root) {
+            std::vector<SourceFile> files;
+            for (const auto& entry : fs::recursive_directory_iterator(root)) {
+                if (!entry.is_regular_file()) continue;
+
+                SourceFile f;
+                f.path = entry.path().string();
+                for (const auto& part : fs::relative(entry.path(), root)) f.components.push_back(part.string());
+                f.length = static_cast<long long>(entry.file_size());
+                files.push_back(std::move(f));
+            }
+            std::sort(files.begin(), files.end(), [](const SourceFile& a, const SourceFile& b) {
+                return a.components < b.components;
+            });
+            return files;
+        }
+
+        long long pick_piece_length(long long total) {
+            long long piece_length = 16 * 1024;
+            while (piece_length < 16 * 1024 * 1024 && total / piece_length > 1500) piece_length *= 2;
+            return piece_length;
+        }
+
+        // Read [offset, offset + len) of the torrent's byte space.
+        void read_range(const std::vector<SourceFile>& files, long long offset, char* out, std::size_t len) {
+            auto it = std::upper_bound(files.begin(), files.end(), offset, [](long long off, const SourceFile& f) {
+                return off < f.offset;
+            });
+            if (it != files.begin()) --it;
+
+            while (len > 0 && it != files.end()) {
+                const long long in_file = offset - it->offset;
+                const std::size_t n = static_cast<std::size_t>(
+                    std::min<long long>(static_cast<long long>(len), it->length - in_file));
+                std::size_t done = 0;
+                while (done < n) {
+                    ssize_t r = ::pread(it->fd, out + done, n - done, static_cast<off_t>(in_file + done));
+                    if (r < 0 && errno == EINTR) continue;
+                    if (r < 0) throw std::runtime_error("Failed to read " + it->path + ": " + std::strerror(errno));
+                    if (r == 0) throw std::runtime_error(it->path + " shrank while hashing");
+                    done += static_cast<std::size_t>(r);
+                }
+                out += n;
+                offset += static_cast<long long>(n);
+                len -= n;
+                ++it;
+            }
+        }
+
+    }
+
+    std::string create_torrent(ThreadPool& pool, const std::string& path, const CreateOptions& options) {
+        fs::path root = fs::absolute(path).lexically_normal();
+        if (root.filename().empty()) root = root.parent_path(); // "dir/"
+        const bool multi_file = fs::is_directory(root);
+
+        std::vector<SourceFile> files;
+        if (multi_file) {
+            files = list_files(root);
+        }
+        else if (fs::is_regular_file(root)) {
+            SourceFile f;
+            f.path = root.string();
+            f.length = static_cast<long long>(fs::file_size(root));
+            files.push_back(std::move(f));
+        }
+        else {
+            throw std::runtime_error("Not a file or directory: " + path);
+        }
+
+        long long total = 0;
+        for (auto& f : files) {
+            f.offset = total;
+            total += f.length;
+        }
+        if (total == 0) throw std::runtime_error("Nothing to share in " + path);
+
+        long long piece_length = options.piece_length;
+        if (piece_length == 0) piece_length = pick_piece_length(total);
+        if (piece_length < 16 * 1024 || (piece_length & (piece_length - 1)) != 0) {
+            throw std::runtime_error("Piece length must be a power of two of at least 16 KiB");
+        }
+
+        for (auto& f : files) {
+            if (f.length == 0) continue;
+            f.fd = ::open(f.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (f.fd < 0) {
+                const std::string error = "Failed to open " + f.path + ": " + std::strerror(errno);
+                for (auto& g : files) if (g.fd >= 0) ::close(g.fd);
+                throw std::runtime_error(error);
+            }
+        }
+
+        // Pieces are independent, so each is read and hashed by whichever
+        // worker gets to it; the hashes go to their own slots.
+        const std::size_t num_pieces = static_cast<std::size_t>((total + piece_length - 1) / piece_length);
+        std::string pieces(num_pieces * 20, '\0');
+        try {
+            parallel_for(pool, 0, num_pieces, [&](std::size_t i) {
+                const long long offset = static_cast<long long>(i) * piece_length;
+                std::string data(static_cast<std::size_t>(std::min(piece_length, total - offset)), '\0');
+                read_range(files, offset, &data[0], data.size());
+                const std::string hash = sha1_raw(data);
+                std::memcpy(&pieces[i * 20], hash.data(), 20);
+            });
+        }
+        catch (...) {
+            for (auto& f : files) if (f.fd >= 0) ::close(f.fd);
+            throw;
+        }
+        for (auto& f : files) if (f.fd >= 0) ::close(f.fd);
+
+        json info = json::object();
+        info["name"] = root.filename().string();
+        info["piece length"] = piece_length;
+        info["pieces"] = pieces;
+        if (multi_file) {
+            json list = json::array();
+            for (const auto& f : files) {
+                list.push_back(json{{"length", f.length}, {"path", f.components}});
+            }
+            info["files"] = list;
+        }
+        else {
+            info["length"] = total;
+        }
+
+        json torrent = json::object();
+        if (!options.announce.empty()) torrent["announce"] = options.announce;
+        if (!options.comment.empty()) torrent["comment"] = options.comment;
+        torrent["created by"] = "bittorrent-cpp";
+        torrent["info"] = info;
+        return encode_bencode_value(torrent);
+    }
+
+}
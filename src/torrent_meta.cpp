@@ -1,7 +1,11 @@
 #include "torrent/torrent_meta.hpp"
 #include "torrent/bencode.hpp"
 #include "torrent/string_utils.hpp"
+#include "torrent/thread_pool.hpp"
 
+#include <algorithm>
+#include <limits>
+#include <random>
 #include <stdexcept>
 #include <iostream>
 #include <nlohmann/json.hpp>
@@ -10,42 +14,84 @@ namespace torrent {
 
     using json = nlohmann::json;
 
-    TorrentMeta parse_torrent_file(const std::string& path) {
-        TorrentMeta meta;
-
-        // 1. Read the raw .torrent file
-        std::string encoded_content = read_file(path);
-
-        // 2. Decode top-level bencoded dictionary into json
-        json decoded_content = decode_bencoded_value(encoded_content);
-
-        // 3. Basic fields from top-level
-        meta.announce = decoded_content["announce"].get<std::string>();
+    // Name, piece length, files and piece hashes from the info dictionary.
+    static void parse_info(TorrentMeta& meta, const json& info) {
+        meta.name         = info.at("name").get<std::string>();
+        meta.piece_length = info.at("piece length").get<long long>();
+        if (meta.piece_length <= 0) {
+            throw std::runtime_error("Invalid piece length: " + std::to_string(meta.piece_length));
+        }
 
-        json info = decoded_content["info"];
-        meta.name         = info["name"].get<std::string>();
-        meta.length       = info["length"].get<long long>();
-        meta.piece_length = info["piece length"].get<long long>();
+        // Files: either a single "length" or a "files" list of {length, path}
+        meta.files.clear();
+        if (info.contains("files")) {
+            meta.multi_file = true;
+
+            long long offset = 0;
+            for (const auto& f : info.at("files")) {
+                FileEntry entry;
+                entry.length = f.at("length").get<long long>();
+                entry.offset = offset;
+                if (entry.length < 0 || entry.length > std::numeric_limits<long long>::max() - offset) {
+                    throw std::runtime_error("Invalid file length in torrent: " + std::to_string(entry.length));
+                }
+
+                for (const auto& component : f.at("path")) {
+                    std::string part = component.get<std::string>();
+                    if (part.empty() || part == "." || part == ".." || part.find('/') != std::string::npos) {
+                        throw std::runtime_error("Invalid path component in torrent: " + part);
+                    }
+                    if (!entry.path.empty()) entry.path += "/";
+                    entry.path += part;
+                }
+                if (entry.path.empty()) {
+                    throw std::runtime_error("Empty file path in torrent");
+                }
+
+                offset += entry.length;
+                meta.files.push_back(entry);
+            }
+            meta.length = offset;
+        }
+        else {
+            meta.length = info.at("length").get<long long>();
+            if (meta.length < 0) {
+                throw std::runtime_error("Invalid length in torrent: " + std::to_string(meta.length));
+            }
+            meta.files.push_back(FileEntry{meta.name, meta.length, 0});
+        }
 
-        // 4. Pieces → piece_hashes
-        std::string pieces_raw = info["pieces"].get<std::string>();
-        std::list<std::string> pieces_list = split_pieces(pieces_raw);
+        // Pieces → piece_hashes
+        //    (copied straight from the raw string: split_pieces() hexlifies)
+        std::string pieces_raw = info.at("pieces").get<std::string>();
+        if (pieces_raw.size() % 20 != 0) {
+            throw std::runtime_error("Invalid pieces length: " + std::to_string(pieces_raw.size()));
+        }
 
         meta.piece_hashes.clear();
-        meta.piece_hashes.reserve(pieces_list.size());
+        meta.piece_hashes.reserve(pieces_raw.size() / 20);
 
-        for (const auto& s : pieces_list) {
+        for (std::size_t off = 0; off < pieces_raw.size(); off += 20) {
             std::array<std::uint8_t, 20> arr{};
             for (std::size_t i = 0; i < 20; ++i) {
-                arr[i] = static_cast<std::uint8_t>(static_cast<unsigned char>(s[i]));
+                arr[i] = static_cast<std::uint8_t>(static_cast<unsigned char>(pieces_raw[off + i]));
             }
             meta.piece_hashes.push_back(arr);
         }
 
-        // 5. info_bencoded
-        meta.info_bencoded = encode_bencode_value(info);
+        // Exactly one hash per piece: code sizing pieces from the hash count
+        // would otherwise read and write past the end of the data
+        if (meta.length == 0) throw std::runtime_error("Torrent has no data");
+        const long long expected = meta.length / meta.piece_length + (meta.length % meta.piece_length != 0);
+        if (static_cast<long long>(meta.piece_hashes.size()) != expected) {
+            throw std::runtime_error("Torrent has " + std::to_string(meta.piece_hashes.size()) + " piece hashes for " +
+                                     std::to_string(expected) + " pieces");
+        }
+    }
 
-        // 6. info_hash_raw
+    // info_hash_raw and info_hash_urlencoded from info_bencoded.
+    static void set_info_hash(TorrentMeta& meta) {
+        // info_hash_raw
         std::string raw = sha1_raw(meta.info_bencoded);
         auto hex = [](const std::string& s) {
             static const char* dig = "0123456789abcdef";
@@ -67,10 +113,76 @@ namespace torrent {
             );
         }
 
-        // 7. URL-encoded version for tracker
+        // URL-encoded version for tracker
         meta.info_hash_urlencoded = percent_encode_bytes(raw);
+    }
+
+    TorrentMeta parse_torrent_file(const std::string& path) {
+        TorrentMeta meta;
+
+        // 1. Read the raw .torrent file
+        std::string encoded_content = read_file(path);
+
+        // 2. Decode top-level bencoded dictionary into json
+        json decoded_content = decode_bencoded_value(encoded_content);
+
+        // 3. Basic fields from top-level
+        if (decoded_content.contains("announce")) {
+            meta.announce = decoded_content["announce"].get<std::string>();
+        }
+
+        // 3a. Tracker tiers; trackers within a tier are tried in random order
+        if (decoded_content.contains("announce-list") && decoded_content["announce-list"].is_array()) {
+            std::mt19937 rng(std::random_device{}());
+            for (const auto& tier : decoded_content["announce-list"]) {
+                if (!tier.is_array()) continue;
+
+                std::vector<std::string> urls;
+                for (const auto& url : tier) {
+                    if (url.is_string() && !url.get<std::string>().empty()) urls.push_back(url.get<std::string>());
+                }
+                if (urls.empty()) continue;
+
+                std::shuffle(urls.begin(), urls.end(), rng);
+                meta.announce_list.push_back(std::move(urls));
+            }
+        }
+        if (meta.announce_list.empty() && !meta.announce.empty()) {
+            meta.announce_list.push_back({meta.announce});
+        }
+        if (meta.announce.empty() && !meta.announce_list.empty()) {
+            meta.announce = meta.announce_list[0][0];
+        }
+
+        json info = decoded_content["info"];
+        parse_info(meta, info);
+
+        // 5. info_bencoded, info hashes
+        meta.info_bencoded = encode_bencode_value(info);
+        set_info_hash(meta);
 
         return meta;
     }
 
+    TorrentMeta parse_info_dict(const std::string& info_bencoded) {
+        json info = decode_bencoded_value(info_bencoded);
+        if (!info.is_object()) {
+            throw std::runtime_error("info dictionary is not a dictionary");
+        }
+
+        TorrentMeta meta;
+        parse_info(meta, info);
+        meta.info_bencoded = info_bencoded;
+        set_info_hash(meta);
+        return meta;
+    }
+
+    std::vector<TorrentMeta> parse_torrent_files(ThreadPool& pool, const std::vector<std::string>& paths) {
+        std::vector<TorrentMeta> metas(paths.size());
+        parallel_for(pool, 0, paths.size(), [&](std::size_t i) {
+            metas[i] = parse_torrent_file(paths[i]);
+        });
+        return metas;
+    }
+
 }
@@ -1,5 +1,6 @@
 #include "torrent/tracker.hpp"
 #include "torrent/bencode.hpp"
+#include "torrent/udp_tracker.hpp"
 
 #include <nlohmann/json.hpp>
 #include <stdexcept>
@@ -26,9 +27,17 @@ namespace torrent {
         return size * nmemb;
     }
 
+    // One easy handle per thread, reset between requests, so repeated
+    // announces reuse its connection cache instead of reconnecting.
     HttpResp http_get(const std::string& url) {
-        CURL* curl = curl_easy_init();
+        struct Handle {
+            CURL* curl = curl_easy_init();
+            ~Handle() { if (curl) curl_easy_cleanup(curl); }
+        };
+        static thread_local Handle handle;
+        CURL* curl = handle.curl;
         if (!curl) throw std::runtime_error("curl_easy_init failed");
+        curl_easy_reset(curl);
 
         HttpResp r;
         curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
@@ -38,49 +47,63 @@ namespace torrent {
 
         auto rc = curl_easy_perform(curl);
         if (rc != CURLE_OK) {
-            std::string err = curl_easy_strerror(rc);
-            curl_easy_cleanup(curl);
-            throw std::runtime_error("HTTP GET failed: " + err);
+            throw std::runtime_error(std::string("HTTP GET failed: ") + curl_easy_strerror(rc));
         }
 
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &r.status);
-        curl_easy_cleanup(curl);
         return r;
     }
 
 
     // ----------------- URL Builder -----------------
 
-    static std::string build_tracker_url(const TorrentMeta& meta, const std::string& peer_id) {
-        std::string peer_id_enc = percent_encode_bytes(peer_id);
-        std::string left = std::to_string(meta.length);
+    static const char* event_name(AnnounceEvent event) {
+        switch (event) {
+            case AnnounceEvent::Completed: return "completed";
+            case AnnounceEvent::Started:   return "started";
+            case AnnounceEvent::Stopped:   return "stopped";
+            default:                       return nullptr;
+        }
+    }
 
+    std::string build_announce_url(
+        const std::string& announce_url,
+        const TorrentMeta& meta,
+        const std::string& peer_id,
+        const AnnounceRequest& req
+    ) {
         std::ostringstream oss;
-        oss << meta.announce
-            << "?info_hash="  << meta.info_hash_urlencoded
-            << "&peer_id="    << peer_id_enc
-            << "&port="       << 6881
-            << "&uploaded="   << 0
-            << "&downloaded=" << 0
-            << "&left="       << left
-            << "&compact="    << 1
-            << "&event=started";
+        oss << announce_url
+            << (announce_url.find('?') == std::string::npos ? "?" : "&")
+            << "info_hash="   << meta.info_hash_urlencoded
+            << "&peer_id="    << percent_encode_bytes(peer_id)
+            << "&port="       << req.port
+            << "&uploaded="   << req.uploaded
+            << "&downloaded=" << req.downloaded
+            << "&left="       << req.left
+            << "&compact="    << 1;
+        if (req.num_want >= 0) oss << "&numwant=" << req.num_want;
+        if (const char* ev = event_name(req.event)) oss << "&event=" << ev;
 
         return oss.str();
     }
 
 
     // ----------------- Public API -----------------
-    static std::vector<Peer> parse_compact_peers(const std::string& peers_bin);
 
     TrackerResponse request_peers(const TorrentMeta& meta, const std::string& peer_id) {
-        TrackerResponse result;
+        AnnounceRequest req;
+        req.left = static_cast<std::uint64_t>(meta.length);
+
+        if (meta.announce.rfind("udp://", 0) == 0) {
+            return udp_announce(meta.announce, meta.info_hash_raw, peer_id, req);
+        }
 
         // 1. Build URL using TorrentMeta + peer_id
-        std::string url = build_tracker_url(meta, peer_id);
+        std::string url = build_announce_url(meta.announce, meta, peer_id, req);
         std::cerr << "[debug] URL: " << url << "\n";
 
-        // 2. Perform HTTP GET (your real http_get will go here)
+        // 2. Perform HTTP GET
         HttpResp resp = http_get(url);
 
         if (resp.status != 200) {
@@ -88,26 +111,66 @@ namespace torrent {
         }
 
         // 3. Bdecode tracker response
-        json tr = decode_bencoded_value(resp.body);
+        return parse_tracker_response(resp.body);
+    }
+
+    TrackerResponse parse_tracker_response(const std::string& body) {
+        TrackerResponse result;
+
+        json tr = decode_bencoded_value(body);
+        if (!tr.is_object()) {
+            throw std::runtime_error("Tracker response is not a dictionary");
+        }
 
-        // 4. Failure reason from tracker
+        // 1. Failure reason from tracker
         if (tr.contains("failure reason")) {
             throw std::runtime_error("Tracker error: " + tr["failure reason"].get<std::string>());
         }
 
-        // 5. Optional interval
+        // 2. Optional interval and swarm counts
         if (tr.contains("interval") && tr["interval"].is_number_integer()) {
             result.interval = tr["interval"].get<int>();
         }
+        if (tr.contains("min interval") && tr["min interval"].is_number_integer()) {
+            result.min_interval = tr["min interval"].get<int>();
+        }
+        if (tr.contains("complete") && tr["complete"].is_number_integer()) {
+            result.seeders = tr["complete"].get<int>();
+        }
+        if (tr.contains("incomplete") && tr["incomplete"].is_number_integer()) {
+            result.leechers = tr["incomplete"].get<int>();
+        }
 
-        // 6. Compact peers ("peers" is a binary string)
-        if (!tr.contains("peers")) {
-            // no peers, return empty list
-            return result;
+        // 3. Peers: compact binary string, or the original list of
+        //    {ip, port, peer id} dicts. Dict entries with a hostname instead
+        //    of a numeric address are skipped rather than resolved.
+        if (tr.contains("peers")) {
+            const json& peers = tr["peers"];
+            if (peers.is_string()) {
+                result.peers = parse_compact_peers(peers.get<std::string>()); // binary-safe
+            }
+            else if (peers.is_array()) {
+                for (const json& p : peers) {
+                    if (!p.is_object() || !p.contains("ip") || !p.contains("port")) continue;
+                    if (!p["ip"].is_string() || !p["port"].is_number_integer()) continue;
+
+                    std::string ip = p["ip"].get<std::string>();
+                    long long port = p["port"].get<long long>();
+                    if (port <= 0 || port > 65535) continue;
+
+                    std::string text = ip.find(':') != std::string::npos ? "[" + ip + "]" : ip;
+                    if (auto ep = Endpoint::parse(text + ":" + std::to_string(port))) {
+                        result.peers.push_back(*ep);
+                    }
+                }
+            }
         }
 
-        std::string peers_bin = tr.at("peers").get<std::string>(); // binary-safe
-        result.peers = parse_compact_peers(peers_bin);
+        // 4. IPv6 peers (BEP 7)
+        if (tr.contains("peers6") && tr["peers6"].is_string()) {
+            auto v6 = parse_compact_peers6(tr["peers6"].get<std::string>());
+            result.peers.insert(result.peers.end(), v6.begin(), v6.end());
+        }
 
         return result;
     }
@@ -115,29 +178,33 @@ namespace torrent {
 
     // ----------------- Compact peers parser -----------------
 
+    static std::uint16_t read_port(const std::string& bin, std::size_t pos) {
+        return static_cast<std::uint16_t>(
+            (static_cast<unsigned char>(bin[pos]) << 8) | static_cast<unsigned char>(bin[pos + 1])
+        );
+    }
+
     // Each peer: 6 bytes: 4 for IP, 2 for port (big-endian).
-    // So peers_bin.size() must be a multiple of 6.
-    std::vector<Peer> parse_compact_peers(const std::string& peers_bin) {
-        std::vector<Peer> out;
+    std::vector<Endpoint> parse_compact_peers(const std::string& peers_bin) {
+        std::vector<Endpoint> out;
+        out.reserve(peers_bin.size() / 6);
 
-        if (peers_bin.size() % 6 != 0) {
-            throw std::runtime_error("Invalid compact peers length");
+        for (std::size_t i = 0; i + 6 <= peers_bin.size(); i += 6) {
+            auto* ip = reinterpret_cast<const std::uint8_t*>(peers_bin.data() + i);
+            out.push_back(Endpoint::v4(ip, read_port(peers_bin, i + 4)));
         }
 
-        for (std::size_t i = 0; i + 5 < peers_bin.size(); i += 6) {
-            unsigned char b1 = static_cast<unsigned char>(peers_bin[i + 0]);
-            unsigned char b2 = static_cast<unsigned char>(peers_bin[i + 1]);
-            unsigned char b3 = static_cast<unsigned char>(peers_bin[i + 2]);
-            unsigned char b4 = static_cast<unsigned char>(peers_bin[i + 3]);
-            unsigned char p1 = static_cast<unsigned char>(peers_bin[i + 4]);
-            unsigned char p2 = static_cast<unsigned char>(peers_bin[i + 5]);
+        return out;
+    }
 
-            Peer peer;
-            peer.ip = std::to_string(b1) + "." + std::to_string(b2) + "." +
-                      std::to_string(b3) + "." + std::to_string(b4);
-            peer.port = static_cast<std::uint16_t>((p1 << 8) | p2);
+    // Each peer: 18 bytes: 16 for IP, 2 for port (big-endian).
+    std::vector<Endpoint> parse_compact_peers6(const std::string& peers_bin) {
+        std::vector<Endpoint> out;
+        out.reserve(peers_bin.size() / 18);
 
-            out.push_back(peer);
+        for (std::size_t i = 0; i + 18 <= peers_bin.size(); i += 18) {
+            auto* ip = reinterpret_cast<const std::uint8_t*>(peers_bin.data() + i);
+            out.push_back(Endpoint::v6(ip, read_port(peers_bin, i + 16)));
         }
 
         return out;
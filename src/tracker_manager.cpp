@@ -0,0 +1,268 @@
+#include "torrent/tracker_manager.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_set>
+
+namespace torrent {
+
+    // Used when the tracker doesn't say how often to come back.
+    static constexpr std::chrono::seconds kDefaultInterval{30 * 60};
+    static constexpr std::chrono::seconds kDefaultMinInterval{2 * 60};
+
+    // Below this many connected peers we re-announce early for more.
+    static constexpr std::size_t kWantMorePeersBelow = 20;
+
+    // Retry delay after a whole tier failed: 60s, 120s, ... up to 30 minutes.
+    static constexpr std::chrono::seconds kRetryBase{60};
+    static constexpr std::chrono::seconds kRetryMax{30 * 60};
+
+    static constexpr auto kTickInterval = std::chrono::seconds(5);
+
+    TrackerManager::TrackerManager(EventLoop& loop, const TorrentMeta& meta, const std::string& peer_id)
+        : m_loop(loop), m_meta(meta), m_peer_id(peer_id), m_own_http(std::make_unique<HttpClient>(loop)),
+          m_http(*m_own_http), m_own_udp(std::make_unique<UdpTrackerClient>(loop)), m_udp(*m_own_udp),
+          m_shared(std::make_shared<Shared>()) {
+        for (const auto& urls : meta.announce_list) {
+            Tier tier;
+            tier.urls = urls;
+            m_tiers.push_back(std::move(tier));
+        }
+    }
+
+    TrackerManager::TrackerManager(EventLoop& loop, const TorrentMeta& meta, const std::string& peer_id,
+                                   HttpClient& http, UdpTrackerClient& udp)
+        : m_loop(loop), m_meta(meta), m_peer_id(peer_id), m_http(http), m_udp(udp),
+          m_shared(std::make_shared<Shared>()) {
+        for (const auto& urls : meta.announce_list) {
+            Tier tier;
+            tier.urls = urls;
+            m_tiers.push_back(std::move(tier));
+        }
+    }
+
+    TrackerManager::~TrackerManager() {
+        if (m_tick_timer) m_loop.cancel_timer(m_tick_timer);
+        m_shared->alive = false;
+    }
+
+    bool TrackerManager::busy() const {
+        for (const Tier& t : m_tiers) {
+            if (t.busy) return true;
+        }
+        return false;
+    }
+
+
+    // ----------------- Scheduling -----------------
+
+    AnnounceRequest TrackerManager::make_request(AnnounceEvent event) const {
+        AnnounceStats stats;
+        if (m_stats) {
+            stats = m_stats();
+        }
+        else {
+            stats.left = static_cast<std::uint64_t>(m_meta.length);
+        }
+
+        AnnounceRequest req;
+        req.uploaded   = stats.uploaded;
+        req.downloaded = stats.downloaded;
+        req.left       = stats.left;
+        req.port       = m_port;
+        req.event      = event;
+        req.num_want   = event == AnnounceEvent::Stopped ? 0 : -1;
+        return req;
+    }
+
+    void TrackerManager::announce(const AnnounceRequest& req) {
+        for (std::size_t i = 0; i < m_tiers.size(); ++i) {
+            if (m_tiers[i].busy) continue;
+
+            m_tiers[i].busy = true;
+            announce_tier(i, 0, req);
+        }
+    }
+
+    void TrackerManager::start() {
+        const auto now = m_loop.now();
+        for (Tier& t : m_tiers) {
+            t.pending_event = AnnounceEvent::Started;
+            t.next_announce = now;
+        }
+
+        if (!m_tick_timer) {
+            m_tick_timer = m_loop.add_timer(
+                std::chrono::duration_cast<std::chrono::milliseconds>(kTickInterval),
+                [this] { on_tick(); }
+            );
+        }
+        on_tick();
+    }
+
+    void TrackerManager::completed() {
+        for (std::size_t i = 0; i < m_tiers.size(); ++i) {
+            m_tiers[i].pending_event = AnnounceEvent::Completed;
+            if (!m_tiers[i].busy && !m_stopping) announce_scheduled(i);
+        }
+    }
+
+    void TrackerManager::stop(std::function<void()> done) {
+        m_stopping = true;
+        m_on_stopped = std::move(done);
+        if (m_tick_timer) {
+            m_loop.cancel_timer(m_tick_timer);
+            m_tick_timer = 0;
+        }
+
+        // Busy tiers send "stopped" as soon as their current announce returns
+        for (std::size_t i = 0; i < m_tiers.size(); ++i) {
+            if (m_tiers[i].busy) continue;
+
+            m_tiers[i].busy = true;
+            announce_tier(i, 0, make_request(AnnounceEvent::Stopped));
+        }
+        check_stopped();
+    }
+
+    void TrackerManager::announce_scheduled(std::size_t tier) {
+        Tier& t = m_tiers[tier];
+        t.busy = true;
+        t.last_announce = m_loop.now();
+        announce_tier(tier, 0, make_request(t.pending_event));
+    }
+
+    void TrackerManager::on_tick() {
+        if (m_stopping) return;
+
+        const auto now = m_loop.now();
+        const bool low_on_peers = m_peer_count && m_peer_count() < kWantMorePeersBelow;
+
+        for (std::size_t i = 0; i < m_tiers.size(); ++i) {
+            Tier& t = m_tiers[i];
+            if (t.busy) continue;
+
+            bool due = now >= t.next_announce;
+            // completed() announced right away to the tiers that weren't busy;
+            // the others send it now, unless it failed and is backing off
+            if (t.pending_event == AnnounceEvent::Completed && t.failures == 0) due = true;
+            if (low_on_peers && t.failures == 0 && now - t.last_announce >= t.min_interval) due = true;
+
+            if (due) announce_scheduled(i);
+        }
+    }
+
+
+    // ----------------- Announcing -----------------
+
+    void TrackerManager::announce_tier(std::size_t tier, std::size_t index, const AnnounceRequest& req) {
+        const std::string url = m_tiers[tier].urls[index];
+
+        if (url.rfind("udp://", 0) == 0) {
+            // A shared client may finish the announce after we are gone
+            m_udp.announce(url, m_meta.info_hash_raw, m_peer_id, req,
+                           [this, shared = m_shared, tier, index, req](const TrackerResponse& resp,
+                                                                       const std::string& error) {
+                if (shared->alive) on_reply(tier, index, req, resp, error);
+            });
+            return;
+        }
+
+        if (url.rfind("http://", 0) != 0 && url.rfind("https://", 0) != 0) {
+            // Unknown scheme (e.g. wss://): move on to the next tracker
+            m_loop.post([this, shared = m_shared, tier, index, req, url] {
+                if (shared->alive) on_reply(tier, index, req, {}, "unsupported tracker URL " + url);
+            });
+            return;
+        }
+
+        // A shared client may finish the request after we are gone
+        m_http.get(build_announce_url(url, m_meta, m_peer_id, req), [this, shared = m_shared, tier, index, req](const HttpClient::Response& r) {
+            if (!shared->alive) return;
+            TrackerResponse resp;
+            std::string error = r.error;
+            if (error.empty() && r.status != 200) error = "HTTP status " + std::to_string(r.status);
+            if (error.empty()) {
+                try {
+                    resp = parse_tracker_response(r.body);
+                }
+                catch (const std::exception& ex) {
+                    error = ex.what();
+                }
+            }
+            on_reply(tier, index, req, resp, error);
+        });
+    }
+
+    void TrackerManager::on_reply(
+        std::size_t tier,
+        std::size_t index,
+        const AnnounceRequest& req,
+        const TrackerResponse& resp,
+        const std::string& error
+    ) {
+        Tier& t = m_tiers[tier];
+        const std::string url = t.urls[index];
+        const auto now = m_loop.now();
+
+        if (!error.empty()) {
+            std::cerr << "[tracker] " << url << ": " << error << "\n";
+            if (index + 1 < t.urls.size()) {
+                announce_tier(tier, index + 1, req);
+                return;
+            }
+
+            // Every tracker in the tier failed: back off before the next round
+            t.failures++;
+            auto delay = std::min(kRetryMax, kRetryBase * (1 << std::min(t.failures - 1, 5)));
+            t.next_announce = now + delay;
+        }
+        else {
+            std::cerr << "[tracker] " << url << ": " << resp.peers.size() << " peers\n";
+
+            // BEP 12: a tracker that answered moves to the front of its tier
+            t.urls.erase(t.urls.begin() + static_cast<std::ptrdiff_t>(index));
+            t.urls.insert(t.urls.begin(), url);
+
+            t.failures = 0;
+            t.interval = resp.interval > 0 ? std::chrono::seconds(resp.interval) : kDefaultInterval;
+            t.min_interval = resp.min_interval > 0 ? std::chrono::seconds(resp.min_interval)
+                                                   : std::min(kDefaultMinInterval, t.interval);
+            t.next_announce = now + t.interval;
+
+            // The tracker has seen this event; later announces are regular ones
+            if (t.pending_event == req.event) t.pending_event = AnnounceEvent::None;
+
+            if (!m_stopping) deliver(resp.peers);
+        }
+
+        // stop() was called while this announce was in flight
+        if (m_stopping && req.event != AnnounceEvent::Stopped) {
+            announce_tier(tier, 0, make_request(AnnounceEvent::Stopped));
+            return;
+        }
+
+        t.busy = false;
+        check_stopped();
+    }
+
+    void TrackerManager::deliver(const std::vector<Endpoint>& peers) {
+        // Only within this response: a later one may bring back a peer
+        // that has dropped since
+        std::unordered_set<Endpoint> seen;
+        std::vector<Endpoint> fresh;
+        for (const Endpoint& p : peers) {
+            if (seen.insert(p).second) fresh.push_back(p);
+        }
+        if (!fresh.empty() && m_on_peers) m_on_peers(fresh);
+    }
+
+    void TrackerManager::check_stopped() {
+        if (!m_stopping || busy() || !m_on_stopped) return;
+
+        auto done = std::move(m_on_stopped);
+        m_on_stopped = nullptr;
+        done();
+    }
+
+}
@@ -0,0 +1,832 @@
+#include "torrent/udp_tracker.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    static constexpr std::uint64_t kProtocolId = 0x41727101980ULL;
+
+    enum UdpAction : std::uint32_t {
+        kActionConnect  = 0,
+        kActionAnnounce = 1,
+        kActionScrape   = 2,
+        kActionError    = 3,
+    };
+
+    // Connection ids may be reused for one minute (clients) / two (servers).
+    static constexpr auto kClientConnectionIdTtl = std::chrono::seconds(60);
+    static constexpr auto kServerConnectionIdTtl = std::chrono::seconds(120);
+
+    static constexpr std::size_t kMaxScrapeHashes = 74;
+
+
+    // ----------------- Wire helpers -----------------
+
+    static void put_u32(std::string& out, std::uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<char>((v >> shift) & 0xFF));
+    }
+
+    static void put_u64(std::string& out, std::uint64_t v) {
+        for (int shift = 56; shift >= 0; shift -= 8) out.push_back(static_cast<char>((v >> shift) & 0xFF));
+    }
+
+    static std::uint32_t get_u32(const std::string& in, std::size_t pos) {
+        std::uint32_t v = 0;
+        for (std::size_t i = 0; i < 4; ++i) v = (v << 8) | static_cast<unsigned char>(in[pos + i]);
+        return v;
+    }
+
+    static std::uint64_t get_u64(const std::string& in, std::size_t pos) {
+        std::uint64_t v = 0;
+        for (std::size_t i = 0; i < 8; ++i) v = (v << 8) | static_cast<unsigned char>(in[pos + i]);
+        return v;
+    }
+
+    static std::mt19937& rng() {
+        static thread_local std::mt19937 gen(std::random_device{}());
+        return gen;
+    }
+
+
+    // "host" and "port" of udp://host:port[/path]; IPv6 hosts in brackets.
+    static void split_tracker_url(const std::string& url, std::string& host, std::string& port) {
+        const std::string scheme = "udp://";
+        if (url.compare(0, scheme.size(), scheme) != 0) {
+            throw std::runtime_error("Not a udp:// tracker URL: " + url);
+        }
+
+        std::string rest = url.substr(scheme.size());
+        rest = rest.substr(0, rest.find('/'));
+
+        if (!rest.empty() && rest[0] == '[') {
+            auto close = rest.find(']');
+            if (close == std::string::npos) throw std::runtime_error("Invalid tracker URL: " + url);
+            host = rest.substr(1, close - 1);
+            if (close + 1 < rest.size() && rest[close + 1] == ':') port = rest.substr(close + 2);
+        }
+        else {
+            auto colon = rest.rfind(':');
+            if (colon == std::string::npos) throw std::runtime_error("UDP tracker URL needs a port: " + url);
+            host = rest.substr(0, colon);
+            port = rest.substr(colon + 1);
+        }
+        if (host.empty() || port.empty()) throw std::runtime_error("Invalid tracker URL: " + url);
+    }
+
+    // Announce request with a zero connection and transaction id.
+    static std::string build_announce(
+        const std::array<std::uint8_t, 20>& info_hash,
+        const std::string& peer_id,
+        const AnnounceRequest& announce
+    ) {
+        if (peer_id.size() != 20) throw std::runtime_error("peer_id must be exactly 20 bytes");
+
+        // Lets the tracker recognise us across IP changes; fixed per process
+        static const std::uint32_t key = std::random_device{}();
+
+        std::string req;
+        put_u64(req, 0);
+        put_u32(req, kActionAnnounce);
+        put_u32(req, 0);
+        req.append(reinterpret_cast<const char*>(info_hash.data()), 20);
+        req.append(peer_id);
+        put_u64(req, announce.downloaded);
+        put_u64(req, announce.left);
+        put_u64(req, announce.uploaded);
+        put_u32(req, static_cast<std::uint32_t>(announce.event));
+        put_u32(req, 0);                                          // ip: use the sender's
+        put_u32(req, key);
+        put_u32(req, static_cast<std::uint32_t>(announce.num_want));
+        req.push_back(static_cast<char>(announce.port >> 8));
+        req.push_back(static_cast<char>(announce.port & 0xFF));
+        return req;
+    }
+
+    // Peers come in the address family of the tracker connection.
+    static TrackerResponse parse_announce(const std::string& resp, bool v6) {
+        if (resp.size() < 20) throw std::runtime_error("Short announce response from tracker");
+
+        TrackerResponse result;
+        result.interval = static_cast<int>(get_u32(resp, 8));
+        result.leechers = static_cast<int>(get_u32(resp, 12));
+        result.seeders  = static_cast<int>(get_u32(resp, 16));
+
+        std::string peers_bin = resp.substr(20);
+        result.peers = v6 ? parse_compact_peers6(peers_bin) : parse_compact_peers(peers_bin);
+        return result;
+    }
+
+    static void set_u64(std::string& out, std::size_t pos, std::uint64_t v) {
+        for (std::size_t i = 0; i < 8; ++i) out[pos + i] = static_cast<char>(v >> (56 - 8 * i));
+    }
+
+    static void set_u32(std::string& out, std::size_t pos, std::uint32_t v) {
+        for (std::size_t i = 0; i < 4; ++i) out[pos + i] = static_cast<char>(v >> (24 - 8 * i));
+    }
+
+
+    // ----------------- Client -----------------
+
+    namespace {
+
+        // A UDP socket connect()ed to one tracker, so only its datagrams arrive.
+        class UdpTrackerSocket {
+        public:
+            UdpTrackerSocket(const std::string& url, const UdpTrackerOptions& options)
+                : m_options(options) {
+                std::string host, port;
+                split_tracker_url(url, host, port);
+
+                addrinfo hints{};
+                hints.ai_family   = AF_UNSPEC;
+                hints.ai_socktype = SOCK_DGRAM;
+
+                addrinfo* res = nullptr;
+                int rc = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+                if (rc != 0 || !res) {
+                    throw std::runtime_error("Cannot resolve tracker " + host + ": " + ::gai_strerror(rc));
+                }
+
+                for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+                    int fd = ::socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+                    if (fd < 0) continue;
+                    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                        m_fd = fd;
+                        m_family = ai->ai_family;
+                        break;
+                    }
+                    ::close(fd);
+                }
+                ::freeaddrinfo(res);
+
+                if (m_fd < 0) throw std::runtime_error("Cannot reach tracker " + host + ":" + port);
+                m_key = host + ":" + port;
+            }
+
+            ~UdpTrackerSocket() {
+                if (m_fd >= 0) ::close(m_fd);
+            }
+
+            UdpTrackerSocket(const UdpTrackerSocket&) = delete;
+            UdpTrackerSocket& operator=(const UdpTrackerSocket&) = delete;
+
+            int family() const { return m_family; }
+
+            // Send the request produced by `build(connection_id)` (after its
+            // bytes 12..16 are set to a fresh transaction id) and return the
+            // reply for `action`. Connects first when no cached id is valid,
+            // and retransmits with exponential backoff.
+            template <typename Build>
+            std::string request(std::uint32_t action, Build build) {
+                for (int attempt = 0; attempt <= m_options.max_retries; ++attempt) {
+                    auto timeout = m_options.base_timeout * (1 << attempt);
+
+                    std::uint64_t conn_id = 0;
+                    bool cached = cached_connection_id(conn_id);
+                    if (!cached) {
+                        std::string req;
+                        put_u64(req, kProtocolId);
+                        put_u32(req, kActionConnect);
+                        put_u32(req, 0);
+
+                        std::string resp;
+                        Reply r = exchange(req, kActionConnect, timeout, resp);
+                        if (r == Reply::Timeout) continue;
+                        if (r == Reply::Error) throw std::runtime_error("Tracker error: " + resp);
+                        if (resp.size() < 16) throw std::runtime_error("Short connect response from tracker");
+
+                        conn_id = get_u64(resp, 8);
+                        store_connection_id(conn_id);
+                    }
+
+                    std::string req = build(conn_id);
+                    std::string resp;
+                    Reply r = exchange(req, action, timeout, resp);
+                    if (r == Reply::Ok) return resp;
+                    if (r == Reply::Error) {
+                        // A cached id may have expired on the tracker's side: reconnect
+                        forget_connection_id();
+                        if (!cached) throw std::runtime_error("Tracker error: " + resp);
+                    }
+                }
+
+                throw std::runtime_error("UDP tracker " + m_key + " timed out");
+            }
+
+        private:
+            bool cached_connection_id(std::uint64_t& out) {
+                std::lock_guard<std::mutex> lock(cache_mutex());
+                auto it = cache().find(m_key);
+                if (it == cache().end()) return false;
+                if (std::chrono::steady_clock::now() - it->second.second > kClientConnectionIdTtl) {
+                    cache().erase(it);
+                    return false;
+                }
+                out = it->second.first;
+                return true;
+            }
+
+            void store_connection_id(std::uint64_t id) {
+                std::lock_guard<std::mutex> lock(cache_mutex());
+                cache()[m_key] = {id, std::chrono::steady_clock::now()};
+            }
+
+            void forget_connection_id() {
+                std::lock_guard<std::mutex> lock(cache_mutex());
+                cache().erase(m_key);
+            }
+
+            enum class Reply { Ok, Timeout, Error };
+
+            // On Error, `resp` holds the tracker's message.
+            Reply exchange(std::string req, std::uint32_t action, std::chrono::milliseconds timeout, std::string& resp) {
+                std::uint32_t txid = rng()();
+                set_u32(req, 12, txid);
+
+                if (::send(m_fd, req.data(), req.size(), 0) < 0) {
+                    throw std::runtime_error(std::string("UDP send failed: ") + std::strerror(errno));
+                }
+
+                auto deadline = std::chrono::steady_clock::now() + timeout;
+                while (true) {
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now()
+                    );
+                    if (left.count() <= 0) return Reply::Timeout;
+
+                    pollfd pfd{m_fd, POLLIN, 0};
+                    int rc = ::poll(&pfd, 1, static_cast<int>(left.count()));
+                    if (rc < 0 && errno == EINTR) continue;
+                    if (rc <= 0) return Reply::Timeout;
+
+                    char buf[65536];
+                    ssize_t n = ::recv(m_fd, buf, sizeof(buf), 0);
+                    if (n < 0) {
+                        // ICMP port unreachable surfaces as ECONNREFUSED; treat as loss
+                        if (errno == EINTR || errno == ECONNREFUSED) continue;
+                        throw std::runtime_error(std::string("UDP recv failed: ") + std::strerror(errno));
+                    }
+                    if (n < 8) continue;
+
+                    std::string data(buf, static_cast<std::size_t>(n));
+                    if (get_u32(data, 4) != txid) continue; // stale reply to an earlier attempt
+
+                    std::uint32_t got = get_u32(data, 0);
+                    if (got == kActionError) {
+                        resp = data.substr(8);
+                        return Reply::Error;
+                    }
+                    if (got != action) throw std::runtime_error("Unexpected action in tracker response");
+
+                    resp = std::move(data);
+                    return Reply::Ok;
+                }
+            }
+
+            using Cache = std::unordered_map<std::string, std::pair<std::uint64_t, std::chrono::steady_clock::time_point>>;
+
+            static Cache& cache() {
+                static Cache c;
+                return c;
+            }
+
+            static std::mutex& cache_mutex() {
+                static std::mutex m;
+                return m;
+            }
+
+            UdpTrackerOptions m_options;
+            int m_fd = -1;
+            int m_family = AF_INET;
+            std::string m_key;
+        };
+
+    }
+
+    TrackerResponse udp_announce(
+        const std::string& url,
+        const std::array<std::uint8_t, 20>& info_hash,
+        const std::string& peer_id,
+        const AnnounceRequest& announce,
+        const UdpTrackerOptions& options
+    ) {
+        const std::string packet = build_announce(info_hash, peer_id, announce);
+
+        UdpTrackerSocket sock(url, options);
+        std::string resp = sock.request(kActionAnnounce, [&](std::uint64_t conn_id) {
+            std::string req = packet;
+            set_u64(req, 0, conn_id);
+            return req;
+        });
+        return parse_announce(resp, sock.family() == AF_INET6);
+    }
+
+    std::vector<ScrapeResult> udp_scrape(
+        const std::string& url,
+        const std::vector<std::array<std::uint8_t, 20>>& info_hashes,
+        const UdpTrackerOptions& options
+    ) {
+        if (info_hashes.empty() || info_hashes.size() > kMaxScrapeHashes) {
+            throw std::runtime_error("udp_scrape: between 1 and 74 info hashes per request");
+        }
+
+        UdpTrackerSocket sock(url, options);
+        std::string resp = sock.request(kActionScrape, [&](std::uint64_t conn_id) {
+            std::string req;
+            put_u64(req, conn_id);
+            put_u32(req, kActionScrape);
+            put_u32(req, 0);
+            for (const auto& h : info_hashes) req.append(reinterpret_cast<const char*>(h.data()), 20);
+            return req;
+        });
+
+        if (resp.size() < 8 + 12 * info_hashes.size()) {
+            throw std::runtime_error("Short scrape response from tracker");
+        }
+
+        std::vector<ScrapeResult> out(info_hashes.size());
+        for (std::size_t i = 0; i < out.size(); ++i) {
+            std::size_t pos = 8 + 12 * i;
+            out[i].seeders   = get_u32(resp, pos);
+            out[i].completed = get_u32(resp, pos + 4);
+            out[i].leechers  = get_u32(resp, pos + 8);
+        }
+        return out;
+    }
+
+
+    // ----------------- Asynchronous client -----------------
+
+    // Tracker addresses are looked up again after this long.
+    static constexpr auto kResolveTtl = std::chrono::minutes(30);
+
+    UdpTrackerClient::UdpTrackerClient(EventLoop& loop)
+        : UdpTrackerClient(loop, UdpTrackerOptions{}) {}
+
+    UdpTrackerClient::UdpTrackerClient(EventLoop& loop, UdpTrackerOptions options)
+        : m_loop(loop), m_options(options) {}
+
+    UdpTrackerClient::~UdpTrackerClient() {
+        if (m_resolver.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(m_resolve_mutex);
+                m_resolver_stop = true;
+            }
+            m_resolve_cv.notify_one();
+            m_resolver.join();
+        }
+        *m_alive = false;
+
+        for (auto& kv : m_requests) {
+            if (kv.second.timer) m_loop.cancel_timer(kv.second.timer);
+        }
+        for (int fd : {m_fd4, m_fd6}) {
+            if (fd < 0) continue;
+            m_loop.remove_fd(fd);
+            ::close(fd);
+        }
+    }
+
+    void UdpTrackerClient::announce(
+        const std::string& url,
+        const std::array<std::uint8_t, 20>& info_hash,
+        const std::string& peer_id,
+        const AnnounceRequest& req,
+        AnnounceCallback cb
+    ) {
+        const std::uint64_t id = m_next_id++;
+        Request& r = m_requests[id];
+        r.cb = std::move(cb);
+        try {
+            std::string host, port;
+            split_tracker_url(url, host, port);
+            r.tracker = (host.find(':') != std::string::npos ? "[" + host + "]" : host) + ":" + port;
+            r.packet = build_announce(info_hash, peer_id, req);
+        }
+        catch (const std::exception& ex) {
+            finish(id, {}, ex.what());
+            return;
+        }
+
+        Tracker& t = m_trackers[r.tracker];
+        if (t.resolved && m_loop.now() - t.resolved_at < kResolveTtl) {
+            start_attempt(id);
+            return;
+        }
+        t.waiting.push_back(id);
+        if (!t.resolving) resolve(r.tracker);
+    }
+
+
+    // ----------------- Resolving -----------------
+
+    void UdpTrackerClient::resolve(const std::string& key) {
+        m_trackers[key].resolving = true;
+        if (std::optional<Endpoint> ep = Endpoint::parse(key)) {
+            on_resolved(key, {*ep}, "");
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_resolve_mutex);
+            m_resolve_queue.push_back(key);
+        }
+        if (m_resolver.joinable()) m_resolve_cv.notify_one();
+        else m_resolver = std::thread([this] { resolver_main(); });
+    }
+
+    void UdpTrackerClient::resolver_main() {
+        // Signals are for the thread that waits for them (signalfd)
+        sigset_t all;
+        sigfillset(&all);
+        ::pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        while (true) {
+            std::string key;
+            {
+                std::unique_lock<std::mutex> lock(m_resolve_mutex);
+                m_resolve_cv.wait(lock, [this] { return m_resolver_stop || !m_resolve_queue.empty(); });
+                if (m_resolver_stop) return;
+                key = std::move(m_resolve_queue.front());
+                m_resolve_queue.pop_front();
+            }
+
+            std::vector<Endpoint> addresses;
+            std::string error;
+            try {
+                addresses = Endpoint::resolve_all(key);
+            }
+            catch (const std::exception& ex) {
+                error = std::string("Cannot resolve tracker: ") + ex.what();
+            }
+            m_loop.post([this, alive = m_alive, key, addresses, error] {
+                if (*alive) on_resolved(key, addresses, error);
+            });
+        }
+    }
+
+    void UdpTrackerClient::on_resolved(const std::string& key, const std::vector<Endpoint>& addresses,
+                                       const std::string& error) {
+        Tracker& t = m_trackers[key];
+        t.resolving = false;
+        std::vector<std::uint64_t> waiting;
+        waiting.swap(t.waiting);
+
+        if (!error.empty()) {
+            for (std::uint64_t id : waiting) finish(id, {}, error);
+            return;
+        }
+
+        if (!t.resolved || t.address != addresses.front()) t.has_connection_id = false;
+        t.address = addresses.front();
+        t.resolved = true;
+        t.resolved_at = m_loop.now();
+        for (std::uint64_t id : waiting) start_attempt(id);
+    }
+
+
+    // ----------------- Exchanges -----------------
+
+    // One round of the schedule: connect first unless a cached id is still
+    // good, then announce. Each send gets 15 * 2^attempt seconds.
+    void UdpTrackerClient::start_attempt(std::uint64_t id) {
+        Request& r = m_requests.at(id);
+        if (r.attempt > m_options.max_retries) {
+            finish(id, {}, "UDP tracker " + r.tracker + " timed out");
+            return;
+        }
+
+        const Tracker& t = m_trackers.at(r.tracker);
+        if (t.has_connection_id && m_loop.now() - t.connected_at <= kClientConnectionIdTtl) {
+            r.cached = true;
+            send_announce(id);
+            return;
+        }
+
+        r.cached = false;
+        r.connecting = true;
+        std::string req;
+        put_u64(req, kProtocolId);
+        put_u32(req, kActionConnect);
+        put_u32(req, 0);
+        transmit(id, std::move(req));
+    }
+
+    void UdpTrackerClient::send_announce(std::uint64_t id) {
+        Request& r = m_requests.at(id);
+        r.connecting = false;
+        std::string req = r.packet;
+        set_u64(req, 0, m_trackers.at(r.tracker).connection_id);
+        transmit(id, std::move(req));
+    }
+
+    void UdpTrackerClient::transmit(std::uint64_t id, std::string packet) {
+        Request& r = m_requests.at(id);
+        if (r.txid) m_transactions.erase(r.txid);
+        if (r.timer) m_loop.cancel_timer(r.timer);
+        r.timer = 0;
+
+        do {
+            r.txid = rng()();
+        } while (r.txid == 0 || m_transactions.count(r.txid));
+        m_transactions[r.txid] = id;
+        set_u32(packet, 12, r.txid);
+
+        const Endpoint& address = m_trackers.at(r.tracker).address;
+        try {
+            const int fd = socket_for(address);
+            sockaddr_storage ss;
+            const socklen_t len = address.to_sockaddr(ss);
+            if (::sendto(fd, packet.data(), packet.size(), 0, reinterpret_cast<sockaddr*>(&ss), len) < 0 &&
+                errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != EINTR) {
+                throw std::runtime_error(std::string("UDP send failed: ") + std::strerror(errno));
+            }
+        }
+        catch (const std::exception& ex) {
+            finish(id, {}, ex.what());
+            return;
+        }
+
+        // A full socket buffer counts as a lost datagram
+        r.timer = m_loop.add_timer(m_options.base_timeout * (1 << r.attempt), [this, id] { on_timeout(id); }, false);
+    }
+
+    void UdpTrackerClient::on_timeout(std::uint64_t id) {
+        Request& r = m_requests.at(id);
+        r.timer = 0;
+        r.attempt++;
+        start_attempt(id);
+    }
+
+    void UdpTrackerClient::on_readable(int fd) {
+        while (true) {
+            char buf[65536];
+            sockaddr_storage from{};
+            socklen_t len = sizeof(from);
+            ssize_t n = ::recvfrom(fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+            if (n < 0) return; // EAGAIN
+            if (n < 8) continue;
+
+            std::string data(buf, static_cast<std::size_t>(n));
+            auto tx = m_transactions.find(get_u32(data, 4));
+            if (tx == m_transactions.end()) continue; // stale reply to an earlier attempt
+
+            const std::uint64_t id = tx->second;
+            Request& r = m_requests.at(id);
+            Tracker& t = m_trackers.at(r.tracker);
+            std::optional<Endpoint> sender = Endpoint::from_sockaddr(reinterpret_cast<sockaddr*>(&from));
+            if (!sender || *sender != t.address) continue;
+
+            m_transactions.erase(tx);
+            r.txid = 0;
+            m_loop.cancel_timer(r.timer);
+            r.timer = 0;
+
+            const std::uint32_t action = get_u32(data, 0);
+            if (action == kActionError) {
+                if (!r.connecting && r.cached) {
+                    // A cached id may have expired on the tracker's side: reconnect
+                    t.has_connection_id = false;
+                    r.attempt++;
+                    start_attempt(id);
+                }
+                else {
+                    finish(id, {}, "Tracker error: " + data.substr(8));
+                }
+                continue;
+            }
+
+            if (r.connecting) {
+                if (action != kActionConnect || data.size() < 16) {
+                    finish(id, {}, "Bad connect response from tracker");
+                    continue;
+                }
+                t.connection_id = get_u64(data, 8);
+                t.has_connection_id = true;
+                t.connected_at = m_loop.now();
+                send_announce(id);
+                continue;
+            }
+
+            if (action != kActionAnnounce) {
+                finish(id, {}, "Unexpected action in tracker response");
+                continue;
+            }
+            try {
+                finish(id, parse_announce(data, !t.address.is_v4()), "");
+            }
+            catch (const std::exception& ex) {
+                finish(id, {}, ex.what());
+            }
+        }
+    }
+
+    void UdpTrackerClient::finish(std::uint64_t id, const TrackerResponse& resp, const std::string& error) {
+        auto it = m_requests.find(id);
+        if (it == m_requests.end()) return;
+
+        Request& r = it->second;
+        if (r.txid) m_transactions.erase(r.txid);
+        if (r.timer) m_loop.cancel_timer(r.timer);
+
+        // Never from within announce(): the caller may not be ready for it
+        m_loop.post([alive = m_alive, cb = std::move(r.cb), resp, error] {
+            if (*alive && cb) cb(resp, error);
+        });
+        m_requests.erase(it);
+    }
+
+    int UdpTrackerClient::socket_for(const Endpoint& address) {
+        int& fd = address.is_v4() ? m_fd4 : m_fd6;
+        if (fd >= 0) return fd;
+
+        fd = ::socket(address.is_v4() ? AF_INET : AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) throw std::runtime_error(std::string("UDP socket failed: ") + std::strerror(errno));
+        const int sock = fd;
+        m_loop.add_fd(sock, EPOLLIN, [this, sock](std::uint32_t) { on_readable(sock); });
+        return sock;
+    }
+
+
+    // ----------------- Mock server -----------------
+
+    UdpTrackerServer::UdpTrackerServer(EventLoop& loop, std::uint16_t port, std::vector<Endpoint> fixed_peers)
+        : m_loop(loop), m_fixed_peers(std::move(fixed_peers)), m_rng(std::random_device{}()) {
+        m_fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) throw std::runtime_error(std::string("UDP socket failed: ") + std::strerror(errno));
+
+        sockaddr_in addr{};
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port        = htons(port);
+        if (::bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::string err = std::strerror(errno);
+            ::close(m_fd);
+            throw std::runtime_error("Failed to bind UDP port " + std::to_string(port) + ": " + err);
+        }
+
+        m_loop.add_fd(m_fd, EPOLLIN, [this](std::uint32_t) { on_readable(); });
+    }
+
+    UdpTrackerServer::~UdpTrackerServer() {
+        m_loop.remove_fd(m_fd);
+        ::close(m_fd);
+    }
+
+    void UdpTrackerServer::on_readable() {
+        while (true) {
+            char buf[2048];
+            sockaddr_in from{};
+            socklen_t len = sizeof(from);
+            ssize_t n = ::recvfrom(m_fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+            if (n < 0) return; // EAGAIN
+
+            m_requests++;
+            if (m_drop > 0) {
+                m_drop--;
+                continue;
+            }
+
+            std::optional<Endpoint> sender = Endpoint::from_sockaddr(reinterpret_cast<sockaddr*>(&from));
+            if (!sender) continue;
+
+            std::string resp = handle(std::string(buf, static_cast<std::size_t>(n)), *sender);
+            if (!resp.empty()) {
+                ::sendto(m_fd, resp.data(), resp.size(), 0, reinterpret_cast<sockaddr*>(&from), len);
+            }
+        }
+    }
+
+    std::string UdpTrackerServer::handle(const std::string& req, const Endpoint& from) {
+        if (req.size() < 16) return {};
+
+        const std::uint64_t conn_id = get_u64(req, 0);
+        const std::uint32_t action  = get_u32(req, 8);
+        const std::uint32_t txid    = get_u32(req, 12);
+        const auto now = m_loop.now();
+
+        std::string out;
+        auto error = [&](const std::string& msg) {
+            out.clear();
+            put_u32(out, kActionError);
+            put_u32(out, txid);
+            out += msg;
+            return out;
+        };
+
+        if (action == kActionConnect) {
+            if (conn_id != kProtocolId) return {};
+
+            // Ids are issued in time order, so the expired ones are in front
+            while (!m_issued_ids.empty() && now - m_issued_ids.front().first > kServerConnectionIdTtl) {
+                auto old = m_connection_ids.find(m_issued_ids.front().second);
+                if (old != m_connection_ids.end() && old->second == m_issued_ids.front().first) {
+                    m_connection_ids.erase(old);
+                }
+                m_issued_ids.pop_front();
+            }
+
+            std::uint64_t id = m_rng();
+            m_connection_ids[id] = now;
+            m_issued_ids.emplace_back(now, id);
+            put_u32(out, kActionConnect);
+            put_u32(out, txid);
+            put_u64(out, id);
+            return out;
+        }
+
+        auto it = m_connection_ids.find(conn_id);
+        if (it == m_connection_ids.end() || now - it->second > kServerConnectionIdTtl) {
+            return error("connection id expired");
+        }
+
+        if (action == kActionAnnounce) {
+            if (req.size() < 98) return error("announce too short");
+
+            const std::string info_hash = req.substr(16, 20);
+            const std::uint64_t left    = get_u64(req, 64);
+            const std::uint32_t event   = get_u32(req, 80);
+            const std::int32_t num_want = static_cast<std::int32_t>(get_u32(req, 92));
+            const std::uint16_t port    = static_cast<std::uint16_t>(
+                (static_cast<unsigned char>(req[96]) << 8) | static_cast<unsigned char>(req[97])
+            );
+
+            Endpoint announcer = from;
+            announcer.port = port;
+
+            auto& swarm = m_swarms[info_hash];
+            swarm.erase(std::remove_if(swarm.begin(), swarm.end(), [&](const SwarmPeer& p) {
+                bool self  = p.peer == announcer;
+                bool stale = now - p.last_seen > std::chrono::hours(1);
+                return self || stale;
+            }), swarm.end());
+
+            if (event == 1) m_completed[info_hash]++;
+
+            std::uint32_t seeders = 0;
+            std::uint32_t leechers = 0;
+            for (const SwarmPeer& p : swarm) (p.seed ? seeders : leechers)++;
+
+            put_u32(out, kActionAnnounce);
+            put_u32(out, txid);
+            put_u32(out, 1800);
+            put_u32(out, leechers);
+            put_u32(out, seeders);
+
+            std::size_t limit = num_want < 0 ? 50 : static_cast<std::size_t>(num_want);
+            std::vector<Endpoint> peers = m_fixed_peers;
+            for (const SwarmPeer& p : swarm) peers.push_back(p.peer);
+
+            std::size_t count = 0;
+            for (const Endpoint& p : peers) {
+                if (!p.is_v4()) continue; // the BEP 15 IPv4 reply has no room for v6
+                if (count++ >= limit) break;
+
+                out.append(reinterpret_cast<const char*>(p.addr.data() + 12), 4);
+                out.push_back(static_cast<char>(p.port >> 8));
+                out.push_back(static_cast<char>(p.port & 0xFF));
+            }
+
+            if (event != 3) { // stopped
+                swarm.push_back(SwarmPeer{announcer, left == 0, now});
+            }
+            return out;
+        }
+
+        if (action == kActionScrape) {
+            put_u32(out, kActionScrape);
+            put_u32(out, txid);
+            for (std::size_t pos = 16; pos + 20 <= req.size() && pos < 16 + 20 * kMaxScrapeHashes; pos += 20) {
+                const std::string info_hash = req.substr(pos, 20);
+
+                std::uint32_t seeders = 0;
+                std::uint32_t leechers = 0;
+                auto sw = m_swarms.find(info_hash);
+                if (sw != m_swarms.end()) {
+                    for (const SwarmPeer& p : sw->second) (p.seed ? seeders : leechers)++;
+                }
+
+                put_u32(out, seeders);
+                put_u32(out, m_completed[info_hash]);
+                put_u32(out, leechers);
+            }
+            return out;
+        }
+
+        return error("unknown action");
+    }
+
+}
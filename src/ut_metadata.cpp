@@ -0,0 +1,268 @@
+#include "torrent/ut_metadata.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace torrent {
+
+    // A request unanswered this long goes to another peer.
+    static constexpr auto kRequestTimeout = std::chrono::seconds(15);
+    // Pieces requested from one peer at a time.
+    static constexpr std::size_t kRequestsPerPeer = 3;
+
+    UtMetadata::UtMetadata(std::string info_bencoded)
+        : m_complete(true), m_metadata(std::move(info_bencoded)) {}
+
+    UtMetadata::UtMetadata(const std::array<std::uint8_t, 20>& info_hash, CompleteCallback on_complete)
+        : m_info_hash(info_hash), m_on_complete(std::move(on_complete)) {}
+
+    void UtMetadata::add_handshake_keys(json& dict) const {
+        if (m_complete) dict["metadata_size"] = static_cast<std::int64_t>(m_metadata.size());
+    }
+
+    void UtMetadata::on_handshake(ExtensionPeer& peer) {
+        if (m_complete || !peer.supports(name())) return;
+
+        const json& dict = peer.extension_handshake().dict;
+        auto it = dict.find("metadata_size");
+        if (it == dict.end() || !it->is_number_integer()) return;
+
+        const std::int64_t size = it->get<std::int64_t>();
+        if (size <= 0 || static_cast<std::uint64_t>(size) > kMaxMetadataSize) return;
+
+        m_peers[&peer].metadata_size = static_cast<std::size_t>(size);
+        if (m_size == 0) {
+            start_download();
+        }
+        else {
+            request_pieces(peer);
+        }
+    }
+
+    void UtMetadata::on_message(ExtensionPeer& peer, const std::uint8_t* data, std::size_t len) {
+        std::size_t consumed = 0;
+        const std::string msg(reinterpret_cast<const char*>(data), len);
+        json dict = decode_bencoded_prefix(msg, consumed);
+
+        if (!dict.is_object() || !dict.contains("msg_type") || !dict.contains("piece") ||
+            !dict["msg_type"].is_number_integer() || !dict["piece"].is_number_integer()) {
+            throw std::runtime_error("bad ut_metadata message");
+        }
+        const std::int64_t piece = dict["piece"].get<std::int64_t>();
+        if (piece < 0 || piece > static_cast<std::int64_t>(kMaxMetadataSize / kPieceSize)) {
+            throw std::runtime_error("bad ut_metadata piece");
+        }
+        const auto index = static_cast<std::uint32_t>(piece);
+
+        switch (static_cast<MsgType>(dict["msg_type"].get<std::int64_t>())) {
+            case MsgType::Request:
+                serve(peer, index);
+                break;
+
+            case MsgType::Data:
+                on_data(peer, index, data + consumed, len - consumed);
+                break;
+
+            case MsgType::Reject: {
+                auto it = m_peers.find(&peer);
+                if (it == m_peers.end()) break;
+                forget_request(peer, index);
+                it->second.rejected.push_back(index);
+                request_pieces(peer);
+                break;
+            }
+
+            default:
+                // Unknown types must be ignored (BEP 9)
+                break;
+        }
+    }
+
+    void UtMetadata::on_disconnect(ExtensionPeer& peer) {
+        auto it = m_peers.find(&peer);
+        if (it != m_peers.end()) {
+            std::vector<std::uint32_t> pending;
+            for (const auto& kv : it->second.requests) pending.push_back(kv.first);
+            for (std::uint32_t piece : pending) forget_request(peer, piece);
+            m_peers.erase(it);
+        }
+        for (Piece& p : m_pieces) {
+            if (p.source == &peer) p.source = nullptr;
+        }
+
+        // Its pieces are free again
+        for (auto& kv : m_peers) request_pieces(*kv.first);
+    }
+
+    void UtMetadata::on_tick() {
+        if (m_complete) return;
+
+        const auto now = Clock::now();
+        for (auto& kv : m_peers) {
+            std::vector<std::uint32_t> expired;
+            for (const auto& req : kv.second.requests) {
+                if (now - req.second > kRequestTimeout) expired.push_back(req.first);
+            }
+            for (std::uint32_t piece : expired) {
+                forget_request(*kv.first, piece);
+                std::vector<std::uint32_t>& late = kv.second.timed_out;
+                if (std::find(late.begin(), late.end(), piece) == late.end()) late.push_back(piece);
+            }
+        }
+        for (auto& kv : m_peers) request_pieces(*kv.first);
+    }
+
+
+    // ----------------- Serving -----------------
+
+    void UtMetadata::serve(ExtensionPeer& peer, std::uint32_t piece) {
+        const std::size_t offset = static_cast<std::size_t>(piece) * kPieceSize;
+        if (!m_complete || offset >= m_metadata.size()) {
+            send(peer, MsgType::Reject, piece);
+            return;
+        }
+
+        const std::size_t len = std::min(kPieceSize, m_metadata.size() - offset);
+        send(peer, MsgType::Data, piece, reinterpret_cast<const std::uint8_t*>(m_metadata.data()) + offset, len,
+             m_metadata.size());
+    }
+
+    void UtMetadata::send(ExtensionPeer& peer, MsgType type, std::uint32_t piece,
+                          const std::uint8_t* data, std::size_t len, std::size_t total) {
+        json dict = json::object();
+        dict["msg_type"] = static_cast<std::int64_t>(type);
+        dict["piece"] = static_cast<std::int64_t>(piece);
+        if (type == MsgType::Data) dict["total_size"] = static_cast<std::int64_t>(total);
+
+        std::string msg = encode_bencode_value(dict);
+        if (len > 0) msg.append(reinterpret_cast<const char*>(data), len);
+        peer.send_extended(name(), reinterpret_cast<const std::uint8_t*>(msg.data()), msg.size());
+    }
+
+
+    // ----------------- Downloading -----------------
+
+    // (Re)start with the size announced by the first peer we still trust.
+    void UtMetadata::start_download() {
+        m_size = 0;
+        for (const auto& kv : m_peers) {
+            if (!kv.second.ignored && kv.second.metadata_size > 0) {
+                m_size = kv.second.metadata_size;
+                break;
+            }
+        }
+
+        m_buffer.assign(m_size, '\0');
+        m_pieces.assign((m_size + kPieceSize - 1) / kPieceSize, Piece{});
+        m_received = 0;
+        for (auto& kv : m_peers) {
+            kv.second.requests.clear();
+            kv.second.rejected.clear();
+            kv.second.timed_out.clear();
+        }
+        if (m_size == 0) return;
+
+        std::cerr << "[*] Metadata is " << m_size << " bytes (" << m_pieces.size() << " pieces)\n";
+        for (auto& kv : m_peers) request_pieces(*kv.first);
+    }
+
+    void UtMetadata::request_pieces(ExtensionPeer& peer) {
+        if (m_complete || m_size == 0) return;
+
+        auto it = m_peers.find(&peer);
+        if (it == m_peers.end()) return;
+        PeerState& st = it->second;
+        if (st.ignored || st.metadata_size != m_size) return;
+
+        auto listed = [](const std::vector<std::uint32_t>& list, std::uint32_t index) {
+            return std::find(list.begin(), list.end(), index) != list.end();
+        };
+
+        while (st.requests.size() < kRequestsPerPeer) {
+            // A piece nobody is working on; failing that (the last few pieces),
+            // the one with the fewest peers on it. Pieces that timed out with
+            // this peer only if there is nothing else.
+            std::size_t best = m_pieces.size();
+            for (int pass = 0; pass < 2 && best == m_pieces.size(); ++pass) {
+                for (std::size_t i = 0; i < m_pieces.size(); ++i) {
+                    const Piece& p = m_pieces[i];
+                    const auto index = static_cast<std::uint32_t>(i);
+                    if (p.received || st.requests.count(index) || listed(st.rejected, index)) continue;
+                    if (pass == 0 && listed(st.timed_out, index)) continue;
+
+                    if (best == m_pieces.size() || p.requested_from.size() < m_pieces[best].requested_from.size()) {
+                        best = i;
+                        if (p.requested_from.empty()) break;
+                    }
+                }
+            }
+            if (best == m_pieces.size()) break;
+
+            const auto index = static_cast<std::uint32_t>(best);
+            st.requests[index] = Clock::now();
+            m_pieces[best].requested_from.push_back(&peer);
+            send(peer, MsgType::Request, index);
+        }
+    }
+
+    void UtMetadata::forget_request(ExtensionPeer& peer, std::uint32_t piece) {
+        auto it = m_peers.find(&peer);
+        if (it == m_peers.end() || it->second.requests.erase(piece) == 0) return;
+
+        auto& from = m_pieces.at(piece).requested_from;
+        from.erase(std::remove(from.begin(), from.end(), &peer), from.end());
+    }
+
+    void UtMetadata::on_data(ExtensionPeer& peer, std::uint32_t piece, const std::uint8_t* data, std::size_t len) {
+        if (m_complete) return;
+
+        auto it = m_peers.find(&peer);
+        if (it == m_peers.end() || !it->second.requests.count(piece)) return; // not asked for
+        forget_request(peer, piece);
+
+        Piece& p = m_pieces[piece];
+        if (!p.received) {
+            const std::size_t offset = static_cast<std::size_t>(piece) * kPieceSize;
+            if (len != std::min(kPieceSize, m_size - offset)) {
+                throw std::runtime_error("ut_metadata piece has the wrong size");
+            }
+
+            std::memcpy(&m_buffer[offset], data, len);
+            p.received = true;
+            p.source = &peer;
+            if (++m_received == m_pieces.size()) {
+                verify();
+                return;
+            }
+        }
+        request_pieces(peer);
+    }
+
+    void UtMetadata::verify() {
+        const std::string digest = sha1_raw(m_buffer);
+        if (std::memcmp(digest.data(), m_info_hash.data(), 20) == 0) {
+            m_complete = true;
+            m_metadata = std::move(m_buffer);
+            m_buffer.clear();
+            m_peers.clear();
+            std::cerr << "[✓] Metadata received and verified\n";
+            if (m_on_complete) m_on_complete(m_metadata);
+            return;
+        }
+
+        // If one peer sent everything, it's the culprit; otherwise we can't
+        // tell and simply start over
+        std::vector<ExtensionPeer*> sources;
+        for (const Piece& p : m_pieces) {
+            if (std::find(sources.begin(), sources.end(), p.source) == sources.end()) sources.push_back(p.source);
+        }
+        std::cerr << "[!] Metadata failed its hash check, starting over\n";
+        if (sources.size() == 1 && sources[0]) {
+            m_peers[sources[0]].ignored = true;
+        }
+        start_download();
+    }
+
+}
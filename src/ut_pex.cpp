@@ -0,0 +1,150 @@
+#include "torrent/ut_pex.hpp"
+#include "torrent/tracker.hpp"
+
+#include <iostream>
+#include <stdexcept>
+
+namespace torrent {
+
+    // How often each peer gets an update (BEP 11: at most once a minute).
+    static constexpr auto kSendInterval = std::chrono::seconds(60);
+    // Messages that come faster than this from one peer are ignored.
+    static constexpr auto kMinReceiveInterval = std::chrono::seconds(45);
+    // Peers per list, both directions.
+    static constexpr std::size_t kMaxPeersPerMessage = 50;
+    // Addresses remembered as already handed over; forgotten all at once.
+    static constexpr std::size_t kMaxKnown = 10000;
+
+    UtPex::UtPex(PeersProvider connected, PeersCallback on_peers)
+        : m_connected(std::move(connected)), m_on_peers(std::move(on_peers)) {}
+
+    void UtPex::on_handshake(ExtensionPeer& peer) {
+        // The first update goes out with the next tick
+        if (peer.supports(name())) m_peers.emplace(&peer, PeerState{});
+    }
+
+    void UtPex::on_disconnect(ExtensionPeer& peer) {
+        m_peers.erase(&peer);
+    }
+
+    void UtPex::on_tick() {
+        if (m_peers.empty()) return;
+
+        const auto now = Clock::now();
+        std::vector<Peer> current;
+        bool have_current = false;
+
+        for (auto& kv : m_peers) {
+            PeerState& st = kv.second;
+            if (st.first_sent && now - st.last_sent < kSendInterval) continue;
+
+            if (!have_current) {
+                current = m_connected();
+                have_current = true;
+            }
+            send_update(*kv.first, st, current);
+            st.first_sent = true;
+            st.last_sent = now;
+        }
+    }
+
+    void UtPex::send_update(ExtensionPeer& peer, PeerState& st, const std::vector<Peer>& current) {
+        const Endpoint& self = peer.endpoint();
+        const auto& listen_port = peer.extension_handshake().listen_port;
+        auto is_self = [&](const Endpoint& ep) {
+            return ep.addr == self.addr && (ep.port == self.port || (listen_port && ep.port == *listen_port));
+        };
+
+        std::string added, added_f, added6, added6_f, dropped, dropped6;
+        std::size_t num_added = 0;
+        std::unordered_set<Endpoint> now_connected;
+        for (const Peer& p : current) {
+            if (is_self(p.endpoint)) continue;
+            now_connected.insert(p.endpoint);
+            if (num_added == kMaxPeersPerMessage || st.sent.count(p.endpoint)) continue;
+
+            if (p.endpoint.is_v4()) {
+                added += p.endpoint.compact();
+                added_f.push_back(static_cast<char>(p.flags));
+            }
+            else {
+                added6 += p.endpoint.compact();
+                added6_f.push_back(static_cast<char>(p.flags));
+            }
+            st.sent.insert(p.endpoint);
+            num_added++;
+        }
+
+        std::size_t num_dropped = 0;
+        for (auto it = st.sent.begin(); it != st.sent.end() && num_dropped < kMaxPeersPerMessage;) {
+            if (now_connected.count(*it)) {
+                ++it;
+                continue;
+            }
+            (it->is_v4() ? dropped : dropped6) += it->compact();
+            num_dropped++;
+            it = st.sent.erase(it);
+        }
+
+        // Nothing new: skip the message (the first one always goes out)
+        if (st.first_sent && num_added == 0 && num_dropped == 0) return;
+
+        json dict = json::object();
+        dict["added"] = added;
+        dict["added.f"] = added_f;
+        dict["added6"] = added6;
+        dict["added6.f"] = added6_f;
+        dict["dropped"] = dropped;
+        dict["dropped6"] = dropped6;
+
+        const std::string msg = encode_bencode_value(dict);
+        peer.send_extended(name(), reinterpret_cast<const std::uint8_t*>(msg.data()), msg.size());
+    }
+
+    void UtPex::on_message(ExtensionPeer& peer, const std::uint8_t* data, std::size_t len) {
+        auto st = m_peers.find(&peer);
+        if (st == m_peers.end()) return;
+
+        const auto now = Clock::now();
+        if (st->second.last_received != Clock::time_point{} && now - st->second.last_received < kMinReceiveInterval) {
+            return; // too often; the next one will have whatever this one had
+        }
+        st->second.last_received = now;
+
+        json dict = decode_bencoded_value(std::string(reinterpret_cast<const char*>(data), len));
+        if (!dict.is_object()) throw std::runtime_error("bad ut_pex message");
+
+        auto string_of = [&dict](const char* key) {
+            auto it = dict.find(key);
+            return it != dict.end() && it->is_string() ? it->get<std::string>() : std::string();
+        };
+
+        std::vector<Endpoint> endpoints = parse_compact_peers(string_of("added"));
+        std::string flags = string_of("added.f");
+        std::vector<Endpoint> v6 = parse_compact_peers6(string_of("added6"));
+        std::string flags6 = string_of("added6.f");
+
+        // Flags line up with the addresses of their own family
+        std::vector<std::uint8_t> all_flags(endpoints.size(), 0);
+        for (std::size_t i = 0; i < endpoints.size() && i < flags.size(); ++i) {
+            all_flags[i] = static_cast<std::uint8_t>(flags[i]);
+        }
+        for (std::size_t i = 0; i < v6.size(); ++i) {
+            endpoints.push_back(v6[i]);
+            all_flags.push_back(i < flags6.size() ? static_cast<std::uint8_t>(flags6[i]) : 0);
+        }
+
+        if (m_known.size() > kMaxKnown) m_known.clear();
+
+        std::vector<Peer> fresh;
+        for (std::size_t i = 0; i < endpoints.size() && i < kMaxPeersPerMessage; ++i) {
+            if (endpoints[i].port == 0 || !m_known.insert(endpoints[i]).second) continue;
+            fresh.push_back(Peer{endpoints[i], all_flags[i]});
+        }
+        if (fresh.empty()) return;
+
+        std::cerr << "[peer] " << peer.endpoint().to_string() << " sent " << fresh.size() << " new peers (PEX)\n";
+        m_on_peers(fresh);
+    }
+
+}
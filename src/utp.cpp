@@ -0,0 +1,803 @@
+#include "torrent/utp.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace torrent {
+
+    // Packet types
+    static constexpr std::uint8_t ST_DATA  = 0;
+    static constexpr std::uint8_t ST_FIN   = 1;
+    static constexpr std::uint8_t ST_STATE = 2;
+    static constexpr std::uint8_t ST_RESET = 3;
+    static constexpr std::uint8_t ST_SYN   = 4;
+
+    static constexpr std::uint8_t kVersion = 1;
+    static constexpr std::uint8_t kExtSelectiveAck = 1;
+    static constexpr std::size_t kHeaderSize = 20;
+    // Fits any path that carries IPv6's 1280-byte minimum, with headers
+    static constexpr std::size_t kMaxPayload = 1200;
+    static constexpr std::size_t kMaxSackBytes = 32; // packets ack_nr+2 .. ack_nr+257
+
+    // LEDBAT
+    static constexpr std::uint32_t kTargetDelay = 100000;     // µs of queuing we accept
+    static constexpr double kMaxCwndIncrease = 3000;          // bytes per RTT, at zero queuing
+    static constexpr double kMinWindow = 2 * kMaxPayload;
+    static constexpr double kInitialWindow = 4 * kMaxPayload;
+    static constexpr std::size_t kRecvWindow = 1 << 20;       // also the largest cwnd
+    static constexpr auto kBaseDelayWindow = std::chrono::minutes(1); // two of these are remembered
+
+    static constexpr auto kMinRto = std::chrono::milliseconds(500);
+    static constexpr auto kMaxRto = std::chrono::milliseconds(60000);
+    static constexpr int kMaxSynTransmissions = 2;  // then give up (3 s)
+    static constexpr int kMaxTransmissions = 6;     // of one data packet
+    static constexpr std::uint16_t kMaxReorder = 1024; // packets past a gap we keep
+
+    static constexpr auto kTickInterval = std::chrono::milliseconds(20);
+    static constexpr auto kKeepAlive = std::chrono::seconds(29);
+    static constexpr auto kIdleTimeout = std::chrono::minutes(2);
+    static constexpr auto kFinTimeout = std::chrono::seconds(10);
+
+    static std::uint32_t now_micros() {
+        return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    static void put16(std::uint8_t* p, std::uint16_t v) {
+        p[0] = static_cast<std::uint8_t>(v >> 8);
+        p[1] = static_cast<std::uint8_t>(v);
+    }
+
+    static void put32(std::uint8_t* p, std::uint32_t v) {
+        p[0] = static_cast<std::uint8_t>(v >> 24);
+        p[1] = static_cast<std::uint8_t>(v >> 16);
+        p[2] = static_cast<std::uint8_t>(v >> 8);
+        p[3] = static_cast<std::uint8_t>(v);
+    }
+
+    static std::uint16_t get16(const std::uint8_t* p) {
+        return static_cast<std::uint16_t>((p[0] << 8) | p[1]);
+    }
+
+    static std::uint32_t get32(const std::uint8_t* p) {
+        return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+               (static_cast<std::uint32_t>(p[2]) << 8) | p[3];
+    }
+
+    // Sequence numbers and timestamps wrap around
+    static bool seq_less(std::uint16_t a, std::uint16_t b) {
+        return a != b && static_cast<std::uint16_t>(b - a) < 0x8000;
+    }
+
+    static bool wrapping_less(std::uint32_t a, std::uint32_t b) {
+        return a != b && b - a < 0x80000000u;
+    }
+
+    UtpSocketManager::UtpSocketManager(EventLoop& loop, std::uint16_t port)
+        : UtpSocketManager(loop, port, Config{}) {}
+
+    UtpSocketManager::UtpSocketManager(EventLoop& loop, std::uint16_t port, Config config)
+        : m_loop(loop), m_config(std::move(config)) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(port);
+        if (::inet_pton(AF_INET, m_config.bind_address.c_str(), &addr.sin_addr) != 1) {
+            throw std::runtime_error("uTP: bad bind address " + m_config.bind_address);
+        }
+
+        m_fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0) throw std::runtime_error(std::string("uTP socket failed: ") + std::strerror(errno));
+        if (::bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::string err = std::strerror(errno);
+            ::close(m_fd);
+            throw std::runtime_error("Failed to bind uTP port " + std::to_string(port) + ": " + err);
+        }
+
+        // Every connection shares these; room for a few windows' worth of bursts
+        int size = 4 << 20;
+        ::setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        ::setsockopt(m_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+        socklen_t len = sizeof(addr);
+        ::getsockname(m_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+        m_port = ntohs(addr.sin_port);
+
+        m_loop.add_fd(m_fd, EPOLLIN, [this](std::uint32_t) { on_readable(); });
+        m_tick_timer = m_loop.add_timer(kTickInterval, [this] { tick(); });
+    }
+
+    UtpSocketManager::~UtpSocketManager() {
+        m_loop.cancel_timer(m_tick_timer);
+        if (m_delay_timer) m_loop.cancel_timer(m_delay_timer);
+        for (auto& kv : m_conns) {
+            if (kv.second->registered) m_loop.remove_fd(kv.second->fd);
+            ::close(kv.second->fd);
+        }
+        m_loop.remove_fd(m_fd);
+        ::close(m_fd);
+    }
+
+    std::vector<UtpSocketManager::ConnectionInfo> UtpSocketManager::connections() const {
+        std::vector<ConnectionInfo> out;
+        for (const auto& kv : m_conns) {
+            const Conn& c = *kv.second;
+            ConnectionInfo info;
+            info.remote = c.remote;
+            info.cwnd = static_cast<std::size_t>(c.cwnd);
+            info.in_flight = c.in_flight;
+            info.rtt = c.rtt;
+            info.queuing_delay = std::chrono::microseconds(c.queuing_delay);
+            out.push_back(info);
+        }
+        return out;
+    }
+
+    // ----------------- Connecting -----------------
+
+    int UtpSocketManager::connect(const Endpoint& remote, ConnectCallback done) {
+        if (!remote.is_v4()) return -1;
+
+        int pair[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) != 0) return -1;
+
+        // Ids: they send to recv_id, we send to recv_id + 1
+        std::uint16_t recv_id;
+        do {
+            recv_id = static_cast<std::uint16_t>(m_rng());
+        } while (m_conns.count({remote, recv_id}) || m_conns.count({remote, static_cast<std::uint16_t>(recv_id + 1)}));
+
+        auto conn = std::make_unique<Conn>();
+        Conn& c = *conn;
+        c.remote = remote;
+        c.recv_id = recv_id;
+        c.send_id = static_cast<std::uint16_t>(recv_id + 1);
+        c.fd = pair[0];
+        c.user_fd = pair[1];
+        c.on_connect = std::move(done);
+        c.cwnd = kInitialWindow;
+        c.ssthresh = kRecvWindow;
+        c.last_recv = Clock::now();
+        m_conns[{remote, recv_id}] = std::move(conn);
+        m_stats.connections++;
+
+        Packet syn;
+        syn.type = ST_SYN;
+        syn.seq = c.seq_nr++;
+        c.outstanding.push_back(std::move(syn));
+        send_packet(c, c.outstanding.back());
+        update_watch(c);
+        return pair[1];
+    }
+
+    void UtpSocketManager::accept_syn(const Endpoint& from, std::uint16_t conn_id, std::uint16_t seq) {
+        if (!m_on_accept) {
+            send_reset(from, conn_id);
+            return;
+        }
+
+        int pair[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) != 0) {
+            send_reset(from, conn_id);
+            return;
+        }
+
+        const std::uint16_t recv_id = static_cast<std::uint16_t>(conn_id + 1);
+        auto conn = std::make_unique<Conn>();
+        Conn& c = *conn;
+        c.state = Conn::State::Connected;
+        c.remote = from;
+        c.recv_id = recv_id;
+        c.send_id = conn_id;
+        c.fd = pair[0];
+        c.user_fd = pair[1];
+        c.seq_nr = static_cast<std::uint16_t>(m_rng());
+        c.ack_nr = seq;
+        c.cwnd = kInitialWindow;
+        c.ssthresh = kRecvWindow;
+        c.last_recv = Clock::now();
+        m_conns[{from, recv_id}] = std::move(conn);
+        m_stats.connections++;
+
+        // The SYN's answer carries the sequence number our first data
+        // packet will have, without using it up
+        send_ack(c);
+        update_watch(c);
+        m_on_accept(pair[1], from);
+    }
+
+    // ----------------- Receiving -----------------
+
+    void UtpSocketManager::on_readable() {
+        while (true) {
+            std::uint8_t buf[2048];
+            sockaddr_storage from{};
+            socklen_t len = sizeof(from);
+            ssize_t n = ::recvfrom(m_fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &len);
+            if (n < 0) break; // EAGAIN
+
+            std::optional<Endpoint> sender = Endpoint::from_sockaddr(reinterpret_cast<sockaddr*>(&from));
+            if (!sender || sender->port == 0) continue;
+
+            const std::size_t size = static_cast<std::size_t>(n);
+            if (size >= kHeaderSize && (buf[0] & 0x0F) == kVersion && (buf[0] >> 4) <= ST_SYN) {
+                on_packet(buf, size, *sender);
+            }
+            else if (m_on_datagram) {
+                m_on_datagram(reinterpret_cast<const char*>(buf), size, *sender);
+            }
+        }
+
+        // One ack per connection for the whole batch
+        std::vector<Key> acks;
+        acks.swap(m_acks);
+        for (const Key& key : acks) {
+            auto it = m_conns.find(key);
+            if (it == m_conns.end()) continue;
+            Conn& c = *it->second;
+            if (c.ack_due) send_ack(c);
+            finish_if_done(c);
+        }
+    }
+
+    void UtpSocketManager::on_packet(const std::uint8_t* data, std::size_t len, const Endpoint& from) {
+        m_stats.packets_received++;
+
+        const std::uint8_t type = data[0] >> 4;
+        const std::uint16_t conn_id = get16(data + 2);
+        const std::uint32_t timestamp = get32(data + 4);
+        const std::uint32_t their_delay = get32(data + 8);
+        const std::uint32_t wnd = get32(data + 12);
+        const std::uint16_t seq = get16(data + 16);
+        const std::uint16_t ack = get16(data + 18);
+
+        // Extensions: [next type][length][data], chained
+        const std::uint8_t* sack = nullptr;
+        std::size_t sack_len = 0;
+        std::size_t pos = kHeaderSize;
+        std::uint8_t ext = data[1];
+        while (ext != 0) {
+            if (pos + 2 > len) return;
+            const std::uint8_t next = data[pos];
+            const std::size_t ext_len = data[pos + 1];
+            pos += 2;
+            if (pos + ext_len > len) return;
+            if (ext == kExtSelectiveAck) {
+                sack = data + pos;
+                sack_len = ext_len;
+            }
+            pos += ext_len;
+            ext = next;
+        }
+
+        if (type == ST_SYN) {
+            auto it = m_conns.find({from, static_cast<std::uint16_t>(conn_id + 1)});
+            if (it == m_conns.end()) accept_syn(from, conn_id, seq);
+            else send_ack(*it->second); // our answer was lost
+            return;
+        }
+
+        auto it = m_conns.find({from, conn_id});
+        if (it == m_conns.end()) {
+            if (type == ST_RESET) {
+                // A reset may carry either of the connection's ids
+                it = m_conns.find({from, static_cast<std::uint16_t>(conn_id - 1)});
+                if (it == m_conns.end() || it->second->send_id != conn_id) return;
+            }
+            else {
+                send_reset(from, conn_id);
+                return;
+            }
+        }
+        Conn& c = *it->second;
+
+        if (type == ST_RESET) {
+            fail(c, "connection reset");
+            return;
+        }
+
+        c.last_recv = Clock::now();
+        c.reply_delay = now_micros() - timestamp;
+        c.peer_wnd = wnd;
+
+        bool connected = false;
+        if (c.state == Conn::State::SynSent) {
+            if (type != ST_STATE || ack != c.outstanding.front().seq) return;
+            // The answer to our SYN names their first sequence number
+            c.state = Conn::State::Connected;
+            c.ack_nr = static_cast<std::uint16_t>(seq - 1);
+            connected = true;
+        }
+
+        process_acks(c, ack, sack, sack_len, their_delay, type == ST_STATE);
+        if (type == ST_DATA || type == ST_FIN) {
+            receive_data(c, type, seq, data + pos, len - pos);
+        }
+
+        flush_to_app(c);
+        pump(c);
+
+        if (connected && c.on_connect) {
+            const Key key{c.remote, c.recv_id};
+            ConnectCallback done = std::move(c.on_connect);
+            c.on_connect = nullptr;
+            done(c.user_fd, "");
+            // Nothing the callback does tears us down, but look again to be safe
+            auto again = m_conns.find(key);
+            if (again != m_conns.end()) finish_if_done(*again->second);
+            return;
+        }
+        finish_if_done(c);
+    }
+
+    void UtpSocketManager::process_acks(Conn& c, std::uint16_t ack_nr, const std::uint8_t* sack,
+                                        std::size_t sack_len, std::uint32_t their_delay, bool pure_ack) {
+        // Acks for packets we haven't sent are junk
+        if (c.outstanding.empty() || !seq_less(ack_nr, c.seq_nr)) return;
+
+        const auto now = Clock::now();
+        std::size_t bytes_acked = 0;
+        std::chrono::microseconds min_rtt = std::chrono::microseconds::max();
+
+        auto acked = [&](Packet& p) {
+            if (p.acked) return;
+            p.acked = true;
+            bytes_acked += p.payload.size();
+            c.in_flight -= p.payload.size();
+            // Karn: a resent packet's ack might be for either copy
+            if (p.transmissions == 1) {
+                min_rtt = std::min(min_rtt, std::chrono::duration_cast<std::chrono::microseconds>(now - p.sent));
+            }
+        };
+
+        const bool progress = seq_less(c.last_ack, ack_nr);
+        while (!c.outstanding.empty() && !seq_less(ack_nr, c.outstanding.front().seq)) {
+            acked(c.outstanding.front());
+            c.outstanding.pop_front();
+        }
+
+        // Bit i of the mask: packet ack_nr + 2 + i arrived
+        std::size_t sacked_total = 0;
+        if (sack && !c.outstanding.empty()) {
+            const std::uint16_t first = c.outstanding.front().seq;
+            for (std::size_t i = 0; i < sack_len * 8; ++i) {
+                if (!(sack[i / 8] & (1u << (i % 8)))) continue;
+                const std::uint16_t s = static_cast<std::uint16_t>(ack_nr + 2 + i);
+                const std::size_t index = static_cast<std::uint16_t>(s - first);
+                if (index >= c.outstanding.size()) break;
+                acked(c.outstanding[index]);
+                sacked_total++;
+            }
+        }
+
+        // A packet that three later ones overtook is lost
+        bool lost = false;
+        if (sacked_total >= 3) {
+            std::size_t after = 0;
+            for (auto p = c.outstanding.rbegin(); p != c.outstanding.rend(); ++p) {
+                if (p->acked) {
+                    after++;
+                }
+                else if (after >= 3 && p->transmissions == 1 && !p->need_resend) {
+                    p->need_resend = true;
+                    m_stats.fast_retransmits++;
+                    lost = true;
+                }
+            }
+        }
+
+        // ... and so is one the same ack keeps coming back for
+        if (progress || bytes_acked > 0) {
+            c.dup_acks = 0;
+        }
+        else if (pure_ack && c.in_flight > 0 && ++c.dup_acks == 3) {
+            Packet& p = c.outstanding.front();
+            if (p.transmissions == 1 && !p.need_resend) {
+                p.need_resend = true;
+                m_stats.fast_retransmits++;
+                lost = true;
+            }
+        }
+        c.last_ack = ack_nr;
+
+        if (min_rtt != std::chrono::microseconds::max()) {
+            if (c.rtt.count() == 0) {
+                c.rtt = min_rtt;
+                c.rtt_var = min_rtt / 2;
+            }
+            else {
+                const auto diff = c.rtt > min_rtt ? c.rtt - min_rtt : min_rtt - c.rtt;
+                c.rtt_var += (diff - c.rtt_var) / 4;
+                c.rtt += (min_rtt - c.rtt) / 8;
+            }
+            const auto rto = std::chrono::duration_cast<std::chrono::milliseconds>(c.rtt + 4 * c.rtt_var);
+            c.rto = std::clamp<std::chrono::milliseconds>(rto, kMinRto, kMaxRto);
+        }
+
+        // Drop acked packets off the front, so it's always the oldest unacked
+        while (!c.outstanding.empty() && c.outstanding.front().acked) c.outstanding.pop_front();
+
+        if (lost) on_loss(c);
+        if (bytes_acked == 0) return;
+
+        // LEDBAT: their_delay is how long our packet took to get there
+        // (by their clock minus ours, so only differences mean anything)
+        if (their_delay != 0) {
+            if (now - c.base_rotated >= kBaseDelayWindow) {
+                c.base_delay[1] = c.base_delay[0];
+                c.base_valid[1] = c.base_valid[0];
+                c.base_valid[0] = false;
+                c.base_rotated = now;
+            }
+            if (!c.base_valid[0] || wrapping_less(their_delay, c.base_delay[0])) {
+                c.base_delay[0] = their_delay;
+                c.base_valid[0] = true;
+            }
+            std::uint32_t base = c.base_delay[0];
+            if (c.base_valid[1] && wrapping_less(c.base_delay[1], base)) base = c.base_delay[1];
+            c.queuing_delay = their_delay - base;
+        }
+
+        if (c.slow_start) {
+            c.cwnd += static_cast<double>(bytes_acked);
+            if (c.cwnd >= c.ssthresh || c.queuing_delay > kTargetDelay / 2) c.slow_start = false;
+        }
+        else {
+            const double off_target = (static_cast<double>(kTargetDelay) - c.queuing_delay) / kTargetDelay;
+            c.cwnd += kMaxCwndIncrease * std::max(off_target, -1.0) * static_cast<double>(bytes_acked) / c.cwnd;
+        }
+        c.cwnd = std::clamp(c.cwnd, kMinWindow, static_cast<double>(kRecvWindow));
+    }
+
+    void UtpSocketManager::on_loss(Conn& c) {
+        // Once per round trip: a burst of losses is one congestion event
+        const auto now = Clock::now();
+        if (now - c.last_loss < std::max<std::chrono::microseconds>(c.rtt, std::chrono::milliseconds(1))) return;
+        c.last_loss = now;
+        c.cwnd = std::max(c.cwnd / 2, kMinWindow);
+        c.ssthresh = c.cwnd;
+        c.slow_start = false;
+    }
+
+    void UtpSocketManager::receive_data(Conn& c, std::uint8_t type, std::uint16_t seq, const std::uint8_t* payload,
+                                        std::size_t len) {
+        if (!c.ack_due) {
+            c.ack_due = true;
+            m_acks.push_back({c.remote, c.recv_id});
+        }
+        if (c.eof_received && seq_less(c.eof_seq, seq)) return; // past the end
+        if (type == ST_FIN) {
+            c.eof_received = true;
+            c.eof_seq = seq;
+            len = 0;
+        }
+
+        const std::uint16_t distance = static_cast<std::uint16_t>(seq - c.ack_nr);
+        if (distance == 0 || distance > kMaxReorder) return; // a duplicate, or nonsense; the ack says where we are
+
+        if (distance > 1) {
+            if (c.reorder_bytes + len > kRecvWindow) return;
+            auto inserted = c.reorder.emplace(seq, std::vector<std::uint8_t>(payload, payload + len));
+            if (inserted.second) c.reorder_bytes += len;
+            return;
+        }
+
+        c.to_app.insert(c.to_app.end(), payload, payload + len);
+        m_stats.bytes_received += len;
+        c.ack_nr = seq;
+        for (auto it = c.reorder.find(static_cast<std::uint16_t>(c.ack_nr + 1)); it != c.reorder.end();
+             it = c.reorder.find(static_cast<std::uint16_t>(c.ack_nr + 1))) {
+            c.to_app.insert(c.to_app.end(), it->second.begin(), it->second.end());
+            m_stats.bytes_received += it->second.size();
+            c.reorder_bytes -= it->second.size();
+            c.ack_nr = it->first;
+            c.reorder.erase(it);
+        }
+    }
+
+    // ----------------- The application's end -----------------
+
+    void UtpSocketManager::on_app_event(Conn& c, std::uint32_t events) {
+        if ((events & (EPOLLHUP | EPOLLERR)) && c.state == Conn::State::SynSent) {
+            // Given up on before it connected; the fd may already be reused,
+            // so the callback mustn't run
+            send_reset(c.remote, c.send_id);
+            destroy(c);
+            return;
+        }
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            // The application closed its end: nobody reads what we
+            // receive any more. What it wrote is still there for pump(),
+            // which acks call; watching a hung-up socket would only spin.
+            c.app_closed = true;
+            c.to_app.clear();
+            m_loop.remove_fd(c.fd);
+            c.registered = false;
+            pump(c);
+            finish_if_done(c);
+            return;
+        }
+        if (events & EPOLLOUT) flush_to_app(c);
+        if (events & EPOLLIN) pump(c);
+        finish_if_done(c);
+    }
+
+    std::size_t UtpSocketManager::window(const Conn& c) const {
+        return std::min(static_cast<std::size_t>(c.cwnd), static_cast<std::size_t>(c.peer_wnd));
+    }
+
+    bool UtpSocketManager::can_send(const Conn& c) const {
+        // With nothing in flight one packet always goes, which also
+        // probes a window the receiver closed
+        return c.in_flight == 0 || c.in_flight + kMaxPayload <= window(c);
+    }
+
+    void UtpSocketManager::pump(Conn& c) {
+        if (c.state != Conn::State::Connected) return;
+
+        for (Packet& p : c.outstanding) {
+            if (p.need_resend) send_packet(c, p);
+        }
+
+        while (!c.app_eof && can_send(c)) {
+            Packet p;
+            p.payload.resize(kMaxPayload);
+            ssize_t n = ::read(c.fd, p.payload.data(), p.payload.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+            if (n <= 0) {
+                // Everything it wrote is on its way: the FIN goes last
+                c.app_eof = true;
+                p.type = ST_FIN;
+                p.payload.clear();
+            }
+            else {
+                p.type = ST_DATA;
+                p.payload.resize(static_cast<std::size_t>(n));
+                c.in_flight += p.payload.size();
+                m_stats.bytes_sent += p.payload.size();
+            }
+            p.seq = c.seq_nr++;
+            c.outstanding.push_back(std::move(p));
+            send_packet(c, c.outstanding.back());
+            if (c.app_eof) c.fin_time = Clock::now();
+        }
+        update_watch(c);
+    }
+
+    void UtpSocketManager::flush_to_app(Conn& c) {
+        const std::uint32_t before = recv_window(c);
+        if (c.app_closed) c.to_app.clear();
+
+        std::size_t written = 0;
+        while (written < c.to_app.size()) {
+            ssize_t n = ::send(c.fd, c.to_app.data() + written, c.to_app.size() - written,
+                               MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    c.app_closed = true;
+                    written = c.to_app.size();
+                }
+                break;
+            }
+            written += static_cast<std::size_t>(n);
+        }
+        c.to_app.erase(c.to_app.begin(), c.to_app.begin() + static_cast<std::ptrdiff_t>(written));
+
+        // Their FIN, once everything before it is read
+        if (c.to_app.empty() && c.eof_received && c.ack_nr == c.eof_seq && !c.app_shut) {
+            ::shutdown(c.fd, SHUT_WR);
+            c.app_shut = true;
+        }
+
+        // The application caught up: tell a sender we had stopped
+        if (before < kRecvWindow / 2 && recv_window(c) >= kRecvWindow / 2) send_ack(c);
+
+        update_watch(c);
+    }
+
+    void UtpSocketManager::update_watch(Conn& c) {
+        if (c.app_closed) return;
+
+        std::uint32_t events = 0;
+        if (c.state == Conn::State::Connected && !c.app_eof && can_send(c)) events |= EPOLLIN;
+        if (!c.to_app.empty()) events |= EPOLLOUT;
+        if (!c.registered) {
+            // EPOLLHUP comes regardless, so the fd stays registered from here on
+            Conn* conn = &c;
+            m_loop.add_fd(c.fd, events, [this, conn](std::uint32_t ev) { on_app_event(*conn, ev); });
+            c.registered = true;
+            c.events = events;
+        }
+        else if (c.events != events) {
+            m_loop.modify_fd(c.fd, events);
+            c.events = events;
+        }
+    }
+
+    std::uint32_t UtpSocketManager::recv_window(const Conn& c) const {
+        const std::size_t used = c.to_app.size() + c.reorder_bytes;
+        return static_cast<std::uint32_t>(used >= kRecvWindow ? 0 : kRecvWindow - used);
+    }
+
+    // ----------------- Sending -----------------
+
+    std::vector<std::uint8_t> UtpSocketManager::build_packet(const Conn& c, std::uint8_t type, std::uint16_t seq,
+                                                             const std::vector<std::uint8_t>& payload) const {
+        // Selective ack for what we hold past the gap
+        std::uint8_t mask[kMaxSackBytes] = {};
+        std::size_t mask_len = 0;
+        for (const auto& kv : c.reorder) {
+            const std::uint16_t bit = static_cast<std::uint16_t>(kv.first - c.ack_nr - 2);
+            if (bit >= kMaxSackBytes * 8) continue;
+            mask[bit / 8] |= static_cast<std::uint8_t>(1u << (bit % 8));
+            mask_len = std::max<std::size_t>(mask_len, (bit / 32 + 1) * 4);
+        }
+
+        std::vector<std::uint8_t> out(kHeaderSize + (mask_len ? 2 + mask_len : 0) + payload.size());
+        std::uint8_t* p = out.data();
+        p[0] = static_cast<std::uint8_t>((type << 4) | kVersion);
+        p[1] = mask_len ? kExtSelectiveAck : 0;
+        put16(p + 2, type == ST_SYN ? c.recv_id : c.send_id);
+        put32(p + 4, now_micros());
+        put32(p + 8, c.reply_delay);
+        put32(p + 12, recv_window(c));
+        put16(p + 16, seq);
+        put16(p + 18, c.ack_nr);
+
+        std::size_t pos = kHeaderSize;
+        if (mask_len) {
+            p[pos++] = 0; // no further extensions
+            p[pos++] = static_cast<std::uint8_t>(mask_len);
+            std::memcpy(p + pos, mask, mask_len);
+            pos += mask_len;
+        }
+        if (!payload.empty()) std::memcpy(p + pos, payload.data(), payload.size());
+        return out;
+    }
+
+    void UtpSocketManager::send_packet(Conn& c, Packet& p) {
+        if (p.transmissions > 0) m_stats.retransmits++;
+        p.transmissions++;
+        p.need_resend = false;
+        p.sent = Clock::now();
+        c.last_send = p.sent;
+        c.ack_due = false; // it carries our ack
+        send_raw(c.remote, build_packet(c, p.type, p.seq, p.payload));
+    }
+
+    void UtpSocketManager::send_ack(Conn& c) {
+        c.ack_due = false;
+        c.last_send = Clock::now();
+        send_raw(c.remote, build_packet(c, ST_STATE, c.seq_nr, {}));
+    }
+
+    void UtpSocketManager::send_reset(const Endpoint& to, std::uint16_t conn_id) {
+        std::vector<std::uint8_t> out(kHeaderSize);
+        out[0] = static_cast<std::uint8_t>((ST_RESET << 4) | kVersion);
+        put16(out.data() + 2, conn_id);
+        put32(out.data() + 4, now_micros());
+        send_raw(to, std::move(out));
+    }
+
+    void UtpSocketManager::send_datagram(const Endpoint& to, const std::string& data) {
+        send_raw(to, std::vector<std::uint8_t>(data.begin(), data.end()));
+    }
+
+    void UtpSocketManager::send_raw(const Endpoint& to, std::vector<std::uint8_t> data) {
+        m_stats.packets_sent++;
+        if (m_config.loss > 0 && std::uniform_real_distribution<double>(0, 1)(m_rng) < m_config.loss) {
+            m_stats.dropped++;
+            return;
+        }
+        if (m_config.delay.count() > 0) {
+            m_delayed.push_back(Delayed{Clock::now() + m_config.delay, to, std::move(data)});
+            if (!m_delay_timer) {
+                m_delay_timer = m_loop.add_timer(m_config.delay, [this] { flush_delayed(); }, false);
+            }
+            return;
+        }
+
+        sockaddr_storage ss{};
+        socklen_t len = to.to_sockaddr(ss);
+        // A datagram the kernel won't take counts as lost
+        (void)::sendto(m_fd, data.data(), data.size(), 0, reinterpret_cast<sockaddr*>(&ss), len);
+    }
+
+    void UtpSocketManager::flush_delayed() {
+        m_delay_timer = 0;
+        const auto now = Clock::now();
+        while (!m_delayed.empty() && m_delayed.front().due <= now) {
+            Delayed& d = m_delayed.front();
+            sockaddr_storage ss{};
+            socklen_t len = d.to.to_sockaddr(ss);
+            (void)::sendto(m_fd, d.data.data(), d.data.size(), 0, reinterpret_cast<sockaddr*>(&ss), len);
+            m_delayed.pop_front();
+        }
+        if (!m_delayed.empty()) {
+            // Every datagram waits the same, so they come due in order
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(m_delayed.front().due - now);
+            m_delay_timer = m_loop.add_timer(std::max(wait, std::chrono::milliseconds(1)),
+                                             [this] { flush_delayed(); }, false);
+        }
+    }
+
+    // ----------------- Timers and teardown -----------------
+
+    void UtpSocketManager::tick() {
+        const auto now = Clock::now();
+        std::vector<Key> keys;
+        keys.reserve(m_conns.size());
+        for (const auto& kv : m_conns) keys.push_back(kv.first);
+
+        for (const Key& key : keys) {
+            auto it = m_conns.find(key);
+            if (it == m_conns.end()) continue;
+            Conn& c = *it->second;
+
+            if (now - c.last_recv > kIdleTimeout) {
+                fail(c, "timed out");
+                continue;
+            }
+
+            if (!c.outstanding.empty() && now - c.outstanding.front().sent >= c.rto) {
+                Packet& p = c.outstanding.front();
+                const int limit = p.type == ST_SYN ? kMaxSynTransmissions : kMaxTransmissions;
+                if (p.transmissions >= limit) {
+                    fail(c, "timed out");
+                    continue;
+                }
+
+                // Start over from one packet, and back off
+                m_stats.timeouts++;
+                c.ssthresh = std::max(c.cwnd / 2, kMinWindow);
+                c.cwnd = kMinWindow;
+                c.slow_start = true;
+                c.last_loss = now;
+                c.rto = std::min<std::chrono::milliseconds>(c.rto * 2, kMaxRto);
+                send_packet(c, p);
+                if (c.state == Conn::State::Connected) pump(c);
+            }
+            else if (c.state == Conn::State::Connected && now - c.last_send > kKeepAlive) {
+                send_ack(c);
+            }
+
+            finish_if_done(c);
+        }
+    }
+
+    void UtpSocketManager::finish_if_done(Conn& c) {
+        // Both FINs delivered and ours acked, or the other side never
+        // finishes
+        const bool ours_done = c.app_eof && c.outstanding.empty();
+        const bool theirs_done = c.eof_received && (c.app_shut || c.app_closed);
+        if ((ours_done && theirs_done) || (c.app_eof && Clock::now() - c.fin_time > kFinTimeout)) {
+            destroy(c);
+        }
+    }
+
+    void UtpSocketManager::fail(Conn& c, const std::string& error) {
+        ConnectCallback done = std::move(c.on_connect);
+        const int user_fd = c.user_fd;
+        const bool connecting = c.state == Conn::State::SynSent;
+        destroy(c); // the application reads EOF
+
+        if (connecting && done) done(user_fd, error);
+    }
+
+    void UtpSocketManager::destroy(Conn& c) {
+        if (c.registered) m_loop.remove_fd(c.fd);
+        ::close(c.fd);
+        m_conns.erase({c.remote, c.recv_id});
+    }
+
+}